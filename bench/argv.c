@@ -0,0 +1,89 @@
+/*
+ * Command line splitting: argv_split() of command lines from a few words up to the
+ * length of a generated wrapper script's, with quoted and escaped arguments mixed in
+ * as real service files have them.  Each sample is the average over a batch of splits,
+ * reported per command line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench/bench.h"
+#include "libsvc/common.h"
+#include "libsvc/argv.h"
+
+
+#define BENCH_BATCH	100
+
+
+/* every fourth argument quoted, every eighth escaped, the rest plain options */
+static char *
+make_command(size_t args)
+{
+	size_t size = 64 + args * 48, len;
+	char *command = malloc(size);
+
+	if (command == NULL)
+		abort();
+
+	len = snprintf(command, size, "/usr/sbin/daemon");
+
+	for (size_t i = 1; i < args; i++)
+	{
+		if (i % 8 == 0)
+			len += snprintf(command + len, size - len, " --label=rack\\ %zu\\ row\\ %zu", i, i / 8);
+		else if (i % 4 == 0)
+			len += snprintf(command + len, size - len, " \"--comment=argument %zu of %zu\"", i, args);
+		else
+			len += snprintf(command + len, size - len, " --option-%zu=/var/lib/daemon/%zu", i, i);
+	}
+
+	return command;
+}
+
+
+static void
+bench_split(size_t args, size_t iterations)
+{
+	char *command = make_command(args);
+	struct bench b;
+	int count = 0;
+
+	bench_init(&b, "argv_split", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+		{
+			argv_t argv = {};
+
+			if (!argv_split(&argv, command))
+				abort();
+
+			count = argv_count(&argv);
+			argv_free(&argv);
+		}
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "args=%d bytes=%zu", count, strlen(command));
+	bench_free(&b);
+
+	free(command);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	static const size_t sizes[] = {4, 32, 256, 2048};
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); i++)
+		bench_split(sizes[i], iterations);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/* benchmark harness */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include "bench/bench.h"
+
+
+void
+bench_init(struct bench *b, const char *name, size_t capacity)
+{
+	assert(b != NULL);
+	assert(capacity > 0);
+
+	b->name = name;
+	b->count = 0;
+	b->capacity = capacity;
+	b->samples = calloc(capacity, sizeof(uint64_t));
+
+	if (b->samples == NULL)
+		abort();
+}
+
+
+void
+bench_record(struct bench *b, uint64_t ns)
+{
+	if (b->count < b->capacity)
+		b->samples[b->count++] = ns;
+}
+
+
+static int
+bench_sample_cmp(const void *a, const void *b)
+{
+	const uint64_t *sa = a, *sb = b;
+
+	return *sa < *sb ? -1 : *sa > *sb;
+}
+
+
+static uint64_t
+bench_percentile(const struct bench *b, unsigned int pct)
+{
+	size_t idx = (b->count * pct) / 100;
+
+	return b->samples[idx < b->count ? idx : b->count - 1];
+}
+
+
+/*
+ * Print one result line of space-separated key=value pairs, so that runs can be
+ * compared between releases with nothing more than awk.
+ */
+void
+bench_report(struct bench *b, const char *params_fmt, ...)
+{
+	char params[256] = "";
+	uint64_t sum = 0;
+	va_list va;
+
+	assert(b != NULL);
+
+	if (b->count == 0)
+		return;
+
+	if (params_fmt != NULL)
+	{
+		va_start(va, params_fmt);
+		vsnprintf(params, sizeof params, params_fmt, va);
+		va_end(va);
+	}
+
+	qsort(b->samples, b->count, sizeof(uint64_t), bench_sample_cmp);
+
+	for (size_t i = 0; i < b->count; i++)
+		sum += b->samples[i];
+
+	printf("bench=%s%s%s n=%zu min_ns=%" PRIu64 " p50_ns=%" PRIu64 " p90_ns=%" PRIu64 " p99_ns=%" PRIu64 " mean_ns=%" PRIu64 "\n",
+		b->name, *params ? " " : "", params, b->count, b->samples[0], bench_percentile(b, 50),
+		bench_percentile(b, 90), bench_percentile(b, 99), sum / b->count);
+	fflush(stdout);
+}
+
+
+void
+bench_free(struct bench *b)
+{
+	free(b->samples);
+	b->samples = NULL;
+	b->count = b->capacity = 0;
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+
+#ifndef SVC_BENCH_H
+#define SVC_BENCH_H
+
+
+/*
+ * A benchmark collects one latency sample per iteration and reports order statistics,
+ * which are far more stable between runs than the mean alone.
+ */
+struct bench {
+	const char *name;
+
+	uint64_t *samples;
+	size_t count;
+	size_t capacity;
+};
+
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void bench_init(struct bench *b, const char *name, size_t capacity);
+void bench_record(struct bench *b, uint64_t ns);
+void bench_report(struct bench *b, const char *params_fmt, ...);
+void bench_free(struct bench *b);
+
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Dependency scheduling cost: graphs of 1000, 10000 and 100000 services, each needing or
+ * wanting up to four services declared before it, are started in full with depgraph,
+ * every start completing at once (the first argument scales the number of samples).
+ * Each sample is building the graph, preparing it and draining it, so that the cost
+ * per service and per edge shows.  The graph must finish with every service started.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bench/bench.h"
+#include "libsvc/depgraph.h"
+
+
+static const size_t graph_sizes[] = {1000, 10000, 100000};
+
+
+static bool
+schedule_graph(char **names, size_t count, size_t limit)
+{
+	struct depgraph g;
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	size_t started = 0;
+	ssize_t node;
+	bool ok;
+
+	depgraph_init(&g, limit, NULL, NULL);
+
+	for (size_t i = 0; i < count; i++)
+		depgraph_add(&g, names[i], NULL);
+
+	for (size_t i = 1; i < count; i++)
+	{
+		for (int d = 0; d < 4; d++)
+		{
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+
+			/* mostly recent services, like a layered boot */
+			depgraph_depend(&g, i, names[i - 1 - rng % (i < 64 ? i : 64)], d ? DEPGRAPH_WANTS : DEPGRAPH_NEEDS);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+		depgraph_select(&g, i);
+
+	if (!depgraph_prepare(&g))
+	{
+		perror("bench-depgraph: depgraph_prepare");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((node = depgraph_next(&g)) >= 0)
+	{
+		depgraph_done(&g, node, true);
+		started++;
+	}
+
+	ok = depgraph_finished(&g) && started == count;
+	depgraph_free(&g);
+
+	return ok;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 20;
+	bool ok = true;
+
+	for (size_t i = 0; i < sizeof graph_sizes / sizeof graph_sizes[0]; i++)
+	{
+		size_t count = graph_sizes[i];
+		size_t iterations = scale * 1000 / count;
+		char **names = calloc(count, sizeof(char *));
+		struct bench b;
+
+		if (iterations < 5)
+			iterations = 5;
+
+		for (size_t j = 0; j < count; j++)
+		{
+			names[j] = malloc(32);
+			snprintf(names[j], 32, "svc%06zu", j);
+		}
+
+		bench_init(&b, "depgraph.schedule", iterations);
+		for (size_t j = 0; j < iterations; j++)
+		{
+			uint64_t start = bench_now();
+
+			ok = schedule_graph(names, count, 16) && ok;
+			bench_record(&b, bench_now() - start);
+		}
+		bench_report(&b, "services=%zu edges=%zu jobs=16", count, (count - 1) * 4);
+		bench_free(&b);
+
+		for (size_t j = 0; j < count; j++)
+			free(names[j]);
+
+		free(names);
+	}
+
+	if (!ok)
+	{
+		fprintf(stderr, "bench-depgraph: not every service was started\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+/*
+ * Dispatch cost: nvlist_process() over a configuration section and ipc_obj_dispatch()
+ * of a request, comparing the perfect hash against the bsearch() lookup it replaced,
+ * at table sizes from today's tables up to what a manager handles.  Each sample is the
+ * average over a batch of messages, reported per message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <nv.h>
+
+#include "bench/bench.h"
+#include "libsvc/common.h"
+#include "libsvc/ipc.h"
+#include "libsvc/nvlist-process.h"
+
+
+#define BENCH_BATCH	1000
+#define BENCH_KEYS_MAX	128
+
+
+static const char *real_keys[] = {
+	"after", "before", "chdir", "chroot", "command", "cpu-max", "group", "idle-timeout",
+	"io-max", "kill-delay", "listen", "log-buffer-size", "log-keep", "log-max-size",
+	"memory-high", "memory-max", "name", "needs", "notify", "respawn-delay", "respawn-max",
+	"respawn-period", "stderr", "stdout", "stop-sequence", "user", "wants",
+};
+
+
+static char key_storage[BENCH_KEYS_MAX][32];
+static unsigned long handled;
+
+
+static void
+bench_handler(const char *key, const nvpair_t *pair, void *opaque)
+{
+	(void) key;
+	(void) pair;
+	(void) opaque;
+
+	handled++;
+}
+
+
+static ipc_obj_return_code_t
+bench_ipc_handler(int sock, const nvlist_t *nvl, void *opaque)
+{
+	(void) sock;
+	(void) nvl;
+	(void) opaque;
+
+	handled++;
+	return IPC_OBJ_OK;
+}
+
+
+static int
+table_cmp(const void *a, const void *b)
+{
+	const nvlist_process_table_t *ta = a, *tb = b;
+
+	return strcmp(ta->key, tb->key);
+}
+
+
+static int
+table_key_cmp(const char *key, const void *tentry)
+{
+	const nvlist_process_table_t *ptentry = tentry;
+
+	return strcmp(key, ptentry->key);
+}
+
+
+/* the lookup nvlist_process() used to do, as a baseline */
+static void
+process_bsearch(const nvlist_t *nvl, const nvlist_process_table_t table[], size_t table_size, void *opaque)
+{
+	for (const nvpair_t *nvp = nvlist_first_nvpair(nvl); nvp != NULL; nvp = nvlist_next_nvpair(nvl, nvp))
+	{
+		const nvlist_process_table_t *tentry;
+
+		tentry = bsearch(nvpair_name(nvp), table, table_size, sizeof(nvlist_process_table_t), (void *) table_key_cmp);
+		if (tentry != NULL)
+			tentry->dispatch_fn(nvpair_name(nvp), nvp, opaque);
+	}
+}
+
+
+static int
+ipc_method_cmp(const char *key, const void *tentry)
+{
+	const ipc_hdl_dispatch_t *dtentry = tentry;
+
+	return strcmp(key, dtentry->method);
+}
+
+
+/* the lookup ipc_obj_dispatch() used to do, as a baseline */
+static ipc_obj_return_code_t
+dispatch_bsearch(int sock, const nvlist_t *nvl, const ipc_hdl_dispatch_t table[], size_t table_size, void *opaque)
+{
+	const ipc_hdl_dispatch_t *pair;
+
+	if (!ipc_obj_validate(nvl))
+		return IPC_OBJ_INVALID;
+
+	if (ipc_obj_is_reply(nvl))
+		return IPC_OBJ_IS_REPLY;
+
+	pair = bsearch(nvlist_get_string(nvl, "ipc:method"), table, table_size, sizeof(ipc_hdl_dispatch_t), (void *) ipc_method_cmp);
+	if (pair == NULL)
+		return IPC_OBJ_METHOD_NOT_FOUND;
+
+	return pair->dispatch_fn(sock, nvl, opaque);
+}
+
+
+/*
+ * Build a sorted table of n keys: the real service keys first, then synthetic ones
+ * of similar length.
+ */
+static void
+make_table(nvlist_process_table_t *table, ipc_hdl_dispatch_t *ipc_table, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (i < ARRAY_SIZE(real_keys))
+			snprintf(key_storage[i], sizeof key_storage[i], "%s", real_keys[i]);
+		else
+			snprintf(key_storage[i], sizeof key_storage[i], "option-%03zu-value", i);
+
+		/* table entries have const members, so they are copied in whole */
+		memcpy(&table[i], &(nvlist_process_table_t) {key_storage[i], bench_handler, NV_TYPE_NONE}, sizeof *table);
+	}
+
+	qsort(table, n, sizeof *table, table_cmp);
+
+	for (size_t i = 0; i < n; i++)
+		memcpy(&ipc_table[i], &(ipc_hdl_dispatch_t) {table[i].key, bench_ipc_handler}, sizeof *ipc_table);
+}
+
+
+/* a section setting every eighth key, plus one key nobody handles */
+static nvlist_t *
+make_section(const nvlist_process_table_t *table, size_t n)
+{
+	nvlist_t *nvl = nvlist_create(0);
+
+	for (size_t i = 0; i < n; i += 8)
+		nvlist_add_string(nvl, table[i].key, "value");
+
+	nvlist_add_string(nvl, "unknown-key", "value");
+
+	return nvl;
+}
+
+
+static void
+bench_process(size_t n, size_t iterations)
+{
+	nvlist_process_table_t table[BENCH_KEYS_MAX];
+	ipc_hdl_dispatch_t ipc_table[BENCH_KEYS_MAX];
+	nvlist_process_index_t idx;
+	nvlist_t *section;
+	char errbuf[128];
+	struct bench b;
+	size_t pairs = 0;
+
+	make_table(table, ipc_table, n);
+	section = make_section(table, n);
+
+	for (const nvpair_t *nvp = nvlist_first_nvpair(section); nvp != NULL; nvp = nvlist_next_nvpair(section, nvp))
+		pairs++;
+
+	if (!nvlist_process_index_init(&idx, table, n, errbuf, sizeof errbuf))
+	{
+		fprintf(stderr, "bench-dispatch: %s\n", errbuf);
+		exit(EXIT_FAILURE);
+	}
+
+	bench_init(&b, "nvlist_process.bsearch", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+			process_bsearch(section, table, n, NULL);
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "keys=%zu pairs=%zu", n, pairs);
+	bench_free(&b);
+
+	bench_init(&b, "nvlist_process.phash", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+			nvlist_process(section, &idx, NULL);
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "keys=%zu pairs=%zu", n, pairs);
+	bench_free(&b);
+
+	phash_free(&idx.hash);
+	nvlist_destroy(section);
+}
+
+
+static void
+bench_ipc(size_t n, size_t iterations)
+{
+	nvlist_process_table_t table[BENCH_KEYS_MAX];
+	ipc_hdl_dispatch_t ipc_table[BENCH_KEYS_MAX];
+	ipc_hdl_index_t idx;
+	nvlist_t *requests[BENCH_KEYS_MAX];
+	char errbuf[128];
+	struct bench b;
+
+	make_table(table, ipc_table, n);
+
+	if (!ipc_hdl_index_init(&idx, ipc_table, n, errbuf, sizeof errbuf))
+	{
+		fprintf(stderr, "bench-dispatch: %s\n", errbuf);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		requests[i] = nvlist_create(0);
+		ipc_obj_prepare(requests[i], ipc_table[i].method, i, false);
+	}
+
+	bench_init(&b, "ipc_obj_dispatch.bsearch", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+			dispatch_bsearch(-1, requests[j % n], ipc_table, n, NULL);
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "methods=%zu", n);
+	bench_free(&b);
+
+	bench_init(&b, "ipc_obj_dispatch.phash", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+			ipc_obj_dispatch(-1, requests[j % n], &idx, NULL);
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "methods=%zu", n);
+	bench_free(&b);
+
+	for (size_t i = 0; i < n; i++)
+		nvlist_destroy(requests[i]);
+
+	phash_free(&idx.hash);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	static const size_t sizes[] = {8, 16, 32, 128};
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); i++)
+		bench_process(sizes[i], iterations);
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); i++)
+		bench_ipc(sizes[i], iterations);
+
+	if (handled == 0)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
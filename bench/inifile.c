@@ -0,0 +1,325 @@
+/*
+ * INI parsing throughput: a corpus of service files is parsed with the old fgets()
+ * parser, with inifile_parse(), and with inifile_scan() alone, which shows the cost of
+ * tokenizing apart from building nvlists, and loaded through a warm inicache.  Each
+ * sample is one pass over the corpus.  A single large file, of the kind a generated
+ * configuration for many instances is, is parsed the same ways.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <nv.h>
+
+#include "bench/bench.h"
+#include "libsvc/inicache.h"
+#include "libsvc/inifile.h"
+
+
+#define CORPUS_FILES	3000
+#define LARGE_SECTIONS	5000
+
+
+static char corpus_dir[] = "/tmp/bench-inifile.XXXXXX";
+static char corpus_paths[CORPUS_FILES][64];
+static char cache_path[64];
+static char large_path[64];
+static size_t corpus_bytes;
+static size_t large_bytes;
+
+
+static bool
+value_is_numeric(const char *data)
+{
+	for (const char *p = data; *p; p++)
+		if (!isdigit(*p))
+			return false;
+
+	return true;
+}
+
+
+/* the parser inifile_parse() used to be, as a baseline */
+static nvlist_t *
+parse_fgets(const char *path)
+{
+	FILE *f;
+	nvlist_t *out, *section = NULL;
+	char buffer[4096], *tmp, *section_name = NULL;
+
+	f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+
+	out = nvlist_create(0);
+
+	while (fgets(buffer, sizeof buffer, f))
+	{
+		if (buffer[0] == '[' && (tmp = strchr(buffer, ']')) != NULL)
+		{
+			*tmp = 0;
+
+			if (section != NULL && section_name != NULL)
+			{
+				nvlist_add_nvlist(out, section_name, section);
+				nvlist_destroy(section);
+				free(section_name);
+			}
+
+			section = nvlist_create(NV_FLAG_NO_UNIQUE);
+			section_name = strdup(&buffer[1]);
+		}
+		else if (buffer[0] != '#' && section != NULL && (tmp = strchr(buffer, '=')) != NULL)
+		{
+			char *end;
+
+			*tmp = 0;
+
+			end = strchr(tmp + 1, '\n');
+			if (end != NULL)
+				*end = 0;
+
+			if (!value_is_numeric(tmp + 1))
+				nvlist_add_string(section, buffer, tmp + 1);
+			else
+				nvlist_add_number(section, buffer, strtol(tmp + 1, NULL, 10));
+		}
+	}
+
+	if (section != NULL && section_name != NULL)
+	{
+		nvlist_add_nvlist(out, section_name, section);
+		nvlist_destroy(section);
+		free(section_name);
+	}
+
+	fclose(f);
+	return out;
+}
+
+
+/*
+ * Write a corpus of service files modelled on real ones: a comment header, a
+ * [service] section with a dozen keys, and a longer command line in some.
+ */
+static void
+corpus_create(void)
+{
+	if (mkdtemp(corpus_dir) == NULL)
+	{
+		perror("bench-inifile: mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < CORPUS_FILES; i++)
+	{
+		FILE *f;
+		long size;
+
+		snprintf(corpus_paths[i], sizeof corpus_paths[i], "%s/svc%04d.ini", corpus_dir, i);
+
+		f = fopen(corpus_paths[i], "w");
+		if (f == NULL)
+		{
+			perror("bench-inifile: fopen");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(f, "# service %d\n# generated for bench-inifile\n\n[service]\n", i);
+		fprintf(f, "name = svc%04d\n", i);
+		fprintf(f, "command = /usr/sbin/daemon%d --foreground --config /etc/daemon%d.conf%s\n", i, i,
+			i % 10 == 0 ? " --verbose --log-level debug --pid-file /run/daemon.pid --listen 0.0.0.0:8080" : "");
+		fprintf(f, "user = nobody\ngroup = nogroup\nchdir = /var/lib/daemon%d\n", i);
+		fprintf(f, "respawn-delay = 2\nrespawn-max = 10\nrespawn-period = 60\n");
+		fprintf(f, "stdout = /var/log/daemon%d.log\nstderr = /var/log/daemon%d.log\n", i, i);
+		fprintf(f, "log-max-size = 10M\nlog-keep = 5\nstop-sequence = TERM:5,INT:2,KILL\n");
+
+		size = ftell(f);
+		fclose(f);
+
+		corpus_bytes += size;
+	}
+}
+
+
+/* one file of LARGE_SECTIONS instance sections, each like a service file of the corpus */
+static void
+large_create(void)
+{
+	FILE *f;
+
+	snprintf(large_path, sizeof large_path, "%s/large.ini", corpus_dir);
+
+	f = fopen(large_path, "w");
+	if (f == NULL)
+	{
+		perror("bench-inifile: fopen");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(f, "# %d instances\n# generated for bench-inifile\n", LARGE_SECTIONS);
+
+	for (int i = 0; i < LARGE_SECTIONS; i++)
+	{
+		fprintf(f, "\n[instance%04d]\n", i);
+		fprintf(f, "command = /usr/sbin/worker --instance %d --config /etc/worker/%d.conf\n", i, i);
+		fprintf(f, "user = nobody\ngroup = nogroup\nrespawn-delay = 2\nrespawn-max = 10\n");
+		fprintf(f, "stdout = /var/log/worker%d.log\nstop-sequence = TERM:5,KILL\n", i);
+	}
+
+	large_bytes = ftell(f);
+	fclose(f);
+}
+
+
+static void
+corpus_remove(void)
+{
+	for (int i = 0; i < CORPUS_FILES; i++)
+		unlink(corpus_paths[i]);
+
+	unlink(large_path);
+	unlink(cache_path);
+	rmdir(corpus_dir);
+}
+
+
+static bool
+count_entry(const struct inifile_entry *entry, void *opaque, struct inifile_error *err)
+{
+	size_t *count = opaque;
+
+	(void) entry;
+	(void) err;
+
+	(*count)++;
+	return true;
+}
+
+
+static void
+bench_parser(const char *name, nvlist_t *(*parse)(const char *path), size_t iterations)
+{
+	struct bench b;
+
+	bench_init(&b, name, iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < CORPUS_FILES; j++)
+			nvlist_destroy(parse(corpus_paths[j]));
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "files=%d bytes=%zu", CORPUS_FILES, corpus_bytes);
+	bench_free(&b);
+}
+
+
+static void
+bench_large(const char *name, nvlist_t *(*parse)(const char *path), size_t iterations)
+{
+	struct bench b;
+
+	bench_init(&b, name, iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		nvlist_destroy(parse(large_path));
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "files=1 sections=%d bytes=%zu", LARGE_SECTIONS, large_bytes);
+	bench_free(&b);
+}
+
+
+/*
+ * A boot with an up-to-date cache: open it, load every file through it, and find there
+ * is nothing to save.  The cache is written once beforehand, long enough after the
+ * corpus that no file looks recently modified and needs its contents checked.
+ */
+static void
+bench_cache(size_t iterations)
+{
+	struct inicache cache;
+	struct bench b;
+	size_t hits = 0;
+
+	snprintf(cache_path, sizeof cache_path, "%s/cache", corpus_dir);
+	sleep(3);
+
+	inicache_open(&cache, cache_path);
+	for (int j = 0; j < CORPUS_FILES; j++)
+		nvlist_destroy(inicache_load(&cache, corpus_paths[j], NULL));
+	inicache_save(&cache, cache_path);
+	inicache_close(&cache);
+
+	bench_init(&b, "inicache.load", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		inicache_open(&cache, cache_path);
+		for (int j = 0; j < CORPUS_FILES; j++)
+			nvlist_destroy(inicache_load(&cache, corpus_paths[j], NULL));
+		inicache_save(&cache, cache_path);
+
+		hits += cache.hits;
+		inicache_close(&cache);
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "files=%d hits=%zu", CORPUS_FILES, hits / iterations);
+	bench_free(&b);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 50;
+	size_t entries = 0;
+	struct bench b;
+
+	corpus_create();
+	large_create();
+
+	bench_parser("inifile.fgets-legacy", parse_fgets, iterations);
+	bench_parser("inifile.parse", inifile_parse, iterations);
+
+	bench_init(&b, "inifile.scan", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < CORPUS_FILES; j++)
+		{
+			struct inifile_map map;
+
+			if (!inifile_map(&map, corpus_paths[j]))
+				continue;
+
+			inifile_scan(map.data, map.len, count_entry, &entries, NULL);
+			inifile_unmap(&map);
+		}
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "files=%d bytes=%zu", CORPUS_FILES, corpus_bytes);
+	bench_free(&b);
+
+	bench_large("inifile.fgets-legacy-large", parse_fgets, iterations);
+	bench_large("inifile.parse-large", inifile_parse, iterations);
+
+	bench_cache(iterations);
+
+	corpus_remove();
+
+	return entries > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
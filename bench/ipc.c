@@ -0,0 +1,226 @@
+/*
+ * IPC round trips: a request built with ipc_obj_prepare() goes out with nvlist_send() over
+ * a socketpair, as between svc-manager and a supervisor, and a reply like that of `list'
+ * comes back, for supervisors of one to a few hundred services.  The responder runs
+ * in the same process, which measures packing, unpacking and the syscalls alone, and in a
+ * child which dispatches the request through ipc_obj_dispatch(), which adds the wakeups
+ * a real exchange has.  Each sample is one round trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <nv.h>
+
+#include "bench/bench.h"
+#include "libsvc/common.h"
+#include "libsvc/ipc.h"
+
+
+static size_t reply_services;
+
+
+/* what supervisor_ipc_list() sends, for reply_services services */
+static ipc_obj_return_code_t
+bench_ipc_list(int sock, const nvlist_t *nvl, void *opaque)
+{
+	nvlist_t *obj, *services;
+	char name[32];
+
+	(void) opaque;
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "list", ipc_obj_id(nvl), true);
+
+	services = nvlist_create(0);
+	for (size_t i = 0; i < reply_services; i++)
+	{
+		snprintf(name, sizeof name, "service-%04zu", i);
+		nvlist_add_number(services, name, 3);
+	}
+
+	nvlist_move_nvlist(obj, "services", services);
+
+	nvlist_send(sock, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+static const ipc_hdl_dispatch_t bench_dispatch_table[] = {
+	{"list", bench_ipc_list},
+};
+
+
+static void
+bench_request(int sock, uint64_t id)
+{
+	nvlist_t *obj = nvlist_create(0);
+
+	ipc_obj_prepare(obj, "list", id, false);
+
+	if (nvlist_send(sock, obj) < 0)
+	{
+		perror("bench-ipc: nvlist_send");
+		exit(EXIT_FAILURE);
+	}
+
+	nvlist_destroy(obj);
+}
+
+
+static void
+bench_reply(int sock, uint64_t id)
+{
+	nvlist_t *obj = nvlist_recv(sock, 0);
+
+	if (obj == NULL || !ipc_obj_is_reply(obj) || ipc_obj_id(obj) != id)
+	{
+		fprintf(stderr, "bench-ipc: bad reply to request %llu\n", (unsigned long long) id);
+		exit(EXIT_FAILURE);
+	}
+
+	nvlist_destroy(obj);
+}
+
+
+/* answer requests until the other end goes away */
+static void
+bench_responder(int sock, const ipc_hdl_index_t *idx)
+{
+	nvlist_t *obj;
+
+	while ((obj = nvlist_recv(sock, 0)) != NULL)
+	{
+		ipc_obj_dispatch(sock, obj, idx, NULL);
+		nvlist_destroy(obj);
+	}
+}
+
+
+static void
+bench_local(const ipc_hdl_index_t *idx, size_t iterations)
+{
+	struct bench b;
+	nvlist_t *obj;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	{
+		perror("bench-ipc: socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	bench_init(&b, "ipc.roundtrip-local", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		bench_request(sv[0], i);
+
+		if ((obj = nvlist_recv(sv[1], 0)) == NULL)
+			abort();
+
+		ipc_obj_dispatch(sv[1], obj, idx, NULL);
+		nvlist_destroy(obj);
+
+		bench_reply(sv[0], i);
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "services=%zu", reply_services);
+	bench_free(&b);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+
+static void
+bench_forked(const ipc_hdl_index_t *idx, size_t iterations)
+{
+	struct bench b;
+	pid_t pid;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	{
+		perror("bench-ipc: socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((pid = fork()) < 0)
+	{
+		perror("bench-ipc: fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0)
+	{
+		close(sv[0]);
+		bench_responder(sv[1], idx);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+
+	/* let the child get scheduled and its pages faulted in before sampling */
+	for (size_t i = 0; i < 10; i++)
+	{
+		bench_request(sv[0], i);
+		bench_reply(sv[0], i);
+	}
+
+	bench_init(&b, "ipc.roundtrip", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		bench_request(sv[0], i);
+		bench_reply(sv[0], i);
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "services=%zu", reply_services);
+	bench_free(&b);
+
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+	static const size_t sizes[] = {1, 16, 256};
+	ipc_hdl_index_t idx;
+	char errbuf[128];
+
+	/* a responder dying early must show up as a failed send, not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!ipc_hdl_index_init(&idx, bench_dispatch_table, ARRAY_SIZE(bench_dispatch_table), errbuf, sizeof errbuf))
+	{
+		fprintf(stderr, "bench-ipc: %s\n", errbuf);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); i++)
+	{
+		reply_services = sizes[i];
+
+		bench_local(&idx, iterations);
+		bench_forked(&idx, iterations);
+	}
+
+	phash_free(&idx.hash);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/*
+ * Spawn latency: time from starting a child to reaping it, for the old fork() path and
+ * for childproc_start(), with the descriptor limit raised as high as we are allowed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "bench/bench.h"
+#include "libsvc/childproc.h"
+#include "libsvc/signal.h"
+
+
+static char *bench_argv[] = {"/bin/true", NULL};
+
+
+/*
+ * The spawn path svc-supervise used before clone3(): fork(), then walk every possible
+ * descriptor in the child.
+ */
+static void
+spawn_legacy(void)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0)
+	{
+		signal_unblock();
+		setsid();
+
+		syslog(LOG_INFO, "%s: starting, pid %d", bench_argv[0], getpid());
+
+		for (int i = getdtablesize() - 1; i > STDERR_FILENO; i--)
+			fcntl(i, F_SETFD, FD_CLOEXEC);
+
+		execvp(bench_argv[0], bench_argv);
+		_exit(127);
+	}
+
+	waitpid(pid, &status, 0);
+}
+
+
+static void
+spawn_childproc(struct childproc *proc)
+{
+	struct pollfd pfd;
+	int status;
+
+	childproc_start(proc);
+
+	pfd = (struct pollfd) {.fd = proc->pidfd, .events = POLLIN};
+	while (!childproc_collect(proc, &status))
+	{
+		/* without a pidfd there is nothing to poll; wait for the exit, leaving it to be collected */
+		if (proc->pidfd < 0)
+		{
+			siginfo_t si;
+
+			if (proc->child_pid == 0 || waitid(P_PID, proc->child_pid, &si, WEXITED | WNOWAIT) < 0)
+				break;
+
+			continue;
+		}
+
+		poll(&pfd, 1, -1);
+	}
+}
+
+
+static rlim_t
+raise_fd_limit(void)
+{
+	struct rlimit rl = {.rlim_cur = 1 << 20, .rlim_max = 1 << 20};
+
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+	{
+		getrlimit(RLIMIT_NOFILE, &rl);
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	getrlimit(RLIMIT_NOFILE, &rl);
+	return rl.rlim_cur;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	struct childproc proc;
+	struct bench b;
+	rlim_t limit;
+
+	signal_block();
+	openlog("bench-spawn", LOG_PID, LOG_DAEMON);
+	limit = raise_fd_limit();
+
+	childproc_init(&proc);
+	proc.prog_name = bench_argv[0];
+	proc.prog_argv = bench_argv;
+
+	bench_init(&b, "spawn.fork-legacy", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		spawn_legacy();
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "fdlimit=%lu", (unsigned long) limit);
+	bench_free(&b);
+
+	bench_init(&b, "spawn.childproc", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		spawn_childproc(&proc);
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "fdlimit=%lu", (unsigned long) limit);
+	bench_free(&b);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+/*
+ * Status page reads: statuspage_read() and statuspage_lookup() of a page written with
+ * statuspage_publish(), once while nothing writes it and once while a child process
+ * republishes every entry as fast as it can, which is when readers retry.  Each sample
+ * is the average over a batch of reads, reported per read, and failed= counts the reads
+ * which gave up for the entry being written all along.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "bench/bench.h"
+#include "libsvc/common.h"
+#include "libsvc/statuspage.h"
+
+
+#define BENCH_BATCH	1000
+#define PAGE_ENTRIES	256
+
+
+static char page_path[] = "/tmp/bench-statuspage.XXXXXX";
+
+
+static void
+publish_all(struct statuspage *sp, struct childproc *proc)
+{
+	char name[32];
+
+	for (size_t i = 0; i < PAGE_ENTRIES; i++)
+	{
+		snprintf(name, sizeof name, "service-%04zu", i);
+
+		proc->child_pid = 1000 + i;
+		proc->restart_count++;
+		statuspage_publish(sp, i, name, proc);
+	}
+}
+
+
+static void
+bench_reads(const char *mode, size_t iterations)
+{
+	struct statuspage_entry entry;
+	struct statuspage sp;
+	struct bench b;
+	unsigned long failed = 0;
+	char name[32];
+
+	if (!statuspage_open(&sp, page_path))
+	{
+		fprintf(stderr, "bench-statuspage: %s: cannot open the page just written\n", page_path);
+		exit(EXIT_FAILURE);
+	}
+
+	bench_init(&b, "statuspage_read", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		for (int j = 0; j < BENCH_BATCH; j++)
+			if (!statuspage_read(&sp, j % PAGE_ENTRIES, &entry))
+				failed++;
+
+		bench_record(&b, (bench_now() - start) / BENCH_BATCH);
+	}
+	bench_report(&b, "entries=%d writer=%s failed=%lu", PAGE_ENTRIES, mode, failed);
+	bench_free(&b);
+
+	failed = 0;
+
+	/* the last entry, which a lookup has to read every other entry to reach */
+	snprintf(name, sizeof name, "service-%04d", PAGE_ENTRIES - 1);
+
+	bench_init(&b, "statuspage_lookup", iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		if (!statuspage_lookup(&sp, name, &entry))
+			failed++;
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "entries=%d writer=%s failed=%lu", PAGE_ENTRIES, mode, failed);
+	bench_free(&b);
+
+	statuspage_close(&sp);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	struct childproc proc = {.state = CHILDPROC_READY};
+	struct statuspage sp;
+	pid_t pid;
+	int fd;
+
+	if ((fd = mkstemp(page_path)) < 0)
+	{
+		perror("bench-statuspage: mkstemp");
+		return EXIT_FAILURE;
+	}
+
+	close(fd);
+
+	if (!statuspage_create(&sp, page_path, PAGE_ENTRIES))
+	{
+		perror("bench-statuspage: statuspage_create");
+		return EXIT_FAILURE;
+	}
+
+	publish_all(&sp, &proc);
+	bench_reads("idle", iterations);
+
+	if ((pid = fork()) < 0)
+	{
+		perror("bench-statuspage: fork");
+		return EXIT_FAILURE;
+	}
+
+	if (pid == 0)
+	{
+		for (;;)
+			publish_all(&sp, &proc);
+	}
+
+	bench_reads("busy", iterations);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	statuspage_close(&sp);
+	unlink(page_path);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+/*
+ * Service directory load time: directories of 100, 1000 and 10000 service files are
+ * loaded with svcdir_load() on 1, 2, 4... workers, up to one per CPU or as many as the
+ * second argument says (the first scales the number of samples).  Each sample is one
+ * load of the whole directory, with the files in the page cache.  The order services
+ * are handed over in is checked to be the same for every worker count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench/bench.h"
+#include "libsvc/svcdir.h"
+
+
+static const size_t corpus_sizes[] = {100, 1000, 10000};
+
+
+struct load_result {
+	size_t loaded;
+	uint64_t order;
+};
+
+
+static void
+corpus_create(const char *dir, size_t files)
+{
+	char path[256];
+
+	for (size_t i = 0; i < files; i++)
+	{
+		FILE *f;
+
+		snprintf(path, sizeof path, "%s/svc%05zu.ini", dir, i);
+
+		f = fopen(path, "w");
+		if (f == NULL)
+		{
+			perror("bench-svcdir: fopen");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(f, "# service %zu\n\n[service]\nname = svc%05zu\n", i, i);
+		fprintf(f, "command = /usr/sbin/daemon%zu --foreground --config /etc/daemon%zu.conf\n", i, i);
+		fprintf(f, "user = %s\ngroup = %s\nchdir = /var/lib/daemon%zu\n",
+			i % 2 ? "nobody" : "root", i % 3 ? "nogroup" : "root", i);
+		fprintf(f, "respawn-delay = 2\nrespawn-max = 10\nrespawn-period = 60\n");
+		fprintf(f, "stdout = /var/log/daemon%zu.log\nlog-max-size = 10M\nlog-keep = 5\n", i);
+		fprintf(f, "stop-sequence = TERM:5,INT:2,KILL\numask = 0027\n");
+
+		fclose(f);
+	}
+}
+
+
+static void
+corpus_remove(const char *dir, size_t files)
+{
+	char path[256];
+
+	for (size_t i = 0; i < files; i++)
+	{
+		snprintf(path, sizeof path, "%s/svc%05zu.ini", dir, i);
+		unlink(path);
+	}
+
+	rmdir(dir);
+}
+
+
+/* fold each service name into a hash, so that any change of order shows */
+static void
+load_one(struct svcdir_entry *entry, void *opaque)
+{
+	struct load_result *res = opaque;
+
+	if (!entry->loaded)
+	{
+		fprintf(stderr, "bench-svcdir: %s: %s\n", entry->path, entry->error);
+		exit(EXIT_FAILURE);
+	}
+
+	for (const char *p = entry->svc.name; *p; p++)
+		res->order = (res->order ^ (unsigned char) *p) * 0x100000001b3ULL;
+
+	res->loaded++;
+	service_free(&entry->svc);
+}
+
+
+static bool
+bench_corpus(size_t files, unsigned int cpus, size_t iterations)
+{
+	char dir[] = "/tmp/bench-svcdir.XXXXXX";
+	uint64_t order = 0;
+	bool ok = true;
+	char errbuf[256];
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("bench-svcdir: mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+
+	corpus_create(dir, files);
+
+	for (unsigned int workers = 1; ; workers = workers * 2 < cpus ? workers * 2 : cpus)
+	{
+		struct bench b;
+		char name[64];
+
+		snprintf(name, sizeof name, "svcdir.load.%zu", files);
+
+		bench_init(&b, name, iterations);
+		for (size_t i = 0; i < iterations; i++)
+		{
+			struct load_result res = {.order = 0xcbf29ce484222325ULL};
+			uint64_t start = bench_now();
+
+			if (!svcdir_load(dir, workers, load_one, &res, errbuf, sizeof errbuf))
+			{
+				fprintf(stderr, "bench-svcdir: %s\n", errbuf);
+				exit(EXIT_FAILURE);
+			}
+
+			bench_record(&b, bench_now() - start);
+
+			if (order == 0)
+				order = res.order;
+
+			ok = ok && res.loaded == files && res.order == order;
+		}
+		bench_report(&b, "files=%zu workers=%u", files, workers);
+		bench_free(&b);
+
+		if (workers == cpus)
+			break;
+	}
+
+	corpus_remove(dir, files);
+
+	return ok;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	long cpus = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	size_t scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 20;
+	bool ok = true;
+
+	if (cpus < 1)
+		cpus = 1;
+
+	if (cpus > SVCDIR_WORKERS_MAX)
+		cpus = SVCDIR_WORKERS_MAX;
+
+	for (size_t i = 0; i < sizeof corpus_sizes / sizeof corpus_sizes[0]; i++)
+	{
+		/* fewer samples for larger directories, but never too few */
+		size_t iterations = scale * 1000 / corpus_sizes[i];
+
+		if (iterations < 5)
+			iterations = 5;
+
+		ok = bench_corpus(corpus_sizes[i], cpus, iterations) && ok;
+	}
+
+	if (!ok)
+	{
+		fprintf(stderr, "bench-svcdir: load order depends on the number of workers\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,244 @@
+/*
+ * Name resolution: uid_resolve() and gid_resolve() against large local passwd and group
+ * files, such as sites which export their directory into /etc have, for a name at the
+ * start of the file, one at the end, a numeric id and a name which is not there, which
+ * the last two have to read the whole file for.  The same lookups through a warm idcache
+ * show what loading many services which share a user costs.  Each sample is one lookup.
+ *
+ * The files are generated, and bind mounted over /etc/passwd and /etc/group in a private
+ * user and mount namespace.  Where that is not allowed, the system's own files are used,
+ * and the results say so with files=system.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mount.h>
+
+#include "bench/bench.h"
+#include "libsvc/common.h"
+#include "libsvc/uidgid.h"
+
+
+#define DATABASE_ENTRIES	10000
+
+
+static char database_dir[] = "/tmp/bench-uidgid.XXXXXX";
+static char passwd_path[64], group_path[64];
+
+
+static void
+database_create(void)
+{
+	FILE *pf, *gf;
+
+	if (mkdtemp(database_dir) == NULL)
+	{
+		perror("bench-uidgid: mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(passwd_path, sizeof passwd_path, "%s/passwd", database_dir);
+	snprintf(group_path, sizeof group_path, "%s/group", database_dir);
+
+	if ((pf = fopen(passwd_path, "w")) == NULL || (gf = fopen(group_path, "w")) == NULL)
+	{
+		perror("bench-uidgid: fopen");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(pf, "root:x:0:0:root:/root:/bin/sh\n");
+	fprintf(gf, "root:x:0:root\n");
+
+	for (int i = 0; i < DATABASE_ENTRIES; i++)
+	{
+		fprintf(pf, "user%05d:x:%d:%d:Generated User %d:/home/user%05d:/bin/sh\n", i, 10000 + i, 10000 + i, i, i);
+		fprintf(gf, "group%05d:x:%d:user%05d,user%05d\n", i, 10000 + i, i, (i + 1) % DATABASE_ENTRIES);
+	}
+
+	fclose(pf);
+	fclose(gf);
+}
+
+
+static void
+database_remove(void)
+{
+	unlink(passwd_path);
+	unlink(group_path);
+	rmdir(database_dir);
+}
+
+
+static bool
+write_file(const char *path, const char *data)
+{
+	int fd;
+	bool ok;
+
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	ok = write(fd, data, strlen(data)) == (ssize_t) strlen(data);
+	close(fd);
+
+	return ok;
+}
+
+
+/*
+ * Enter a namespace of our own, mapped to ourselves, where the generated files can be
+ * mounted over the system's without privilege.
+ */
+static bool
+database_install(void)
+{
+	char map[64];
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNS) < 0)
+		return false;
+
+	/* setgroups must be denied before an unprivileged process may write gid_map */
+	write_file("/proc/self/setgroups", "deny");
+
+	snprintf(map, sizeof map, "%d %d 1\n", (int) uid, (int) uid);
+	if (!write_file("/proc/self/uid_map", map))
+		return false;
+
+	snprintf(map, sizeof map, "%d %d 1\n", (int) gid, (int) gid);
+	if (!write_file("/proc/self/gid_map", map))
+		return false;
+
+	return mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == 0 &&
+		mount(passwd_path, "/etc/passwd", NULL, MS_BIND, NULL) == 0 &&
+		mount(group_path, "/etc/group", NULL, MS_BIND, NULL) == 0;
+}
+
+
+/*
+ * Count the entries of a passwd or group file, and note the name of the last one, which
+ * a lookup has to read the whole file to find.
+ */
+static size_t
+database_scan(const char *path, char *last, size_t len)
+{
+	FILE *f;
+	char line[1024];
+	size_t entries = 0;
+
+	snprintf(last, len, "root");
+
+	if ((f = fopen(path, "r")) == NULL)
+		return 0;
+
+	while (fgets(line, sizeof line, f) != NULL)
+	{
+		if (line[0] == '#' || strchr(line, ':') == NULL)
+			continue;
+
+		*strchr(line, ':') = 0;
+		snprintf(last, len, "%s", line);
+		entries++;
+	}
+
+	fclose(f);
+	return entries;
+}
+
+
+static void
+bench_lookup(const char *name, int (*resolve)(const char *), const char *key, const char *files, size_t entries, size_t iterations)
+{
+	struct bench b;
+	int id = -1;
+
+	bench_init(&b, name, iterations);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		uint64_t start = bench_now();
+
+		id = resolve(key);
+
+		bench_record(&b, bench_now() - start);
+	}
+	bench_report(&b, "files=%s entries=%zu key=%s found=%d", files, entries, key, id != -1);
+	bench_free(&b);
+}
+
+
+static int
+resolve_uid(const char *name)
+{
+	return (int) uid_resolve(name);
+}
+
+
+static int
+resolve_gid(const char *name)
+{
+	return (int) gid_resolve(name);
+}
+
+
+static struct idcache ids;
+
+
+static int
+cached_uid(const char *name)
+{
+	return idcache_uid(&ids, name);
+}
+
+
+static int
+cached_gid(const char *name)
+{
+	return idcache_gid(&ids, name);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	size_t users, groups;
+	const char *files = "generated";
+	char last_user[1024], last_group[1024];
+
+	database_create();
+
+	if (!database_install())
+		files = "system";
+
+	users = database_scan("/etc/passwd", last_user, sizeof last_user);
+	groups = database_scan("/etc/group", last_group, sizeof last_group);
+
+	bench_lookup("uid_resolve.first", resolve_uid, "root", files, users, iterations);
+	bench_lookup("uid_resolve.last", resolve_uid, last_user, files, users, iterations);
+	bench_lookup("uid_resolve.numeric", resolve_uid, "65533", files, users, iterations);
+	bench_lookup("uid_resolve.missing", resolve_uid, "no-such-user", files, users, iterations);
+
+	bench_lookup("gid_resolve.first", resolve_gid, "root", files, groups, iterations);
+	bench_lookup("gid_resolve.last", resolve_gid, last_group, files, groups, iterations);
+	bench_lookup("gid_resolve.numeric", resolve_gid, "65533", files, groups, iterations);
+	bench_lookup("gid_resolve.missing", resolve_gid, "no-such-group", files, groups, iterations);
+
+	idcache_init(&ids);
+	bench_lookup("idcache_uid.last", cached_uid, last_user, files, users, iterations);
+	bench_lookup("idcache_gid.last", cached_gid, last_group, files, groups, iterations);
+	idcache_free(&ids);
+
+	database_remove();
+
+	return EXIT_SUCCESS;
+}
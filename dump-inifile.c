@@ -1,26 +1,120 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <nv.h>
+#include "libsvc/inicache.h"
 #include "libsvc/inifile.h"
+#include "libsvc/statuspage.h"
 
 
 static void
 usage(void)
 {
 	printf("usage: dump-inifile inifile\n");
+	printf("       dump-inifile -c cachefile\n");
+	printf("       dump-inifile -s statusfile\n");
 	exit(EXIT_FAILURE);
 }
 
 
+static int
+dump_cache(const char *path)
+{
+	struct inicache cache;
+
+	if (!inicache_open(&cache, path))
+	{
+		fprintf(stderr, "%s: missing or invalid service cache\n", path);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < inicache_count(&cache); i++)
+	{
+		const char *source;
+		nvlist_t *nvl;
+
+		if (!inicache_get(&cache, i, &source, &nvl))
+		{
+			fprintf(stderr, "%s: record %zu is damaged\n", path, i);
+			continue;
+		}
+
+		printf("%s:\n", source);
+		nvlist_fdump(nvl, stdout);
+		nvlist_destroy(nvl);
+	}
+
+	inicache_close(&cache);
+
+	return EXIT_SUCCESS;
+}
+
+
+static int
+dump_status(const char *path)
+{
+	struct statuspage sp;
+	struct statuspage_entry entry;
+
+	if (!statuspage_open(&sp, path))
+	{
+		fprintf(stderr, "%s: missing or incompatible status page\n", path);
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < statuspage_count(&sp); i++)
+	{
+		if (!statuspage_read(&sp, i, &entry))
+		{
+			fprintf(stderr, "%s: entry %zu is being written, try again\n", path, i);
+			continue;
+		}
+
+		printf("%s: state=%u pid=%d exit_pid=%d exit_status=%d restarts=%u respawn_last=%lld "
+			"state_changed_ns=%llu started_ns=%llu ready_ns=%llu\n",
+			entry.name, entry.state, entry.pid, entry.exit_pid, entry.exit_status, entry.restart_count,
+			(long long) entry.respawn_last, (unsigned long long) entry.state_changed_ns,
+			(unsigned long long) entry.started_ns, (unsigned long long) entry.ready_ns);
+	}
+
+	statuspage_close(&sp);
+
+	return EXIT_SUCCESS;
+}
+
+
 int
 main(int argc, char *argv[])
 {
 	nvlist_t *nvl;
+	struct inifile_error err;
 
 	if (argc < 2)
 		usage();
 
-	nvl = inifile_parse(argv[1]);
+	if (!strcmp(argv[1], "-c"))
+	{
+		if (argc < 3)
+			usage();
+
+		return dump_cache(argv[2]);
+	}
+
+	if (!strcmp(argv[1], "-s"))
+	{
+		if (argc < 3)
+			usage();
+
+		return dump_status(argv[2]);
+	}
+
+	nvl = inifile_load(argv[1], &err);
+	if (nvl == NULL)
+	{
+		fprintf(stderr, "%s:%u:%u: %s\n", argv[1], err.line, err.column, err.message);
+		return EXIT_FAILURE;
+	}
+
 	nvlist_fdump(nvl, stdout);
 	nvlist_destroy(nvl);
 
@@ -0,0 +1,339 @@
+/* resource accounting of services, from /proc, cgroups and rusage */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+
+
+#include "libsvc/accounting.h"
+
+
+/* largest stat file read; smaps_rollup and status are well under this */
+#define ACCOUNTING_FILE_MAX	4096
+
+
+void
+accounting_init(struct accounting *a)
+{
+	assert(a != NULL);
+
+	memset(a, 0, sizeof *a);
+}
+
+
+/*
+ * Read a whole small file, relative to dir_fd, into buf as a string.
+ */
+static bool
+accounting_read(int dir_fd, const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+
+	if (n < 0)
+		return false;
+
+	buf[n] = 0;
+	return true;
+}
+
+
+/*
+ * Find the line starting with key in a "key value" or "key: value" file, and parse the
+ * number after it.
+ */
+static bool
+accounting_field(const char *buf, const char *key, uint64_t *value)
+{
+	size_t len = strlen(key);
+	const char *p = buf;
+	char *end;
+
+	while (p != NULL && *p)
+	{
+		if (!strncmp(p, key, len) && (p[len] == ' ' || p[len] == ':' || p[len] == '\t'))
+		{
+			p += len + 1;
+			*value = strtoull(p, &end, 10);
+
+			return end != p;
+		}
+
+		if ((p = strchr(p, '\n')) != NULL)
+			p++;
+	}
+
+	return false;
+}
+
+
+static uint32_t
+accounting_count_fds(const char *path)
+{
+	struct dirent *de;
+	uint32_t count = 0;
+	DIR *dir;
+
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+
+	while ((de = readdir(dir)) != NULL)
+		if (de->d_name[0] != '.')
+			count++;
+
+	closedir(dir);
+
+	return count;
+}
+
+
+/*
+ * Sample the main process.  CPU time includes the children it has reaped, as the rusage
+ * of its own exit will.
+ */
+static bool
+accounting_sample_proc(struct accounting_sample *s, pid_t pid)
+{
+	static long ticks;
+	char path[64], buf[ACCOUNTING_FILE_MAX], *p;
+	unsigned long long utime, stime;
+	long long cutime, cstime;
+	uint64_t value;
+
+	if (ticks == 0)
+		ticks = sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+
+	/* the command name may hold spaces and parentheses; the fields after it do not */
+	if (!accounting_read(AT_FDCWD, path, buf, sizeof buf) || (p = strrchr(buf, ')')) == NULL ||
+		sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld",
+			&utime, &stime, &cutime, &cstime) != 4)
+		return false;
+
+	s->usage.cpu_user_us = (utime + cutime) * 1000000ULL / ticks;
+	s->usage.cpu_system_us = (stime + cstime) * 1000000ULL / ticks;
+
+	snprintf(path, sizeof path, "/proc/%d/status", (int) pid);
+
+	if (accounting_read(AT_FDCWD, path, buf, sizeof buf))
+	{
+		if (accounting_field(buf, "VmRSS", &value))
+			s->rss_bytes = value * 1024;
+
+		if (accounting_field(buf, "Threads", &value))
+			s->threads = value;
+
+		accounting_field(buf, "voluntary_ctxt_switches", &s->usage.ctxsw_voluntary);
+		accounting_field(buf, "nonvoluntary_ctxt_switches", &s->usage.ctxsw_involuntary);
+	}
+
+	snprintf(path, sizeof path, "/proc/%d/smaps_rollup", (int) pid);
+
+	if (accounting_read(AT_FDCWD, path, buf, sizeof buf) && accounting_field(buf, "Pss", &value))
+		s->pss_bytes = value * 1024;
+
+	/* only readable by whoever may ptrace the process */
+	snprintf(path, sizeof path, "/proc/%d/io", (int) pid);
+
+	if (accounting_read(AT_FDCWD, path, buf, sizeof buf))
+	{
+		accounting_field(buf, "read_bytes", &s->usage.io_read_bytes);
+		accounting_field(buf, "write_bytes", &s->usage.io_write_bytes);
+	}
+
+	snprintf(path, sizeof path, "/proc/%d/fd", (int) pid);
+	s->fd_count = accounting_count_fds(path);
+
+	return true;
+}
+
+
+/*
+ * Read the CPU time and IO of the cgroup.  cpu.stat is always there; io.stat only with
+ * the io controller, and *has_io tells whether it was.
+ */
+static bool
+accounting_cgroup_usage(const struct cgroup *cg, struct accounting_usage *u, bool *has_io)
+{
+	char buf[ACCOUNTING_FILE_MAX];
+	const char *p;
+
+	if (cg == NULL || cg->dir_fd < 0 || !accounting_read(cg->dir_fd, "cpu.stat", buf, sizeof buf) ||
+		!accounting_field(buf, "user_usec", &u->cpu_user_us) ||
+		!accounting_field(buf, "system_usec", &u->cpu_system_us))
+		return false;
+
+	if (!(*has_io = accounting_read(cg->dir_fd, "io.stat", buf, sizeof buf)))
+		return true;
+
+	/* one line per device, "MAJ:MIN rbytes=N wbytes=N rios=N wios=N ..." */
+	u->io_read_bytes = 0;
+	u->io_write_bytes = 0;
+
+	for (p = buf; *p; p++)
+	{
+		if (!strncmp(p, "rbytes=", sizeof "rbytes=" - 1))
+			u->io_read_bytes += strtoull(p + sizeof "rbytes=" - 1, NULL, 10);
+		else if (!strncmp(p, "wbytes=", sizeof "wbytes=" - 1))
+			u->io_write_bytes += strtoull(p + sizeof "wbytes=" - 1, NULL, 10);
+	}
+
+	return true;
+}
+
+
+static void
+accounting_raise(uint64_t *value, uint64_t now, uint64_t base)
+{
+	if (now > base && now - base > *value)
+		*value = now - base;
+}
+
+
+/*
+ * Fold in what the cgroup used since base, in the fields a cgroup counts.  The cgroup holds
+ * the main process as well, so it can only count more; where it counts less, as on hybrid
+ * hierarchies whose cpu controller is bound to v1, the figures of the process are kept.
+ */
+static void
+accounting_cgroup_delta(struct accounting_usage *u, const struct accounting_usage *now, const struct accounting_usage *base, bool has_io)
+{
+	accounting_raise(&u->cpu_user_us, now->cpu_user_us, base->cpu_user_us);
+	accounting_raise(&u->cpu_system_us, now->cpu_system_us, base->cpu_system_us);
+
+	if (!has_io)
+		return;
+
+	accounting_raise(&u->io_read_bytes, now->io_read_bytes, base->io_read_bytes);
+	accounting_raise(&u->io_write_bytes, now->io_write_bytes, base->io_write_bytes);
+}
+
+
+/*
+ * A run is starting: forget the last sample, and note where the cgroup's counters stand.
+ */
+void
+accounting_started(struct accounting *a, const struct cgroup *cg)
+{
+	bool has_io;
+
+	assert(a != NULL);
+
+	memset(&a->live, 0, sizeof a->live);
+	memset(&a->cgroup_base, 0, sizeof a->cgroup_base);
+
+	accounting_cgroup_usage(cg, &a->cgroup_base, &has_io);
+}
+
+
+/*
+ * Sample the run in progress at now_ns.  With a cgroup, CPU time and IO cover the whole
+ * tree; the rest is always of the main process.
+ */
+bool
+accounting_sample(struct accounting *a, pid_t pid, const struct cgroup *cg, uint64_t now_ns)
+{
+	struct accounting_sample s = {};
+	struct accounting_usage u = a->cgroup_base;
+	char buf[64];
+	uint64_t value;
+	bool has_io = false;
+
+	assert(a != NULL);
+
+	if (pid <= 0 || !accounting_sample_proc(&s, pid))
+		return false;
+
+	if (accounting_cgroup_usage(cg, &u, &has_io))
+	{
+		accounting_cgroup_delta(&s.usage, &u, &a->cgroup_base, has_io);
+
+		if (accounting_read(cg->dir_fd, "memory.current", buf, sizeof buf) && sscanf(buf, "%" SCNu64, &value) == 1)
+			s.memory_bytes = value;
+	}
+
+	s.sampled_ns = now_ns;
+	a->live = s;
+
+	return true;
+}
+
+
+/*
+ * The child was reaped with rusage ru, and whatever it forked is gone.  Its usage is added
+ * to the totals, with the cgroup's counters where it has one, as rusage misses what the
+ * child did not wait for.
+ */
+void
+accounting_ended(struct accounting *a, const struct rusage *ru, const struct cgroup *cg)
+{
+	struct accounting_usage run = {}, u = a->cgroup_base;
+	bool has_io = false;
+
+	assert(a != NULL);
+	assert(ru != NULL);
+
+	run.cpu_user_us = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+	run.cpu_system_us = ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+	run.ctxsw_voluntary = ru->ru_nvcsw;
+	run.ctxsw_involuntary = ru->ru_nivcsw;
+
+	/* in 512 byte blocks, as counted by the block layer */
+	run.io_read_bytes = ru->ru_inblock * 512ULL;
+	run.io_write_bytes = ru->ru_oublock * 512ULL;
+
+	if (accounting_cgroup_usage(cg, &u, &has_io))
+		accounting_cgroup_delta(&run, &u, &a->cgroup_base, has_io);
+
+	a->total.cpu_user_us += run.cpu_user_us;
+	a->total.cpu_system_us += run.cpu_system_us;
+	a->total.ctxsw_voluntary += run.ctxsw_voluntary;
+	a->total.ctxsw_involuntary += run.ctxsw_involuntary;
+	a->total.io_read_bytes += run.io_read_bytes;
+	a->total.io_write_bytes += run.io_write_bytes;
+
+	if ((uint64_t) ru->ru_maxrss * 1024 > a->maxrss_bytes)
+		a->maxrss_bytes = ru->ru_maxrss * 1024ULL;
+
+	a->runs++;
+
+	memset(&a->live, 0, sizeof a->live);
+}
+
+
+/*
+ * Usage over every run, including the one in progress as last sampled.
+ */
+void
+accounting_cumulative(const struct accounting *a, struct accounting_usage *u)
+{
+	assert(a != NULL);
+	assert(u != NULL);
+
+	*u = a->total;
+
+	if (a->live.sampled_ns == 0)
+		return;
+
+	u->cpu_user_us += a->live.usage.cpu_user_us;
+	u->cpu_system_us += a->live.usage.cpu_system_us;
+	u->ctxsw_voluntary += a->live.usage.ctxsw_voluntary;
+	u->ctxsw_involuntary += a->live.usage.ctxsw_involuntary;
+	u->io_read_bytes += a->live.usage.io_read_bytes;
+	u->io_write_bytes += a->live.usage.io_write_bytes;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+
+#ifndef LIBSVC_ACCOUNTING_H
+#define LIBSVC_ACCOUNTING_H
+
+#include "libsvc/cgroup.h"
+
+
+/*
+ * What a service costs.  While a child runs, its usage is sampled from /proc/PID and,
+ * if it has one, from its cgroup, whose counters cover everything the child forked.  When
+ * the child is reaped, what it used (the rusage returned with its exit status, or the
+ * final cgroup counters) is added to totals which are kept across restarts.
+ */
+
+/* counters which only ever grow during a run, and so can be summed over runs */
+struct accounting_usage {
+	uint64_t cpu_user_us;
+	uint64_t cpu_system_us;
+	uint64_t ctxsw_voluntary;
+	uint64_t ctxsw_involuntary;
+	uint64_t io_read_bytes;
+	uint64_t io_write_bytes;
+};
+
+
+/* the run in progress, as of sampled_ns */
+struct accounting_sample {
+	struct accounting_usage usage;
+
+	/* of the main process; memory_bytes is the cgroup's memory.current, or 0 without one */
+	uint64_t rss_bytes;
+	uint64_t pss_bytes;
+	uint64_t memory_bytes;
+	uint32_t fd_count;
+	uint32_t threads;
+
+	uint64_t sampled_ns;
+};
+
+
+struct accounting {
+	/* valid while live.sampled_ns is not 0 */
+	struct accounting_sample live;
+
+	/* the cgroup's counters when the run started, as the cgroup outlives each run */
+	struct accounting_usage cgroup_base;
+
+	/* every run which has ended */
+	struct accounting_usage total;
+	uint64_t maxrss_bytes;
+	uint64_t runs;
+};
+
+
+void accounting_init(struct accounting *a);
+void accounting_started(struct accounting *a, const struct cgroup *cg);
+bool accounting_sample(struct accounting *a, pid_t pid, const struct cgroup *cg, uint64_t now_ns);
+void accounting_ended(struct accounting *a, const struct rusage *ru, const struct cgroup *cg);
+void accounting_cumulative(const struct accounting *a, struct accounting_usage *u);
+
+
+#endif
@@ -42,6 +42,10 @@ argv_free(argv_t *argv)
 
 	for (int i = 0; i < argv->count; i++)
 		free(argv->argv[i]);
+
+	free(argv->argv);
+	argv->argv = NULL;
+	argv->count = 0;
 }
 
 
@@ -154,15 +158,17 @@ argv_append(argv_t *argv, const char *arg)
 
 	if (argv->argv == NULL)
 	{
-		argv->argv = calloc(sizeof(void *), 1);
+		argv->argv = calloc(sizeof(void *), 2);
 		argv->argv[0] = strdup(arg);
 		argv->count = 1;
 
 		return;
 	}
 
-	argv->argv = realloc(argv->argv, sizeof(void *) * (argv->count + 1));
+	/* keep the vector NULL-terminated so that it may be passed to execvp() */
+	argv->argv = realloc(argv->argv, sizeof(void *) * (argv->count + 2));
 	argv->argv[argv->count++] = strdup(arg);
+	argv->argv[argv->count] = NULL;
 }
 
 
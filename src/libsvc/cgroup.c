@@ -0,0 +1,476 @@
+/* cgroup v2 leaves for services */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+
+#include "libsvc/cgroup.h"
+#include "libsvc/logcapture.h"
+
+
+/* the period cpu-max=N% is a share of, as cpu.max defaults to */
+#define CGROUP_CPU_PERIOD_US	100000
+
+/* passes over cgroup.procs when cgroup.kill is not there, since processes may fork meanwhile */
+#define CGROUP_KILL_PASSES	8
+
+
+void
+cgroup_limits_init(struct cgroup_limits *limits)
+{
+	assert(limits != NULL);
+
+	memset(limits, 0, sizeof *limits);
+
+	limits->cpu_quota_us = CGROUP_LIMIT_UNSET;
+	limits->memory_max = CGROUP_LIMIT_UNSET;
+	limits->memory_high = CGROUP_LIMIT_UNSET;
+}
+
+
+/*
+ * Parse a CPU limit: "max", a share of one CPU such as "150%", or a quota and period in
+ * microseconds as cpu.max takes them, e.g. "50000 100000".
+ */
+bool
+cgroup_parse_cpu(struct cgroup_limits *limits, const char *text)
+{
+	long long quota, period = CGROUP_CPU_PERIOD_US;
+	char *end;
+
+	if (!strcmp(text, "max"))
+	{
+		limits->cpu_quota_us = CGROUP_LIMIT_MAX;
+		limits->cpu_period_us = CGROUP_CPU_PERIOD_US;
+		return true;
+	}
+
+	errno = 0;
+	quota = strtoll(text, &end, 10);
+	if (errno != 0 || end == text)
+		return false;
+
+	if (*end == '%' && end[1] == 0)
+	{
+		if (quota < 1 || quota > 100000)
+			return false;
+
+		quota = quota * CGROUP_CPU_PERIOD_US / 100;
+	}
+	else if (*end == ' ')
+	{
+		char *p = end + 1;
+
+		period = strtoll(p, &end, 10);
+		if (errno != 0 || end == p || *end != 0)
+			return false;
+	}
+	else if (*end != 0)
+		return false;
+
+	/* the bounds the kernel enforces */
+	if (quota < 1000 || period < 1000 || period > 1000000)
+		return false;
+
+	limits->cpu_quota_us = quota;
+	limits->cpu_period_us = period;
+	return true;
+}
+
+
+/*
+ * Parse a memory limit: "max", or a size such as 512M.
+ */
+bool
+cgroup_parse_memory(int64_t *limit, const char *text)
+{
+	off_t size;
+
+	if (!strcmp(text, "max"))
+	{
+		*limit = CGROUP_LIMIT_MAX;
+		return true;
+	}
+
+	if (!logcapture_parse_size(&size, text))
+		return false;
+
+	*limit = size;
+	return true;
+}
+
+
+/*
+ * Parse an I/O limit, "DEVICE KEY=VALUE...", where DEVICE is a block device or its
+ * MAJOR:MINOR numbers and the keys are rbps, wbps, riops and wiops as io.max takes them.
+ */
+bool
+cgroup_parse_io(struct cgroup_limits *limits, const char *text, char *errbuf, size_t errbuf_len)
+{
+	char buf[512], line[512], *tok, *saveptr = NULL;
+	unsigned int major_nr, minor_nr;
+	size_t len;
+	char c;
+
+	if (strlen(text) >= sizeof buf)
+	{
+		snprintf(errbuf, errbuf_len, "too long");
+		return false;
+	}
+
+	strcpy(buf, text);
+
+	if ((tok = strtok_r(buf, " \t", &saveptr)) == NULL)
+	{
+		snprintf(errbuf, errbuf_len, "expected a device and limits such as /dev/sda wbps=10M");
+		return false;
+	}
+
+	if (sscanf(tok, "%u:%u%c", &major_nr, &minor_nr, &c) != 2)
+	{
+		struct stat st;
+
+		if (stat(tok, &st) < 0 || !S_ISBLK(st.st_mode))
+		{
+			snprintf(errbuf, errbuf_len, "'%s' is not a block device", tok);
+			return false;
+		}
+
+		major_nr = major(st.st_rdev);
+		minor_nr = minor(st.st_rdev);
+	}
+
+	len = snprintf(line, sizeof line, "%u:%u", major_nr, minor_nr);
+
+	while ((tok = strtok_r(NULL, " \t", &saveptr)) != NULL)
+	{
+		char *value = strchr(tok, '=');
+		off_t n;
+
+		if (value == NULL)
+		{
+			snprintf(errbuf, errbuf_len, "expected KEY=VALUE, not '%s'", tok);
+			return false;
+		}
+
+		*value++ = 0;
+
+		if (strcmp(tok, "rbps") && strcmp(tok, "wbps") && strcmp(tok, "riops") && strcmp(tok, "wiops"))
+		{
+			snprintf(errbuf, errbuf_len, "unknown I/O limit '%s', expected rbps, wbps, riops or wiops", tok);
+			return false;
+		}
+
+		if (strcmp(value, "max") && !logcapture_parse_size(&n, value))
+		{
+			snprintf(errbuf, errbuf_len, "expected a number or max for %s", tok);
+			return false;
+		}
+
+		if (!strcmp(value, "max"))
+			len += snprintf(line + len, sizeof line - len, " %s=max", tok);
+		else
+			len += snprintf(line + len, sizeof line - len, " %s=%lld", tok, (long long) n);
+
+		if (len >= sizeof line)
+		{
+			snprintf(errbuf, errbuf_len, "too long");
+			return false;
+		}
+	}
+
+	argv_append(&limits->io_max, line);
+	return true;
+}
+
+
+void
+cgroup_limits_free(struct cgroup_limits *limits)
+{
+	assert(limits != NULL);
+
+	argv_free(&limits->io_max);
+}
+
+
+void
+cgroup_init(struct cgroup *cg)
+{
+	assert(cg != NULL);
+
+	memset(cg, 0, sizeof *cg);
+
+	cg->dir_fd = -1;
+	cg->events_fd = -1;
+}
+
+
+/*
+ * Create (or take over) the cgroup parent/name.  It is kept across restarts of the
+ * service, and removed by cgroup_destroy().
+ */
+bool
+cgroup_create(struct cgroup *cg, const char *parent, const char *name)
+{
+	int saved_errno;
+
+	assert(cg != NULL);
+	assert(parent != NULL);
+	assert(name != NULL);
+
+	cgroup_init(cg);
+
+	if (strchr(name, '/') != NULL || !strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	if ((cg->path = malloc(strlen(parent) + strlen(name) + 2)) == NULL)
+		return false;
+
+	sprintf(cg->path, "%s/%s", parent, name);
+
+	if (mkdir(cg->path, 0755) < 0 && errno != EEXIST)
+		goto fail;
+
+	if ((cg->dir_fd = open(cg->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		goto fail;
+
+	if ((cg->events_fd = openat(cg->dir_fd, "cgroup.events", O_RDONLY | O_CLOEXEC)) < 0)
+		goto fail;
+
+	cgroup_update(cg);
+	return true;
+
+fail:
+	saved_errno = errno;
+	cgroup_destroy(cg);
+	errno = saved_errno;
+
+	return false;
+}
+
+
+static bool
+cgroup_write(int dir_fd, const char *file, const char *value)
+{
+	ssize_t len = strlen(value), n;
+	int fd;
+
+	if ((fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	n = write(fd, value, len);
+	close(fd);
+
+	return n == len;
+}
+
+
+static void
+cgroup_format_limit(char *buf, size_t len, int64_t limit)
+{
+	if (limit == CGROUP_LIMIT_MAX)
+		snprintf(buf, len, "max");
+	else
+		snprintf(buf, len, "%lld", (long long) limit);
+}
+
+
+/*
+ * Enable a controller for the children of the parent cgroup, which it must be for the
+ * service's limits to be settable at all.
+ */
+static bool
+cgroup_enable(struct cgroup *cg, const char *controller)
+{
+	char buf[32];
+	int fd;
+	bool ok;
+
+	if ((fd = openat(cg->dir_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return false;
+
+	snprintf(buf, sizeof buf, "+%s", controller);
+	ok = cgroup_write(fd, "cgroup.subtree_control", buf);
+	close(fd);
+
+	return ok;
+}
+
+
+/*
+ * Apply the limits of a service to its cgroup.  Stops at the first which cannot be set,
+ * with a description of it in errbuf.
+ */
+bool
+cgroup_apply(struct cgroup *cg, const struct cgroup_limits *limits, char *errbuf, size_t errbuf_len)
+{
+	const char *file = NULL;
+	char buf[64];
+
+	assert(cg != NULL);
+	assert(limits != NULL);
+
+	if (cg->dir_fd < 0)
+		return true;
+
+	if (limits->cpu_quota_us != CGROUP_LIMIT_UNSET)
+	{
+		cgroup_format_limit(buf, sizeof buf, limits->cpu_quota_us);
+		snprintf(buf + strlen(buf), sizeof buf - strlen(buf), " %lld", (long long) limits->cpu_period_us);
+
+		if (!cgroup_enable(cg, "cpu"))
+			goto fail_enable;
+
+		if (!cgroup_write(cg->dir_fd, file = "cpu.max", buf))
+			goto fail_file;
+	}
+
+	if (limits->memory_max != CGROUP_LIMIT_UNSET || limits->memory_high != CGROUP_LIMIT_UNSET)
+	{
+		if (!cgroup_enable(cg, "memory"))
+			goto fail_enable;
+
+		cgroup_format_limit(buf, sizeof buf, limits->memory_max);
+		if (limits->memory_max != CGROUP_LIMIT_UNSET && !cgroup_write(cg->dir_fd, file = "memory.max", buf))
+			goto fail_file;
+
+		cgroup_format_limit(buf, sizeof buf, limits->memory_high);
+		if (limits->memory_high != CGROUP_LIMIT_UNSET && !cgroup_write(cg->dir_fd, file = "memory.high", buf))
+			goto fail_file;
+	}
+
+	if (argv_count(&limits->io_max) > 0 && !cgroup_enable(cg, "io"))
+		goto fail_enable;
+
+	/* io.max takes one device per write */
+	for (int i = 0; i < argv_count(&limits->io_max); i++)
+	{
+		if (!cgroup_write(cg->dir_fd, "io.max", limits->io_max.argv[i]))
+		{
+			snprintf(errbuf, errbuf_len, "could not set io.max to '%s' in %s: %s", limits->io_max.argv[i], cg->path, strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+
+fail_enable:
+	snprintf(errbuf, errbuf_len, "could not enable the controllers needed in the parent of %s: %s", cg->path, strerror(errno));
+	return false;
+
+fail_file:
+	snprintf(errbuf, errbuf_len, "could not set %s to '%s' in %s: %s", file, buf, cg->path, strerror(errno));
+	return false;
+}
+
+
+/*
+ * Read cgroup.events again, after it polled POLLPRI.  Returns whether anything is left
+ * in the cgroup.
+ */
+bool
+cgroup_update(struct cgroup *cg)
+{
+	char buf[256], *p;
+	ssize_t n;
+
+	assert(cg != NULL);
+
+	if (cg->events_fd < 0)
+		return false;
+
+	/* the file must be read from the start for the next change to be reported */
+	if ((n = pread(cg->events_fd, buf, sizeof buf - 1, 0)) < 0)
+		return cg->populated;
+
+	buf[n] = 0;
+
+	if ((p = strstr(buf, "populated ")) != NULL)
+		cg->populated = p[sizeof "populated " - 1] == '1';
+
+	return cg->populated;
+}
+
+
+/*
+ * Kill every process in the cgroup.  Without cgroup.kill (before Linux 5.14) each process
+ * listed in cgroup.procs is killed in turn, which a process forking fast enough may outrun.
+ */
+bool
+cgroup_kill(struct cgroup *cg)
+{
+	assert(cg != NULL);
+
+	if (cg->dir_fd < 0)
+		return false;
+
+	if (cgroup_write(cg->dir_fd, "cgroup.kill", "1"))
+		return true;
+
+	if (errno != ENOENT)
+		return false;
+
+	for (int pass = 0; pass < CGROUP_KILL_PASSES; pass++)
+	{
+		bool found = false;
+		FILE *procs;
+		int fd, pid;
+
+		if ((fd = openat(cg->dir_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC)) < 0)
+			return false;
+
+		if ((procs = fdopen(fd, "r")) == NULL)
+		{
+			close(fd);
+			return false;
+		}
+
+		while (fscanf(procs, "%d", &pid) == 1)
+		{
+			kill(pid, SIGKILL);
+			found = true;
+		}
+
+		fclose(procs);
+
+		if (!found)
+			break;
+	}
+
+	return true;
+}
+
+
+/*
+ * Close the cgroup and remove it, which only succeeds once it is empty.
+ */
+void
+cgroup_destroy(struct cgroup *cg)
+{
+	assert(cg != NULL);
+
+	if (cg->events_fd >= 0)
+		close(cg->events_fd);
+
+	if (cg->dir_fd >= 0)
+		close(cg->dir_fd);
+
+	if (cg->path != NULL)
+		rmdir(cg->path);
+
+	free(cg->path);
+	cgroup_init(cg);
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_CGROUP_H
+#define LIBSVC_CGROUP_H
+
+#include "libsvc/argv.h"
+
+
+/*
+ * A cgroup v2 leaf holding every process of one service.  The child is cloned straight
+ * into it, so that whatever it forks stays inside: the service has only really exited
+ * once the cgroup is no longer populated, and stopping it for good is one write to
+ * cgroup.kill.
+ */
+
+/* a memory limit which is not set, and one set to "max" */
+#define CGROUP_LIMIT_UNSET	(-1)
+#define CGROUP_LIMIT_MAX	INT64_MAX
+
+
+/* as declared with cpu-max=, memory-max=, memory-high= and io-max= */
+struct cgroup_limits {
+	/* cpu.max, in microseconds; cpu_quota_us is CGROUP_LIMIT_MAX for no quota */
+	int64_t cpu_quota_us;
+	int64_t cpu_period_us;
+
+	int64_t memory_max;
+	int64_t memory_high;
+
+	/* io.max lines, "MAJOR:MINOR rbps=... wbps=... riops=... wiops=..." */
+	argv_t io_max;
+};
+
+
+struct cgroup {
+	char *path;
+
+	/* the directory, for CLONE_INTO_CGROUP, and cgroup.events, polled for POLLPRI */
+	int dir_fd;
+	int events_fd;
+
+	bool populated;
+};
+
+
+void cgroup_limits_init(struct cgroup_limits *limits);
+bool cgroup_parse_cpu(struct cgroup_limits *limits, const char *text);
+bool cgroup_parse_memory(int64_t *limit, const char *text);
+bool cgroup_parse_io(struct cgroup_limits *limits, const char *text, char *errbuf, size_t errbuf_len);
+void cgroup_limits_free(struct cgroup_limits *limits);
+
+void cgroup_init(struct cgroup *cg);
+bool cgroup_create(struct cgroup *cg, const char *parent, const char *name);
+bool cgroup_apply(struct cgroup *cg, const struct cgroup_limits *limits, char *errbuf, size_t errbuf_len);
+bool cgroup_update(struct cgroup *cg);
+bool cgroup_kill(struct cgroup *cg);
+void cgroup_destroy(struct cgroup *cg);
+
+
+#endif
@@ -1,5 +1,9 @@
 /* childproc helpers */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -17,6 +21,10 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/queue.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <signal.h>
 #include <assert.h>
 
 
@@ -24,162 +32,969 @@
 #include "libsvc/signal.h"
 
 
+/*
+ * pidfd helpers.  These go through syscall(2) directly, as not every libc we care about
+ * wraps them yet.  P_PIDFD is likewise not always present in <sys/wait.h>.
+ */
+#define CHILDPROC_P_PIDFD	3
+
+
+static int
+childproc_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void) pid;
+
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+static int
+childproc_pidfd_send_signal(int pidfd, int sig)
+{
+#ifdef SYS_pidfd_send_signal
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+	(void) pidfd;
+	(void) sig;
+
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/*
+ * Initialize a childproc with default settings.
+ */
+void
+childproc_init(struct childproc *proc)
+{
+	assert(proc != NULL);
+
+	memset(proc, 0, sizeof *proc);
+
+	proc->child_uid = -1;
+	proc->child_gid = -1;
+	proc->child_umask = -1;
+
+	proc->stdin_fd = STDIN_FILENO;
+	proc->stdout_fd = STDOUT_FILENO;
+	proc->stderr_fd = STDERR_FILENO;
+
+	proc->notify_fd = -1;
+	proc->notify_fd_to = -1;
+
+	proc->pidfd = -1;
+	proc->kill_delay = 3;
+	proc->stop_timer_fd = -1;
+
+	respawn_init(&proc->respawn);
+	cgroup_init(&proc->cgroup);
+}
+
+
 /*
  * Set childproc state.
  */
 void
 childproc_setstate(struct childproc *proc, childproc_state_t state)
 {
+	childproc_state_t old_state = proc->state;
+
+	if (state == old_state)
+		return;
+
 	proc->state = state;
+	clock_gettime(CLOCK_MONOTONIC, &proc->state_changed);
+
+	if (state == CHILDPROC_STARTING)
+	{
+		proc->started = proc->state_changed;
+		proc->ready = (struct timespec) {};
+	}
+	else if (state == CHILDPROC_READY)
+	{
+		proc->ready = proc->state_changed;
+		proc->times.ready_ns = proc->ready.tv_sec * 1000000000ULL + proc->ready.tv_nsec;
+	}
+
+	if (proc->state_fn != NULL)
+		proc->state_fn(proc, old_state, proc->state_opaque);
 }
 
 
 /*
- * Fork a child process to execute the service in, via childproc_exec().
+ * clone3(2) and close_range(2) definitions, for the same reason as above.  Without
+ * CLONE_VM the child runs on a private copy of our memory like fork(2), so it needs
+ * no stack of its own; CLONE_VFORK suspends us until it has called execve(2) or exited.
  */
-void
+#define CHILDPROC_CLONE_VFORK		0x00004000ULL
+#define CHILDPROC_CLONE_PIDFD		0x00001000ULL
+#define CHILDPROC_CLONE_INTO_CGROUP	0x200000000ULL
+#define CHILDPROC_CLOSE_RANGE_CLOEXEC	(1U << 2)
+
+
+struct childproc_clone_args {
+	uint64_t flags;
+	uint64_t pidfd;
+	uint64_t child_tid;
+	uint64_t parent_tid;
+	uint64_t exit_signal;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t tls;
+
+	/* Linux 5.5 and 5.7 */
+	uint64_t set_tid;
+	uint64_t set_tid_size;
+	uint64_t cgroup;
+};
+
+/* the size before set_tid was added, which every kernel with clone3() accepts */
+#define CHILDPROC_CLONE_ARGS_SIZE_VER0	64
+
+
+/* descriptor setup plan: the child gets descriptor from as descriptor to */
+struct childproc_fdmap {
+	int from;
+	int to;
+};
+
+#define CHILDPROC_FDMAP_MAX	(4 + CHILDPROC_PASS_FDS_MAX)
+
+
+/* steps of child setup which may fail, reported back over the error pipe */
+typedef enum childproc_spawn_step_e {
+	CHILDPROC_SPAWN_CGROUP,
+	CHILDPROC_SPAWN_SETSID,
+	CHILDPROC_SPAWN_CHROOT,
+	CHILDPROC_SPAWN_CHDIR,
+	CHILDPROC_SPAWN_SETGID,
+	CHILDPROC_SPAWN_SETUID,
+	CHILDPROC_SPAWN_FDS,
+	CHILDPROC_SPAWN_EXEC,
+} childproc_spawn_step_t;
+
+
+static const char *childproc_spawn_step_names[] = {
+	[CHILDPROC_SPAWN_CGROUP] = "join cgroup",
+	[CHILDPROC_SPAWN_SETSID] = "create session",
+	[CHILDPROC_SPAWN_CHROOT] = "chroot",
+	[CHILDPROC_SPAWN_CHDIR] = "chdir",
+	[CHILDPROC_SPAWN_SETGID] = "setgid",
+	[CHILDPROC_SPAWN_SETUID] = "setuid",
+	[CHILDPROC_SPAWN_FDS] = "set up descriptors",
+	[CHILDPROC_SPAWN_EXEC] = "exec",
+};
+
+
+struct childproc_spawn_error {
+	int step;
+	int error;
+};
+
+
+/*
+ * Build the descriptor plan for the child.  Returns the number of entries.
+ */
+static size_t
+childproc_fdplan(const struct childproc *proc, struct childproc_fdmap plan[CHILDPROC_FDMAP_MAX])
+{
+	size_t n = 0;
+
+	plan[n++] = (struct childproc_fdmap) {.from = proc->stdin_fd, .to = STDIN_FILENO};
+	plan[n++] = (struct childproc_fdmap) {.from = proc->stdout_fd, .to = STDOUT_FILENO};
+	plan[n++] = (struct childproc_fdmap) {.from = proc->stderr_fd, .to = STDERR_FILENO};
+
+	for (int i = 0; i < proc->pass_fd_count && i < CHILDPROC_PASS_FDS_MAX; i++)
+		plan[n++] = (struct childproc_fdmap) {.from = proc->pass_fds[i], .to = STDERR_FILENO + 1 + i};
+
+	if (proc->notify_fd >= 0)
+		plan[n++] = (struct childproc_fdmap) {.from = proc->notify_fd, .to = proc->notify_fd_to};
+
+	return n;
+}
+
+
+static int
+childproc_fdplan_top(const struct childproc_fdmap *plan, size_t n)
+{
+	int top = 0;
+
+	for (size_t i = 0; i < n; i++)
+		if (plan[i].to > top)
+			top = plan[i].to;
+
+	return top;
+}
+
+
+/*
+ * Apply the descriptor plan in the child, then mark every other descriptor close-on-exec.
+ */
+static bool
+childproc_fdplan_apply(struct childproc_fdmap *plan, size_t n)
+{
+	int top = childproc_fdplan_top(plan, n);
+
+	/* move sources out of the way first, so that no dup2() clobbers a later source */
+	for (size_t i = 0; i < n; i++)
+	{
+		if (plan[i].from == plan[i].to)
+			continue;
+
+		if ((plan[i].from = fcntl(plan[i].from, F_DUPFD_CLOEXEC, top + 1)) < 0)
+			return false;
+	}
+
+	for (size_t i = 0; i < n; i++)
+	{
+		if (plan[i].from == plan[i].to)
+		{
+			if (fcntl(plan[i].to, F_SETFD, 0) < 0)
+				return false;
+		}
+		else if (dup2(plan[i].from, plan[i].to) < 0)
+			return false;
+	}
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, top + 1, ~0U, CHILDPROC_CLOSE_RANGE_CLOEXEC) == 0)
+		return true;
+#endif
+
+	/* kernels older than 5.11 */
+	for (int i = getdtablesize() - 1; i > top; i--)
+		fcntl(i, F_SETFD, FD_CLOEXEC);
+
+	return true;
+}
+
+
+/*
+ * Set $LISTEN_FDS, $LISTEN_PID and $LISTEN_FDNAMES for the descriptors passed, or clear
+ * them so that a service does not take on sockets meant for its supervisor.  This runs in
+ * the child, which has its own copy of our memory, so it may allocate.
+ */
+static void
+childproc_listen_env(const struct childproc *proc)
+{
+	char buf[32];
+
+	if (!proc->listen_fds || proc->pass_fd_count == 0)
+	{
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_PID");
+		unsetenv("LISTEN_FDNAMES");
+		return;
+	}
+
+	snprintf(buf, sizeof buf, "%d", proc->pass_fd_count);
+	setenv("LISTEN_FDS", buf, 1);
+
+	snprintf(buf, sizeof buf, "%d", (int) getpid());
+	setenv("LISTEN_PID", buf, 1);
+
+	if (proc->listen_fdnames != NULL)
+		setenv("LISTEN_FDNAMES", proc->listen_fdnames, 1);
+	else
+		unsetenv("LISTEN_FDNAMES");
+}
+
+
+/*
+ * Move the calling process into the cgroup, for kernels without CLONE_INTO_CGROUP.
+ */
+static bool
+childproc_cgroup_join(const struct childproc *proc)
+{
+	int fd;
+	bool ok;
+
+	if ((fd = openat(proc->cgroup.dir_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	ok = write(fd, "0", 1) == 1;
+	close(fd);
+
+	return ok;
+}
+
+
+/*
+ * Execute a child process.  This runs in the child and only returns on failure, after
+ * reporting which step failed on err_fd.  Nothing here may log: the supervisor does that.
+ */
+static void
+childproc_exec(struct childproc *proc, struct childproc_fdmap *plan, size_t plan_size, int err_fd)
+{
+	struct childproc_spawn_error e;
+
+	signal_unblock();
+
+	/* the kernel could not clone us into the cgroup: join it before anything else runs */
+	if (proc->cgroup.dir_fd >= 0 && !proc->cgroup_joined && !childproc_cgroup_join(proc))
+	{
+		e.step = CHILDPROC_SPAWN_CGROUP;
+		goto fail;
+	}
+
+	if (setsid() < 0)
+	{
+		e.step = CHILDPROC_SPAWN_SETSID;
+		goto fail;
+	}
+
+	if (proc->dir_chroot != NULL && chroot(proc->dir_chroot) < 0)
+	{
+		e.step = CHILDPROC_SPAWN_CHROOT;
+		goto fail;
+	}
+
+	if (proc->dir_chdir != NULL && chdir(proc->dir_chdir) < 0)
+	{
+		e.step = CHILDPROC_SPAWN_CHDIR;
+		goto fail;
+	}
+
+	if (proc->child_umask > -1)
+		umask(proc->child_umask);
+
+	if (proc->child_gid > -1 && setgid(proc->child_gid) < 0)
+	{
+		e.step = CHILDPROC_SPAWN_SETGID;
+		goto fail;
+	}
+
+	if (proc->child_uid > -1 && setuid(proc->child_uid) < 0)
+	{
+		e.step = CHILDPROC_SPAWN_SETUID;
+		goto fail;
+	}
+
+	if (!childproc_fdplan_apply(plan, plan_size))
+	{
+		e.step = CHILDPROC_SPAWN_FDS;
+		goto fail;
+	}
+
+	/* our memory is a private copy, so the environment may be changed in place */
+	for (char **env = proc->child_env; env != NULL && *env != NULL; env++)
+		putenv(*env);
+
+	childproc_listen_env(proc);
+
+	execvp(proc->prog_name, proc->prog_argv);
+	e.step = CHILDPROC_SPAWN_EXEC;
+
+fail:
+	e.error = errno;
+
+	while (write(err_fd, &e, sizeof e) < 0 && errno == EINTR)
+		;
+}
+
+
+/*
+ * Create the child process, preferring clone3() so that the pidfd is returned atomically
+ * and we are suspended until the child has exec'd.  Falls back to fork() and pidfd_open().
+ */
+static pid_t
+childproc_clone(struct childproc *proc)
+{
+	pid_t pid;
+
+#ifdef SYS_clone3
+	int pidfd = -1;
+	struct childproc_clone_args args = {
+		.flags = CHILDPROC_CLONE_PIDFD | CHILDPROC_CLONE_VFORK,
+		.pidfd = (uintptr_t) &pidfd,
+		.exit_signal = SIGCHLD,
+	};
+
+	/* the child's copy of this tells it whether it still has to join the cgroup itself */
+	proc->cgroup_joined = proc->cgroup.dir_fd >= 0;
+
+	if (proc->cgroup_joined)
+	{
+		args.flags |= CHILDPROC_CLONE_INTO_CGROUP;
+		args.cgroup = proc->cgroup.dir_fd;
+
+		pid = syscall(SYS_clone3, &args, sizeof args);
+		if (pid >= 0 || (errno != EINVAL && errno != E2BIG))
+			goto cloned;
+
+		/* before Linux 5.7 */
+		proc->cgroup_joined = false;
+		args.flags &= ~CHILDPROC_CLONE_INTO_CGROUP;
+		args.cgroup = 0;
+	}
+
+	pid = syscall(SYS_clone3, &args, CHILDPROC_CLONE_ARGS_SIZE_VER0);
+
+cloned:
+	if (pid > 0)
+		proc->pidfd = pidfd;
+
+	if (pid >= 0 || (errno != ENOSYS && errno != EINVAL && errno != E2BIG))
+		return pid;
+#endif
+
+	proc->cgroup_joined = false;
+	pid = fork();
+
+	/*
+	 * The child cannot be reaped by anyone but us, so its pid is stable until we
+	 * wait for it and the pidfd refers to the right process.  Without pidfd support
+	 * the caller falls back to SIGCHLD and waitpid().
+	 */
+	if (pid > 0)
+	{
+		proc->pidfd = childproc_pidfd_open(pid);
+		if (proc->pidfd >= 0)
+			fcntl(proc->pidfd, F_SETFD, FD_CLOEXEC);
+	}
+
+	return pid;
+}
+
+
+/*
+ * Start a child process to execute the service in, via childproc_exec().
+ * Returns false if the child could not be created or failed before exec.
+ */
+bool
 childproc_start(struct childproc *proc)
 {
+	struct childproc_fdmap plan[CHILDPROC_FDMAP_MAX];
+	struct childproc_spawn_error e;
+	size_t plan_size;
+	int err_pipe[2], fd;
+	ssize_t n;
+
 	assert(proc != NULL);
 
+	proc->respawn_last = time(NULL);
+	proc->spawn_error = 0;
+
 	childproc_setstate(proc, CHILDPROC_STARTING);
 
-	proc->child_pid = fork();
+	proc->times.fork_ns = proc->started.tv_sec * 1000000000ULL + proc->started.tv_nsec;
+	proc->times.exec_ns = 0;
+	proc->times.ready_ns = 0;
+	proc->times.stop_ns = 0;
+	proc->times.reap_ns = 0;
+
+	if (proc->times.requested_ns == 0)
+		proc->times.requested_ns = proc->times.fork_ns;
+
+	plan_size = childproc_fdplan(proc, plan);
+
+	/* close-on-exec from the start, so that no child forked elsewhere meanwhile inherits it */
+	if (pipe2(err_pipe, O_CLOEXEC) < 0)
+	{
+		proc->spawn_error = errno;
+		syslog(LOG_INFO, "%s: failed to create error pipe: %s", proc->prog_name, strerror(errno));
+		return false;
+	}
+
+	/* keep the write end clear of the descriptors the plan installs */
+	if (err_pipe[1] <= childproc_fdplan_top(plan, plan_size))
+	{
+		fd = fcntl(err_pipe[1], F_DUPFD_CLOEXEC, childproc_fdplan_top(plan, plan_size) + 1);
+		close(err_pipe[1]);
+		err_pipe[1] = fd;
+	}
+
+	proc->child_pid = childproc_clone(proc);
 	if (proc->child_pid == 0)
 	{
-		childproc_exec(proc);
-		exit(EXIT_FAILURE);
+		close(err_pipe[0]);
+		childproc_exec(proc, plan, plan_size, err_pipe[1]);
+		_exit(127);
 	}
 
-	proc->respawn_last = time(NULL);
+	close(err_pipe[1]);
+
+	if (proc->child_pid < 0)
+	{
+		proc->spawn_error = errno;
+		proc->child_pid = 0;
+		close(err_pipe[0]);
+
+		syslog(LOG_INFO, "%s: failed to create child process: %s", proc->prog_name, strerror(proc->spawn_error));
+		return false;
+	}
+
+	/* EOF means the exec succeeded and closed the write end */
+	while ((n = read(err_pipe[0], &e, sizeof e)) < 0 && errno == EINTR)
+		;
+
+	close(err_pipe[0]);
+
+	if (n == sizeof e)
+	{
+		proc->spawn_error = e.error;
+		syslog(LOG_INFO, "%s: failed to %s: %s", proc->prog_name, childproc_spawn_step_names[e.step], strerror(e.error));
+		return false;
+	}
+
+	proc->times.exec_ns = respawn_now();
+
+	/* indicate to the system operator that the process is alive */
+	syslog(LOG_INFO, "%s: starting, pid %d", proc->prog_name, proc->child_pid);
+
+	return true;
 }
 
 
 /*
- * Execute a child process.
+ * Send a signal to the child process, through its pidfd when we have one.
  */
-void
-childproc_exec(struct childproc *proc)
+int
+childproc_signal(struct childproc *proc, int sig)
 {
 	assert(proc != NULL);
 
-	signal_unblock();
+	if (proc->child_pid == 0)
+	{
+		errno = ESRCH;
+		return -1;
+	}
 
-	setsid();
+	/* in a cgroup, SIGKILL takes whatever the child forked along with it */
+	if (sig == SIGKILL && proc->cgroup.dir_fd >= 0 && cgroup_kill(&proc->cgroup))
+		return 0;
 
-	/* indicate to the system operator that the process is alive */
-	syslog(LOG_INFO, "%s: starting, pid %d", proc->prog_name, getpid());
+	if (proc->pidfd >= 0)
+		return childproc_pidfd_send_signal(proc->pidfd, sig);
 
-	if (proc->dir_chroot != NULL && chroot(proc->dir_chroot) < 0)
+	return kill(proc->child_pid, sig);
+}
+
+
+/*
+ * Collect the exit status of the child process without blocking.
+ * Returns true and releases the child's pid and pidfd if it has exited.
+ */
+bool
+childproc_collect(struct childproc *proc, int *status)
+{
+	assert(proc != NULL);
+	assert(status != NULL);
+
+	if (proc->child_pid == 0)
+		return false;
+
+	if (proc->pidfd >= 0)
 	{
-		syslog(LOG_INFO, "%s: failed to chroot to '%s': %s", proc->prog_name, proc->dir_chroot, strerror(errno));
-		return;
+		siginfo_t si;
+
+		memset(&si, 0, sizeof si);
+		memset(&proc->exit_rusage, 0, sizeof proc->exit_rusage);
+
+		/* the raw syscall takes a struct rusage, which the libc wrapper does not expose */
+		if (syscall(SYS_waitid, CHILDPROC_P_PIDFD, proc->pidfd, &si, WEXITED | WNOHANG, &proc->exit_rusage) < 0 || si.si_pid == 0)
+			return false;
+
+		/* translate back to a wait(2) status, which is what everything else speaks */
+		if (si.si_code == CLD_EXITED)
+			*status = W_EXITCODE(si.si_status, 0);
+		else
+			*status = W_EXITCODE(0, si.si_status) | (si.si_code == CLD_DUMPED ? WCOREFLAG : 0);
+
+		close(proc->pidfd);
+		proc->pidfd = -1;
 	}
+	else if (wait4(proc->child_pid, status, WNOHANG, &proc->exit_rusage) != proc->child_pid)
+		return false;
 
-	if (proc->dir_chdir != NULL && chdir(proc->dir_chdir) < 0)
+	proc->exit_status = *status;
+	proc->exit_pid = proc->child_pid;
+	proc->child_pid = 0;
+	proc->times.reap_ns = respawn_now();
+
+	return true;
+}
+
+
+/*
+ * Wait up to timeout milliseconds for the child process to exit, -1 meaning forever.
+ */
+static bool
+childproc_wait(struct childproc *proc, int timeout)
+{
+	int status;
+
+	if (proc->pidfd >= 0)
 	{
-		syslog(LOG_INFO, "%s: failed to chdir to '%s': %s", proc->prog_name, proc->dir_chdir, strerror(errno));
-		return;
+		struct pollfd pfd = {.fd = proc->pidfd, .events = POLLIN};
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			return false;
+
+		return childproc_collect(proc, &status);
 	}
 
-	if (proc->child_gid > -1 && setgid(proc->child_gid))
+	/* no pidfd: fall back to polling waitpid() */
+	for (int waited = 0; timeout < 0 || waited <= timeout; waited += 100)
 	{
-		syslog(LOG_INFO, "%s: failed to setgid to %d: %s", proc->prog_name, proc->child_gid, strerror(errno));
-		return;
+		if (childproc_collect(proc, &status))
+			return true;
+
+		usleep(100 * 1000);
 	}
 
-	if (proc->child_uid > -1 && setgid(proc->child_uid))
+	return false;
+}
+
+
+/*
+ * Fetch step n of the stop sequence, or return false if the sequence is exhausted.
+ */
+static bool
+childproc_stop_step_get(const struct childproc *proc, int n, struct childproc_stop_step *step)
+{
+	if (proc->stop_step_count > 0)
 	{
-		syslog(LOG_INFO, "%s: failed to setuid to %d: %s", proc->prog_name, proc->child_uid, strerror(errno));
+		if (n >= proc->stop_step_count)
+			return false;
+
+		*step = proc->stop_steps[n];
+		return true;
+	}
+
+	if (n == 0)
+		*step = (struct childproc_stop_step) {.signo = SIGTERM, .timeout_ms = proc->kill_delay * 1000};
+	else if (n == 1)
+		*step = (struct childproc_stop_step) {.signo = SIGKILL, .timeout_ms = 0};
+	else
+		return false;
+
+	return true;
+}
+
+
+/*
+ * Parse a stop sequence such as "TERM:3,INT:2.5,KILL": each step names a signal and
+ * optionally how many seconds to wait for the child to exit before moving on.
+ */
+bool
+childproc_stop_parse(struct childproc *proc, const char *text)
+{
+	struct childproc_stop_step steps[CHILDPROC_STOP_STEPS_MAX];
+	char buf[256], *tok, *saveptr = NULL;
+	int count = 0;
+
+	assert(proc != NULL);
+	assert(text != NULL);
+
+	if (strlen(text) >= sizeof buf)
+		return false;
+
+	strcpy(buf, text);
+
+	for (tok = strtok_r(buf, ", \t", &saveptr); tok != NULL; tok = strtok_r(NULL, ", \t", &saveptr))
+	{
+		char *timeout = strchr(tok, ':');
+		double seconds = 0;
+
+		if (count == CHILDPROC_STOP_STEPS_MAX)
+			return false;
+
+		if (timeout != NULL)
+		{
+			char *end;
+
+			*timeout++ = 0;
+
+			seconds = strtod(timeout, &end);
+			if (end == timeout || *end || seconds < 0 || seconds > 86400)
+				return false;
+		}
+
+		steps[count].signo = signal_parse(tok);
+		steps[count].timeout_ms = seconds * 1000;
+
+		if (steps[count].signo < 0)
+			return false;
+
+		count++;
+	}
+
+	if (count == 0)
+		return false;
+
+	memcpy(proc->stop_steps, steps, sizeof(steps[0]) * count);
+	proc->stop_step_count = count;
+
+	return true;
+}
+
+
+static void
+childproc_stop_arm(struct childproc *proc, int timeout_ms)
+{
+	struct itimerspec its = {
+		.it_value = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L},
+	};
+
+	if (proc->stop_timer_fd >= 0)
+		timerfd_settime(proc->stop_timer_fd, 0, &its, NULL);
+}
+
+
+/*
+ * Send the signal for the current stop step and arm the timer for its deadline.
+ */
+static void
+childproc_stop_step_run(struct childproc *proc)
+{
+	struct childproc_stop_step step;
+
+	if (!childproc_stop_step_get(proc, proc->stop_step, &step))
+	{
+		syslog(LOG_INFO, "%s: still running after stop sequence, pid %d", proc->prog_name, proc->child_pid);
 		return;
 	}
 
-	dup2(proc->stdin_fd, STDIN_FILENO);
-	dup2(proc->stdout_fd, STDOUT_FILENO);
-	dup2(proc->stderr_fd, STDERR_FILENO);
+	childproc_signal(proc, step.signo);
 
-	for (int i = getdtablesize() - 1; i > STDERR_FILENO; i--)
-		fcntl(i, F_SETFD, FD_CLOEXEC);
+	/* a step which does not wait gives way to the next one at once */
+	while (step.timeout_ms == 0 && childproc_stop_step_get(proc, proc->stop_step + 1, &step))
+	{
+		proc->stop_step++;
+		childproc_signal(proc, step.signo);
+	}
 
-	execvp(proc->prog_name, proc->prog_argv);
-	syslog(LOG_INFO, "%s: failed to exec %s: %s", proc->prog_name, proc->prog_name, strerror(errno));
+	if (step.timeout_ms > 0)
+		childproc_stop_arm(proc, step.timeout_ms);
 }
 
 
 /*
- * Kill a process.
+ * Wait up to timeout milliseconds for the child to exit, without reaping it.
  */
-bool
-childproc_kill(struct childproc *proc, bool should_wait)
+static bool
+childproc_exited_within(struct childproc *proc, int timeout)
 {
-	int i;
+	siginfo_t si;
+
+	if (proc->pidfd >= 0)
+	{
+		struct pollfd pfd = {.fd = proc->pidfd, .events = POLLIN};
+
+		return poll(&pfd, 1, timeout) > 0;
+	}
+
+	for (int waited = 0; ; waited += 100)
+	{
+		memset(&si, 0, sizeof si);
 
+		if (waitid(P_PID, proc->child_pid, &si, WEXITED | WNOHANG | WNOWAIT) < 0 || si.si_pid != 0)
+			return true;
+
+		if (waited >= timeout)
+			return false;
+
+		usleep(100 * 1000);
+	}
+}
+
+
+/*
+ * Without a timer, run the whole stop sequence here, leaving the child to be reaped by
+ * the caller as usual.
+ */
+static void
+childproc_stop_run_blocking(struct childproc *proc)
+{
+	struct childproc_stop_step step;
+
+	for (; childproc_stop_step_get(proc, proc->stop_step, &step); proc->stop_step++)
+	{
+		childproc_signal(proc, step.signo);
+
+		if (childproc_exited_within(proc, step.timeout_ms))
+			return;
+	}
+}
+
+
+/*
+ * Begin stopping the child process without waiting for it.  The caller polls
+ * stop_timer_fd and calls childproc_stop_advance() when it fires; the stop completes
+ * when the child is reaped.  Returns false if there is no child to stop.
+ */
+bool
+childproc_stop_begin(struct childproc *proc)
+{
 	assert(proc != NULL);
-	assert(proc->child_pid != 0);
 
-	kill(proc->child_pid, SIGTERM);
+	if (proc->child_pid == 0)
+	{
+		childproc_setstate(proc, CHILDPROC_DOWN);
+		return false;
+	}
 
-	if (!should_wait)
+	/* already stopping: let the sequence in progress run its course */
+	if (proc->state == CHILDPROC_STOPPING && proc->stop_timer_fd >= 0)
 		return true;
 
-	waitpid(proc->child_pid, &i, WNOHANG);
+	childproc_setstate(proc, CHILDPROC_STOPPING);
+	clock_gettime(CLOCK_MONOTONIC, &proc->stop_started);
+	proc->times.stop_ns = proc->stop_started.tv_sec * 1000000000ULL + proc->stop_started.tv_nsec;
+
+	if (proc->stop_timer_fd < 0)
+		proc->stop_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-	if (WIFEXITED(i) || WIFSIGNALED(i))
+	proc->stop_step = 0;
+
+	if (proc->stop_timer_fd < 0)
+	{
+		syslog(LOG_ERR, "%s: timerfd_create: %s, stopping pid %d synchronously", proc->prog_name, strerror(errno), proc->child_pid);
+		childproc_stop_run_blocking(proc);
 		return true;
+	}
+
+	childproc_stop_step_run(proc);
+
+	return true;
+}
+
+
+/*
+ * The deadline of the current stop step has passed: escalate to the next step.
+ */
+void
+childproc_stop_advance(struct childproc *proc)
+{
+	uint64_t expirations;
+
+	assert(proc != NULL);
+
+	if (proc->stop_timer_fd < 0 || read(proc->stop_timer_fd, &expirations, sizeof expirations) < 0)
+		return;
+
+	if (proc->child_pid == 0 || proc->state != CHILDPROC_STOPPING)
+		return;
+
+	proc->stop_step++;
+	childproc_stop_step_run(proc);
+}
 
-	sleep(proc->kill_delay);
 
-	waitpid(proc->child_pid, &i, WNOHANG);
+static void
+childproc_stop_finish(struct childproc *proc)
+{
+	struct timespec now;
+
+	if (proc->stop_timer_fd >= 0)
+	{
+		close(proc->stop_timer_fd);
+		proc->stop_timer_fd = -1;
+	}
+
+	if (proc->stop_started.tv_sec == 0 && proc->stop_started.tv_nsec == 0)
+		return;
 
-	if (WIFEXITED(i) || WIFSIGNALED(i))
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	proc->stop_duration_ns = (now.tv_sec - proc->stop_started.tv_sec) * 1000000000ULL + now.tv_nsec - proc->stop_started.tv_nsec;
+	proc->stop_started = (struct timespec) {};
+}
+
+
+/*
+ * Kill a process, running through the stop sequence.  If should_wait is set, this
+ * blocks until the child has exited; event loops should use childproc_stop_begin() instead.
+ */
+bool
+childproc_kill(struct childproc *proc, bool should_wait)
+{
+	struct childproc_stop_step step, next;
+	int status;
+
+	assert(proc != NULL);
+
+	if (proc->child_pid == 0)
+		return true;
+
+	if (!should_wait)
+	{
+		childproc_signal(proc, SIGTERM);
 		return true;
+	}
 
-	kill(proc->child_pid, SIGKILL);
+	for (int n = 0; childproc_stop_step_get(proc, n, &step); n++)
+	{
+		childproc_signal(proc, step.signo);
+
+		if (childproc_collect(proc, &status))
+			return true;
 
-	waitpid(proc->child_pid, &i, 0);
+		/* only the last step waits for good; one which does not wait moves straight on */
+		if (childproc_wait(proc, step.timeout_ms > 0 || childproc_stop_step_get(proc, n + 1, &next) ? step.timeout_ms : -1))
+			return true;
+	}
 
-	return WIFEXITED(i) != 0 || WIFSIGNALED(i) != 0;
+	return childproc_wait(proc, -1);
 }
 
 
 /*
- * Monitor a child process using wait(2).
+ * Handle the exit of a child process which has already been reaped with the given wait(2) status.
  * Returns true if process needs to be restarted, else false.
  */
 bool
-childproc_monitor(struct childproc *proc)
+childproc_reaped(struct childproc *proc, int status)
 {
-	int i;
-
 	assert(proc != NULL);
-	assert(proc->child_pid != 0);
 
-	waitpid(proc->child_pid, &i, 0);
+	proc->exit_status = status;
+
+	if (proc->child_pid != 0)
+	{
+		proc->exit_pid = proc->child_pid;
+		proc->child_pid = 0;
+		proc->times.reap_ns = respawn_now();
+	}
+
+	if (proc->pidfd >= 0)
+	{
+		close(proc->pidfd);
+		proc->pidfd = -1;
+	}
 
 	if (proc->state == CHILDPROC_STOPPING || proc->state == CHILDPROC_DOWN)
 	{
-		signal(SIGCHLD, SIG_IGN);
-		syslog(LOG_INFO, "%s: stop%s, pid %d", proc->prog_name, proc->state == CHILDPROC_DOWN ? "ed" : "ping", proc->child_pid);
+		childproc_stop_finish(proc);
 
-		if (proc->state != CHILDPROC_DOWN)
-		{
-			childproc_kill(proc, true);
-			childproc_setstate(proc, CHILDPROC_DOWN);
-		}
+		syslog(LOG_INFO, "%s: stopped in %.3f s", proc->prog_name, proc->stop_duration_ns / 1e9);
+
+		childproc_setstate(proc, CHILDPROC_DOWN);
 	}
 	else
 	{
-		time_t current_ts = time(NULL);
-
-		childproc_setstate(proc, CHILDPROC_CRASHED);
+		uint64_t now_ns = respawn_now();
+		uint64_t ran_ns = now_ns - (proc->started.tv_sec * 1000000000ULL + proc->started.tv_nsec);
 
 		proc->restart_count++;
-		if (proc->respawn_period && current_ts - proc->respawn_last > proc->respawn_period)
-			proc->restart_count = 0;
 
-		if (proc->respawn_max > 0 && proc->restart_count > proc->respawn_max)
+		childproc_setstate(proc, CHILDPROC_CRASHED);
+
+		if (!respawn_crashed(&proc->respawn, now_ns, ran_ns))
 		{
-			syslog(LOG_INFO, "%s: restarted too many times, giving up", proc->prog_name);
+			if (proc->respawn.policy.period > 0)
+				syslog(LOG_INFO, "%s: crashed more than %d times in %d s, giving up", proc->prog_name,
+					proc->respawn.policy.max, proc->respawn.policy.period);
+			else
+				syslog(LOG_INFO, "%s: crashed more than %d times, giving up", proc->prog_name, proc->respawn.policy.max);
+
 			return false;
 		}
 
@@ -188,3 +1003,22 @@ childproc_monitor(struct childproc *proc)
 
 	return false;
 }
+
+
+/*
+ * Monitor a child process.  This does not block: it is meant to be called once the child's
+ * pidfd polls readable or SIGCHLD arrives.
+ * Returns true if process needs to be restarted, else false.
+ */
+bool
+childproc_monitor(struct childproc *proc)
+{
+	int i;
+
+	assert(proc != NULL);
+
+	if (!childproc_collect(proc, &i))
+		return false;
+
+	return childproc_reaped(proc, i);
+}
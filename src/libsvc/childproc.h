@@ -20,6 +20,9 @@
 #ifndef LIBSVC_CHILDPROC_H
 #define LIBSVC_CHILDPROC_H
 
+#include "libsvc/cgroup.h"
+#include "libsvc/respawn.h"
+
 typedef enum childproc_state_e {
 	CHILDPROC_INITIAL,
 	CHILDPROC_STARTING,
@@ -31,6 +34,40 @@ typedef enum childproc_state_e {
 } childproc_state_t;
 
 
+/* one step of a stop sequence: send signo, then wait up to timeout_ms before the next step */
+struct childproc_stop_step {
+	int signo;
+	int timeout_ms;
+};
+
+#define CHILDPROC_STOP_STEPS_MAX	8
+
+/* descriptors handed to the child beyond stdin, stdout and stderr */
+#define CHILDPROC_PASS_FDS_MAX		13
+
+
+/*
+ * CLOCK_MONOTONIC nanoseconds at which the last run passed each point of its life, 0 for
+ * those it has not (yet).  requested_ns is set by the caller when the start is asked for,
+ * which may be well before the fork if it has to wait for its turn; childproc_start()
+ * takes the fork time for it otherwise.  exec_ns is when the exec was seen to succeed.
+ */
+struct childproc_times {
+	uint64_t requested_ns;
+	uint64_t fork_ns;
+	uint64_t exec_ns;
+	uint64_t ready_ns;
+	uint64_t stop_ns;
+	uint64_t reap_ns;
+};
+
+
+struct childproc;
+
+/* called after every state change, with the state that was left */
+typedef void (*childproc_state_fn_t)(struct childproc *proc, childproc_state_t old_state, void *opaque);
+
+
 struct childproc {
 	char *prog_name;
 	char **prog_argv;
@@ -40,30 +77,78 @@ struct childproc {
 
 	int restart_count;
 
-	int respawn_delay;
-	int respawn_max;
-	int respawn_period;
+	/* when to restart after a crash, and whether to at all */
+	struct respawn respawn;
 	time_t respawn_last;
 
 	int kill_delay;
 
+	/* if stop_step_count is 0, the sequence is SIGTERM, kill_delay seconds, SIGKILL */
+	struct childproc_stop_step stop_steps[CHILDPROC_STOP_STEPS_MAX];
+	int stop_step_count;
+	int stop_step;
+	int stop_timer_fd;
+	struct timespec stop_started;
+	uint64_t stop_duration_ns;
+
 	pid_t child_pid;
+	int pidfd;
+	pid_t exit_pid;
+	int exit_status;
+
+	/* what the last child and the children it waited for used, as returned with its status */
+	struct rusage exit_rusage;
+	int spawn_error;
 
 	int child_uid;
 	int child_gid;
+	int child_umask;
 
 	int stdin_fd;
 	int stdout_fd;
 	int stderr_fd;
 
+	/* installed in the child as descriptors 3, 4, ... */
+	int pass_fds[CHILDPROC_PASS_FDS_MAX];
+	int pass_fd_count;
+
+	/* installed in the child as descriptor notify_fd_to, unless notify_fd is -1 */
+	int notify_fd;
+	int notify_fd_to;
+
+	/* "NAME=value" strings added to the child's environment, NULL-terminated, or NULL */
+	char **child_env;
+
+	/* announce the passed descriptors as sd_listen_fds(3) expects, named by listen_fdnames */
+	bool listen_fds;
+	char *listen_fdnames;
+
+	/* the cgroup the child is started in, if its dir_fd is not -1 */
+	struct cgroup cgroup;
+	bool cgroup_joined;
+
+	struct childproc_times times;
+
 	childproc_state_t state;
+	struct timespec state_changed;
+	struct timespec started;
+	struct timespec ready;
+
+	childproc_state_fn_t state_fn;
+	void *state_opaque;
 };
 
 
+void childproc_init(struct childproc *proc);
 void childproc_setstate(struct childproc *proc, childproc_state_t state);
-void childproc_start(struct childproc *proc);
-void childproc_exec(struct childproc *proc);
+bool childproc_start(struct childproc *proc);
+int childproc_signal(struct childproc *proc, int sig);
 bool childproc_kill(struct childproc *proc, bool should_wait);
+bool childproc_stop_parse(struct childproc *proc, const char *text);
+bool childproc_stop_begin(struct childproc *proc);
+void childproc_stop_advance(struct childproc *proc);
+bool childproc_collect(struct childproc *proc, int *status);
 bool childproc_monitor(struct childproc *proc);
+bool childproc_reaped(struct childproc *proc, int status);
 
 #endif
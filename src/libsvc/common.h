@@ -1,6 +1,9 @@
+#include <stddef.h>
+
 #ifndef LIBSVC_COMMON_H
 #define LIBSVC_COMMON_H
 
 #define ARRAY_SIZE(x)		(sizeof(x) / sizeof(x[0]))
+#define CONTAINER_OF(ptr, type, member)	((type *) ((char *) (ptr) - offsetof(type, member)))
 
 #endif
@@ -0,0 +1,595 @@
+/* service dependency graph and start scheduler */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+
+#include "libsvc/depgraph.h"
+
+
+void
+depgraph_init(struct depgraph *g, size_t limit, depgraph_fail_fn_t fail_fn, void *opaque)
+{
+	assert(g != NULL);
+
+	memset(g, 0, sizeof *g);
+
+	g->limit = limit;
+	g->fail_fn = fail_fn;
+	g->fail_opaque = opaque;
+}
+
+
+/* FNV-1a */
+static uint32_t
+depgraph_hash(const char *name)
+{
+	uint32_t h = 0x811c9dc5U;
+
+	for (const char *p = name; *p; p++)
+	{
+		h ^= (unsigned char) *p;
+		h *= 0x01000193U;
+	}
+
+	return h;
+}
+
+
+static uint32_t *
+depgraph_slot(const struct depgraph *g, uint32_t *names, size_t size, const char *name)
+{
+	size_t i = depgraph_hash(name) & (size - 1);
+
+	while (names[i] != 0 && strcmp(g->nodes[names[i] - 1].name, name))
+		i = (i + 1) & (size - 1);
+
+	return &names[i];
+}
+
+
+static bool
+depgraph_names_grow(struct depgraph *g)
+{
+	size_t size = g->names_size ? g->names_size * 2 : 64;
+	uint32_t *names = calloc(size, sizeof *names);
+
+	if (names == NULL)
+		return false;
+
+	for (size_t i = 0; i < g->count; i++)
+		*depgraph_slot(g, names, size, g->nodes[i].name) = i + 1;
+
+	free(g->names);
+	g->names = names;
+	g->names_size = size;
+
+	return true;
+}
+
+
+ssize_t
+depgraph_find(const struct depgraph *g, const char *name)
+{
+	if (g->names_size == 0)
+		return -1;
+
+	return (ssize_t) *depgraph_slot(g, g->names, g->names_size, name) - 1;
+}
+
+
+/*
+ * Add a node.  name must stay valid for the life of the graph.  Returns the index of
+ * the node, or -1 if the name is taken or memory runs out.
+ */
+ssize_t
+depgraph_add(struct depgraph *g, const char *name, void *opaque)
+{
+	struct depgraph_node *node;
+	uint32_t *slot;
+
+	assert(g != NULL);
+	assert(name != NULL);
+
+	if (depgraph_find(g, name) >= 0)
+		return -1;
+
+	if (g->count == g->size)
+	{
+		size_t size = g->size ? g->size * 2 : 64;
+		struct depgraph_node *nodes = realloc(g->nodes, size * sizeof *nodes);
+
+		if (nodes == NULL)
+			return -1;
+
+		g->nodes = nodes;
+		g->size = size;
+	}
+
+	/* keep the name table at most half full */
+	if ((g->count + 1) * 2 > g->names_size && !depgraph_names_grow(g))
+		return -1;
+
+	node = &g->nodes[g->count];
+	memset(node, 0, sizeof *node);
+
+	node->name = name;
+	node->opaque = opaque;
+	node->failed_dep = DEPGRAPH_NONE;
+
+	slot = depgraph_slot(g, g->names, g->names_size, name);
+	*slot = ++g->count;
+
+	return g->count - 1;
+}
+
+
+static bool
+depgraph_dep_append(struct depgraph_node *node, uint32_t on, depgraph_dep_t type)
+{
+	if (node->dep_count == node->dep_size)
+	{
+		size_t size = node->dep_size ? node->dep_size * 2 : 4;
+		struct depgraph_dep *deps = realloc(node->deps, size * sizeof *deps);
+
+		if (deps == NULL)
+			return false;
+
+		node->deps = deps;
+		node->dep_size = size;
+	}
+
+	node->deps[node->dep_count++] = (struct depgraph_dep) {.node = on, .type = type};
+	return true;
+}
+
+
+/*
+ * Declare a dependency of node on the node called name, once every node is added.
+ * Only a missing needed node matters: it fails node when the graph is prepared.
+ */
+bool
+depgraph_depend(struct depgraph *g, size_t node, const char *name, depgraph_dep_t type)
+{
+	ssize_t other;
+
+	assert(g != NULL);
+	assert(node < g->count);
+
+	if ((other = depgraph_find(g, name)) < 0)
+	{
+		if (type == DEPGRAPH_NEEDS && g->nodes[node].missing == NULL)
+			return (g->nodes[node].missing = strdup(name)) != NULL;
+
+		return true;
+	}
+
+	/* node before other is other after node */
+	if (type == DEPGRAPH_BEFORE)
+		return depgraph_dep_append(&g->nodes[other], node, DEPGRAPH_AFTER);
+
+	return depgraph_dep_append(&g->nodes[node], other, type);
+}
+
+
+/*
+ * Select node to be started, with everything it needs or wants.
+ */
+void
+depgraph_select(struct depgraph *g, size_t node)
+{
+	uint32_t *stack;
+	size_t depth = 0;
+
+	assert(g != NULL);
+	assert(node < g->count);
+
+	/* a node is pushed at most once, when it is first selected */
+	stack = malloc(g->count * sizeof *stack);
+	if (stack == NULL)
+		abort();
+
+	if (g->nodes[node].state == DEPGRAPH_UNSELECTED)
+	{
+		g->nodes[node].state = DEPGRAPH_WAITING;
+		stack[depth++] = node;
+	}
+
+	while (depth > 0)
+	{
+		const struct depgraph_node *n = &g->nodes[stack[--depth]];
+
+		for (size_t i = 0; i < n->dep_count; i++)
+		{
+			struct depgraph_node *dep = &g->nodes[n->deps[i].node];
+
+			if (n->deps[i].type != DEPGRAPH_NEEDS && n->deps[i].type != DEPGRAPH_WANTS)
+				continue;
+
+			if (dep->state != DEPGRAPH_UNSELECTED)
+				continue;
+
+			dep->state = DEPGRAPH_WAITING;
+			stack[depth++] = n->deps[i].node;
+		}
+	}
+
+	free(stack);
+}
+
+
+static void
+depgraph_enqueue(struct depgraph *g, uint32_t node)
+{
+	g->nodes[node].state = DEPGRAPH_QUEUED;
+	g->queue[g->queue_tail++] = node;
+}
+
+
+/*
+ * Let the nodes waiting for node know it has started or failed.
+ */
+static void
+depgraph_release(struct depgraph *g, uint32_t node, bool ok)
+{
+	const struct depgraph_node *n = &g->nodes[node];
+
+	for (uint32_t i = n->out_first; i < n->out_first + n->out_count; i++)
+	{
+		struct depgraph_node *to = &g->nodes[g->edges[i].to];
+
+		if (to->state != DEPGRAPH_WAITING)
+			continue;
+
+		if (!ok && g->edges[i].hard && to->failed_dep == DEPGRAPH_NONE)
+			to->failed_dep = node;
+
+		if (--to->pending == 0)
+			depgraph_enqueue(g, g->edges[i].to);
+	}
+}
+
+
+static void
+depgraph_mark_failed(struct depgraph *g, uint32_t node, const char *reason)
+{
+	g->nodes[node].state = DEPGRAPH_FAILED;
+	g->remaining--;
+
+	if (g->fail_fn != NULL)
+		g->fail_fn(g, node, reason, g->fail_opaque);
+}
+
+
+static void
+depgraph_fail(struct depgraph *g, uint32_t node, const char *reason)
+{
+	depgraph_mark_failed(g, node, reason);
+	depgraph_release(g, node, false);
+}
+
+
+/*
+ * Describe a cycle as "a -> b -> c -> a", where each node waits for the next.
+ */
+static void
+depgraph_describe_cycle(const struct depgraph *g, const uint32_t *cycle, size_t len, char *buf, size_t buflen)
+{
+	size_t off = snprintf(buf, buflen, "dependency cycle: ");
+
+	for (size_t i = 0; i <= len && off < buflen; i++)
+		off += snprintf(buf + off, buflen - off, "%s%s", i ? " -> " : "", g->nodes[cycle[i % len]].name);
+
+	if (off >= buflen && buflen > 4)
+		strcpy(buf + buflen - 4, "...");
+}
+
+
+/* the first dependency of node which is selected and not yet resolved */
+static uint32_t
+depgraph_unresolved_dep(const struct depgraph *g, uint32_t node, const bool *resolved)
+{
+	const struct depgraph_node *n = &g->nodes[node];
+
+	for (size_t i = 0; i < n->dep_count; i++)
+		if (g->nodes[n->deps[i].node].state != DEPGRAPH_UNSELECTED && !resolved[n->deps[i].node])
+			return n->deps[i].node;
+
+	return DEPGRAPH_NONE;
+}
+
+
+/*
+ * Find the cycles among the selected nodes and fail their members, so that the rest of
+ * the graph can go ahead.  The start order is first played out on copies of the pending
+ * counts (Kahn's algorithm); nodes it cannot reach are in a cycle or wait for one.  Every
+ * such node waits for another such node, so walking back from one of them must come
+ * round to a node already on the path, which closes a cycle.  The cycle is failed, which
+ * resolves it, and the play-out goes on from there.
+ */
+static bool
+depgraph_break_cycles(struct depgraph *g, const uint32_t *initial)
+{
+	uint32_t *sim = malloc(g->count * sizeof *sim);
+	uint32_t *work = malloc(g->count * sizeof *work);
+	uint32_t *path = malloc(g->count * sizeof *path);
+	uint32_t *onpath = malloc(g->count * sizeof *onpath);
+	bool *resolved = calloc(g->count, sizeof *resolved);
+	size_t nwork = 0, scan = 0;
+	bool ret = false;
+	char reason[512];
+
+	if (sim == NULL || work == NULL || path == NULL || onpath == NULL || resolved == NULL)
+		goto out;
+
+	for (size_t i = 0; i < g->count; i++)
+	{
+		sim[i] = initial[i];
+		onpath[i] = DEPGRAPH_NONE;
+
+		if (g->nodes[i].state == DEPGRAPH_UNSELECTED)
+			continue;
+
+		if (sim[i] == 0 || g->nodes[i].missing != NULL)
+		{
+			resolved[i] = true;
+			work[nwork++] = i;
+		}
+	}
+
+	for (;;)
+	{
+		size_t len = 0, start;
+		uint32_t x;
+
+		while (nwork > 0)
+		{
+			const struct depgraph_node *n = &g->nodes[work[--nwork]];
+
+			for (uint32_t i = n->out_first; i < n->out_first + n->out_count; i++)
+			{
+				uint32_t to = g->edges[i].to;
+
+				if (!resolved[to] && --sim[to] == 0)
+				{
+					resolved[to] = true;
+					work[nwork++] = to;
+				}
+			}
+		}
+
+		while (scan < g->count && (g->nodes[scan].state == DEPGRAPH_UNSELECTED || resolved[scan]))
+			scan++;
+
+		if (scan == g->count)
+			break;
+
+		for (x = scan; onpath[x] == DEPGRAPH_NONE; )
+		{
+			onpath[x] = len;
+			path[len++] = x;
+
+			x = depgraph_unresolved_dep(g, x, resolved);
+			assert(x != DEPGRAPH_NONE);
+		}
+
+		start = onpath[x];
+		depgraph_describe_cycle(g, &path[start], len - start, reason, sizeof reason);
+
+		for (size_t i = 0; i < len; i++)
+			onpath[path[i]] = DEPGRAPH_NONE;
+
+		/* fail the whole cycle before releasing any of it, or its members would be queued */
+		for (size_t i = start; i < len; i++)
+		{
+			resolved[path[i]] = true;
+			work[nwork++] = path[i];
+
+			if (g->nodes[path[i]].state == DEPGRAPH_WAITING)
+				depgraph_mark_failed(g, path[i], reason);
+		}
+
+		for (size_t i = start; i < len; i++)
+			depgraph_release(g, path[i], false);
+	}
+
+	ret = true;
+
+out:
+	free(sim);
+	free(work);
+	free(path);
+	free(onpath);
+	free(resolved);
+
+	return ret;
+}
+
+
+/*
+ * Build the edges between the selected nodes and queue those which wait for nothing.
+ * Nodes needing a missing node, and nodes in dependency cycles, are failed.
+ */
+bool
+depgraph_prepare(struct depgraph *g)
+{
+	uint32_t *initial;
+	size_t total = 0;
+	char reason[256];
+
+	assert(g != NULL);
+
+	for (size_t v = 0; v < g->count; v++)
+	{
+		struct depgraph_node *n = &g->nodes[v];
+
+		if (n->state == DEPGRAPH_UNSELECTED)
+			continue;
+
+		g->remaining++;
+
+		for (size_t i = 0; i < n->dep_count; i++)
+		{
+			struct depgraph_node *dep = &g->nodes[n->deps[i].node];
+
+			if (dep->state == DEPGRAPH_UNSELECTED)
+				continue;
+
+			dep->out_count++;
+			n->pending++;
+			total++;
+		}
+	}
+
+	g->edges = malloc((total ? total : 1) * sizeof *g->edges);
+	g->queue = malloc((g->count ? g->count : 1) * sizeof *g->queue);
+	initial = malloc((g->count ? g->count : 1) * sizeof *initial);
+	if (g->edges == NULL || g->queue == NULL || initial == NULL)
+	{
+		free(initial);
+		return false;
+	}
+
+	/* lay the edges out by source node, counting out_count up again as they are placed */
+	total = 0;
+	for (size_t u = 0; u < g->count; u++)
+	{
+		g->nodes[u].out_first = total;
+		total += g->nodes[u].out_count;
+		g->nodes[u].out_count = 0;
+
+		initial[u] = g->nodes[u].pending;
+	}
+
+	for (size_t v = 0; v < g->count; v++)
+	{
+		const struct depgraph_node *n = &g->nodes[v];
+
+		if (n->state == DEPGRAPH_UNSELECTED)
+			continue;
+
+		for (size_t i = 0; i < n->dep_count; i++)
+		{
+			struct depgraph_node *dep = &g->nodes[n->deps[i].node];
+
+			if (dep->state == DEPGRAPH_UNSELECTED)
+				continue;
+
+			g->edges[dep->out_first + dep->out_count++] = (struct depgraph_edge) {
+				.to = v,
+				.hard = n->deps[i].type == DEPGRAPH_NEEDS,
+			};
+		}
+	}
+
+	for (size_t v = 0; v < g->count; v++)
+	{
+		if (g->nodes[v].state != DEPGRAPH_WAITING || g->nodes[v].missing == NULL)
+			continue;
+
+		snprintf(reason, sizeof reason, "needs %s, which is not declared", g->nodes[v].missing);
+		depgraph_fail(g, v, reason);
+	}
+
+	for (size_t v = 0; v < g->count; v++)
+		if (g->nodes[v].state == DEPGRAPH_WAITING && g->nodes[v].pending == 0)
+			depgraph_enqueue(g, v);
+
+	if (!depgraph_break_cycles(g, initial))
+	{
+		free(initial);
+		return false;
+	}
+
+	free(initial);
+	return true;
+}
+
+
+/*
+ * Take the next node to start, or -1 if none may start until another finishes.
+ * Nodes whose needed nodes failed are failed on the way.
+ */
+ssize_t
+depgraph_next(struct depgraph *g)
+{
+	char reason[256];
+
+	assert(g != NULL);
+
+	while (g->queue_head < g->queue_tail)
+	{
+		uint32_t node = g->queue[g->queue_head];
+		struct depgraph_node *n = &g->nodes[node];
+
+		if (n->failed_dep != DEPGRAPH_NONE)
+		{
+			g->queue_head++;
+
+			snprintf(reason, sizeof reason, "needs %s, which failed", g->nodes[n->failed_dep].name);
+			depgraph_fail(g, node, reason);
+
+			continue;
+		}
+
+		if (g->limit > 0 && g->running >= g->limit)
+			return -1;
+
+		g->queue_head++;
+		g->running++;
+		n->state = DEPGRAPH_STARTING;
+
+		return node;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Record that a node returned by depgraph_next() has started, or failed to.
+ */
+void
+depgraph_done(struct depgraph *g, size_t node, bool ok)
+{
+	assert(g != NULL);
+	assert(node < g->count);
+	assert(g->nodes[node].state == DEPGRAPH_STARTING);
+
+	g->running--;
+	g->remaining--;
+	g->nodes[node].state = ok ? DEPGRAPH_STARTED : DEPGRAPH_FAILED;
+
+	depgraph_release(g, node, ok);
+}
+
+
+bool
+depgraph_finished(const struct depgraph *g)
+{
+	return g->remaining == 0;
+}
+
+
+void
+depgraph_free(struct depgraph *g)
+{
+	assert(g != NULL);
+
+	for (size_t i = 0; i < g->count; i++)
+	{
+		free(g->nodes[i].deps);
+		free(g->nodes[i].missing);
+	}
+
+	free(g->nodes);
+	free(g->names);
+	free(g->edges);
+	free(g->queue);
+
+	memset(g, 0, sizeof *g);
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_DEPGRAPH_H
+#define LIBSVC_DEPGRAPH_H
+
+
+/*
+ * The dependency graph of a set of services, and the order to start them in.  A node
+ * is started as soon as everything it waits for has started or failed, with at most a
+ * given number starting at once.  Each edge is looked at once over a whole boot, and
+ * taking the next node to start is O(1).
+ */
+typedef enum depgraph_dep_e {
+	DEPGRAPH_NEEDS,		/* pull in, start after, and fail if it fails */
+	DEPGRAPH_WANTS,		/* pull in and start after, whether it starts or not */
+	DEPGRAPH_AFTER,		/* start after, if both are started */
+	DEPGRAPH_BEFORE		/* start before, if both are started */
+} depgraph_dep_t;
+
+typedef enum depgraph_state_e {
+	DEPGRAPH_UNSELECTED,
+	DEPGRAPH_WAITING,
+	DEPGRAPH_QUEUED,
+	DEPGRAPH_STARTING,
+	DEPGRAPH_STARTED,
+	DEPGRAPH_FAILED
+} depgraph_state_t;
+
+
+/* node waits for what dep names, as declared */
+struct depgraph_dep {
+	uint32_t node;
+	depgraph_dep_t type;
+};
+
+/* built by depgraph_prepare(): an edge to a node waiting for this one */
+struct depgraph_edge {
+	uint32_t to;
+	bool hard;
+};
+
+struct depgraph_node {
+	const char *name;
+	void *opaque;
+	depgraph_state_t state;
+
+	struct depgraph_dep *deps;
+	size_t dep_count;
+	size_t dep_size;
+
+	/* the first needed service which is not declared, if any */
+	char *missing;
+
+	uint32_t out_first;
+	uint32_t out_count;
+	uint32_t pending;
+
+	/* a needed node which failed, or DEPGRAPH_NONE */
+	uint32_t failed_dep;
+};
+
+#define DEPGRAPH_NONE	UINT32_MAX
+
+
+struct depgraph;
+
+/* called for every node the graph fails by itself, rather than through depgraph_done() */
+typedef void (*depgraph_fail_fn_t)(struct depgraph *g, size_t node, const char *reason, void *opaque);
+
+struct depgraph {
+	struct depgraph_node *nodes;
+	size_t count;
+	size_t size;
+
+	/* name -> node index + 1, open addressing */
+	uint32_t *names;
+	size_t names_size;
+
+	struct depgraph_edge *edges;
+
+	/* FIFO of nodes ready to start; each node enters it at most once */
+	uint32_t *queue;
+	size_t queue_head;
+	size_t queue_tail;
+
+	size_t limit;
+	size_t running;
+	size_t remaining;
+
+	depgraph_fail_fn_t fail_fn;
+	void *fail_opaque;
+};
+
+
+void depgraph_init(struct depgraph *g, size_t limit, depgraph_fail_fn_t fail_fn, void *opaque);
+ssize_t depgraph_add(struct depgraph *g, const char *name, void *opaque);
+ssize_t depgraph_find(const struct depgraph *g, const char *name);
+bool depgraph_depend(struct depgraph *g, size_t node, const char *name, depgraph_dep_t type);
+void depgraph_select(struct depgraph *g, size_t node);
+bool depgraph_prepare(struct depgraph *g);
+ssize_t depgraph_next(struct depgraph *g);
+void depgraph_done(struct depgraph *g, size_t node, bool ok);
+bool depgraph_finished(const struct depgraph *g);
+void depgraph_free(struct depgraph *g);
+
+
+#endif
@@ -0,0 +1,108 @@
+/* log-linear latency histograms */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+
+#include "libsvc/histogram.h"
+
+
+void
+histogram_init(struct histogram *h)
+{
+	assert(h != NULL);
+
+	memset(h, 0, sizeof *h);
+}
+
+
+static size_t
+histogram_bucket(uint64_t ns)
+{
+	unsigned int shift;
+
+	if (ns < (1ULL << HISTOGRAM_MIN_SHIFT))
+		return 0;
+
+	if (ns >= (1ULL << HISTOGRAM_MAX_SHIFT))
+		return HISTOGRAM_BUCKETS - 1;
+
+	/* the power of two, then which of its sub-buckets, from the bits right below the top one */
+	shift = 63 - __builtin_clzll(ns);
+
+	return 1 + (shift - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BUCKETS +
+		((ns >> (shift - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+
+void
+histogram_record(struct histogram *h, uint64_t ns)
+{
+	assert(h != NULL);
+
+	if (h->count == 0 || ns < h->min_ns)
+		h->min_ns = ns;
+
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+
+	h->count++;
+	h->sum_ns += ns;
+	h->buckets[histogram_bucket(ns)]++;
+}
+
+
+/*
+ * The value every value in the bucket is below, or UINT64_MAX for the last one.
+ */
+uint64_t
+histogram_bucket_upper(size_t bucket)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (bucket == 0)
+		return 1ULL << HISTOGRAM_MIN_SHIFT;
+
+	if (bucket >= HISTOGRAM_BUCKETS - 1)
+		return UINT64_MAX;
+
+	shift = HISTOGRAM_MIN_SHIFT + (bucket - 1) / HISTOGRAM_SUB_BUCKETS;
+	sub = (bucket - 1) % HISTOGRAM_SUB_BUCKETS;
+
+	return (HISTOGRAM_SUB_BUCKETS + sub + 1) << (shift - HISTOGRAM_SUB_BITS);
+}
+
+
+/*
+ * The value percent of the recorded values are at or below, to the bucket's resolution
+ * and never beyond the largest value recorded.  0 if nothing was.
+ */
+uint64_t
+histogram_percentile(const struct histogram *h, unsigned int percent)
+{
+	uint64_t rank, seen = 0;
+
+	assert(h != NULL);
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (h->count * percent + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+
+		if (seen >= rank)
+			return histogram_bucket_upper(i) < h->max_ns ? histogram_bucket_upper(i) : h->max_ns;
+	}
+
+	return h->max_ns;
+}
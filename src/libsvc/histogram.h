@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_HISTOGRAM_H
+#define LIBSVC_HISTOGRAM_H
+
+
+/*
+ * A latency histogram with fixed, log-linear buckets, as HDR histograms have: each power
+ * of two from 1 us up to about 18 minutes is split into HISTOGRAM_SUB_BUCKETS, so that
+ * any value is off by at most a quarter of it.  Recording is a few shifts and an add, and
+ * the whole thing is a flat array which needs no allocation.
+ */
+#define HISTOGRAM_SUB_BITS	2
+#define HISTOGRAM_SUB_BUCKETS	(1 << HISTOGRAM_SUB_BITS)
+
+/* below 2^10 ns everything shares the first bucket; from 2^40 ns on, the last one */
+#define HISTOGRAM_MIN_SHIFT	10
+#define HISTOGRAM_MAX_SHIFT	40
+
+#define HISTOGRAM_BUCKETS	(2 + (HISTOGRAM_MAX_SHIFT - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BUCKETS)
+
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+
+void histogram_init(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t ns);
+uint64_t histogram_bucket_upper(size_t bucket);
+uint64_t histogram_percentile(const struct histogram *h, unsigned int percent);
+
+
+#endif
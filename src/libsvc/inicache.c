@@ -0,0 +1,460 @@
+/* compiled INI file cache */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#include "libsvc/inicache.h"
+
+
+/*
+ * A file modified this close to the moment the cache was written may have changed again
+ * within the timestamp granularity of its filesystem without its mtime changing, so its
+ * contents are checked against the recorded hash before the record is trusted.
+ */
+#define INICACHE_RACY_NS	(2 * 1000000000ULL)
+
+
+/* FNV-1a */
+static uint64_t
+inicache_hash(const char *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char) data[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+static uint64_t
+inicache_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+static bool
+inicache_range_ok(const struct inicache *cache, uint64_t offset, uint64_t len)
+{
+	return offset <= cache->map_size && len <= cache->map_size - offset;
+}
+
+
+/*
+ * Check that every record of a freshly mapped cache points inside the file, and set up
+ * the path index.
+ */
+static bool
+inicache_validate(struct inicache *cache)
+{
+	const struct inicache_header *hdr = cache->map;
+	const struct inicache_record *recs;
+
+	if (cache->map_size < sizeof *hdr || hdr->magic != INICACHE_MAGIC || hdr->version != INICACHE_VERSION ||
+		!inicache_range_ok(cache, sizeof *hdr, (uint64_t) hdr->count * sizeof(struct inicache_record)))
+		return false;
+
+	if (hdr->count == 0)
+		return true;
+
+	cache->old = calloc(hdr->count, sizeof(struct inicache_entry));
+	cache->old_used = calloc(hdr->count, sizeof(bool));
+	if (cache->old == NULL || cache->old_used == NULL)
+		return false;
+
+	recs = (const struct inicache_record *) (hdr + 1);
+
+	for (uint32_t i = 0; i < hdr->count; i++)
+	{
+		const char *base = cache->map;
+
+		if (!inicache_range_ok(cache, recs[i].path_offset, recs[i].path_len + 1) ||
+			!inicache_range_ok(cache, recs[i].data_offset, recs[i].data_len) ||
+			base[recs[i].path_offset + recs[i].path_len] != 0)
+			return false;
+
+		cache->old[i] = (struct inicache_entry) {
+			.path = base + recs[i].path_offset,
+			.rec = recs[i],
+			.data = base + recs[i].data_offset,
+		};
+	}
+
+	/* duplicate paths also mean the cache is damaged */
+	return phash_build(&cache->index, cache->old, hdr->count, sizeof(struct inicache_entry),
+		offsetof(struct inicache_entry, path), NULL, 0);
+}
+
+
+/*
+ * Open a cache.  Returns false if it is missing or unusable, in which case the cache
+ * starts out empty; it can be used either way.
+ */
+bool
+inicache_open(struct inicache *cache, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	assert(cache != NULL);
+	assert(path != NULL);
+
+	memset(cache, 0, sizeof *cache);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	cache->map = map;
+	cache->map_size = st.st_size;
+
+	if (!inicache_validate(cache))
+	{
+		inicache_close(cache);
+		return false;
+	}
+
+	return true;
+}
+
+
+static void
+inicache_entry_free(struct inicache_entry *entry)
+{
+	if (!entry->owned)
+		return;
+
+	free((void *) entry->path);
+	free((void *) entry->data);
+}
+
+
+static bool
+inicache_append(struct inicache *cache, const struct inicache_entry *entry)
+{
+	if (cache->count == cache->size)
+	{
+		size_t size = cache->size ? cache->size * 2 : 64;
+		struct inicache_entry *entries = realloc(cache->entries, size * sizeof *entries);
+
+		if (entries == NULL)
+			return false;
+
+		cache->entries = entries;
+		cache->size = size;
+	}
+
+	cache->entries[cache->count++] = *entry;
+	return true;
+}
+
+
+/*
+ * Record a freshly parsed file, replacing any record of it made earlier in this run.
+ * Only misses come here, so the linear search does not matter.
+ */
+static bool
+inicache_replace(struct inicache *cache, const struct inicache_entry *entry)
+{
+	for (size_t i = 0; i < cache->count; i++)
+	{
+		if (strcmp(cache->entries[i].path, entry->path))
+			continue;
+
+		inicache_entry_free(&cache->entries[i]);
+		cache->entries[i] = *entry;
+
+		return true;
+	}
+
+	return inicache_append(cache, entry);
+}
+
+
+/*
+ * Return the cached parse of path if the file is unchanged, or NULL.
+ */
+static nvlist_t *
+inicache_lookup(struct inicache *cache, const char *path, const struct stat *st)
+{
+	const struct inicache_header *hdr = cache->map;
+	const struct inicache_entry *old;
+	nvlist_t *nvl;
+	ssize_t i;
+
+	if ((i = phash_lookup(&cache->index, path)) < 0)
+		return NULL;
+
+	old = &cache->old[i];
+
+	if (old->rec.dev != (uint64_t) st->st_dev || old->rec.ino != (uint64_t) st->st_ino ||
+		old->rec.size != (uint64_t) st->st_size || old->rec.mtime_ns != inicache_ns(&st->st_mtim))
+		return NULL;
+
+	if (old->rec.mtime_ns + INICACHE_RACY_NS >= hdr->written_ns)
+	{
+		struct inifile_map map;
+		bool same;
+
+		if (!inifile_map(&map, path))
+			return NULL;
+
+		same = inicache_hash(map.data, map.len) == old->rec.hash;
+		inifile_unmap(&map);
+
+		if (!same)
+			return NULL;
+
+		/* saving again with a later timestamp spares the next run this check */
+		cache->dirty = true;
+	}
+
+	nvl = nvlist_unpack(old->data, old->rec.data_len, 0);
+	if (nvl == NULL)
+		return NULL;
+
+	/* a file loaded twice is only recorded once */
+	if (!cache->old_used[i])
+	{
+		if (!inicache_append(cache, old))
+		{
+			nvlist_destroy(nvl);
+			return NULL;
+		}
+
+		cache->old_used[i] = true;
+	}
+
+	return nvl;
+}
+
+
+/*
+ * Parse an INI file like inifile_load(), skipping the parse if the cache holds the file
+ * as it is now.  Files which are parsed are added to the cache.
+ */
+nvlist_t *
+inicache_load(struct inicache *cache, const char *path, struct inifile_error *err)
+{
+	struct inicache_entry entry = {};
+	struct inifile_map map;
+	struct stat st;
+	nvlist_t *nvl;
+	size_t len;
+
+	assert(cache != NULL);
+	assert(path != NULL);
+
+	if (stat(path, &st) < 0)
+		return inifile_load(path, err);
+
+	if ((nvl = inicache_lookup(cache, path, &st)) != NULL)
+	{
+		cache->hits++;
+		return nvl;
+	}
+
+	cache->misses++;
+
+	if (!inifile_map(&map, path))
+		return inifile_load(path, err);
+
+	nvl = inifile_load_map(&map, err);
+
+	if (nvl != NULL)
+	{
+		entry.rec = (struct inicache_record) {
+			.dev = st.st_dev,
+			.ino = st.st_ino,
+			.size = st.st_size,
+			.mtime_ns = inicache_ns(&st.st_mtim),
+			.hash = inicache_hash(map.data, map.len),
+		};
+
+		entry.path = strdup(path);
+		entry.data = nvlist_pack(nvl, &len);
+		entry.rec.data_len = len;
+		entry.owned = true;
+
+		if (entry.path != NULL && entry.data != NULL && inicache_replace(cache, &entry))
+			cache->dirty = true;
+		else
+			inicache_entry_free(&entry);
+	}
+
+	inifile_unmap(&map);
+
+	return nvl;
+}
+
+
+static bool
+inicache_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+
+/*
+ * Write the records used since the cache was opened, dropping those of files which
+ * were not loaded.  The new cache replaces the old one atomically.  Nothing is written
+ * if nothing changed.
+ */
+bool
+inicache_save(struct inicache *cache, const char *path)
+{
+	struct inicache_header hdr = {
+		.magic = INICACHE_MAGIC,
+		.version = INICACHE_VERSION,
+		.count = cache->count,
+	};
+	struct timespec now;
+	char tmp_path[4096];
+	uint64_t offset;
+	bool ok = true;
+	int fd;
+
+	assert(cache != NULL);
+	assert(path != NULL);
+
+	if (!cache->dirty && cache->count == inicache_count(cache))
+		return true;
+
+	if ((size_t) snprintf(tmp_path, sizeof tmp_path, "%s.new", path) >= sizeof tmp_path)
+		return false;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	hdr.written_ns = inicache_ns(&now);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	/* paths and data follow the record table, in record order */
+	offset = sizeof hdr + cache->count * sizeof(struct inicache_record);
+	for (size_t i = 0; i < cache->count; i++)
+	{
+		struct inicache_entry *entry = &cache->entries[i];
+
+		entry->rec.path_len = strlen(entry->path);
+		entry->rec.path_offset = offset;
+		offset += entry->rec.path_len + 1;
+
+		entry->rec.data_offset = offset;
+		offset += entry->rec.data_len;
+	}
+
+	ok = inicache_write(fd, &hdr, sizeof hdr);
+
+	for (size_t i = 0; ok && i < cache->count; i++)
+		ok = inicache_write(fd, &cache->entries[i].rec, sizeof(struct inicache_record));
+
+	for (size_t i = 0; ok && i < cache->count; i++)
+	{
+		const struct inicache_entry *entry = &cache->entries[i];
+
+		ok = inicache_write(fd, entry->path, entry->rec.path_len + 1) &&
+			inicache_write(fd, entry->data, entry->rec.data_len);
+	}
+
+	if (close(fd) < 0)
+		ok = false;
+
+	if (!ok || rename(tmp_path, path) < 0)
+	{
+		unlink(tmp_path);
+		return false;
+	}
+
+	cache->dirty = false;
+	return true;
+}
+
+
+size_t
+inicache_count(const struct inicache *cache)
+{
+	return cache->index.count;
+}
+
+
+/*
+ * Unpack record index of the cache as it was opened, for inspection.
+ */
+bool
+inicache_get(const struct inicache *cache, size_t index, const char **path, nvlist_t **nvl)
+{
+	if (index >= inicache_count(cache))
+		return false;
+
+	*path = cache->old[index].path;
+	*nvl = nvlist_unpack(cache->old[index].data, cache->old[index].rec.data_len, 0);
+
+	return *nvl != NULL;
+}
+
+
+void
+inicache_close(struct inicache *cache)
+{
+	assert(cache != NULL);
+
+	for (size_t i = 0; i < cache->count; i++)
+		inicache_entry_free(&cache->entries[i]);
+
+	free(cache->entries);
+	free(cache->old);
+	free(cache->old_used);
+	phash_free(&cache->index);
+
+	if (cache->map != NULL)
+		munmap(cache->map, cache->map_size);
+
+	memset(cache, 0, sizeof *cache);
+}
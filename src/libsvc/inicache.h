@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <nv.h>
+
+
+#ifndef LIBSVC_INICACHE_H
+#define LIBSVC_INICACHE_H
+
+#include "libsvc/inifile.h"
+#include "libsvc/phash.h"
+
+
+/*
+ * A cache of parsed INI files, kept in a single file which is mapped when opened.
+ * Each record is keyed by the source path, its device, inode, size and mtime, and a
+ * hash of its contents, and holds the parsed nvlist packed with nvlist_pack().
+ *
+ * File layout: struct inicache_header, header.count struct inicache_record, then the
+ * paths and packed nvlists they point to.  All offsets are from the start of the file.
+ */
+#define INICACHE_MAGIC		0x53564343	/* "SVCC" */
+#define INICACHE_VERSION	2
+
+
+struct inicache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+
+	/* CLOCK_REALTIME when the cache was written, in nanoseconds */
+	uint64_t written_ns;
+};
+
+
+struct inicache_record {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t hash;
+
+	uint64_t path_offset;
+	uint64_t path_len;
+	uint64_t data_offset;
+	uint64_t data_len;
+};
+
+
+/* a record to be written by inicache_save(), from the old cache or freshly parsed */
+struct inicache_entry {
+	const char *path;
+	struct inicache_record rec;
+	const void *data;
+
+	bool owned;
+};
+
+
+struct inicache {
+	/* the cache as it was opened */
+	void *map;
+	size_t map_size;
+	struct phash index;
+	struct inicache_entry *old;
+	bool *old_used;
+
+	/* the records used since, which inicache_save() writes out */
+	struct inicache_entry *entries;
+	size_t count;
+	size_t size;
+	bool dirty;
+
+	size_t hits;
+	size_t misses;
+};
+
+
+bool inicache_open(struct inicache *cache, const char *path);
+nvlist_t *inicache_load(struct inicache *cache, const char *path, struct inifile_error *err);
+bool inicache_save(struct inicache *cache, const char *path);
+void inicache_close(struct inicache *cache);
+
+bool inicache_get(const struct inicache *cache, size_t index, const char **path, nvlist_t **nvl);
+size_t inicache_count(const struct inicache *cache);
+
+
+#endif
@@ -3,89 +3,395 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <nv.h>
 
 #include "libsvc/inifile.h"
 
 
+/*
+ * Files up to this size are read rather than mapped: for a typical service file of a
+ * few hundred bytes, the page fault and munmap() cost more than copying the data.
+ */
+#define INIFILE_READ_MAX	(64 * 1024)
+
+
+struct inifile_load_ctx {
+	nvlist_t *out;
+
+	/* the section being filled, moved into out when the next one starts */
+	nvlist_t *section;
+	char *section_name;
+
+	/* NUL-terminated copies of the current key and value */
+	char *scratch;
+	size_t scratch_len;
+};
+
+
+static bool
+inifile_error(struct inifile_error *err, unsigned int line, unsigned int column, const char *fmt, ...)
+{
+	va_list va;
+
+	err->line = line;
+	err->column = column;
+
+	va_start(va, fmt);
+	vsnprintf(err->message, sizeof err->message, fmt, va);
+	va_end(va);
+
+	return false;
+}
+
+
 static bool
-value_is_numeric(const char *data)
+inifile_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static struct inifile_slice
+inifile_trim(const char *start, const char *end)
 {
-	for (const char *p = data; *p; p++)
-		if (!isdigit(*p))
+	while (start < end && inifile_space(*start))
+		start++;
+
+	while (end > start && inifile_space(end[-1]))
+		end--;
+
+	return (struct inifile_slice) {start, end - start};
+}
+
+
+static bool
+inifile_read(struct inifile_map *map, int fd, size_t size)
+{
+	char *data;
+	size_t len = 0;
+	ssize_t n;
+
+	data = malloc(size + 1);
+	if (data == NULL)
+		return false;
+
+	/* read one byte more than expected, to notice a file which grew meanwhile */
+	while (len <= size && (n = read(fd, data + len, size + 1 - len)) != 0)
+	{
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			free(data);
 			return false;
+		}
+
+		len += n;
+	}
+
+	if (len > size)
+	{
+		free(data);
+		errno = EAGAIN;
+		return false;
+	}
+
+	/* the file was truncated meanwhile */
+	if (len == 0)
+	{
+		free(data);
+		return true;
+	}
+
+	map->data = data;
+	map->len = len;
 
 	return true;
 }
 
 
-nvlist_t *
-inifile_parse(const char *path)
+/*
+ * Bring an INI file into memory for scanning.
+ */
+bool
+inifile_map(struct inifile_map *map, const char *path)
 {
-	FILE *f;
-	nvlist_t *out, *section = NULL;
-	char buffer[4096], *tmp, *section_name = NULL;
+	struct stat st;
+	void *data;
+	int fd;
+	bool ret;
 
-	f = fopen(path, "rb");
-	if (f == NULL)
-		return NULL;
+	map->data = "";
+	map->len = 0;
+	map->mapped = false;
 
-	out = nvlist_create(0);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
 
-	while (fgets(buffer, sizeof buffer, f))
+	if (fstat(fd, &st) < 0)
 	{
-		if (buffer[0] == '[' && (tmp = strchr(buffer, ']')) != NULL)
-		{
-			*tmp = 0;
+		close(fd);
+		return false;
+	}
+
+	if (st.st_size <= INIFILE_READ_MAX)
+	{
+		ret = st.st_size == 0 || inifile_read(map, fd, st.st_size);
+		close(fd);
+
+		return ret;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return false;
+
+	map->data = data;
+	map->len = st.st_size;
+	map->mapped = true;
 
-			if (section != NULL && section_name != NULL)
-			{
-				nvlist_add_nvlist(out, section_name, section);
-				nvlist_destroy(section);
-				free(section_name);
-			}
+	return true;
+}
+
+
+void
+inifile_unmap(struct inifile_map *map)
+{
+	if (map->mapped)
+		munmap((void *) map->data, map->len);
+	else if (map->len > 0)
+		free((void *) map->data);
 
-			section = nvlist_create(NV_FLAG_NO_UNIQUE);
-			section_name = strdup(&buffer[1]);
+	map->data = "";
+	map->len = 0;
+	map->mapped = false;
+}
+
+
+/*
+ * Tokenize an INI file in a single pass, calling fn for every section header and
+ * key = value pair.  Section headers are announced with a NULL key.  Slices point into
+ * data, so nothing is copied; lines may be of any length.
+ *
+ * Lines are found with memchr(), which the C library implements with vector
+ * instructions, so most of the file is skipped over a word or more at a time.
+ */
+bool
+inifile_scan(const char *data, size_t len, inifile_entry_fn_t fn, void *opaque, struct inifile_error *err)
+{
+	const char *p = data, *end = data + len;
+	struct inifile_entry entry = {};
+	struct inifile_error scratch;
+
+	if (err == NULL)
+		err = &scratch;
+
+	memset(err, 0, sizeof *err);
+
+	for (unsigned int line = 1; p < end; line++)
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		const char *next = eol != NULL ? eol + 1 : end;
+		struct inifile_slice text = inifile_trim(p, eol != NULL ? eol : end);
+		const char *s = text.ptr, *e = text.ptr + text.len;
+		unsigned int column = s - p + 1;
+
+		if (s == e || *s == '#' || *s == ';')
+		{
+			p = next;
+			continue;
 		}
-		else if (buffer[0] != '#' && section != NULL && (tmp = strchr(buffer, '=')) != NULL)
+
+		if (*s == '[')
 		{
-			const char *key, *value;
-			char *end;
+			const char *close = memchr(s, ']', e - s);
+
+			if (close == NULL)
+				return inifile_error(err, line, e - p + 1, "expected ']'");
 
-			*tmp = 0;
+			if (close + 1 != e)
+				return inifile_error(err, line, close - p + 2, "unexpected text after section header");
 
-			key = buffer;
-			value = tmp + 1;
+			entry.section = inifile_trim(s + 1, close);
+			if (entry.section.len == 0)
+				return inifile_error(err, line, column, "empty section name");
 
-			end = strchr(tmp + 1, '\n');
-			if (end != NULL)
-				*end = 0;
+			entry.key = (struct inifile_slice) {};
+			entry.value = (struct inifile_slice) {};
+		}
+		else
+		{
+			const char *eq = memchr(s, '=', e - s);
+
+			if (eq == NULL)
+				return inifile_error(err, line, column, "expected key = value");
 
-			end = strchr(tmp + 1, '\r');
-			if (end != NULL)
-				*end = 0;
+			if (entry.section.ptr == NULL)
+				return inifile_error(err, line, column, "key outside of a section");
 
-			if (!value_is_numeric(value))
-				nvlist_add_string(section, key, value);
-			else
-			{
-				uint64_t number;
+			entry.key = inifile_trim(s, eq);
+			if (entry.key.len == 0)
+				return inifile_error(err, line, column, "missing key");
 
-				number = strtol(value, NULL, 10);
-				nvlist_add_number(section, key, number);
-			}
+			entry.value = inifile_trim(eq + 1, e);
 		}
+
+		entry.line = line;
+		entry.column = column;
+
+		err->line = line;
+		err->column = column;
+
+		if (!fn(&entry, opaque, err))
+			return false;
+
+		p = next;
 	}
 
-	if (section != NULL && section_name != NULL)
+	return true;
+}
+
+
+static const char *
+inifile_load_copy(struct inifile_load_ctx *ctx, const struct inifile_slice *a, const struct inifile_slice *b)
+{
+	size_t need = a->len + 1 + b->len + 1;
+
+	if (need > ctx->scratch_len)
 	{
-		nvlist_add_nvlist(out, section_name, section);
-		nvlist_destroy(section);
-		free(section_name);
+		char *scratch = realloc(ctx->scratch, need);
+
+		if (scratch == NULL)
+			return NULL;
+
+		ctx->scratch = scratch;
+		ctx->scratch_len = need;
 	}
 
-	fclose(f);
-	return out;
+	memcpy(ctx->scratch, a->ptr, a->len);
+	ctx->scratch[a->len] = 0;
+
+	memcpy(ctx->scratch + a->len + 1, b->ptr, b->len);
+	ctx->scratch[a->len + 1 + b->len] = 0;
+
+	return ctx->scratch;
+}
+
+
+static void
+inifile_load_flush(struct inifile_load_ctx *ctx)
+{
+	if (ctx->section == NULL)
+		return;
+
+	nvlist_move_nvlist(ctx->out, ctx->section_name, ctx->section);
+	free(ctx->section_name);
+
+	ctx->section = NULL;
+	ctx->section_name = NULL;
+}
+
+
+static bool
+inifile_load_entry(const struct inifile_entry *entry, void *opaque, struct inifile_error *err)
+{
+	struct inifile_load_ctx *ctx = opaque;
+	const char *key, *value;
+
+	if (entry->key.ptr == NULL)
+	{
+		inifile_load_flush(ctx);
+
+		ctx->section_name = strndup(entry->section.ptr, entry->section.len);
+		if (ctx->section_name == NULL)
+			return inifile_error(err, entry->line, entry->column, "out of memory");
+
+		if (nvlist_exists(ctx->out, ctx->section_name))
+			return inifile_error(err, entry->line, entry->column, "duplicate section [%s]", ctx->section_name);
+
+		ctx->section = nvlist_create(NV_FLAG_NO_UNIQUE);
+		return true;
+	}
+
+	key = inifile_load_copy(ctx, &entry->key, &entry->value);
+	if (key == NULL)
+		return inifile_error(err, entry->line, entry->column, "out of memory");
+
+	value = key + entry->key.len + 1;
+
+	/* values stay strings: only the reader knows whether 0022 is a mode or a number */
+	nvlist_add_string(ctx->section, key, value);
+
+	return true;
+}
+
+
+/*
+ * Parse an INI file already in memory to an nvlist holding one nvlist per section.
+ */
+nvlist_t *
+inifile_load_map(const struct inifile_map *map, struct inifile_error *err)
+{
+	struct inifile_load_ctx ctx = {};
+
+	ctx.out = nvlist_create(0);
+
+	if (!inifile_scan(map->data, map->len, inifile_load_entry, &ctx, err))
+	{
+		nvlist_destroy(ctx.section);
+		nvlist_destroy(ctx.out);
+		ctx.out = NULL;
+	}
+	else
+		inifile_load_flush(&ctx);
+
+	free(ctx.section_name);
+	free(ctx.scratch);
+
+	return ctx.out;
+}
+
+
+/*
+ * Parse an INI file to an nvlist holding one nvlist per section.  On failure, err
+ * (if given) says where and why; a line of 0 means the file could not be read.
+ */
+nvlist_t *
+inifile_load(const char *path, struct inifile_error *err)
+{
+	struct inifile_map map;
+	struct inifile_error scratch;
+	nvlist_t *nvl;
+
+	if (err == NULL)
+		err = &scratch;
+
+	if (!inifile_map(&map, path))
+	{
+		inifile_error(err, 0, 0, "%s", strerror(errno));
+		return NULL;
+	}
+
+	nvl = inifile_load_map(&map, err);
+	inifile_unmap(&map);
+
+	return nvl;
+}
+
+
+nvlist_t *
+inifile_parse(const char *path)
+{
+	return inifile_load(path, NULL);
 }
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <nv.h>
 
 
@@ -6,6 +8,50 @@
 #define LIBSVC_INIFILE_H
 
 
+/* a piece of the file being scanned; not NUL-terminated */
+struct inifile_slice {
+	const char *ptr;
+	size_t len;
+};
+
+
+/* a key = value pair, with surrounding whitespace trimmed from both */
+struct inifile_entry {
+	struct inifile_slice section;
+	struct inifile_slice key;
+	struct inifile_slice value;
+
+	unsigned int line;
+	unsigned int column;
+};
+
+
+struct inifile_error {
+	unsigned int line;
+	unsigned int column;
+	char message[128];
+};
+
+
+/* an INI file in memory: mapped if it is large, read into a buffer otherwise */
+struct inifile_map {
+	const char *data;
+	size_t len;
+
+	bool mapped;
+};
+
+
+/* return false to stop scanning; err->message should then say why */
+typedef bool (*inifile_entry_fn_t)(const struct inifile_entry *entry, void *opaque, struct inifile_error *err);
+
+
+bool inifile_map(struct inifile_map *map, const char *path);
+void inifile_unmap(struct inifile_map *map);
+bool inifile_scan(const char *data, size_t len, inifile_entry_fn_t fn, void *opaque, struct inifile_error *err);
+
+nvlist_t *inifile_load_map(const struct inifile_map *map, struct inifile_error *err);
+nvlist_t *inifile_load(const char *path, struct inifile_error *err);
 nvlist_t *inifile_parse(const char *path);
 
 
@@ -0,0 +1,314 @@
+/* schema-driven decoding of INI sections into structures */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <nv.h>
+
+
+#include "libsvc/inischema.h"
+#include "libsvc/uidgid.h"
+
+
+struct inischema_ctx {
+	const struct inischema *schema;
+	void *target;
+	struct idcache *ids;
+
+	bool in_section;
+	bool seen;
+
+	/* NUL-terminated copy of the current value */
+	char *scratch;
+	size_t scratch_len;
+};
+
+
+static bool
+inischema_error(struct inifile_error *err, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(err->message, sizeof err->message, fmt, va);
+	va_end(va);
+
+	return false;
+}
+
+
+/*
+ * Prepare a schema for decoding.  Fails if a key is duplicated or missing, or a field
+ * is not usable as declared.
+ */
+bool
+inischema_init(struct inischema *schema, const char *section, const struct inischema_field fields[], size_t count, char *errbuf, size_t errbuf_len)
+{
+	assert(schema != NULL);
+	assert(section != NULL);
+
+	schema->section = section;
+	schema->fields = fields;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if ((fields[i].type == INISCHEMA_FUNC && fields[i].fn == NULL) ||
+			(fields[i].type == INISCHEMA_INT && fields[i].min > fields[i].max))
+		{
+			snprintf(errbuf, errbuf_len, "invalid field %s", fields[i].key != NULL ? fields[i].key : "(null)");
+			return false;
+		}
+	}
+
+	return phash_build(&schema->hash, fields, count, sizeof(struct inischema_field),
+		offsetof(struct inischema_field, key), errbuf, errbuf_len);
+}
+
+
+static bool
+inischema_decode_int(const struct inischema_field *field, int *out, const char *value, char *errbuf, size_t errbuf_len)
+{
+	const char *p = value;
+	char *end;
+	long l;
+
+	if (*p == '-')
+		p++;
+
+	/* strtol() alone would accept leading space, a '+' and hexadecimal */
+	if (*p < '0' || *p > '9')
+		goto fail;
+
+	errno = 0;
+	l = strtol(value, &end, 10);
+	if (*end || errno == ERANGE || l < field->min || l > field->max)
+		goto fail;
+
+	*out = l;
+	return true;
+
+fail:
+	snprintf(errbuf, errbuf_len, "expected an integer from %ld to %ld", field->min, field->max);
+	return false;
+}
+
+
+/*
+ * Decode value into the target according to field.
+ */
+static bool
+inischema_decode_field(const struct inischema_field *field, void *target, struct idcache *ids, const char *value, char *errbuf, size_t errbuf_len)
+{
+	void *p = (char *) target + field->offset;
+	mode_t mode;
+	char *copy;
+	int id;
+
+	switch (field->type)
+	{
+		case INISCHEMA_STRING:
+			if (!*value)
+			{
+				snprintf(errbuf, errbuf_len, "expected a non-empty string");
+				return false;
+			}
+
+			if ((copy = strdup(value)) == NULL)
+			{
+				snprintf(errbuf, errbuf_len, "out of memory");
+				return false;
+			}
+
+			free(*(char **) p);
+			*(char **) p = copy;
+			return true;
+
+		case INISCHEMA_INT:
+			return inischema_decode_int(field, p, value, errbuf, errbuf_len);
+
+		case INISCHEMA_MODE:
+			if (parse_mode(&mode, value) < 0)
+			{
+				snprintf(errbuf, errbuf_len, "expected an octal mode such as 022");
+				return false;
+			}
+
+			*(int *) p = mode;
+			return true;
+
+		case INISCHEMA_USER:
+			if (!*value || (id = ids != NULL ? idcache_uid(ids, value) : (int) uid_resolve(value)) == -1)
+			{
+				snprintf(errbuf, errbuf_len, "could not resolve user: %s", value);
+				return false;
+			}
+
+			*(int *) p = id;
+			return true;
+
+		case INISCHEMA_GROUP:
+			if (!*value || (id = ids != NULL ? idcache_gid(ids, value) : (int) gid_resolve(value)) == -1)
+			{
+				snprintf(errbuf, errbuf_len, "could not resolve group: %s", value);
+				return false;
+			}
+
+			*(int *) p = id;
+			return true;
+
+		case INISCHEMA_FUNC:
+			return field->fn(p, value, errbuf, errbuf_len);
+	}
+
+	snprintf(errbuf, errbuf_len, "unknown field type");
+	return false;
+}
+
+
+static bool
+inischema_decode_pair(const struct inischema *schema, void *target, struct idcache *ids, const char *key, const char *value, struct inifile_error *err)
+{
+	const struct inischema_field *field;
+	char msg[sizeof err->message];
+	ssize_t i;
+
+	/* keys the schema does not know are left to other readers of the file */
+	if ((i = phash_lookup(&schema->hash, key)) < 0)
+		return true;
+
+	field = &schema->fields[i];
+
+	if (!inischema_decode_field(field, target, ids, value, msg, sizeof msg))
+		return inischema_error(err, "%s: %s", field->key, msg);
+
+	return true;
+}
+
+
+static bool
+inischema_decode_entry(const struct inifile_entry *entry, void *opaque, struct inifile_error *err)
+{
+	struct inischema_ctx *ctx = opaque;
+	size_t need = entry->key.len + 1 + entry->value.len + 1;
+
+	if (entry->key.ptr == NULL)
+	{
+		ctx->in_section = strlen(ctx->schema->section) == entry->section.len &&
+			!memcmp(ctx->schema->section, entry->section.ptr, entry->section.len);
+
+		if (ctx->in_section && ctx->seen)
+			return inischema_error(err, "duplicate section [%s]", ctx->schema->section);
+
+		ctx->seen |= ctx->in_section;
+		return true;
+	}
+
+	if (!ctx->in_section)
+		return true;
+
+	if (need > ctx->scratch_len)
+	{
+		char *scratch = realloc(ctx->scratch, need);
+
+		if (scratch == NULL)
+			return inischema_error(err, "out of memory");
+
+		ctx->scratch = scratch;
+		ctx->scratch_len = need;
+	}
+
+	memcpy(ctx->scratch, entry->key.ptr, entry->key.len);
+	ctx->scratch[entry->key.len] = 0;
+
+	memcpy(ctx->scratch + entry->key.len + 1, entry->value.ptr, entry->value.len);
+	ctx->scratch[need - 1] = 0;
+
+	/* point errors at the value rather than the key */
+	err->column = entry->column + (entry->value.ptr - entry->key.ptr);
+
+	return inischema_decode_pair(ctx->schema, ctx->target, ctx->ids, ctx->scratch, ctx->scratch + entry->key.len + 1, err);
+}
+
+
+/*
+ * Decode the schema's section of an INI file in memory into target, in a single pass,
+ * resolving user and group names through ids unless it is NULL.  Keys appearing more
+ * than once take the last value.  On failure, err says where and why; a line of 0 means
+ * the section is missing.  Fields decoded before the failure keep their new values.
+ */
+bool
+inischema_decode(const struct inischema *schema, const char *data, size_t len, void *target, struct idcache *ids, struct inifile_error *err)
+{
+	struct inischema_ctx ctx = {
+		.schema = schema,
+		.target = target,
+		.ids = ids,
+	};
+	bool ret;
+
+	assert(schema != NULL);
+	assert(target != NULL);
+	assert(err != NULL);
+
+	ret = inifile_scan(data, len, inischema_decode_entry, &ctx, err);
+	free(ctx.scratch);
+
+	if (ret && !ctx.seen)
+	{
+		err->line = 0;
+		err->column = 0;
+		ret = inischema_error(err, "missing [%s] section", schema->section);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Decode the schema's section from an INI file loaded with inifile_load(), as kept by
+ * inicache.  Errors cannot say where the value was, so err->line is 0.
+ */
+bool
+inischema_decode_nvlist(const struct inischema *schema, const nvlist_t *nvl, void *target, struct idcache *ids, struct inifile_error *err)
+{
+	const nvlist_t *section;
+	const nvpair_t *nvp;
+
+	assert(schema != NULL);
+	assert(nvl != NULL);
+	assert(target != NULL);
+	assert(err != NULL);
+
+	memset(err, 0, sizeof *err);
+
+	if (!nvlist_exists_nvlist(nvl, schema->section))
+		return inischema_error(err, "missing [%s] section", schema->section);
+
+	section = nvlist_get_nvlist(nvl, schema->section);
+
+	for (nvp = nvlist_first_nvpair(section); nvp != NULL; nvp = nvlist_next_nvpair(section, nvp))
+	{
+		if (nvpair_type(nvp) != NV_TYPE_STRING)
+			return inischema_error(err, "%s: unexpected value type", nvpair_name(nvp));
+
+		if (!inischema_decode_pair(schema, target, ids, nvpair_name(nvp), nvpair_get_string(nvp), err))
+			return false;
+	}
+
+	return true;
+}
+
+
+void
+inischema_free(struct inischema *schema)
+{
+	assert(schema != NULL);
+
+	phash_free(&schema->hash);
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <nv.h>
+
+
+#ifndef LIBSVC_INISCHEMA_H
+#define LIBSVC_INISCHEMA_H
+
+#include "libsvc/inifile.h"
+#include "libsvc/phash.h"
+#include "libsvc/uidgid.h"
+
+
+/*
+ * A schema describes the keys of one INI section and where each is decoded to: a field
+ * at offset in the target structure, of a given type.  Values are decoded as the file
+ * is scanned, so no nvlist is built on the way.
+ */
+typedef enum inischema_type_e {
+	INISCHEMA_STRING,	/* char *, non-empty, allocated */
+	INISCHEMA_INT,		/* int, decimal, between min and max */
+	INISCHEMA_MODE,		/* int, octal file mode as parse_mode() takes it */
+	INISCHEMA_USER,		/* int, user name or uid, through the idcache if any */
+	INISCHEMA_GROUP,	/* int, group name or gid, likewise */
+	INISCHEMA_FUNC		/* anything else, decoded by fn */
+} inischema_type_t;
+
+
+/* decode value into field; on failure, say why in errbuf */
+typedef bool (*inischema_fn_t)(void *field, const char *value, char *errbuf, size_t errbuf_len);
+
+struct inischema_field {
+	const char *key;
+	inischema_type_t type;
+	size_t offset;
+
+	long min;
+	long max;
+
+	inischema_fn_t fn;
+};
+
+struct inischema {
+	const char *section;
+	const struct inischema_field *fields;
+	struct phash hash;
+};
+
+
+bool inischema_init(struct inischema *schema, const char *section, const struct inischema_field fields[], size_t count, char *errbuf, size_t errbuf_len);
+bool inischema_decode(const struct inischema *schema, const char *data, size_t len, void *target, struct idcache *ids, struct inifile_error *err);
+bool inischema_decode_nvlist(const struct inischema *schema, const nvlist_t *nvl, void *target, struct idcache *ids, struct inifile_error *err);
+void inischema_free(struct inischema *schema);
+
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include <nv.h>
 
 
@@ -41,19 +42,62 @@ ipc_obj_validate(const nvlist_t *nvl)
 }
 
 
-static int
-ipc_obj_dispatch_method_cmp(const char *key, const void *tentry)
+/*
+ * Return the id a request was sent with, which its replies must carry so that the
+ * requester can match them up when several requests are in flight.
+ */
+uint64_t
+ipc_obj_id(const nvlist_t *nvl)
 {
-	const ipc_hdl_dispatch_t *dtentry = tentry;
-	return strcmp(key, dtentry->method);
+	if (!nvlist_exists_number(nvl, "ipc:id"))
+		return 0;
+
+	return nvlist_get_number(nvl, "ipc:id");
+}
+
+
+/*
+ * Prepare a dispatch table for ipc_obj_dispatch().  Fails if a method is duplicated
+ * or has no handler, so a broken table is caught as soon as the program starts.
+ */
+bool
+ipc_hdl_index_init(ipc_hdl_index_t *idx, const ipc_hdl_dispatch_t dispatch_table[], size_t dispatch_table_size, char *errbuf, size_t errbuf_len)
+{
+	idx->table = dispatch_table;
+
+	for (size_t i = 0; i < dispatch_table_size; i++)
+	{
+		if (dispatch_table[i].method != NULL && dispatch_table[i].dispatch_fn == NULL)
+		{
+			snprintf(errbuf, errbuf_len, "%s: no handler", dispatch_table[i].method);
+			return false;
+		}
+	}
+
+	return phash_build(&idx->hash, dispatch_table, dispatch_table_size, sizeof(ipc_hdl_dispatch_t),
+		offsetof(ipc_hdl_dispatch_t, method), errbuf, errbuf_len);
+}
+
+
+ipc_obj_return_code_t
+ipc_obj_dispatch(int sock, const nvlist_t *nvl, const ipc_hdl_index_t *idx, void *opaque)
+{
+	return ipc_obj_dispatch_entry(sock, nvl, idx, opaque, NULL);
 }
 
 
+/*
+ * Dispatch a request, and store in *entry which entry of the table handled it, or -1
+ * if none did, so that callers keeping per-method state need not look it up again.
+ */
 ipc_obj_return_code_t
-ipc_obj_dispatch(int sock, const nvlist_t *nvl, const ipc_hdl_dispatch_t dispatch_table[], size_t dispatch_table_size, void *opaque)
+ipc_obj_dispatch_entry(int sock, const nvlist_t *nvl, const ipc_hdl_index_t *idx, void *opaque, ssize_t *entry)
 {
 	const char *method;
-	const ipc_hdl_dispatch_t *pair;
+	ssize_t i;
+
+	if (entry != NULL)
+		*entry = -1;
 
 	if (!ipc_obj_validate(nvl))
 		return IPC_OBJ_INVALID;
@@ -65,11 +109,13 @@ ipc_obj_dispatch(int sock, const nvlist_t *nvl, const ipc_hdl_dispatch_t dispatc
 	if (method == NULL)
 		return IPC_OBJ_INVALID;
 
-	pair = bsearch(method, dispatch_table, dispatch_table_size, sizeof(ipc_hdl_dispatch_t), (void *) ipc_obj_dispatch_method_cmp);
-	if (pair == NULL || pair->dispatch_fn == NULL)
+	if ((i = phash_lookup(&idx->hash, method)) < 0)
 		return IPC_OBJ_METHOD_NOT_FOUND;
 
-	return pair->dispatch_fn(sock, nvl, opaque);
+	if (entry != NULL)
+		*entry = i;
+
+	return idx->table[i].dispatch_fn(sock, nvl, opaque);
 }
 
 
@@ -78,6 +124,11 @@ ipc_obj_error(int sock, const nvlist_t *parent, ipc_obj_return_code_t rc)
 {
 	nvlist_t *nvl = nvlist_clone(parent);
 
+	/* the error is a reply to the request, keeping its ipc:id */
+	if (nvlist_exists_bool(nvl, "ipc:reply"))
+		nvlist_free_bool(nvl, "ipc:reply");
+
+	nvlist_add_bool(nvl, "ipc:reply", true);
 	nvlist_add_number(nvl, "ipc:error_code", rc);
 	nvlist_send(sock, nvl);
 	nvlist_destroy(nvl);
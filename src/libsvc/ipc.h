@@ -7,12 +7,14 @@
 #define LIBSVC_IPC_H
 
 #include "libsvc/common.h"
+#include "libsvc/phash.h"
 
 typedef enum ipc_obj_return_code_e {
 	IPC_OBJ_OK,
 	IPC_OBJ_INVALID,
 	IPC_OBJ_IS_REPLY,
 	IPC_OBJ_METHOD_NOT_FOUND,
+	IPC_OBJ_SERVICE_NOT_FOUND,
 } ipc_obj_return_code_t;
 
 typedef ipc_obj_return_code_t (*ipc_hdl_dispatch_fn_t)(int sock, const nvlist_t *nvl, void *opaque);
@@ -21,11 +23,20 @@ typedef struct ipc_hdl_dispatch_s {
 	const ipc_hdl_dispatch_fn_t dispatch_fn;
 } ipc_hdl_dispatch_t;
 
+/* a dispatch table prepared for lookups; tables may be in any order */
+typedef struct ipc_hdl_index_s {
+	const ipc_hdl_dispatch_t *table;
+	struct phash hash;
+} ipc_hdl_index_t;
+
 bool ipc_obj_is_reply(const nvlist_t *nvl);
 bool ipc_obj_validate(const nvlist_t *nvl);
+uint64_t ipc_obj_id(const nvlist_t *nvl);
 
 void ipc_obj_prepare(nvlist_t *nvl, const char *method, uint64_t id, bool reply);
-ipc_obj_return_code_t ipc_obj_dispatch(int sock, const nvlist_t *nvl, const ipc_hdl_dispatch_t dispatch_table[], size_t dispatch_table_size, void *opaque);
+bool ipc_hdl_index_init(ipc_hdl_index_t *idx, const ipc_hdl_dispatch_t dispatch_table[], size_t dispatch_table_size, char *errbuf, size_t errbuf_len);
+ipc_obj_return_code_t ipc_obj_dispatch(int sock, const nvlist_t *nvl, const ipc_hdl_index_t *idx, void *opaque);
+ipc_obj_return_code_t ipc_obj_dispatch_entry(int sock, const nvlist_t *nvl, const ipc_hdl_index_t *idx, void *opaque, ssize_t *entry);
 
 void ipc_obj_error(int sock, const nvlist_t *parent, ipc_obj_return_code_t rc);
 
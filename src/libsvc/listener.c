@@ -0,0 +1,528 @@
+/* listening sockets held by the supervisor and passed to services */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <assert.h>
+
+#include "libsvc/argv.h"
+#include "libsvc/childproc.h"
+#include "libsvc/listener.h"
+#include "libsvc/uidgid.h"
+
+
+/* each listener takes one of the descriptors passed from 3 on */
+#define LISTENER_MAX		CHILDPROC_PASS_FDS_MAX
+
+/* the name sd_listen_fds_with_names(3) reports for a socket nobody named */
+#define LISTENER_NAME_DEFAULT	"unknown"
+
+
+static bool
+listener_parse_port(const char *text, in_port_t *port)
+{
+	char *end;
+	unsigned long l;
+
+	errno = 0;
+	l = strtoul(text, &end, 10);
+	if (errno != 0 || end == text || *end != 0 || l == 0 || l > 65535)
+		return false;
+
+	*port = htons(l);
+	return true;
+}
+
+
+/*
+ * "HOST:PORT", where HOST is an IPv4 address, "*" for any, or an IPv6 address in
+ * brackets.  Names are not resolved: the supervisor must not wait on DNS.
+ */
+static bool
+listener_parse_inet(struct listener *l, const char *text)
+{
+	char host[INET6_ADDRSTRLEN + 1];
+	const char *port;
+	size_t len;
+
+	if (*text == '[')
+	{
+		const char *close = strchr(text, ']');
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &l->addr;
+
+		if (close == NULL || close[1] != ':' || (len = close - text - 1) >= sizeof host)
+			return false;
+
+		memcpy(host, text + 1, len);
+		host[len] = 0;
+
+		sin6->sin6_family = AF_INET6;
+		l->family = AF_INET6;
+		l->addr_len = sizeof *sin6;
+
+		return inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1 && listener_parse_port(close + 2, &sin6->sin6_port);
+	}
+	else
+	{
+		struct sockaddr_in *sin = (struct sockaddr_in *) &l->addr;
+
+		if ((port = strrchr(text, ':')) == NULL || (len = port - text) >= sizeof host)
+			return false;
+
+		memcpy(host, text, len);
+		host[len] = 0;
+
+		sin->sin_family = AF_INET;
+		l->family = AF_INET;
+		l->addr_len = sizeof *sin;
+
+		if (strcmp(host, "*"))
+		{
+			if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+				return false;
+		}
+		else
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+
+		return listener_parse_port(port + 1, &sin->sin_port);
+	}
+}
+
+
+/*
+ * An absolute path, or "@name" in the abstract namespace.
+ */
+static bool
+listener_parse_unix(struct listener *l, const char *text)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *) &l->addr;
+	size_t len = strlen(text);
+
+	if ((*text != '/' && *text != '@') || len < 2 || len >= sizeof sun->sun_path)
+		return false;
+
+	sun->sun_family = AF_UNIX;
+	memcpy(sun->sun_path, text, len);
+
+	if (*text == '@')
+	{
+		sun->sun_path[0] = 0;
+		l->addr_len = offsetof(struct sockaddr_un, sun_path) + len;
+	}
+	else
+		l->addr_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+	l->family = AF_UNIX;
+	return true;
+}
+
+
+static bool
+listener_parse_address(struct listener *l, const char *text)
+{
+	static const struct {
+		const char *prefix;
+		int type;
+		bool local;
+	} kinds[] = {
+		{"tcp:", SOCK_STREAM, false},
+		{"udp:", SOCK_DGRAM, false},
+		{"unix:", SOCK_STREAM, true},
+		{"unix-dgram:", SOCK_DGRAM, true},
+	};
+
+	for (size_t i = 0; i < sizeof kinds / sizeof kinds[0]; i++)
+	{
+		size_t len = strlen(kinds[i].prefix);
+
+		if (strncmp(text, kinds[i].prefix, len))
+			continue;
+
+		l->type = kinds[i].type;
+
+		return kinds[i].local ? listener_parse_unix(l, text + len) : listener_parse_inet(l, text + len);
+	}
+
+	return false;
+}
+
+
+static bool
+listener_parse_option(struct listener *l, const char *opt, char *errbuf, size_t errbuf_len)
+{
+	char *end;
+	mode_t mode;
+	long n;
+
+	if (!strncmp(opt, "name=", 5))
+	{
+		/* the names are passed joined with ':' */
+		if (!opt[5] || strchr(opt + 5, ':') != NULL || strlen(opt + 5) > 255)
+		{
+			snprintf(errbuf, errbuf_len, "invalid socket name '%s'", opt + 5);
+			return false;
+		}
+
+		free(l->name);
+		l->name = strdup(opt + 5);
+	}
+	else if (!strncmp(opt, "backlog=", 8))
+	{
+		errno = 0;
+		n = strtol(opt + 8, &end, 10);
+		if (errno != 0 || end == opt + 8 || *end != 0 || n < 1 || n > 65535 || l->type != SOCK_STREAM)
+		{
+			snprintf(errbuf, errbuf_len, "backlog: expected a number from 1 to 65535, on a stream socket");
+			return false;
+		}
+
+		l->backlog = n;
+	}
+	else if (!strncmp(opt, "mode=", 5))
+	{
+		if (parse_mode(&mode, opt + 5) < 0 || l->family != AF_UNIX)
+		{
+			snprintf(errbuf, errbuf_len, "mode: expected an octal mode, on a unix socket");
+			return false;
+		}
+
+		l->mode = mode;
+	}
+	else if (!strcmp(opt, "reuseport") && l->family != AF_UNIX)
+		l->reuseport = true;
+	else if (!strcmp(opt, "freebind") && l->family != AF_UNIX)
+		l->freebind = true;
+	else if (!strcmp(opt, "v6only") && l->family == AF_INET6)
+		l->v6only = true;
+	else
+	{
+		snprintf(errbuf, errbuf_len, "unknown or inapplicable socket option '%s'", opt);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Add a socket declared as "ADDRESS [OPTION...]", where ADDRESS is tcp:HOST:PORT,
+ * udp:HOST:PORT, unix:PATH or unix-dgram:PATH, and the options are name=NAME,
+ * backlog=N, mode=MODE, reuseport, freebind and v6only.  Nothing is bound yet.
+ */
+bool
+listener_parse(struct listener_set *set, const char *text, char *errbuf, size_t errbuf_len)
+{
+	struct listener *items, *l;
+	argv_t args = {};
+	bool ret = false;
+
+	assert(set != NULL);
+	assert(text != NULL);
+
+	if (set->count == LISTENER_MAX)
+	{
+		snprintf(errbuf, errbuf_len, "at most %d sockets may be declared", LISTENER_MAX);
+		return false;
+	}
+
+	if (!argv_split(&args, text) || argv_count(&args) == 0)
+	{
+		snprintf(errbuf, errbuf_len, "expected an address such as tcp:127.0.0.1:80");
+		goto out;
+	}
+
+	items = realloc(set->items, (set->count + 1) * sizeof *items);
+	if (items == NULL)
+	{
+		snprintf(errbuf, errbuf_len, "out of memory");
+		goto out;
+	}
+
+	set->items = items;
+	l = &items[set->count];
+
+	memset(l, 0, sizeof *l);
+	l->backlog = SOMAXCONN;
+	l->mode = -1;
+	l->fd = -1;
+
+	if (!listener_parse_address(l, args.argv[0]))
+	{
+		snprintf(errbuf, errbuf_len, "invalid socket address '%s'", args.argv[0]);
+		goto out;
+	}
+
+	for (int i = 1; i < argv_count(&args); i++)
+		if (!listener_parse_option(l, args.argv[i], errbuf, errbuf_len))
+		{
+			free(l->name);
+			goto out;
+		}
+
+	l->spec = strdup(args.argv[0]);
+	set->count++;
+	ret = true;
+
+out:
+	argv_free(&args);
+	return ret;
+}
+
+
+static bool
+listener_is_path(const struct listener *l)
+{
+	const struct sockaddr_un *sun = (const struct sockaddr_un *) &l->addr;
+
+	return l->family == AF_UNIX && sun->sun_path[0] != 0;
+}
+
+
+static bool
+listener_setopt(int fd, int level, int name)
+{
+	int one = 1;
+
+	return setsockopt(fd, level, name, &one, sizeof one) == 0;
+}
+
+
+/*
+ * Bind and listen, unless already done.  A stale socket left at a unix path is replaced,
+ * but nothing else is.
+ */
+bool
+listener_open(struct listener *l)
+{
+	const struct sockaddr_un *sun = (const struct sockaddr_un *) &l->addr;
+	struct stat st;
+	int err;
+
+	assert(l != NULL);
+
+	if (l->fd >= 0)
+		return true;
+
+	l->fd = socket(l->family, l->type | SOCK_CLOEXEC, 0);
+	if (l->fd < 0)
+		return false;
+
+	if (l->family != AF_UNIX)
+	{
+		if (l->type == SOCK_STREAM && !listener_setopt(l->fd, SOL_SOCKET, SO_REUSEADDR))
+			goto fail;
+
+		if (l->reuseport && !listener_setopt(l->fd, SOL_SOCKET, SO_REUSEPORT))
+			goto fail;
+
+		if (l->freebind && !listener_setopt(l->fd, IPPROTO_IP, IP_FREEBIND))
+			goto fail;
+
+		if (l->v6only && !listener_setopt(l->fd, IPPROTO_IPV6, IPV6_V6ONLY))
+			goto fail;
+	}
+	else if (listener_is_path(l) && lstat(sun->sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(sun->sun_path);
+
+	if (bind(l->fd, (const struct sockaddr *) &l->addr, l->addr_len) < 0)
+		goto fail;
+
+	if (listener_is_path(l) && l->mode >= 0 && chmod(sun->sun_path, l->mode) < 0)
+		goto fail;
+
+	if (l->type == SOCK_STREAM && listen(l->fd, l->backlog) < 0)
+		goto fail;
+
+	return true;
+
+fail:
+	err = errno;
+	close(l->fd);
+	l->fd = -1;
+	errno = err;
+
+	return false;
+}
+
+
+void
+listener_close(struct listener *l)
+{
+	assert(l != NULL);
+
+	if (l->fd < 0)
+		return;
+
+	close(l->fd);
+	l->fd = -1;
+
+	if (listener_is_path(l))
+		unlink(((const struct sockaddr_un *) &l->addr)->sun_path);
+}
+
+
+/*
+ * Open every socket of the set not open yet.  On failure errbuf says which and why.
+ */
+bool
+listener_open_all(struct listener_set *set, char *errbuf, size_t errbuf_len)
+{
+	assert(set != NULL);
+
+	for (size_t i = 0; i < set->count; i++)
+		if (!listener_open(&set->items[i]))
+		{
+			snprintf(errbuf, errbuf_len, "%s: %s", set->items[i].spec, strerror(errno));
+			return false;
+		}
+
+	return true;
+}
+
+
+void
+listener_close_all(struct listener_set *set)
+{
+	assert(set != NULL);
+
+	for (size_t i = 0; i < set->count; i++)
+		listener_close(&set->items[i]);
+}
+
+
+/*
+ * The socket names joined with ':', as $LISTEN_FDNAMES carries them.
+ */
+char *
+listener_names(const struct listener_set *set)
+{
+	size_t len = 1;
+	char *names, *p;
+
+	assert(set != NULL);
+
+	for (size_t i = 0; i < set->count; i++)
+		len += strlen(set->items[i].name != NULL ? set->items[i].name : LISTENER_NAME_DEFAULT) + 1;
+
+	if ((names = p = malloc(len)) == NULL)
+		return NULL;
+
+	*p = 0;
+	for (size_t i = 0; i < set->count; i++)
+		p += sprintf(p, "%s%s", i ? ":" : "", set->items[i].name != NULL ? set->items[i].name : LISTENER_NAME_DEFAULT);
+
+	return names;
+}
+
+
+/*
+ * Watch the open sockets of the set through set->watch_fd.  They are watched edge
+ * triggered: a client the service has not taken yet is reported once, not on every
+ * poll, so the supervisor can keep watching while the service runs.
+ */
+bool
+listener_watch(struct listener_set *set)
+{
+	assert(set != NULL);
+
+	if (set->watch_fd < 0 && (set->watch_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return false;
+
+	for (size_t i = 0; i < set->count; i++)
+	{
+		struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.u64 = i};
+
+		if (set->items[i].fd < 0)
+			continue;
+
+		if (epoll_ctl(set->watch_fd, EPOLL_CTL_ADD, set->items[i].fd, &ev) < 0 && errno != EEXIST)
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Consume what watch_fd reports.  Returns true if any socket saw a new client.
+ */
+bool
+listener_drain(struct listener_set *set)
+{
+	struct epoll_event evs[CHILDPROC_PASS_FDS_MAX];
+	int n;
+
+	assert(set != NULL);
+
+	if (set->watch_fd < 0)
+		return false;
+
+	while ((n = epoll_wait(set->watch_fd, evs, CHILDPROC_PASS_FDS_MAX, 0)) < 0 && errno == EINTR)
+		;
+
+	return n > 0;
+}
+
+
+/*
+ * Whether a client is waiting on any socket right now.  Edges reported while the service
+ * was running are gone, so this is what tells if one came as it stopped.
+ */
+bool
+listener_pending(const struct listener_set *set)
+{
+	struct pollfd pfds[CHILDPROC_PASS_FDS_MAX];
+	size_t n = 0;
+
+	assert(set != NULL);
+
+	for (size_t i = 0; i < set->count && n < CHILDPROC_PASS_FDS_MAX; i++)
+		if (set->items[i].fd >= 0)
+			pfds[n++] = (struct pollfd) {.fd = set->items[i].fd, .events = POLLIN};
+
+	return n > 0 && poll(pfds, n, 0) > 0;
+}
+
+
+void
+listener_free(struct listener_set *set)
+{
+	assert(set != NULL);
+
+	listener_close_all(set);
+
+	if (set->watch_fd >= 0)
+	{
+		close(set->watch_fd);
+		set->watch_fd = -1;
+	}
+
+	for (size_t i = 0; i < set->count; i++)
+	{
+		free(set->items[i].spec);
+		free(set->items[i].name);
+	}
+
+	free(set->items);
+
+	set->items = NULL;
+	set->count = 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+#ifndef LIBSVC_LISTENER_H
+#define LIBSVC_LISTENER_H
+
+
+/*
+ * A listening socket bound by the supervisor on behalf of a service, and handed to each
+ * child it starts as described by sd_listen_fds(3): descriptors from 3 on, counted by
+ * $LISTEN_FDS and named by $LISTEN_FDNAMES.  The socket outlives the child, so clients
+ * queue in the kernel while the service restarts rather than being refused.
+ */
+struct listener {
+	/* as declared, e.g. "tcp:127.0.0.1:80" */
+	char *spec;
+	char *name;
+
+	int family;
+	int type;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	int backlog;
+	int mode;
+	bool reuseport;
+	bool freebind;
+	bool v6only;
+
+	int fd;
+};
+
+/* the listen= lines of a service, in the order they are passed */
+struct listener_set {
+	struct listener *items;
+	size_t count;
+
+	/* an epoll descriptor reporting each new client on any of them, or -1 */
+	int watch_fd;
+};
+
+
+bool listener_parse(struct listener_set *set, const char *text, char *errbuf, size_t errbuf_len);
+bool listener_open(struct listener *l);
+void listener_close(struct listener *l);
+bool listener_open_all(struct listener_set *set, char *errbuf, size_t errbuf_len);
+void listener_close_all(struct listener_set *set);
+char *listener_names(const struct listener_set *set);
+bool listener_watch(struct listener_set *set);
+bool listener_drain(struct listener_set *set);
+bool listener_pending(const struct listener_set *set);
+void listener_free(struct listener_set *set);
+
+
+#endif
@@ -0,0 +1,375 @@
+/* log capture - zero-copy service output capture with size-based rotation */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "libsvc/logcapture.h"
+#include "libsvc/ringbuf.h"
+
+
+/* bytes moved per splice(2) call and per wakeup: bounds how long one busy service holds the loop */
+#define LOGCAPTURE_CHUNK	(64 * 1024)
+#define LOGCAPTURE_BUDGET	(256 * 1024)
+
+/* a larger pipe lets the child keep writing while the supervisor is busy elsewhere */
+#define LOGCAPTURE_PIPE_SIZE	(1024 * 1024)
+
+
+void
+logcapture_init(struct logcapture *lc)
+{
+	assert(lc != NULL);
+
+	memset(lc, 0, sizeof *lc);
+
+	lc->pipe_rd = -1;
+	lc->pipe_wr = -1;
+	lc->file_fd = -1;
+	lc->tee_rd = -1;
+	lc->tee_wr = -1;
+}
+
+
+/*
+ * Open the current segment.  splice(2) refuses O_APPEND descriptors, so seek to the end instead;
+ * we are the only writer.
+ */
+static bool
+logcapture_open_segment(struct logcapture *lc)
+{
+	lc->file_fd = open(lc->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (lc->file_fd < 0)
+		return false;
+
+	lc->file_size = lseek(lc->file_fd, 0, SEEK_END);
+	if (lc->file_size < 0)
+		lc->file_size = 0;
+
+	return true;
+}
+
+
+/*
+ * Shift path -> path.1 -> ... -> path.keep, dropping the oldest segment, and start a new one.
+ */
+static bool
+logcapture_rotate(struct logcapture *lc)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+
+	close(lc->file_fd);
+	lc->file_fd = -1;
+
+	if (lc->keep == 0)
+		unlink(lc->path);
+
+	for (int i = lc->keep; i > 0; i--)
+	{
+		if (i > 1)
+			snprintf(from, sizeof from, "%s.%d", lc->path, i - 1);
+		else
+			snprintf(from, sizeof from, "%s", lc->path);
+
+		snprintf(to, sizeof to, "%s.%d", lc->path, i);
+
+		if (rename(from, to) < 0 && errno != ENOENT)
+			syslog(LOG_INFO, "%s: failed to rotate to %s: %s", from, to, strerror(errno));
+	}
+
+	return logcapture_open_segment(lc);
+}
+
+
+/*
+ * Set up a capture pipe and open the first segment of the log at path.  A max_size of 0
+ * disables rotation; keep is the number of rotated segments to retain.  If path is NULL,
+ * output is only captured into a ring attached with logcapture_attach_ring().
+ */
+bool
+logcapture_open(struct logcapture *lc, const char *path, off_t max_size, int keep)
+{
+	int fds[2];
+
+	assert(lc != NULL);
+
+	logcapture_init(lc);
+
+	lc->max_size = max_size;
+	lc->keep = keep;
+
+	if (path != NULL)
+	{
+		lc->path = strdup(path);
+
+		if (!logcapture_open_segment(lc))
+			goto fail;
+	}
+
+	/* the child gets pipe_wr through its descriptor plan, so neither end should leak further */
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		goto fail;
+
+	lc->pipe_rd = fds[0];
+	lc->pipe_wr = fds[1];
+
+	/* only our end: the child's shares no file status flags with it */
+	fcntl(lc->pipe_rd, F_SETFL, O_NONBLOCK);
+
+#ifdef F_SETPIPE_SZ
+	fcntl(lc->pipe_rd, F_SETPIPE_SZ, LOGCAPTURE_PIPE_SIZE);
+#endif
+
+	return true;
+
+fail:
+	logcapture_close(lc);
+	return false;
+}
+
+
+/* scratch space for output which has to pass through userspace on its way into a ring */
+static char logcapture_buf[LOGCAPTURE_CHUNK];
+
+
+/*
+ * Read up to len bytes from fd into the ring, if there is one.  Returns the bytes read.
+ */
+static ssize_t
+logcapture_read_ring(struct logcapture *lc, int fd, size_t len)
+{
+	ssize_t n;
+
+	if (len > sizeof logcapture_buf)
+		len = sizeof logcapture_buf;
+
+	while ((n = read(fd, logcapture_buf, len)) < 0 && errno == EINTR)
+		;
+
+	if (n > 0 && lc->ring != NULL)
+		ringbuf_write(lc->ring, logcapture_buf, n);
+
+	return n;
+}
+
+
+/*
+ * The segment cannot be written (disk full, I/O error, ...).  Discard up to len queued bytes
+ * rather than let the child block on a full pipe; they still reach the ring.
+ */
+static ssize_t
+logcapture_discard(struct logcapture *lc, size_t len)
+{
+	ssize_t n, total = 0;
+
+	if (lc->dropped == 0)
+		syslog(LOG_INFO, "%s: failed to write log, discarding output: %s", lc->path, strerror(errno));
+
+	/* bytes already duplicated into the tee pipe reach the ring from there */
+	while ((size_t) total < len && (n = read(lc->pipe_rd, logcapture_buf,
+		len - total < sizeof logcapture_buf ? len - total : sizeof logcapture_buf)) > 0)
+	{
+		if (lc->ring != NULL && lc->tee_rd < 0)
+			ringbuf_write(lc->ring, logcapture_buf, n);
+
+		total += n;
+	}
+
+	lc->dropped += total;
+	return total;
+}
+
+
+/*
+ * Move up to len bytes from the capture pipe into the current segment.  Returns the bytes
+ * consumed from the pipe, 0 if it was empty.
+ */
+static ssize_t
+logcapture_pump_file(struct logcapture *lc, size_t len)
+{
+	ssize_t n, moved = 0;
+
+	if (lc->max_size > 0 && lc->file_size >= lc->max_size && !logcapture_rotate(lc))
+		return logcapture_discard(lc, len);
+
+	if (lc->file_fd < 0 && !logcapture_open_segment(lc))
+		return logcapture_discard(lc, len);
+
+	if (lc->max_size > 0 && (off_t) len > lc->max_size - lc->file_size)
+		len = lc->max_size - lc->file_size;
+
+	/* duplicate the data for the ring first: tee(2) leaves it in the capture pipe */
+	if (lc->tee_rd >= 0)
+	{
+		while ((n = tee(lc->pipe_rd, lc->tee_wr, len, SPLICE_F_NONBLOCK)) < 0 && errno == EINTR)
+			;
+
+		if (n <= 0)
+			return 0;
+
+		len = n;
+	}
+
+	while ((size_t) moved < len)
+	{
+		n = splice(lc->pipe_rd, NULL, lc->file_fd, NULL, len - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 && errno == EAGAIN && moved == 0 && lc->tee_rd < 0)
+			return 0;
+
+		if (n <= 0)
+		{
+			moved += logcapture_discard(lc, len - moved);
+			break;
+		}
+
+		lc->file_size += n;
+		moved += n;
+
+		/* without a tee the pipe decides how much there is */
+		if (lc->tee_rd < 0)
+			break;
+	}
+
+	if (lc->tee_rd >= 0)
+		for (ssize_t copied = 0; copied < moved; copied += n)
+			if ((n = logcapture_read_ring(lc, lc->tee_rd, moved - copied)) <= 0)
+				break;
+
+	return moved;
+}
+
+
+/*
+ * Move whatever the child has written into the current segment and the ring, rotating as
+ * segments fill up.  Returns the number of bytes consumed.
+ */
+ssize_t
+logcapture_pump(struct logcapture *lc)
+{
+	ssize_t total = 0;
+
+	assert(lc != NULL);
+
+	if (lc->pipe_rd < 0)
+		return 0;
+
+	while (total < LOGCAPTURE_BUDGET)
+	{
+		ssize_t n;
+
+		if (lc->path != NULL)
+			n = logcapture_pump_file(lc, LOGCAPTURE_CHUNK);
+		else
+			n = logcapture_read_ring(lc, lc->pipe_rd, LOGCAPTURE_CHUNK);
+
+		if (n <= 0)
+			break;
+
+		total += n;
+	}
+
+	return total;
+}
+
+
+/*
+ * Keep a copy of the captured output in a ring.  With a log file the output is duplicated
+ * with tee(2) on its way to disk; without one, it only goes to the ring.
+ */
+bool
+logcapture_attach_ring(struct logcapture *lc, struct ringbuf *ring)
+{
+	int fds[2];
+
+	assert(lc != NULL);
+
+	lc->ring = ring;
+
+	if (ring == NULL || lc->path == NULL || lc->tee_rd >= 0)
+		return true;
+
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		return false;
+
+	lc->tee_rd = fds[0];
+	lc->tee_wr = fds[1];
+
+	return true;
+}
+
+
+void
+logcapture_close(struct logcapture *lc)
+{
+	assert(lc != NULL);
+
+	if (lc->pipe_rd >= 0)
+		close(lc->pipe_rd);
+
+	if (lc->pipe_wr >= 0)
+		close(lc->pipe_wr);
+
+	if (lc->file_fd >= 0)
+		close(lc->file_fd);
+
+	if (lc->tee_rd >= 0)
+		close(lc->tee_rd);
+
+	if (lc->tee_wr >= 0)
+		close(lc->tee_wr);
+
+	free(lc->path);
+	logcapture_init(lc);
+}
+
+
+/*
+ * Parse a size such as 4096, 512K, 10M or 1G.
+ */
+bool
+logcapture_parse_size(off_t *size, const char *text)
+{
+	char *end;
+	unsigned long long value;
+
+	value = strtoull(text, &end, 10);
+	if (end == text)
+		return false;
+
+	switch (*end)
+	{
+		case 'G': case 'g':
+			value *= 1024;
+			/* fallthrough */
+		case 'M': case 'm':
+			value *= 1024;
+			/* fallthrough */
+		case 'K': case 'k':
+			value *= 1024;
+			end++;
+			break;
+	}
+
+	if (*end || value > INT64_MAX)
+		return false;
+
+	*size = value;
+	return true;
+}
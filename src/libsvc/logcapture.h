@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_LOGCAPTURE_H
+#define LIBSVC_LOGCAPTURE_H
+
+#include "libsvc/ringbuf.h"
+
+
+/*
+ * A log capture owns a pipe which a child writes its output into, and moves that output
+ * into size-capped segments on disk with splice(2): path, path.1, ... path.keep.
+ */
+struct logcapture {
+	char *path;
+
+	off_t max_size;
+	int keep;
+
+	int pipe_rd;
+	int pipe_wr;
+
+	int file_fd;
+	off_t file_size;
+
+	/* bytes thrown away because the segment could not be written */
+	uint64_t dropped;
+
+	/* optional in-memory copy of the output; tee_rd/tee_wr carry it when a file is also written */
+	struct ringbuf *ring;
+	int tee_rd;
+	int tee_wr;
+};
+
+
+void logcapture_init(struct logcapture *lc);
+bool logcapture_open(struct logcapture *lc, const char *path, off_t max_size, int keep);
+bool logcapture_attach_ring(struct logcapture *lc, struct ringbuf *ring);
+ssize_t logcapture_pump(struct logcapture *lc);
+void logcapture_close(struct logcapture *lc);
+bool logcapture_parse_size(off_t *size, const char *text);
+
+
+#endif
@@ -0,0 +1,187 @@
+/* OpenMetrics text rendering into preallocated buffers */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+
+
+#include "libsvc/metrics.h"
+
+
+bool
+metrics_buf_init(struct metrics_buf *mb, size_t size, size_t reserve)
+{
+	assert(mb != NULL);
+	assert(size > reserve);
+
+	memset(mb, 0, sizeof *mb);
+
+	if ((mb->data = malloc(size)) == NULL)
+		return false;
+
+	mb->size = size;
+	mb->reserve = reserve;
+	metrics_buf_reset(mb);
+
+	return true;
+}
+
+
+void
+metrics_buf_reset(struct metrics_buf *mb)
+{
+	assert(mb != NULL);
+
+	mb->len = mb->reserve;
+	mb->data[mb->len] = 0;
+	mb->overflow = false;
+}
+
+
+/*
+ * Double the buffer after a render overflowed it.  What it held is discarded.
+ */
+bool
+metrics_buf_grow(struct metrics_buf *mb)
+{
+	char *data;
+
+	assert(mb != NULL);
+
+	if ((data = realloc(mb->data, mb->size * 2)) == NULL)
+		return false;
+
+	mb->data = data;
+	mb->size *= 2;
+	metrics_buf_reset(mb);
+
+	return true;
+}
+
+
+void
+metrics_buf_free(struct metrics_buf *mb)
+{
+	assert(mb != NULL);
+
+	free(mb->data);
+	memset(mb, 0, sizeof *mb);
+}
+
+
+/* the text rendered so far, after the reserve */
+const char *
+metrics_text(const struct metrics_buf *mb)
+{
+	return mb->data + mb->reserve;
+}
+
+
+void
+metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list va;
+	int n;
+
+	if (mb->overflow)
+		return;
+
+	va_start(va, fmt);
+	n = vsnprintf(mb->data + mb->len, mb->size - mb->len, fmt, va);
+	va_end(va);
+
+	if (n < 0 || (size_t) n >= mb->size - mb->len)
+	{
+		mb->overflow = true;
+		mb->data[mb->len] = 0;
+		return;
+	}
+
+	mb->len += n;
+}
+
+
+/*
+ * Escape a label value into dst, as OpenMetrics wants backslashes, quotes and newlines.
+ * A value too long for dst is cut short.
+ */
+const char *
+metrics_escape(char *dst, size_t len, const char *value)
+{
+	size_t n = 0;
+
+	assert(len > 0);
+
+	for (; *value && n + 2 < len; value++)
+	{
+		if (*value == '\\' || *value == '"')
+			dst[n++] = '\\';
+		else if (*value == '\n')
+		{
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+			continue;
+		}
+
+		dst[n++] = *value;
+	}
+
+	dst[n] = 0;
+	return dst;
+}
+
+
+void
+metrics_family(struct metrics_buf *mb, const char *name, const char *type, const char *help)
+{
+	metrics_printf(mb, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+
+static void
+metrics_seconds(struct metrics_buf *mb, uint64_t ns)
+{
+	metrics_printf(mb, "%" PRIu64 ".%09" PRIu64, ns / 1000000000, ns % 1000000000);
+}
+
+
+/*
+ * Render a histogram of nanoseconds in seconds, with labels (already escaped, and without
+ * braces) on every sample.  Bucket bounds fall on every METRICS_BUCKET_STEP-th of the
+ * histogram's own, which keeps the counts exact and the output a fixed set of lines.
+ */
+void
+metrics_histogram(struct metrics_buf *mb, const char *name, const char *labels, const struct histogram *h)
+{
+	uint64_t cumulative = 0;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+	{
+		cumulative += h->buckets[i];
+
+		if (i % METRICS_BUCKET_STEP != 0)
+			continue;
+
+		metrics_printf(mb, "%s_bucket{%s,le=\"", name, labels);
+		metrics_seconds(mb, histogram_bucket_upper(i));
+		metrics_printf(mb, "\"} %" PRIu64 "\n", cumulative);
+	}
+
+	metrics_printf(mb, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", name, labels, h->count);
+	metrics_printf(mb, "%s_count{%s} %" PRIu64 "\n", name, labels, h->count);
+	metrics_printf(mb, "%s_sum{%s} ", name, labels);
+	metrics_seconds(mb, h->sum_ns);
+	metrics_printf(mb, "\n");
+}
+
+
+void
+metrics_eof(struct metrics_buf *mb)
+{
+	metrics_printf(mb, "# EOF\n");
+}
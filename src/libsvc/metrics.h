@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_METRICS_H
+#define LIBSVC_METRICS_H
+
+#include "libsvc/histogram.h"
+
+
+/*
+ * OpenMetrics text, rendered into a buffer allocated once up front.  A render which does
+ * not fit sets overflow and is to be redone after metrics_buf_grow(), so the buffer only
+ * grows when the output does, and a scrape in the steady state allocates nothing.
+ *
+ * The first reserve bytes are left free for whatever the caller puts in front of the
+ * text, such as an HTTP header, so that both go out in one piece.
+ */
+struct metrics_buf {
+	char *data;
+	size_t size;
+	size_t reserve;
+	size_t len;
+	bool overflow;
+};
+
+/* the buckets a histogram is rendered with: every METRICS_BUCKET_STEP-th of its own */
+#define METRICS_BUCKET_STEP	(2 * HISTOGRAM_SUB_BUCKETS)
+
+/* longest label value, once escaped */
+#define METRICS_LABEL_MAX	256
+
+
+bool metrics_buf_init(struct metrics_buf *mb, size_t size, size_t reserve);
+void metrics_buf_reset(struct metrics_buf *mb);
+bool metrics_buf_grow(struct metrics_buf *mb);
+void metrics_buf_free(struct metrics_buf *mb);
+
+const char *metrics_text(const struct metrics_buf *mb);
+void metrics_printf(struct metrics_buf *mb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+const char *metrics_escape(char *dst, size_t len, const char *value);
+
+void metrics_family(struct metrics_buf *mb, const char *name, const char *type, const char *help);
+void metrics_histogram(struct metrics_buf *mb, const char *name, const char *labels, const struct histogram *h);
+void metrics_eof(struct metrics_buf *mb);
+
+
+#endif
@@ -0,0 +1,362 @@
+/* readiness notification, s6 and sd_notify styles */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <assert.h>
+
+#include "libsvc/notify.h"
+
+
+/* largest notification accepted; sd_notify(3) messages are a few short lines */
+#define NOTIFY_MSG_MAX		4096
+
+/* most datagrams read per wakeup, so a chatty service cannot hold the loop */
+#define NOTIFY_BATCH		16
+
+/* descriptors a datagram may carry (FDSTORE=1), which are not kept */
+#define NOTIFY_RIGHTS_MAX	16
+
+
+void
+notify_init(struct notify *n, const struct notify_config *config)
+{
+	assert(n != NULL);
+
+	memset(n, 0, sizeof *n);
+
+	if (config != NULL)
+		n->config = *config;
+
+	n->rd = -1;
+	n->wr = -1;
+}
+
+
+/*
+ * Parse a readiness setting: "none", "notify" for sd_notify(3), or "fd:N" for a newline
+ * written to descriptor N.
+ */
+bool
+notify_parse(struct notify_config *config, const char *text)
+{
+	char *end;
+	long fd;
+
+	if (!strcmp(text, "none"))
+	{
+		*config = (struct notify_config) {.type = NOTIFY_NONE};
+		return true;
+	}
+
+	if (!strcmp(text, "notify"))
+	{
+		*config = (struct notify_config) {.type = NOTIFY_SOCKET};
+		return true;
+	}
+
+	if (strncmp(text, "fd:", 3))
+		return false;
+
+	errno = 0;
+	fd = strtol(text + 3, &end, 10);
+
+	/* 0 to 2 are stdin, stdout and stderr */
+	if (errno != 0 || end == text + 3 || *end != 0 || fd < 3 || fd > 1023)
+		return false;
+
+	*config = (struct notify_config) {.type = NOTIFY_FD, .fd = fd};
+	return true;
+}
+
+
+/*
+ * Bind the socket to an address picked by the kernel in the abstract namespace, so that
+ * nothing needs cleaning up and no two services can collide.
+ */
+static bool
+notify_bind(struct notify *n)
+{
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	socklen_t len = sizeof(sa_family_t);
+	int one = 1;
+
+	n->rd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (n->rd < 0)
+		return false;
+
+	/* senders are told apart by the credentials the kernel attaches */
+	if (setsockopt(n->rd, SOL_SOCKET, SO_PASSCRED, &one, sizeof one) < 0 ||
+		bind(n->rd, (struct sockaddr *) &sun, len) < 0)
+		goto fail;
+
+	len = sizeof sun;
+	if (getsockname(n->rd, (struct sockaddr *) &sun, &len) < 0)
+		goto fail;
+
+	len -= offsetof(struct sockaddr_un, sun_path);
+	if (len < 2 || sun.sun_path[0] != 0 || len - 1 + sizeof "NOTIFY_SOCKET=@" > sizeof n->env)
+	{
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
+
+	/* sd_notify(3) reads a leading '@' as the abstract namespace */
+	snprintf(n->env, sizeof n->env, "NOTIFY_SOCKET=@%.*s", (int) (len - 1), sun.sun_path + 1);
+	return true;
+
+fail:
+	close(n->rd);
+	n->rd = -1;
+
+	return false;
+}
+
+
+/*
+ * Get ready for the next start of the service: a fresh pipe for NOTIFY_FD, whose write end
+ * goes to the child, and the socket for NOTIFY_SOCKET, which is kept across restarts.
+ */
+bool
+notify_prepare(struct notify *n)
+{
+	int fds[2];
+
+	assert(n != NULL);
+
+	notify_reset(n);
+
+	switch (n->config.type)
+	{
+		case NOTIFY_NONE:
+			return true;
+
+		case NOTIFY_FD:
+			if (pipe2(fds, O_CLOEXEC) < 0)
+				return false;
+
+			/* only our end: the child's shares no file status flags with it */
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+			n->rd = fds[0];
+			n->wr = fds[1];
+			return true;
+
+		case NOTIFY_SOCKET:
+			return n->rd >= 0 || notify_bind(n);
+	}
+
+	return false;
+}
+
+
+/*
+ * The child has been started: drop our copy of its end of the pipe, so that its exit
+ * shows as end of file.
+ */
+void
+notify_started(struct notify *n)
+{
+	assert(n != NULL);
+
+	if (n->wr >= 0)
+	{
+		close(n->wr);
+		n->wr = -1;
+	}
+}
+
+
+static int
+notify_read_fd(struct notify *n)
+{
+	char buf[64];
+	ssize_t len;
+
+	for (;;)
+	{
+		len = read(n->rd, buf, sizeof buf);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && errno == EAGAIN)
+			return 0;
+
+		/* one newline is all there is to say; like s6, stop listening after it */
+		if (len > 0 && memchr(buf, '\n', len) == NULL)
+			continue;
+
+		close(n->rd);
+		n->rd = -1;
+
+		return len > 0 ? NOTIFY_EVENT_READY : 0;
+	}
+}
+
+
+/*
+ * Apply the "KEY=VALUE" lines of one sd_notify(3) message.  Keys not listed are ignored.
+ */
+static int
+notify_parse_message(struct notify *n, char *msg)
+{
+	int events = 0;
+
+	for (char *line = msg, *next; line != NULL; line = next)
+	{
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = 0;
+
+		if (!strcmp(line, "READY=1"))
+			events |= NOTIFY_EVENT_READY;
+		else if (!strncmp(line, "STATUS=", 7))
+		{
+			snprintf(n->status, sizeof n->status, "%s", line + 7);
+			events |= NOTIFY_EVENT_STATUS;
+		}
+		else if (!strncmp(line, "MAINPID=", 8))
+		{
+			char *end;
+			long pid = strtol(line + 8, &end, 10);
+
+			if (end != line + 8 && *end == 0 && pid > 0)
+			{
+				n->main_pid = pid;
+				events |= NOTIFY_EVENT_MAINPID;
+			}
+		}
+	}
+
+	return events;
+}
+
+
+static int
+notify_read_socket(struct notify *n, pid_t pid)
+{
+	char msg[NOTIFY_MSG_MAX + 1];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(NOTIFY_RIGHTS_MAX * sizeof(int))];
+	} control;
+	int events = 0;
+
+	for (int i = 0; i < NOTIFY_BATCH; i++)
+	{
+		struct iovec iov = {.iov_base = msg, .iov_len = NOTIFY_MSG_MAX};
+		struct msghdr mh = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buf,
+			.msg_controllen = sizeof control.buf,
+		};
+		const struct ucred *cred = NULL;
+		ssize_t len;
+
+		len = recvmsg(n->rd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c))
+		{
+			if (c->cmsg_level != SOL_SOCKET)
+				continue;
+
+			if (c->cmsg_type == SCM_CREDENTIALS && c->cmsg_len == CMSG_LEN(sizeof(struct ucred)))
+				cred = (const struct ucred *) CMSG_DATA(c);
+			else if (c->cmsg_type == SCM_RIGHTS)
+			{
+				const int *fds = (const int *) CMSG_DATA(c);
+
+				for (size_t j = 0; j < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); j++)
+					close(fds[j]);
+			}
+		}
+
+		/* only the service itself may speak for it, as with NotifyAccess=main */
+		if (cred == NULL || pid <= 0 || (cred->pid != pid && cred->pid != n->main_pid))
+			continue;
+
+		if (mh.msg_flags & MSG_TRUNC)
+			continue;
+
+		msg[len] = 0;
+		events |= notify_parse_message(n, msg);
+	}
+
+	return events;
+}
+
+
+/*
+ * Read what the service with the given pid has sent, and return the NOTIFY_EVENT_* found.
+ */
+int
+notify_read(struct notify *n, pid_t pid)
+{
+	assert(n != NULL);
+
+	if (n->rd < 0)
+		return 0;
+
+	if (n->config.type == NOTIFY_FD)
+		return notify_read_fd(n);
+
+	return notify_read_socket(n, pid);
+}
+
+
+/*
+ * The service has exited: forget what it said.  The socket stays bound, so that the
+ * address a restarted service is given does not change.
+ */
+void
+notify_reset(struct notify *n)
+{
+	assert(n != NULL);
+
+	if (n->config.type != NOTIFY_SOCKET && n->rd >= 0)
+	{
+		close(n->rd);
+		n->rd = -1;
+	}
+
+	notify_started(n);
+
+	n->main_pid = 0;
+	n->status[0] = 0;
+}
+
+
+void
+notify_close(struct notify *n)
+{
+	assert(n != NULL);
+
+	notify_reset(n);
+
+	if (n->rd >= 0)
+	{
+		close(n->rd);
+		n->rd = -1;
+	}
+}
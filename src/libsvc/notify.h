@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_NOTIFY_H
+#define LIBSVC_NOTIFY_H
+
+
+/*
+ * Readiness notification: how a service tells its supervisor that it is ready, rather
+ * than merely running.  With NOTIFY_FD (as in s6) the service writes a newline to a
+ * descriptor it was given; with NOTIFY_SOCKET (as sd_notify(3)) it sends "READY=1" in a
+ * datagram to the socket named by $NOTIFY_SOCKET.
+ */
+typedef enum notify_type_e {
+	NOTIFY_NONE,
+	NOTIFY_FD,
+	NOTIFY_SOCKET
+} notify_type_t;
+
+/* as declared with ready=fd:N or ready=notify */
+struct notify_config {
+	notify_type_t type;
+
+	/* NOTIFY_FD: the descriptor number the service writes to */
+	int fd;
+};
+
+/* what notify_read() found */
+#define NOTIFY_EVENT_READY	0x1
+#define NOTIFY_EVENT_STATUS	0x2
+#define NOTIFY_EVENT_MAINPID	0x4
+
+#define NOTIFY_STATUS_MAX	256
+
+
+struct notify {
+	struct notify_config config;
+
+	/* polled by the supervisor: a pipe for NOTIFY_FD, the socket for NOTIFY_SOCKET */
+	int rd;
+
+	/* NOTIFY_FD: the end handed to the child, only open while it is being started */
+	int wr;
+
+	/* NOTIFY_SOCKET: "NOTIFY_SOCKET=@...", for the child's environment */
+	char env[64];
+
+	/* as last reported with MAINPID= and STATUS= */
+	pid_t main_pid;
+	char status[NOTIFY_STATUS_MAX];
+};
+
+
+void notify_init(struct notify *n, const struct notify_config *config);
+bool notify_parse(struct notify_config *config, const char *text);
+bool notify_prepare(struct notify *n);
+void notify_started(struct notify *n);
+int notify_read(struct notify *n, pid_t pid);
+void notify_reset(struct notify *n);
+void notify_close(struct notify *n);
+
+
+#endif
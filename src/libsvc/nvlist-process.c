@@ -1,28 +1,48 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stddef.h>
 #include <assert.h>
 
 #include "libsvc/nvlist-process.h"
 
 
-static int
-nvlist_process_table_cmp(const char *key, const void *tentry)
+/*
+ * Prepare a table for nvlist_process().  Fails if a key is duplicated or has no
+ * handler, so a broken table is caught as soon as the program starts.
+ */
+bool
+nvlist_process_index_init(nvlist_process_index_t *idx, const nvlist_process_table_t table[], size_t table_size, char *errbuf, size_t errbuf_len)
 {
-	const nvlist_process_table_t *ptentry = tentry;
-	return strcmp(key, ptentry->key);
+	assert(idx != NULL);
+
+	idx->table = table;
+
+	for (size_t i = 0; i < table_size; i++)
+	{
+		if (table[i].key != NULL && table[i].dispatch_fn == NULL)
+		{
+			snprintf(errbuf, errbuf_len, "%s: no handler", table[i].key);
+			return false;
+		}
+	}
+
+	return phash_build(&idx->hash, table, table_size, sizeof(nvlist_process_table_t),
+		offsetof(nvlist_process_table_t, key), errbuf, errbuf_len);
 }
 
 
 void
-nvlist_process(const nvlist_t *nvl, const nvlist_process_table_t table[], size_t table_size, void *opaque)
+nvlist_process(const nvlist_t *nvl, const nvlist_process_index_t *idx, void *opaque)
 {
 	const nvpair_t *nvp;
 	const char *key;
 	const nvlist_process_table_t *tentry;
+	ssize_t i;
 
 	assert(nvl != NULL);
-	assert(table_size > 0);
+	assert(idx != NULL);
 
 	nvp = nvlist_first_nvpair(nvl);
 	while (nvp != NULL)
@@ -30,14 +50,15 @@ nvlist_process(const nvlist_t *nvl, const nvlist_process_table_t table[], size_t
 		key = nvpair_name(nvp);
 		assert(key != NULL);
 
-		tentry = bsearch(key, table, table_size, sizeof(nvlist_process_table_t), (void *) nvlist_process_table_cmp);
-		if (tentry == NULL)
+		if ((i = phash_lookup(&idx->hash, key)) < 0)
 			goto next;
 
-		if (nvpair_type(nvp) != tentry->type)
+		tentry = &idx->table[i];
+
+		/* NV_TYPE_NONE entries accept any type and leave checking to the handler */
+		if (tentry->type != NV_TYPE_NONE && nvpair_type(nvp) != tentry->type)
 			goto next;
 
-		assert(tentry->dispatch_fn != NULL);
 		tentry->dispatch_fn(key, nvp, opaque);
 
 next:
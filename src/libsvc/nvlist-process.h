@@ -1,11 +1,14 @@
 /* helpers for processing nvlists */
 
+#include <stdbool.h>
 #include <nv.h>
 
 
 #ifndef LIBSVC_NVLIST_PROCESS_H
 #define LIBSVC_NVLIST_PROCESS_H
 
+#include "libsvc/phash.h"
+
 
 typedef void (*nvlist_process_fn_t)(const char *key, const nvpair_t *pair, void *opaque);
 
@@ -15,8 +18,15 @@ typedef struct nvlist_process_table_s {
 	const int type;
 } nvlist_process_table_t;
 
+/* a table prepared for lookups; tables may be in any order */
+typedef struct nvlist_process_index_s {
+	const nvlist_process_table_t *table;
+	struct phash hash;
+} nvlist_process_index_t;
+
 
-void nvlist_process(const nvlist_t *nvl, const nvlist_process_table_t table[], size_t table_size, void *opaque);
+bool nvlist_process_index_init(nvlist_process_index_t *idx, const nvlist_process_table_t table[], size_t table_size, char *errbuf, size_t errbuf_len);
+void nvlist_process(const nvlist_t *nvl, const nvlist_process_index_t *idx, void *opaque);
 
 
 #endif
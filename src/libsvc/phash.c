@@ -0,0 +1,259 @@
+/*
+ * Perfect hashing of static key tables, using hash and displace: keys are first split
+ * into small buckets, then each bucket, largest first, gets a seed which moves all of
+ * its keys into free slots.  With at least twice as many slots as keys a seed is found
+ * within a few tries, so building is cheap enough to do when a program starts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+
+#include "libsvc/phash.h"
+
+
+static const char *
+phash_key(const struct phash *ph, size_t index)
+{
+	return *(const char * const *) ((const char *) ph->table + index * ph->stride + ph->key_offset);
+}
+
+
+/* FNV-1a */
+static uint64_t
+phash_hash(const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *key; key++)
+	{
+		h ^= (unsigned char) *key;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+/* spread a key hash with a seed; seed 0 picks the bucket */
+static uint32_t
+phash_mix(uint64_t h, uint16_t seed, uint32_t mask)
+{
+	h ^= seed * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h & mask;
+}
+
+
+static uint32_t
+phash_pow2(size_t n)
+{
+	uint32_t p = 1;
+
+	while (p < n)
+		p <<= 1;
+
+	return p;
+}
+
+
+static bool
+phash_error(char *errbuf, size_t errbuf_len, const char *fmt, const char *key)
+{
+	if (errbuf != NULL)
+		snprintf(errbuf, errbuf_len, fmt, key);
+
+	return false;
+}
+
+
+/*
+ * Try to place every key of a bucket with the given seed.  On failure, slots taken
+ * so far are released again.
+ */
+static bool
+phash_place(struct phash *ph, const uint64_t *hashes, const uint32_t *members, size_t n, uint16_t seed)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		uint32_t slot = phash_mix(hashes[members[i]], seed, ph->slot_mask);
+
+		if (ph->slots[slot] != 0)
+		{
+			while (i-- > 0)
+				ph->slots[phash_mix(hashes[members[i]], seed, ph->slot_mask)] = 0;
+
+			return false;
+		}
+
+		ph->slots[slot] = members[i] + 1;
+	}
+
+	return true;
+}
+
+
+/*
+ * Build a perfect hash over table.  Fails, describing the problem in errbuf, if a key
+ * is missing or appears twice.
+ */
+bool
+phash_build(struct phash *ph, const void *table, size_t count, size_t stride, size_t key_offset, char *errbuf, size_t errbuf_len)
+{
+	uint64_t *hashes = NULL;
+	uint32_t *bucket_of = NULL, *members = NULL, *bucket_start = NULL, *bucket_fill = NULL;
+	size_t bucket_count, max_size = 0;
+	bool ret = false;
+
+	assert(ph != NULL);
+	assert(table != NULL);
+
+	memset(ph, 0, sizeof *ph);
+	ph->table = table;
+	ph->count = count;
+	ph->stride = stride;
+	ph->key_offset = key_offset;
+
+	if (count == 0 || count > UINT32_MAX / 2)
+		return phash_error(errbuf, errbuf_len, "table size out of range%s", "");
+
+	bucket_count = phash_pow2(count);
+	ph->bucket_mask = bucket_count - 1;
+	ph->slot_mask = phash_pow2(count * 2) - 1;
+
+	ph->seeds = calloc(bucket_count, sizeof(uint16_t));
+	ph->slots = calloc(ph->slot_mask + 1, sizeof(uint32_t));
+	hashes = calloc(count, sizeof(uint64_t));
+	bucket_of = calloc(count, sizeof(uint32_t));
+	members = calloc(count, sizeof(uint32_t));
+	bucket_start = calloc(bucket_count + 1, sizeof(uint32_t));
+	bucket_fill = calloc(bucket_count, sizeof(uint32_t));
+
+	if (ph->seeds == NULL || ph->slots == NULL || hashes == NULL || bucket_of == NULL || members == NULL ||
+		bucket_start == NULL || bucket_fill == NULL)
+	{
+		phash_error(errbuf, errbuf_len, "out of memory%s", "");
+		goto out;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *key = phash_key(ph, i);
+
+		if (key == NULL)
+		{
+			phash_error(errbuf, errbuf_len, "entry without a key%s", "");
+			goto out;
+		}
+
+		hashes[i] = phash_hash(key);
+
+		for (size_t j = 0; j < i; j++)
+		{
+			if (hashes[j] != hashes[i])
+				continue;
+
+			phash_error(errbuf, errbuf_len, strcmp(phash_key(ph, j), key) ?
+				"%s: hash collides with another key" : "%s: duplicate key", key);
+			goto out;
+		}
+
+		bucket_of[i] = phash_mix(hashes[i], 0, ph->bucket_mask);
+		bucket_start[bucket_of[i] + 1]++;
+	}
+
+	/* group keys by bucket */
+	for (size_t b = 0; b < bucket_count; b++)
+	{
+		if (bucket_start[b + 1] > max_size)
+			max_size = bucket_start[b + 1];
+
+		bucket_start[b + 1] += bucket_start[b];
+	}
+
+	for (size_t i = 0; i < count; i++)
+		members[bucket_start[bucket_of[i]] + bucket_fill[bucket_of[i]]++] = i;
+
+	/* largest buckets first, while there is the most room left */
+	for (size_t size = max_size; size > 0; size--)
+	{
+		for (size_t b = 0; b < bucket_count; b++)
+		{
+			uint32_t seed;
+
+			if (bucket_start[b + 1] - bucket_start[b] != size)
+				continue;
+
+			for (seed = 1; seed <= UINT16_MAX; seed++)
+				if (phash_place(ph, hashes, &members[bucket_start[b]], size, seed))
+					break;
+
+			if (seed > UINT16_MAX)
+			{
+				phash_error(errbuf, errbuf_len, "%s: no seed places this key", phash_key(ph, members[bucket_start[b]]));
+				goto out;
+			}
+
+			ph->seeds[b] = seed;
+		}
+	}
+
+	ret = true;
+
+out:
+	free(hashes);
+	free(bucket_of);
+	free(members);
+	free(bucket_start);
+	free(bucket_fill);
+
+	if (!ret)
+		phash_free(ph);
+
+	return ret;
+}
+
+
+/*
+ * Look up a key, returning its index in the table or -1 if it is not present.
+ */
+ssize_t
+phash_lookup(const struct phash *ph, const char *key)
+{
+	uint64_t h;
+	uint32_t index;
+
+	assert(ph != NULL);
+	assert(key != NULL);
+
+	if (ph->slots == NULL)
+		return -1;
+
+	h = phash_hash(key);
+	index = ph->slots[phash_mix(h, ph->seeds[phash_mix(h, 0, ph->bucket_mask)], ph->slot_mask)];
+
+	if (index == 0 || strcmp(phash_key(ph, index - 1), key))
+		return -1;
+
+	return index - 1;
+}
+
+
+void
+phash_free(struct phash *ph)
+{
+	assert(ph != NULL);
+
+	free(ph->seeds);
+	free(ph->slots);
+
+	ph->seeds = NULL;
+	ph->slots = NULL;
+}
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_PHASH_H
+#define LIBSVC_PHASH_H
+
+
+/*
+ * A perfect hash over the keys of a static table of structures, each holding a
+ * const char * key at key_offset.  Building it checks the table for missing and
+ * duplicate keys; lookups then cost one hash of the key and a single strcmp(),
+ * whatever the size or order of the table.
+ */
+struct phash {
+	const void *table;
+	size_t count;
+	size_t stride;
+	size_t key_offset;
+
+	uint32_t bucket_mask;
+	uint32_t slot_mask;
+
+	/* per-bucket seed, then slot -> table index + 1, 0 meaning empty */
+	uint16_t *seeds;
+	uint32_t *slots;
+};
+
+
+bool phash_build(struct phash *ph, const void *table, size_t count, size_t stride, size_t key_offset, char *errbuf, size_t errbuf_len);
+ssize_t phash_lookup(const struct phash *ph, const char *key);
+void phash_free(struct phash *ph);
+
+
+#endif
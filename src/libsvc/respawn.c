@@ -0,0 +1,283 @@
+/* respawn policy: backoff, jitter and the crash budget */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <assert.h>
+
+#include "libsvc/respawn.h"
+
+
+#define RESPAWN_NS_PER_S	1000000000ULL
+#define RESPAWN_NS_PER_MS	1000000ULL
+
+
+/*
+ * Initialize respawn state with the default policy: restart at once, then back off up
+ * to a minute, and start over after ten seconds of running.
+ */
+void
+respawn_init(struct respawn *r)
+{
+	assert(r != NULL);
+
+	memset(r, 0, sizeof *r);
+
+	r->policy.delay_max = 60;
+	r->policy.jitter = 25;
+	r->policy.healthy = 10;
+
+	r->timer_fd = -1;
+}
+
+
+uint64_t
+respawn_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * RESPAWN_NS_PER_S + ts.tv_nsec;
+}
+
+
+/* xorshift64*; jitter needs to differ between services, not to be unpredictable */
+static uint64_t
+respawn_random(struct respawn *r)
+{
+	if (r->rng == 0)
+		r->rng = (respawn_now() ^ (uintptr_t) r ^ ((uint64_t) getpid() << 32)) | 1;
+
+	r->rng ^= r->rng >> 12;
+	r->rng ^= r->rng << 25;
+	r->rng ^= r->rng >> 27;
+
+	return r->rng * 0x2545f4914f6cdd1dULL;
+}
+
+
+/*
+ * Record a crash at now_ns in the window, unless the budget is already spent by the
+ * crashes it holds.  Only the last policy.max crashes matter, so they are kept in a ring.
+ */
+static bool
+respawn_budget(struct respawn *r, uint64_t now_ns)
+{
+	size_t max = r->policy.max;
+
+	if (max == 0)
+		return true;
+
+	if (max > RESPAWN_MAX_LIMIT)
+		max = RESPAWN_MAX_LIMIT;
+
+	if (r->crash_ns == NULL)
+	{
+		r->crash_ns = calloc(max, sizeof(uint64_t));
+		if (r->crash_ns == NULL)
+			abort();
+
+		r->crash_head = 0;
+		r->crash_count = 0;
+	}
+
+	if (r->crash_count == max)
+	{
+		if (r->policy.period == 0 || now_ns - r->crash_ns[r->crash_head] < r->policy.period * RESPAWN_NS_PER_S)
+			return false;
+
+		/* the oldest crash has left the window: its slot takes this one */
+		r->crash_ns[r->crash_head] = now_ns;
+		r->crash_head = (r->crash_head + 1) % max;
+
+		return true;
+	}
+
+	r->crash_ns[(r->crash_head + r->crash_count) % max] = now_ns;
+	r->crash_count++;
+
+	return true;
+}
+
+
+/*
+ * The child exited at now_ns after running for ran_ns.  Returns false if the crash budget
+ * is spent and the service should stay down, else true with delay_ms set to how long to
+ * wait before restarting it.
+ */
+bool
+respawn_crashed(struct respawn *r, uint64_t now_ns, uint64_t ran_ns)
+{
+	const struct respawn_policy *p;
+	uint64_t delay, limit;
+
+	assert(r != NULL);
+
+	p = &r->policy;
+
+	if (p->healthy > 0 && ran_ns >= p->healthy * RESPAWN_NS_PER_S)
+		r->attempt = 0;
+
+	if (!respawn_budget(r, now_ns))
+	{
+		r->gave_up = true;
+		return false;
+	}
+
+	delay = p->delay * 1000ULL;
+	limit = (p->delay_max > p->delay ? p->delay_max : p->delay) * 1000ULL;
+
+	if (r->attempt > 0 && delay < RESPAWN_BACKOFF_MIN_MS)
+		delay = RESPAWN_BACKOFF_MIN_MS;
+
+	for (int i = 0; i < r->attempt && delay < limit; i++)
+		delay *= 2;
+
+	if (delay > limit)
+		delay = limit;
+
+	if (p->jitter > 0 && delay > 0)
+		delay -= delay * p->jitter / 100 * (respawn_random(r) >> 54) / 1024;
+
+	/* past the limit the count only needs to keep the delay there */
+	if (r->attempt < 64)
+		r->attempt++;
+
+	r->delay_ms = delay;
+	return true;
+}
+
+
+/*
+ * Number of crashes that count against the budget at now_ns.
+ */
+size_t
+respawn_window(const struct respawn *r, uint64_t now_ns)
+{
+	size_t count = 0;
+	size_t max;
+
+	assert(r != NULL);
+
+	if (r->crash_ns == NULL || r->policy.period == 0)
+		return r->crash_count;
+
+	max = r->policy.max > RESPAWN_MAX_LIMIT ? RESPAWN_MAX_LIMIT : r->policy.max;
+
+	for (size_t i = 0; i < r->crash_count; i++)
+		if (now_ns - r->crash_ns[(r->crash_head + i) % max] < r->policy.period * RESPAWN_NS_PER_S)
+			count++;
+
+	return count;
+}
+
+
+/*
+ * Arm the timer for a restart delay_ms after now_ns.  The deadline is absolute, so time
+ * spent between the crash and this call is not waited twice.
+ */
+bool
+respawn_arm(struct respawn *r, uint64_t now_ns)
+{
+	struct itimerspec its = {};
+
+	assert(r != NULL);
+
+	if (r->timer_fd < 0)
+	{
+		r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (r->timer_fd < 0)
+			return false;
+	}
+
+	r->due_ns = now_ns + r->delay_ms * RESPAWN_NS_PER_MS;
+
+	/* an all-zero it_value would disarm the timer rather than fire it */
+	its.it_value.tv_sec = r->due_ns / RESPAWN_NS_PER_S;
+	its.it_value.tv_nsec = r->due_ns % RESPAWN_NS_PER_S;
+	if (r->due_ns == 0)
+		its.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return false;
+
+	r->pending = true;
+	return true;
+}
+
+
+/*
+ * The timer fired.  Returns true if the restart it was armed for is still wanted.
+ */
+bool
+respawn_expired(struct respawn *r)
+{
+	uint64_t expirations;
+
+	assert(r != NULL);
+
+	if (r->timer_fd < 0 || read(r->timer_fd, &expirations, sizeof expirations) < 0)
+		return false;
+
+	if (!r->pending)
+		return false;
+
+	r->pending = false;
+	return true;
+}
+
+
+void
+respawn_cancel(struct respawn *r)
+{
+	struct itimerspec its = {};
+
+	assert(r != NULL);
+
+	if (r->pending && r->timer_fd >= 0)
+		timerfd_settime(r->timer_fd, 0, &its, NULL);
+
+	r->pending = false;
+}
+
+
+/*
+ * The service was restarted or stopped on request: its crashes no longer count.
+ */
+void
+respawn_reset(struct respawn *r)
+{
+	assert(r != NULL);
+
+	respawn_cancel(r);
+
+	r->attempt = 0;
+	r->delay_ms = 0;
+	r->crash_head = 0;
+	r->crash_count = 0;
+	r->gave_up = false;
+}
+
+
+void
+respawn_free(struct respawn *r)
+{
+	assert(r != NULL);
+
+	respawn_cancel(r);
+
+	if (r->timer_fd >= 0)
+	{
+		close(r->timer_fd);
+		r->timer_fd = -1;
+	}
+
+	free(r->crash_ns);
+	r->crash_ns = NULL;
+	r->crash_count = 0;
+}
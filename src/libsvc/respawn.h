@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_RESPAWN_H
+#define LIBSVC_RESPAWN_H
+
+
+/*
+ * When to restart a service which exited on its own.  The first restart comes after delay
+ * seconds, and each further one without a healthy run in between waits twice as long as
+ * the last, up to delay_max seconds, less a random share of up to jitter percent so that
+ * services which failed together do not come back in lockstep.
+ */
+struct respawn_policy {
+	int delay;
+	int delay_max;
+	int jitter;
+
+	/* give up once more than max crashes fall within period seconds; 0 for no limit or ever */
+	int max;
+	int period;
+
+	/* a run lasting this many seconds starts the backoff over */
+	int healthy;
+};
+
+/* shortest delay once backing off, so that respawn-delay=0 still grows */
+#define RESPAWN_BACKOFF_MIN_MS	100
+
+/* largest crash budget, which bounds the crash times kept */
+#define RESPAWN_MAX_LIMIT	1000
+
+
+struct respawn {
+	struct respawn_policy policy;
+
+	/* crashes since the last healthy run, and the delay chosen after the last one */
+	int attempt;
+	uint64_t delay_ms;
+
+	/* CLOCK_MONOTONIC times of the last policy.max crashes, oldest at crash_head */
+	uint64_t *crash_ns;
+	size_t crash_head;
+	size_t crash_count;
+
+	/* a restart is due at due_ns, when timer_fd becomes readable */
+	bool pending;
+	uint64_t due_ns;
+	int timer_fd;
+
+	bool gave_up;
+
+	uint64_t rng;
+};
+
+
+void respawn_init(struct respawn *r);
+uint64_t respawn_now(void);
+bool respawn_crashed(struct respawn *r, uint64_t now_ns, uint64_t ran_ns);
+size_t respawn_window(const struct respawn *r, uint64_t now_ns);
+bool respawn_arm(struct respawn *r, uint64_t now_ns);
+bool respawn_expired(struct respawn *r);
+void respawn_cancel(struct respawn *r);
+void respawn_reset(struct respawn *r);
+void respawn_free(struct respawn *r);
+
+
+#endif
@@ -0,0 +1,112 @@
+/* byte ring buffer */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libsvc/ringbuf.h"
+
+
+/*
+ * Allocate a ring of at least size bytes, rounded up to a power of two so that
+ * offsets map to positions with a mask.
+ */
+bool
+ringbuf_init(struct ringbuf *rb, size_t size)
+{
+	size_t rounded = 1;
+
+	assert(rb != NULL);
+	assert(size > 0);
+
+	while (rounded < size)
+		rounded <<= 1;
+
+	rb->data = malloc(rounded);
+	rb->size = rounded;
+	rb->end = 0;
+
+	return rb->data != NULL;
+}
+
+
+void
+ringbuf_free(struct ringbuf *rb)
+{
+	assert(rb != NULL);
+
+	free(rb->data);
+	memset(rb, 0, sizeof *rb);
+}
+
+
+void
+ringbuf_write(struct ringbuf *rb, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t pos, first;
+
+	assert(rb != NULL);
+
+	/* only the tail of an oversized write can survive anyway */
+	if (len > rb->size)
+	{
+		rb->end += len - rb->size;
+		p += len - rb->size;
+		len = rb->size;
+	}
+
+	pos = rb->end & (rb->size - 1);
+	first = rb->size - pos < len ? rb->size - pos : len;
+
+	memcpy(rb->data + pos, p, first);
+	memcpy(rb->data, p + first, len - first);
+
+	rb->end += len;
+}
+
+
+/*
+ * The oldest offset still held by the ring.
+ */
+uint64_t
+ringbuf_start(const struct ringbuf *rb)
+{
+	return rb->end > rb->size ? rb->end - rb->size : 0;
+}
+
+
+/*
+ * Copy up to len bytes starting at *offset.  If *offset has already been overwritten it is
+ * moved forward to the oldest byte still held.  *offset is advanced past the bytes copied.
+ */
+size_t
+ringbuf_read(const struct ringbuf *rb, uint64_t *offset, void *buf, size_t len)
+{
+	char *p = buf;
+	size_t pos, first;
+
+	assert(rb != NULL);
+	assert(offset != NULL);
+
+	if (*offset < ringbuf_start(rb))
+		*offset = ringbuf_start(rb);
+
+	if (*offset >= rb->end)
+		return 0;
+
+	if (len > rb->end - *offset)
+		len = rb->end - *offset;
+
+	pos = *offset & (rb->size - 1);
+	first = rb->size - pos < len ? rb->size - pos : len;
+
+	memcpy(p, rb->data + pos, first);
+	memcpy(p + first, rb->data, len - first);
+
+	*offset += len;
+	return len;
+}
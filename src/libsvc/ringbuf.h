@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#ifndef LIBSVC_RINGBUF_H
+#define LIBSVC_RINGBUF_H
+
+
+/*
+ * A byte ring which keeps the most recent size bytes written to it.  Positions are
+ * absolute offsets into everything ever written, so readers can resume where they left
+ * off and tell when data they wanted has already been overwritten.
+ */
+struct ringbuf {
+	char *data;
+	size_t size;
+
+	uint64_t end;
+};
+
+
+bool ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_free(struct ringbuf *rb);
+void ringbuf_write(struct ringbuf *rb, const void *buf, size_t len);
+size_t ringbuf_read(const struct ringbuf *rb, uint64_t *offset, void *buf, size_t len);
+uint64_t ringbuf_start(const struct ringbuf *rb);
+
+
+#endif
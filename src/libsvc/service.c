@@ -0,0 +1,398 @@
+/* service definition helpers */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <nv.h>
+
+
+#include "libsvc/common.h"
+#include "libsvc/inifile.h"
+#include "libsvc/inischema.h"
+#include "libsvc/logcapture.h"
+#include "libsvc/service.h"
+
+
+/*
+ * Initialize a service with default settings.
+ */
+void
+service_init(struct service *svc, const char *name)
+{
+	assert(svc != NULL);
+
+	memset(svc, 0, sizeof *svc);
+	childproc_init(&svc->proc);
+
+	svc->log_keep = 5;
+	svc->listen.watch_fd = -1;
+	svc->spawn_priority = SPAWNLIMIT_NORMAL;
+	cgroup_limits_init(&svc->limits);
+
+	if (name != NULL)
+		svc->name = strdup(name);
+}
+
+
+static bool
+service_decode_command(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	argv_t *argv = field;
+
+	argv_free(argv);
+
+	if (!argv_split(argv, value) || argv_count(argv) == 0)
+	{
+		snprintf(errbuf, errbuf_len, "could not parse command line '%s'", value);
+		return false;
+	}
+
+	return true;
+}
+
+
+/* lists of service names may be split over several lines */
+static bool
+service_decode_names(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	argv_t names = {};
+
+	if (!argv_split(&names, value))
+	{
+		snprintf(errbuf, errbuf_len, "could not parse service names '%s'", value);
+		return false;
+	}
+
+	for (int i = 0; i < argv_count(&names); i++)
+		argv_append(field, names.argv[i]);
+
+	argv_free(&names);
+	return true;
+}
+
+
+static bool
+service_decode_size(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!logcapture_parse_size(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected a size such as 512K or 10M");
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool
+service_decode_stop_sequence(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!childproc_stop_parse(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected a sequence such as TERM:3,KILL");
+		return false;
+	}
+
+	return true;
+}
+
+
+/* one socket per line, so that several may be declared */
+static bool
+service_decode_listen(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	return listener_parse(field, value, errbuf, errbuf_len);
+}
+
+
+static bool
+service_decode_start(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!strcmp(value, "always"))
+		*(bool *) field = false;
+	else if (!strcmp(value, "on-demand"))
+		*(bool *) field = true;
+	else
+	{
+		snprintf(errbuf, errbuf_len, "expected always or on-demand");
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool
+service_decode_ready(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!notify_parse(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected none, notify, or fd: and a descriptor number from 3 to 1023");
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool
+service_decode_cpu_max(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!cgroup_parse_cpu(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected max, a share of one CPU such as 50%%, or a quota and period in microseconds");
+		return false;
+	}
+
+	return true;
+}
+
+
+/* one device per line, as io.max takes them */
+static bool
+service_decode_io_max(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	return cgroup_parse_io(field, value, errbuf, errbuf_len);
+}
+
+
+static bool
+service_decode_memory(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!cgroup_parse_memory(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected max or a size such as 512M");
+		return false;
+	}
+
+	return true;
+}
+
+
+static bool
+service_decode_spawn_priority(void *field, const char *value, char *errbuf, size_t errbuf_len)
+{
+	if (!spawnlimit_class_parse(field, value))
+	{
+		snprintf(errbuf, errbuf_len, "expected critical, high, normal or low");
+		return false;
+	}
+
+	return true;
+}
+
+
+#define SERVICE_FIELD(key, type, member)		{key, type, offsetof(struct service, member), 0, 0, NULL}
+#define SERVICE_FIELD_INT(key, member, min, max)	{key, INISCHEMA_INT, offsetof(struct service, member), min, max, NULL}
+#define SERVICE_FIELD_FUNC(key, member, fn)		{key, INISCHEMA_FUNC, offsetof(struct service, member), 0, 0, fn}
+
+static const struct inischema_field service_schema_fields[] = {
+	SERVICE_FIELD_FUNC("after", after, service_decode_names),
+	SERVICE_FIELD_FUNC("before", before, service_decode_names),
+	SERVICE_FIELD("chdir", INISCHEMA_STRING, proc.dir_chdir),
+	SERVICE_FIELD("chroot", INISCHEMA_STRING, proc.dir_chroot),
+	SERVICE_FIELD_FUNC("command", argv, service_decode_command),
+	SERVICE_FIELD_FUNC("cpu-max", limits, service_decode_cpu_max),
+	SERVICE_FIELD("group", INISCHEMA_GROUP, proc.child_gid),
+	SERVICE_FIELD_INT("idle-timeout", idle_timeout, 0, 86400),
+	SERVICE_FIELD_FUNC("io-max", limits, service_decode_io_max),
+	SERVICE_FIELD_INT("kill-delay", proc.kill_delay, 0, 86400),
+	SERVICE_FIELD_FUNC("listen", listen, service_decode_listen),
+	SERVICE_FIELD_FUNC("log-buffer-size", log_buffer_size, service_decode_size),
+	SERVICE_FIELD_INT("log-keep", log_keep, 0, 1000),
+	SERVICE_FIELD_FUNC("log-max-size", log_max_size, service_decode_size),
+	SERVICE_FIELD_FUNC("memory-high", limits.memory_high, service_decode_memory),
+	SERVICE_FIELD_FUNC("memory-max", limits.memory_max, service_decode_memory),
+	SERVICE_FIELD("name", INISCHEMA_STRING, name),
+	SERVICE_FIELD_FUNC("needs", needs, service_decode_names),
+	SERVICE_FIELD_FUNC("ready", ready, service_decode_ready),
+	SERVICE_FIELD_INT("respawn-delay", proc.respawn.policy.delay, 0, 86400),
+	SERVICE_FIELD_INT("respawn-delay-max", proc.respawn.policy.delay_max, 0, 86400),
+	SERVICE_FIELD_INT("respawn-healthy", proc.respawn.policy.healthy, 0, 86400),
+	SERVICE_FIELD_INT("respawn-jitter", proc.respawn.policy.jitter, 0, 100),
+	SERVICE_FIELD_INT("respawn-max", proc.respawn.policy.max, 0, RESPAWN_MAX_LIMIT),
+	SERVICE_FIELD_INT("respawn-period", proc.respawn.policy.period, 0, INT_MAX),
+	SERVICE_FIELD_FUNC("spawn-priority", spawn_priority, service_decode_spawn_priority),
+	SERVICE_FIELD_FUNC("start", on_demand, service_decode_start),
+	SERVICE_FIELD("stderr", INISCHEMA_STRING, stderr_path),
+	SERVICE_FIELD("stdout", INISCHEMA_STRING, stdout_path),
+	SERVICE_FIELD_FUNC("stop-sequence", proc, service_decode_stop_sequence),
+	SERVICE_FIELD("umask", INISCHEMA_MODE, proc.child_umask),
+	SERVICE_FIELD("user", INISCHEMA_USER, proc.child_uid),
+	SERVICE_FIELD_FUNC("wants", wants, service_decode_names),
+};
+
+static struct inischema service_schema;
+
+
+/*
+ * Built before main() runs, so that a broken schema is caught however a program uses
+ * libsvc, and loader threads can share it without locking.
+ */
+static void __attribute__((constructor))
+service_schema_init(void)
+{
+	char errbuf[128];
+
+	if (!inischema_init(&service_schema, "service", service_schema_fields, ARRAY_SIZE(service_schema_fields), errbuf, sizeof errbuf))
+	{
+		fprintf(stderr, "service_schema_fields: %s\n", errbuf);
+		abort();
+	}
+}
+
+
+/*
+ * Derive a default service name from the service file path, e.g. /etc/svc/sshd.ini -> sshd.
+ */
+static char *
+service_name_from_path(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *name, *dot;
+
+	name = strdup(base != NULL ? base + 1 : path);
+
+	dot = strrchr(name, '.');
+	if (dot != NULL && dot != name)
+		*dot = 0;
+
+	return name;
+}
+
+
+/*
+ * Decode a service file, straight from the file or from the copy in the cache.
+ */
+static bool
+service_decode(struct service *svc, const char *path, const struct service_loader *loader, struct inifile_error *err)
+{
+	struct inicache *cache = loader != NULL ? loader->cache : NULL;
+	struct idcache *ids = loader != NULL ? loader->ids : NULL;
+	struct inifile_map map;
+	nvlist_t *nvl;
+	bool ret;
+
+	/* on failure, decode the file itself to say where the problem is */
+	if (cache != NULL && (nvl = inicache_load(cache, path, err)) != NULL)
+	{
+		ret = inischema_decode_nvlist(&service_schema, nvl, svc, ids, err);
+		nvlist_destroy(nvl);
+
+		if (ret)
+			return true;
+
+		service_free(svc);
+		service_init(svc, NULL);
+		svc->path = strdup(path);
+	}
+
+	if (!inifile_map(&map, path))
+	{
+		snprintf(err->message, sizeof err->message, "could not open service file: %s", strerror(errno));
+		err->line = 0;
+		return false;
+	}
+
+	ret = inischema_decode(&service_schema, map.data, map.len, svc, ids, err);
+	inifile_unmap(&map);
+
+	return ret;
+}
+
+
+/*
+ * Load a service definition from the [service] section of an INI file, using what
+ * loader provides unless it is NULL.  On failure, a description of the problem is
+ * written to errbuf.
+ */
+bool
+service_load(struct service *svc, const char *path, const struct service_loader *loader, char *errbuf, size_t errbuf_len)
+{
+	struct inifile_error err;
+
+	assert(svc != NULL);
+	assert(path != NULL);
+
+	service_init(svc, NULL);
+	svc->path = strdup(path);
+
+	if (!service_decode(svc, path, loader, &err))
+	{
+		if (err.line == 0)
+			snprintf(errbuf, errbuf_len, "%s", err.message);
+		else
+			snprintf(errbuf, errbuf_len, "line %u, column %u: %s", err.line, err.column, err.message);
+
+		return false;
+	}
+
+	if (argv_count(&svc->argv) == 0)
+	{
+		snprintf(errbuf, errbuf_len, "command: missing");
+		return false;
+	}
+
+	/* the sockets take descriptors 3, 4, ... */
+	if (svc->ready.type == NOTIFY_FD && svc->ready.fd < 3 + (int) svc->listen.count)
+	{
+		snprintf(errbuf, errbuf_len, "ready: descriptor %d is taken by a listen socket", svc->ready.fd);
+		return false;
+	}
+
+	if (svc->on_demand && svc->listen.count == 0)
+	{
+		snprintf(errbuf, errbuf_len, "start: on-demand needs a listen socket to wait on");
+		return false;
+	}
+
+	if (svc->name == NULL)
+		svc->name = service_name_from_path(path);
+
+	svc->proc.prog_name = svc->argv.argv[0];
+	svc->proc.prog_argv = svc->argv.argv;
+
+	return true;
+}
+
+
+/*
+ * Release memory owned by a service definition.
+ */
+void
+service_free(struct service *svc)
+{
+	assert(svc != NULL);
+
+	free(svc->name);
+	free(svc->path);
+	free(svc->stdout_path);
+	free(svc->stderr_path);
+	free(svc->proc.dir_chdir);
+	free(svc->proc.dir_chroot);
+
+	argv_free(&svc->argv);
+	argv_free(&svc->needs);
+	argv_free(&svc->wants);
+	argv_free(&svc->before);
+	argv_free(&svc->after);
+	listener_free(&svc->listen);
+	free(svc->proc.listen_fdnames);
+	respawn_free(&svc->proc.respawn);
+	cgroup_limits_free(&svc->limits);
+
+	svc->name = NULL;
+	svc->path = NULL;
+	svc->stdout_path = NULL;
+	svc->stderr_path = NULL;
+	svc->proc.dir_chdir = NULL;
+	svc->proc.dir_chroot = NULL;
+	svc->proc.prog_name = NULL;
+	svc->proc.prog_argv = NULL;
+	svc->proc.listen_fdnames = NULL;
+}
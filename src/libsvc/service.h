@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_SERVICE_H
+#define LIBSVC_SERVICE_H
+
+#include "libsvc/argv.h"
+#include "libsvc/cgroup.h"
+#include "libsvc/childproc.h"
+#include "libsvc/inicache.h"
+#include "libsvc/listener.h"
+#include "libsvc/notify.h"
+#include "libsvc/spawnlimit.h"
+#include "libsvc/uidgid.h"
+
+
+struct service {
+	char *name;
+	char *path;
+
+	argv_t argv;
+
+	char *stdout_path;
+	char *stderr_path;
+
+	off_t log_max_size;
+	int log_keep;
+	off_t log_buffer_size;
+
+	/* how the service says it is ready, if it does */
+	struct notify_config ready;
+
+	/* sockets bound by the supervisor and passed to the service from descriptor 3 on */
+	struct listener_set listen;
+
+	/* start on the first client rather than at once, and stop after idle_timeout seconds without one */
+	bool on_demand;
+	int idle_timeout;
+
+	/* set on the service's cgroup, if it is given one */
+	struct cgroup_limits limits;
+
+	/* place in the queue for the host-wide spawn limit, if there is one */
+	spawnlimit_class_t spawn_priority;
+
+	/* names of other services this one depends on or is ordered against */
+	argv_t needs;
+	argv_t wants;
+	argv_t before;
+	argv_t after;
+
+	struct childproc proc;
+};
+
+
+/* what service_load() may share between loads; either may be NULL */
+struct service_loader {
+	struct inicache *cache;
+	struct idcache *ids;
+};
+
+
+void service_init(struct service *svc, const char *name);
+bool service_load(struct service *svc, const char *path, const struct service_loader *loader, char *errbuf, size_t errbuf_len);
+void service_free(struct service *svc);
+
+
+#endif
@@ -1,7 +1,33 @@
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
 
+#include "libsvc/common.h"
+#include "libsvc/signal.h"
+
+
+static const struct {
+	const char *name;
+	int signo;
+} signal_names[] = {
+	{"ABRT", SIGABRT},
+	{"ALRM", SIGALRM},
+	{"CONT", SIGCONT},
+	{"HUP", SIGHUP},
+	{"INT", SIGINT},
+	{"KILL", SIGKILL},
+	{"PWR", SIGPWR},
+	{"QUIT", SIGQUIT},
+	{"STOP", SIGSTOP},
+	{"TERM", SIGTERM},
+	{"USR1", SIGUSR1},
+	{"USR2", SIGUSR2},
+	{"WINCH", SIGWINCH},
+};
+
 
 void
 signal_block(void)
@@ -27,3 +53,29 @@ signal_unblock(void)
 	if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
 		abort();
 }
+
+
+/*
+ * Parse a signal given by name (with or without the SIG prefix) or by number.
+ * Returns -1 if the signal is not known.
+ */
+int
+signal_parse(const char *name)
+{
+	if (isdigit((unsigned char) *name))
+	{
+		char *end;
+		long signo = strtol(name, &end, 10);
+
+		return (*end || signo < 1 || signo >= NSIG) ? -1 : (int) signo;
+	}
+
+	if (!strncasecmp(name, "SIG", 3))
+		name += 3;
+
+	for (size_t i = 0; i < ARRAY_SIZE(signal_names); i++)
+		if (!strcasecmp(name, signal_names[i].name))
+			return signal_names[i].signo;
+
+	return -1;
+}
@@ -6,5 +6,6 @@
 
 void signal_block(void);
 void signal_unblock(void);
+int signal_parse(const char *name);
 
 #endif
@@ -0,0 +1,419 @@
+/* host-wide spawn rate limit, shared between supervisors */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#include "libsvc/spawnlimit.h"
+
+
+/* how long a queued start keeps its place beyond the retry it was told to make */
+#define SPAWNLIMIT_LEASE_NS	1000000000ULL
+
+
+static const char *spawnlimit_class_names[SPAWNLIMIT_CLASS_COUNT] = {
+	[SPAWNLIMIT_CRITICAL] = "critical",
+	[SPAWNLIMIT_HIGH] = "high",
+	[SPAWNLIMIT_NORMAL] = "normal",
+	[SPAWNLIMIT_LOW] = "low",
+};
+
+
+bool
+spawnlimit_class_parse(spawnlimit_class_t *class, const char *text)
+{
+	for (int i = 0; i < SPAWNLIMIT_CLASS_COUNT; i++)
+	{
+		if (!strcmp(text, spawnlimit_class_names[i]))
+		{
+			*class = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+const char *
+spawnlimit_class_name(spawnlimit_class_t class)
+{
+	return class < SPAWNLIMIT_CLASS_COUNT ? spawnlimit_class_names[class] : "unknown";
+}
+
+
+static void
+spawnlimit_lock(struct spawnlimit_page *page)
+{
+	/* every field is consistent between stores, so a dead owner left nothing half done */
+	if (pthread_mutex_lock(&page->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&page->lock);
+}
+
+
+static void
+spawnlimit_unlock(struct spawnlimit_page *page)
+{
+	pthread_mutex_unlock(&page->lock);
+}
+
+
+static bool
+spawnlimit_page_init(struct spawnlimit_page *page)
+{
+	pthread_mutexattr_t attr;
+	bool ok;
+
+	memset(page, 0, sizeof *page);
+
+	page->version = SPAWNLIMIT_VERSION;
+	page->page_size = sizeof *page;
+	page->rate = SPAWNLIMIT_DEFAULT_RATE;
+	page->burst = SPAWNLIMIT_DEFAULT_BURST;
+
+	if (pthread_mutexattr_init(&attr) != 0)
+		return false;
+
+	ok = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+		pthread_mutex_init(&page->lock, &attr) == 0;
+
+	pthread_mutexattr_destroy(&attr);
+
+	if (ok)
+		__atomic_store_n(&page->magic, SPAWNLIMIT_MAGIC, __ATOMIC_RELEASE);
+
+	return ok;
+}
+
+
+/*
+ * Map the spawn limit page at path, creating it if it does not exist.  With a nonzero
+ * rate the limit is set to rate starts per second and burst saved up; otherwise the
+ * limit already in the page is kept.  A rate above SPAWNLIMIT_RATE_MAX fails with
+ * EINVAL.
+ */
+bool
+spawnlimit_open(struct spawnlimit *sl, const char *path, unsigned int rate, unsigned int burst)
+{
+	struct spawnlimit_page *page;
+	struct stat st;
+	int fd;
+
+	assert(sl != NULL);
+	assert(path != NULL);
+
+	memset(sl, 0, sizeof *sl);
+
+	if (rate > SPAWNLIMIT_RATE_MAX)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+
+	/* held only while the page may be initialized, so that two first openers do not both do it */
+	if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+		goto fail;
+
+	if (st.st_size == 0 && ftruncate(fd, sizeof *page) < 0)
+		goto fail;
+
+	if (st.st_size != 0 && st.st_size != sizeof *page)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	page = mmap(NULL, sizeof *page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		goto fail;
+
+	if ((st.st_size == 0 && !spawnlimit_page_init(page)) ||
+		__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != SPAWNLIMIT_MAGIC ||
+		page->version != SPAWNLIMIT_VERSION || page->page_size != sizeof *page)
+	{
+		munmap(page, sizeof *page);
+		errno = EINVAL;
+		goto fail;
+	}
+
+	/* the mapping keeps the open file alive, and with it the lock, unless it is dropped */
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	sl->page = page;
+	sl->pid = getpid();
+
+	if (rate > 0)
+	{
+		spawnlimit_lock(page);
+		page->rate = rate;
+		page->burst = burst > 0 ? burst : 1;
+		spawnlimit_unlock(page);
+	}
+
+	return true;
+
+fail:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return false;
+}
+
+
+void
+spawnlimit_ticket_init(struct spawnlimit_ticket *t)
+{
+	assert(t != NULL);
+
+	t->slot = -1;
+	t->since_ns = 0;
+}
+
+
+static bool
+spawnlimit_waiter_live(const struct spawnlimit_waiter *w, uint64_t now_ns)
+{
+	return w->pid != 0 && w->expires_ns > now_ns;
+}
+
+
+/* whether t still holds its slot, which expires if it is not retried in time */
+static bool
+spawnlimit_owns(const struct spawnlimit *sl, const struct spawnlimit_ticket *t)
+{
+	const struct spawnlimit_waiter *w;
+
+	if (t->slot < 0)
+		return false;
+
+	w = &sl->page->waiters[t->slot];
+	return w->pid == sl->pid && w->since_ns == t->since_ns;
+}
+
+
+/*
+ * Whether a live queued start comes before t: one of a higher priority, or of the same
+ * priority which was queued earlier.
+ */
+static bool
+spawnlimit_behind(const struct spawnlimit *sl, const struct spawnlimit_ticket *t, spawnlimit_class_t class, uint64_t now_ns)
+{
+	for (int i = 0; i < SPAWNLIMIT_WAITERS_MAX; i++)
+	{
+		const struct spawnlimit_waiter *w = &sl->page->waiters[i];
+
+		if (i == t->slot || !spawnlimit_waiter_live(w, now_ns))
+			continue;
+
+		if (w->class < class || (w->class == class && w->since_ns < t->since_ns))
+			return true;
+	}
+
+	return false;
+}
+
+
+static void
+spawnlimit_queue(struct spawnlimit *sl, struct spawnlimit_ticket *t, spawnlimit_class_t class, uint64_t expires_ns, uint64_t now_ns)
+{
+	struct spawnlimit_waiter *waiters = sl->page->waiters;
+
+	if (!spawnlimit_owns(sl, t))
+	{
+		t->slot = -1;
+
+		for (int i = 0; i < SPAWNLIMIT_WAITERS_MAX; i++)
+		{
+			if (!spawnlimit_waiter_live(&waiters[i], now_ns))
+			{
+				t->slot = i;
+				break;
+			}
+		}
+
+		if (t->slot < 0)
+			return;
+	}
+
+	waiters[t->slot] = (struct spawnlimit_waiter) {
+		.pid = sl->pid,
+		.class = class,
+		.since_ns = t->since_ns,
+		.expires_ns = expires_ns,
+	};
+}
+
+
+static void
+spawnlimit_dequeue(struct spawnlimit *sl, struct spawnlimit_ticket *t)
+{
+	if (spawnlimit_owns(sl, t))
+		sl->page->waiters[t->slot] = (struct spawnlimit_waiter) {};
+
+	spawnlimit_ticket_init(t);
+}
+
+
+/*
+ * Try to take a token for a start of the given priority at now_ns.  Returns 0 if it was
+ * taken, else the number of nanoseconds after which to try again; until then the start
+ * is queued, and keeps its place as long as it is retried.
+ */
+uint64_t
+spawnlimit_acquire(struct spawnlimit *sl, struct spawnlimit_ticket *t, spawnlimit_class_t class, uint64_t now_ns)
+{
+	struct spawnlimit_page *page;
+	struct spawnlimit_metrics *m;
+	uint64_t interval, allowance, wait = 0;
+
+	assert(sl != NULL);
+	assert(t != NULL);
+
+	if ((page = sl->page) == NULL)
+		return 0;
+
+	if (class >= SPAWNLIMIT_CLASS_COUNT)
+		class = SPAWNLIMIT_NORMAL;
+
+	spawnlimit_lock(page);
+
+	if (t->since_ns == 0)
+		t->since_ns = now_ns;
+
+	/* a rate no opener would set is taken as no limit rather than trusted */
+	if (page->rate > 0 && page->rate <= SPAWNLIMIT_RATE_MAX)
+	{
+		interval = 1000000000ULL / page->rate;
+		allowance = (page->burst > 0 ? page->burst - 1 : 0) * interval;
+
+		if (class == SPAWNLIMIT_CRITICAL)
+			wait = 0;
+		else if (page->tat_ns > now_ns + allowance)
+			wait = page->tat_ns - allowance - now_ns;
+		else if (spawnlimit_behind(sl, t, class, now_ns))
+			wait = interval;
+
+		if (wait > 0)
+		{
+			spawnlimit_queue(sl, t, class, now_ns + wait + SPAWNLIMIT_LEASE_NS, now_ns);
+			spawnlimit_unlock(page);
+
+			return wait;
+		}
+
+		page->tat_ns = (page->tat_ns > now_ns ? page->tat_ns : now_ns) + interval;
+	}
+
+	m = &page->metrics[class];
+	m->granted++;
+
+	if (now_ns > t->since_ns)
+	{
+		uint64_t waited = now_ns - t->since_ns;
+
+		m->waited++;
+		m->wait_ns_total += waited;
+		if (waited > m->wait_ns_max)
+			m->wait_ns_max = waited;
+	}
+
+	spawnlimit_dequeue(sl, t);
+	spawnlimit_unlock(page);
+
+	return 0;
+}
+
+
+/*
+ * Give up a queued start, e.g. because the service is being stopped.
+ */
+void
+spawnlimit_cancel(struct spawnlimit *sl, struct spawnlimit_ticket *t)
+{
+	assert(sl != NULL);
+	assert(t != NULL);
+
+	if (sl->page == NULL)
+	{
+		spawnlimit_ticket_init(t);
+		return;
+	}
+
+	spawnlimit_lock(sl->page);
+	spawnlimit_dequeue(sl, t);
+	spawnlimit_unlock(sl->page);
+}
+
+
+/*
+ * Take a snapshot of the limit, the tokens saved up at now_ns, and the counters and
+ * queue depth of each priority.
+ */
+bool
+spawnlimit_stats(struct spawnlimit *sl, uint64_t now_ns, struct spawnlimit_stats *stats)
+{
+	struct spawnlimit_page *page;
+
+	assert(sl != NULL);
+	assert(stats != NULL);
+
+	memset(stats, 0, sizeof *stats);
+
+	if ((page = sl->page) == NULL)
+		return false;
+
+	spawnlimit_lock(page);
+
+	stats->rate = page->rate;
+	stats->burst = page->burst;
+
+	if (page->rate > 0 && page->rate <= SPAWNLIMIT_RATE_MAX)
+	{
+		uint64_t interval = 1000000000ULL / page->rate;
+		uint64_t full = now_ns + page->burst * interval;
+
+		/* the bucket is full once tat_ns is burst intervals in the past */
+		stats->tokens = page->tat_ns < full ? (full - (page->tat_ns > now_ns ? page->tat_ns : now_ns)) / interval : 0;
+		if (stats->tokens > page->burst)
+			stats->tokens = page->burst;
+	}
+
+	for (int i = 0; i < SPAWNLIMIT_CLASS_COUNT; i++)
+		stats->classes[i].metrics = page->metrics[i];
+
+	for (int i = 0; i < SPAWNLIMIT_WAITERS_MAX; i++)
+		if (spawnlimit_waiter_live(&page->waiters[i], now_ns) && page->waiters[i].class < SPAWNLIMIT_CLASS_COUNT)
+			stats->classes[page->waiters[i].class].queued++;
+
+	spawnlimit_unlock(page);
+
+	return true;
+}
+
+
+void
+spawnlimit_close(struct spawnlimit *sl)
+{
+	assert(sl != NULL);
+
+	if (sl->page != NULL)
+		munmap(sl->page, sizeof *sl->page);
+
+	sl->page = NULL;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_SPAWNLIMIT_H
+#define LIBSVC_SPAWNLIMIT_H
+
+
+/*
+ * A spawn limit is a token bucket shared by every supervisor on the host through a small
+ * file, normally under /run, which each of them maps.  A child is only started once a
+ * token is taken; tokens come at rate per second and up to burst are saved up.  Starts
+ * which find none are queued, by priority and then in the order they arrived, and retried
+ * when the next token is due.  Critical starts skip the queue and are never held back,
+ * though the tokens they take still delay everyone else.
+ *
+ * The page also counts, for each priority, how many starts were granted and how long
+ * those which had to wait waited.
+ */
+#define SPAWNLIMIT_MAGIC	0x5356534c	/* "SVSL" */
+#define SPAWNLIMIT_VERSION	1
+
+/* starts which may be queued at once; further ones wait unordered */
+#define SPAWNLIMIT_WAITERS_MAX	256
+
+#define SPAWNLIMIT_DEFAULT_RATE		20
+#define SPAWNLIMIT_DEFAULT_BURST	8
+
+/* at most one start per nanosecond, the resolution the limit is kept in */
+#define SPAWNLIMIT_RATE_MAX		1000000000
+
+
+typedef enum spawnlimit_class_e {
+	SPAWNLIMIT_CRITICAL,
+	SPAWNLIMIT_HIGH,
+	SPAWNLIMIT_NORMAL,
+	SPAWNLIMIT_LOW,
+	SPAWNLIMIT_CLASS_COUNT
+} spawnlimit_class_t;
+
+
+struct spawnlimit_metrics {
+	uint64_t granted;
+	uint64_t waited;
+	uint64_t wait_ns_total;
+	uint64_t wait_ns_max;
+};
+
+
+/* a queued start, forgotten once expires_ns passes without it being retried */
+struct spawnlimit_waiter {
+	int32_t pid;
+	uint32_t class;
+	uint64_t since_ns;
+	uint64_t expires_ns;
+};
+
+
+struct spawnlimit_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t page_size;
+
+	/* starts per second, 0 for no limit, and how many may be saved up */
+	uint32_t rate;
+	uint32_t burst;
+
+	/* CLOCK_MONOTONIC time at which the bucket is next empty, as in GCRA */
+	uint64_t tat_ns;
+
+	/* robust and process-shared, so that a supervisor dying with it held does not wedge the rest */
+	pthread_mutex_t lock;
+
+	struct spawnlimit_metrics metrics[SPAWNLIMIT_CLASS_COUNT];
+	struct spawnlimit_waiter waiters[SPAWNLIMIT_WAITERS_MAX];
+};
+
+
+struct spawnlimit {
+	struct spawnlimit_page *page;
+	pid_t pid;
+};
+
+
+/* one start's place in the queue; zeroed with slot -1 when not queued */
+struct spawnlimit_ticket {
+	int slot;
+	uint64_t since_ns;
+};
+
+
+/* what spawnlimit_stats() reports for one priority */
+struct spawnlimit_class_stats {
+	struct spawnlimit_metrics metrics;
+	uint32_t queued;
+};
+
+struct spawnlimit_stats {
+	uint32_t rate;
+	uint32_t burst;
+	uint32_t tokens;
+
+	struct spawnlimit_class_stats classes[SPAWNLIMIT_CLASS_COUNT];
+};
+
+
+bool spawnlimit_class_parse(spawnlimit_class_t *class, const char *text);
+const char *spawnlimit_class_name(spawnlimit_class_t class);
+
+bool spawnlimit_open(struct spawnlimit *sl, const char *path, unsigned int rate, unsigned int burst);
+void spawnlimit_ticket_init(struct spawnlimit_ticket *t);
+uint64_t spawnlimit_acquire(struct spawnlimit *sl, struct spawnlimit_ticket *t, spawnlimit_class_t class, uint64_t now_ns);
+void spawnlimit_cancel(struct spawnlimit *sl, struct spawnlimit_ticket *t);
+bool spawnlimit_stats(struct spawnlimit *sl, uint64_t now_ns, struct spawnlimit_stats *stats);
+void spawnlimit_close(struct spawnlimit *sl);
+
+
+#endif
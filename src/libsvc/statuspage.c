@@ -0,0 +1,291 @@
+/* shared-memory status pages */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#include "libsvc/statuspage.h"
+
+
+/* give up on an entry whose writer appears to have died halfway through an update */
+#define STATUSPAGE_READ_RETRIES	10000
+
+
+static struct statuspage_header *
+statuspage_header(const struct statuspage *sp)
+{
+	return sp->map;
+}
+
+
+/* by the layout validated when the page was mapped, never by what the header says now */
+static struct statuspage_entry *
+statuspage_entry(const struct statuspage *sp, size_t index)
+{
+	return (struct statuspage_entry *) ((char *) sp->map + sp->header_size + index * sp->entry_size);
+}
+
+
+static uint64_t
+statuspage_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+
+/*
+ * Create a status page with room for entry_count services, replacing any page left
+ * behind at path by an earlier supervisor.  The page is built in a new file which is
+ * renamed over the old one, so that readers still mapping that keep a whole page.
+ */
+bool
+statuspage_create(struct statuspage *sp, const char *path, size_t entry_count)
+{
+	struct statuspage_header *hdr;
+	char tmp_path[PATH_MAX];
+	int fd;
+
+	assert(sp != NULL);
+	assert(path != NULL);
+
+	memset(sp, 0, sizeof *sp);
+
+	if ((size_t) snprintf(tmp_path, sizeof tmp_path, "%s.XXXXXX", path) >= sizeof tmp_path)
+		return false;
+
+	sp->header_size = sizeof(struct statuspage_header);
+	sp->entry_size = sizeof(struct statuspage_entry);
+	sp->entry_count = entry_count;
+	sp->map_size = sp->header_size + entry_count * sp->entry_size;
+
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, sp->map_size) < 0)
+		goto fail;
+
+	sp->map = mmap(NULL, sp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sp->map == MAP_FAILED)
+	{
+		sp->map = NULL;
+		goto fail;
+	}
+
+	sp->writable = true;
+
+	hdr = statuspage_header(sp);
+	hdr->version = STATUSPAGE_VERSION;
+	hdr->header_size = sp->header_size;
+	hdr->entry_size = sp->entry_size;
+	hdr->entry_count = entry_count;
+	hdr->supervisor_pid = getpid();
+
+	/* readers check the magic last, so they never see a half-initialized header */
+	__atomic_store_n(&hdr->magic, STATUSPAGE_MAGIC, __ATOMIC_RELEASE);
+
+	if (rename(tmp_path, path) < 0)
+		goto fail;
+
+	close(fd);
+	return true;
+
+fail:
+	close(fd);
+	unlink(tmp_path);
+	statuspage_close(sp);
+
+	return false;
+}
+
+
+/*
+ * Publish the current state of a service into its entry.
+ */
+void
+statuspage_publish(struct statuspage *sp, size_t index, const char *name, const struct childproc *proc)
+{
+	struct statuspage_entry *entry;
+	uint32_t seq;
+
+	assert(sp != NULL);
+	assert(proc != NULL);
+
+	if (sp->map == NULL || !sp->writable || index >= statuspage_count(sp))
+		return;
+
+	entry = statuspage_entry(sp, index);
+
+	/* odd while the update is in progress */
+	seq = entry->seq;
+	__atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->state = proc->state;
+	strncpy(entry->name, name, sizeof entry->name - 1);
+
+	entry->pid = proc->child_pid;
+	entry->exit_pid = proc->exit_pid;
+	entry->exit_status = proc->exit_status;
+	entry->restart_count = proc->restart_count;
+	entry->respawn_last = proc->respawn_last;
+
+	entry->state_changed_ns = statuspage_ns(&proc->state_changed);
+	entry->started_ns = statuspage_ns(&proc->started);
+	entry->ready_ns = statuspage_ns(&proc->ready);
+
+	__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Map an existing status page for reading.  Fails if it is not a status page or was
+ * written with an incompatible layout version.
+ */
+bool
+statuspage_open(struct statuspage *sp, const char *path)
+{
+	struct statuspage_header hdr;
+	uint32_t magic;
+	struct stat st;
+	int fd;
+
+	assert(sp != NULL);
+	assert(path != NULL);
+
+	memset(sp, 0, sizeof *sp);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct statuspage_header))
+	{
+		close(fd);
+		return false;
+	}
+
+	sp->map_size = st.st_size;
+	sp->map = mmap(NULL, sp->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (sp->map == MAP_FAILED)
+	{
+		sp->map = NULL;
+		return false;
+	}
+
+	/* validate one copy of the header, and keep using what was validated */
+	magic = __atomic_load_n(&statuspage_header(sp)->magic, __ATOMIC_ACQUIRE);
+	memcpy(&hdr, statuspage_header(sp), sizeof hdr);
+
+	if (magic != STATUSPAGE_MAGIC || hdr.version != STATUSPAGE_VERSION ||
+		hdr.header_size < sizeof(struct statuspage_header) || hdr.entry_size < offsetof(struct statuspage_entry, pid) ||
+		hdr.header_size + (uint64_t) hdr.entry_count * hdr.entry_size > sp->map_size)
+	{
+		statuspage_close(sp);
+		return false;
+	}
+
+	sp->header_size = hdr.header_size;
+	sp->entry_size = hdr.entry_size;
+	sp->entry_count = hdr.entry_count;
+
+	return true;
+}
+
+
+size_t
+statuspage_count(const struct statuspage *sp)
+{
+	assert(sp != NULL);
+
+	if (sp->map == NULL)
+		return 0;
+
+	return sp->entry_count;
+}
+
+
+/*
+ * Take a consistent snapshot of an entry.  Fields a newer writer appended beyond what
+ * this reader knows are ignored, and fields an older writer did not have read as 0.
+ */
+bool
+statuspage_read(const struct statuspage *sp, size_t index, struct statuspage_entry *entry)
+{
+	const struct statuspage_entry *src;
+	size_t len;
+
+	assert(sp != NULL);
+	assert(entry != NULL);
+
+	if (index >= statuspage_count(sp))
+		return false;
+
+	src = statuspage_entry(sp, index);
+	len = sp->entry_size;
+	if (len > sizeof *entry)
+		len = sizeof *entry;
+
+	for (int tries = 0; tries < STATUSPAGE_READ_RETRIES; tries++)
+	{
+		uint32_t seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		memset(entry, 0, sizeof *entry);
+		memcpy(entry, src, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq)
+		{
+			entry->name[sizeof entry->name - 1] = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * Find a service by name and take a snapshot of its entry.
+ */
+bool
+statuspage_lookup(const struct statuspage *sp, const char *name, struct statuspage_entry *entry)
+{
+	assert(name != NULL);
+
+	for (size_t i = 0; i < statuspage_count(sp); i++)
+		if (statuspage_read(sp, i, entry) && !strcmp(entry->name, name))
+			return true;
+
+	return false;
+}
+
+
+void
+statuspage_close(struct statuspage *sp)
+{
+	assert(sp != NULL);
+
+	if (sp->map != NULL)
+		munmap(sp->map, sp->map_size);
+
+	memset(sp, 0, sizeof *sp);
+}
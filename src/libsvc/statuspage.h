@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#ifndef LIBSVC_STATUSPAGE_H
+#define LIBSVC_STATUSPAGE_H
+
+#include "libsvc/childproc.h"
+
+
+/*
+ * A status page is a file, normally under /run, in which a supervisor publishes the state
+ * of its services.  Readers map it and read entries without any IPC or system call; each
+ * entry is guarded by a sequence counter which is odd while the supervisor is writing it.
+ *
+ * The layout is fixed: a header followed by entry_count entries of entry_size bytes.
+ * New fields are only ever appended to struct statuspage_entry, growing entry_size;
+ * incompatible changes bump STATUSPAGE_VERSION.
+ */
+#define STATUSPAGE_MAGIC	0x53564353	/* "SVCS" */
+#define STATUSPAGE_VERSION	1
+
+#define STATUSPAGE_NAME_MAX	64
+
+
+struct statuspage_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t entry_count;
+	int32_t supervisor_pid;
+};
+
+
+struct statuspage_entry {
+	uint32_t seq;
+	uint32_t state;
+
+	char name[STATUSPAGE_NAME_MAX];
+
+	int32_t pid;
+	int32_t exit_pid;
+	int32_t exit_status;
+	uint32_t restart_count;
+	int64_t respawn_last;
+
+	/* CLOCK_MONOTONIC, in nanoseconds; 0 if it has not happened yet */
+	uint64_t state_changed_ns;
+	uint64_t started_ns;
+	uint64_t ready_ns;
+};
+
+
+struct statuspage {
+	void *map;
+	size_t map_size;
+
+	/* the layout, as checked when the page was mapped; the header is not trusted after */
+	size_t header_size;
+	size_t entry_size;
+	size_t entry_count;
+
+	bool writable;
+};
+
+
+bool statuspage_create(struct statuspage *sp, const char *path, size_t entry_count);
+void statuspage_publish(struct statuspage *sp, size_t index, const char *name, const struct childproc *proc);
+
+bool statuspage_open(struct statuspage *sp, const char *path);
+size_t statuspage_count(const struct statuspage *sp);
+bool statuspage_read(const struct statuspage *sp, size_t index, struct statuspage_entry *entry);
+bool statuspage_lookup(const struct statuspage *sp, const char *name, struct statuspage_entry *entry);
+
+void statuspage_close(struct statuspage *sp);
+
+
+#endif
@@ -0,0 +1,357 @@
+/* parallel loading of a directory of service files */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+
+
+#include "libsvc/common.h"
+#include "libsvc/svcdir.h"
+
+
+/* as returned by getdents64(2) */
+struct svcdir_dirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+
+/*
+ * Finished entries travel from the workers to the loading thread through an intrusive
+ * multi-producer, single-consumer queue (Vyukov's): a push is one atomic exchange and a
+ * store, and a pop takes no lock.  A semaphore counts the entries pushed, so that the
+ * loading thread sleeps while the queue is empty.
+ */
+struct svcdir_queue {
+	struct svcdir_node *head;
+	struct svcdir_node *tail;
+	struct svcdir_node stub;
+
+	sem_t ready;
+};
+
+
+struct svcdir_ctx {
+	struct svcdir_entry *entries;
+	size_t count;
+
+	/* the next entry for a worker to claim */
+	size_t next;
+
+	struct idcache ids;
+	struct service_loader loader;
+
+	struct svcdir_queue queue;
+};
+
+
+static void
+svcdir_queue_init(struct svcdir_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+
+	sem_init(&q->ready, 0, 0);
+}
+
+
+static void
+svcdir_queue_push_node(struct svcdir_queue *q, struct svcdir_node *node)
+{
+	struct svcdir_node *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+
+static void
+svcdir_queue_push(struct svcdir_queue *q, struct svcdir_node *node)
+{
+	svcdir_queue_push_node(q, node);
+	sem_post(&q->ready);
+}
+
+
+/*
+ * Take the oldest node, or NULL if there is none or a push is only half done.
+ */
+static struct svcdir_node *
+svcdir_queue_pop(struct svcdir_queue *q)
+{
+	struct svcdir_node *tail = q->tail;
+	struct svcdir_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub)
+	{
+		if (next == NULL)
+			return NULL;
+
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* tail is the last node: put the stub behind it so that it can be taken */
+	svcdir_queue_push_node(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+static struct svcdir_entry *
+svcdir_queue_wait(struct svcdir_queue *q)
+{
+	struct svcdir_node *node;
+
+	while (sem_wait(&q->ready) < 0)
+		if (errno != EINTR)
+			return NULL;
+
+	/* the push counted may be complete while an earlier one is not */
+	while ((node = svcdir_queue_pop(q)) == NULL)
+		sched_yield();
+
+	return CONTAINER_OF(node, struct svcdir_entry, node);
+}
+
+
+static bool
+svcdir_wanted(const struct svcdir_dirent *d)
+{
+	size_t len;
+
+	if (d->d_type != DT_REG && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+		return false;
+
+	if (d->d_name[0] == '.')
+		return false;
+
+	len = strlen(d->d_name);
+	return len > 4 && !strcmp(d->d_name + len - 4, ".ini");
+}
+
+
+static int
+svcdir_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/*
+ * Collect the *.ini files of the directory, in name order.  getdents64() is used rather
+ * than readdir() to read many entries per call into a large buffer.
+ */
+static bool
+svcdir_scan(struct svcdir_ctx *ctx, const char *path)
+{
+	char buf[32768] __attribute__((aligned(8)));
+	argv_t names = {};
+	bool ret = false;
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	for (;;)
+	{
+		long n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			goto out;
+		}
+
+		if (n == 0)
+			break;
+
+		for (long off = 0; off < n; )
+		{
+			const struct svcdir_dirent *d = (const struct svcdir_dirent *) (buf + off);
+
+			if (svcdir_wanted(d))
+				argv_append(&names, d->d_name);
+
+			off += d->d_reclen;
+		}
+	}
+
+	qsort(names.argv, argv_count(&names), sizeof(char *), svcdir_name_cmp);
+
+	ctx->count = argv_count(&names);
+	ctx->entries = calloc(ctx->count ? ctx->count : 1, sizeof(struct svcdir_entry));
+	if (ctx->entries == NULL)
+		goto out;
+
+	for (size_t i = 0; i < ctx->count; i++)
+	{
+		size_t len = strlen(path) + 1 + strlen(names.argv[i]) + 1;
+
+		if ((ctx->entries[i].path = malloc(len)) == NULL)
+			goto out;
+
+		snprintf(ctx->entries[i].path, len, "%s/%s", path, names.argv[i]);
+	}
+
+	ret = true;
+
+out:
+	err = errno;
+	argv_free(&names);
+	close(fd);
+
+	errno = err;
+	return ret;
+}
+
+
+static void *
+svcdir_worker(void *opaque)
+{
+	struct svcdir_ctx *ctx = opaque;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->count)
+	{
+		struct svcdir_entry *entry = &ctx->entries[i];
+
+		entry->loaded = service_load(&entry->svc, entry->path, &ctx->loader, entry->error, sizeof entry->error);
+		if (!entry->loaded)
+			service_free(&entry->svc);
+
+		svcdir_queue_push(&ctx->queue, &entry->node);
+	}
+
+	return NULL;
+}
+
+
+static unsigned int
+svcdir_workers(unsigned int workers, size_t count)
+{
+	if (workers == 0)
+	{
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		workers = n > 0 ? n : 1;
+	}
+
+	if (workers > SVCDIR_WORKERS_MAX)
+		workers = SVCDIR_WORKERS_MAX;
+
+	if (workers > count)
+		workers = count;
+
+	return workers;
+}
+
+
+/*
+ * Load every *.ini file in a directory on a pool of worker threads (one per CPU if
+ * workers is 0), and pass them to fn in name order, whatever order they finish in.
+ * User and group names are resolved once for the whole directory.  Returns false, with
+ * errbuf saying why, only if the directory could not be read.
+ */
+bool
+svcdir_load(const char *path, unsigned int workers, svcdir_fn_t fn, void *opaque, char *errbuf, size_t errbuf_len)
+{
+	struct svcdir_ctx ctx = {};
+	pthread_t threads[SVCDIR_WORKERS_MAX];
+	unsigned int started = 0;
+	bool *done = NULL;
+	size_t emitted = 0;
+	bool ret = false;
+
+	assert(path != NULL);
+	assert(fn != NULL);
+
+	if (!svcdir_scan(&ctx, path))
+	{
+		snprintf(errbuf, errbuf_len, "could not read service directory %s: %s", path, strerror(errno));
+		goto out;
+	}
+
+	done = calloc(ctx.count ? ctx.count : 1, sizeof(bool));
+	if (done == NULL)
+	{
+		snprintf(errbuf, errbuf_len, "out of memory");
+		goto out;
+	}
+
+	idcache_init(&ctx.ids);
+	ctx.loader.ids = &ctx.ids;
+	svcdir_queue_init(&ctx.queue);
+
+	workers = svcdir_workers(workers, ctx.count);
+	for (; started < workers; started++)
+		if (pthread_create(&threads[started], NULL, svcdir_worker, &ctx) != 0)
+			break;
+
+	/* without any thread, load everything here first */
+	if (started == 0)
+		svcdir_worker(&ctx);
+
+	for (size_t received = 0; received < ctx.count; received++)
+	{
+		struct svcdir_entry *entry = svcdir_queue_wait(&ctx.queue);
+
+		assert(entry != NULL);
+		done[entry - ctx.entries] = true;
+
+		while (emitted < ctx.count && done[emitted])
+			fn(&ctx.entries[emitted++], opaque);
+	}
+
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	sem_destroy(&ctx.queue.ready);
+	idcache_free(&ctx.ids);
+	ret = true;
+
+out:
+	for (size_t i = 0; i < ctx.count; i++)
+		free(ctx.entries[i].path);
+
+	free(ctx.entries);
+	free(done);
+
+	return ret;
+}
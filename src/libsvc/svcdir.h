@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#ifndef LIBSVC_SVCDIR_H
+#define LIBSVC_SVCDIR_H
+
+#include "libsvc/service.h"
+
+
+/* more workers than this only contend for the disk */
+#define SVCDIR_WORKERS_MAX	64
+
+
+struct svcdir_node {
+	struct svcdir_node *next;
+};
+
+/* one *.ini file of the directory, and how loading it went */
+struct svcdir_entry {
+	char *path;
+	struct service svc;
+	bool loaded;
+	char error[256];
+
+	struct svcdir_node node;
+};
+
+
+/*
+ * Called on the loading thread for every file, in name order.  If entry->loaded, fn takes
+ * over entry->svc, by copying it out or with service_free(); otherwise entry->error says
+ * why the file did not load.
+ */
+typedef void (*svcdir_fn_t)(struct svcdir_entry *entry, void *opaque);
+
+
+bool svcdir_load(const char *path, unsigned int workers, svcdir_fn_t fn, void *opaque, char *errbuf, size_t errbuf_len);
+
+
+#endif
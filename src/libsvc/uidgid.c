@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "libsvc/uidgid.h"
@@ -68,21 +70,154 @@ gid_resolve(const char *groupname)
 }
 
 
+/*
+ * Parse an octal file mode such as 022.  Only octal digits are taken: strtoul() alone would
+ * also let through an empty string, a sign or leading blanks.
+ */
 int
 parse_mode(mode_t *mode, const char *text)
 {
-	char *p;
 	unsigned long l;
 
-	if ((*text - '0') < 8)
-	{
-		l = strtoul(text, &p, 8);
-		if (*p || l > 07777U)
+	if (!*text)
+		return -1;
+
+	for (const char *p = text; *p; p++)
+		if (*p < '0' || *p > '7')
 			return -1;
 
-		*mode = (mode_t) l;
-		return 0;
+	l = strtoul(text, NULL, 8);
+	if (l > 07777U)
+		return -1;
+
+	*mode = (mode_t) l;
+	return 0;
+}
+
+
+void
+idcache_init(struct idcache *ids)
+{
+	memset(ids, 0, sizeof *ids);
+	pthread_mutex_init(&ids->lock, NULL);
+}
+
+
+/* FNV-1a, with the kind of name mixed in */
+static size_t
+idcache_hash(const char *name, bool group)
+{
+	uint32_t h = group ? 0x050c5d1fU : 0x811c9dc5U;
+
+	for (const char *p = name; *p; p++)
+	{
+		h ^= (unsigned char) *p;
+		h *= 0x01000193U;
 	}
 
-	return -1;
+	return h;
+}
+
+
+static struct idcache_entry *
+idcache_slot(struct idcache_entry *entries, size_t size, const char *name, bool group)
+{
+	size_t i = idcache_hash(name, group) & (size - 1);
+
+	while (entries[i].name != NULL && (entries[i].group != group || strcmp(entries[i].name, name)))
+		i = (i + 1) & (size - 1);
+
+	return &entries[i];
+}
+
+
+static bool
+idcache_grow(struct idcache *ids)
+{
+	size_t size = ids->size ? ids->size * 2 : 64;
+	struct idcache_entry *entries = calloc(size, sizeof *entries);
+
+	if (entries == NULL)
+		return false;
+
+	for (size_t i = 0; i < ids->size; i++)
+		if (ids->entries[i].name != NULL)
+			*idcache_slot(entries, size, ids->entries[i].name, ids->entries[i].group) = ids->entries[i];
+
+	free(ids->entries);
+	ids->entries = entries;
+	ids->size = size;
+
+	return true;
+}
+
+
+/*
+ * The lock is held while a name is resolved, so that threads asking for the same name
+ * at once do not both resolve it.  Names are few, so this costs little.
+ */
+static int
+idcache_lookup(struct idcache *ids, const char *name, bool group)
+{
+	struct idcache_entry *entry;
+	int id;
+
+	pthread_mutex_lock(&ids->lock);
+
+	if (ids->size > 0)
+	{
+		entry = idcache_slot(ids->entries, ids->size, name, group);
+		if (entry->name != NULL)
+		{
+			id = entry->id;
+			pthread_mutex_unlock(&ids->lock);
+
+			return id;
+		}
+	}
+
+	id = group ? (int) gid_resolve(name) : (int) uid_resolve(name);
+
+	/* keep the table at most half full */
+	if ((ids->count + 1) * 2 > ids->size && !idcache_grow(ids))
+		goto out;
+
+	entry = idcache_slot(ids->entries, ids->size, name, group);
+	if ((entry->name = strdup(name)) != NULL)
+	{
+		entry->group = group;
+		entry->id = id;
+		ids->count++;
+	}
+
+out:
+	pthread_mutex_unlock(&ids->lock);
+	return id;
+}
+
+
+int
+idcache_uid(struct idcache *ids, const char *username)
+{
+	return idcache_lookup(ids, username, false);
+}
+
+
+int
+idcache_gid(struct idcache *ids, const char *groupname)
+{
+	return idcache_lookup(ids, groupname, true);
+}
+
+
+void
+idcache_free(struct idcache *ids)
+{
+	for (size_t i = 0; i < ids->size; i++)
+		free(ids->entries[i].name);
+
+	free(ids->entries);
+	pthread_mutex_destroy(&ids->lock);
+
+	memset(ids, 0, sizeof *ids);
 }
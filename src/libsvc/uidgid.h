@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #ifndef LIBSVC_UIDGID_H
@@ -11,4 +12,31 @@ uid_t uid_resolve(const char *username);
 gid_t gid_resolve(const char *groupname);
 int parse_mode(mode_t *mode, const char *text);
 
+
+/*
+ * Remembers resolved user and group names, so that loading many services resolves
+ * each name once.  It may be shared between threads.  Lookups return -1 for names
+ * which do not resolve, and remember that too.
+ */
+struct idcache_entry {
+	char *name;
+	bool group;
+	int id;
+};
+
+struct idcache {
+	pthread_mutex_t lock;
+
+	/* open addressing, size a power of two */
+	struct idcache_entry *entries;
+	size_t size;
+	size_t count;
+};
+
+
+void idcache_init(struct idcache *ids);
+int idcache_uid(struct idcache *ids, const char *username);
+int idcache_gid(struct idcache *ids, const char *groupname);
+void idcache_free(struct idcache *ids);
+
 #endif
@@ -0,0 +1,774 @@
+/*
+ * This file is a part of svc.
+ * svc-manager -- start a set of services in dependency order, each under its own
+ * svc-supervise.
+ *
+ * Copyright (c) 2017 William Pitcock <nenolod@dereferenced.org>.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * This software is provided 'as is' and without any warranty, express or
+ * implied.  In no event shall the authors be liable for any damages arising
+ * from the use of this software.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <assert.h>
+#include <getopt.h>
+#include <err.h>
+
+
+#include "libsvc/childproc.h"
+#include "libsvc/depgraph.h"
+#include "libsvc/ipc.h"
+#include "libsvc/service.h"
+#include "libsvc/signal.h"
+#include "libsvc/spawnlimit.h"
+#include "libsvc/svcdir.h"
+
+
+struct manager_service {
+	struct service svc;
+
+	/* the svc-supervise running the service */
+	struct childproc proc;
+	char *proc_argv[7];
+	int ipc_fd;
+
+	/* waiting for the service to come up */
+	bool starting;
+	struct timespec start_time;
+};
+
+
+struct manager {
+	struct manager_service *services;
+	size_t service_count;
+	size_t service_size;
+
+	struct depgraph graph;
+
+	const char *supervise_path;
+	int start_timeout;
+
+	/* the spawn limit handed to every supervisor, as "--spawn-limit=PATH", or NULL */
+	char *spawn_limit_arg;
+	struct spawnlimit spawn_limit;
+
+	/* the cgroup every supervisor puts its service under, as "--cgroup=DIR", or NULL */
+	char *cgroup_arg;
+
+	/* where each supervisor serves metrics, as DIR/NAME.metrics, or NULL */
+	const char *metrics_dir;
+
+	int signal_fd;
+	struct pollfd *pfds;
+
+	bool exiting;
+
+	/* the initial start of every selected service, which is what boot time measures */
+	struct timespec boot_start;
+	bool boot_done;
+	size_t started;
+	size_t failed;
+};
+
+
+/* slot 0 is the signalfd, then an IPC socket and a pidfd for every service */
+#define MANAGER_SLOT(i, n)	(1 + 2 * (i) + (n))
+
+/* the most --jobs may ask for; more than the services there are changes nothing */
+#define MANAGER_JOBS_MAX	65536
+
+
+static uint64_t
+manager_elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000ULL + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+/*
+ * Take over a service loaded from a directory given with --service-dir.
+ */
+static void
+manager_add_dir_entry(struct svcdir_entry *entry, void *opaque)
+{
+	struct manager *m = opaque;
+	struct manager_service *ms;
+
+	if (!entry->loaded)
+		errx(1, "%s: %s", entry->path, entry->error);
+
+	if (m->service_count == m->service_size)
+	{
+		size_t size = m->service_size ? m->service_size * 2 : 64;
+		struct manager_service *services = realloc(m->services, size * sizeof *services);
+
+		if (services == NULL)
+			err(1, "allocating service table");
+
+		m->services = services;
+		m->service_size = size;
+	}
+
+	ms = &m->services[m->service_count++];
+	memset(ms, 0, sizeof *ms);
+
+	ms->svc = entry->svc;
+	ms->ipc_fd = -1;
+	childproc_init(&ms->proc);
+}
+
+
+/*
+ * Build the dependency graph, with every service selected unless targets are named.
+ */
+static void
+manager_build_graph(struct manager *m, int ntargets, char *targets[])
+{
+	static const depgraph_dep_t types[] = {DEPGRAPH_NEEDS, DEPGRAPH_WANTS, DEPGRAPH_BEFORE, DEPGRAPH_AFTER};
+
+	for (size_t i = 0; i < m->service_count; i++)
+		if (depgraph_add(&m->graph, m->services[i].svc.name, &m->services[i]) < 0)
+			errx(1, "%s: duplicate service name '%s'", m->services[i].svc.path, m->services[i].svc.name);
+
+	for (size_t i = 0; i < m->service_count; i++)
+	{
+		struct service *svc = &m->services[i].svc;
+		const argv_t *lists[] = {&svc->needs, &svc->wants, &svc->before, &svc->after};
+
+		for (size_t l = 0; l < ARRAY_SIZE(lists); l++)
+			for (int j = 0; j < argv_count(lists[l]); j++)
+				if (!depgraph_depend(&m->graph, i, lists[l]->argv[j], types[l]))
+					err(1, "building dependency graph");
+	}
+
+	if (ntargets == 0)
+	{
+		for (size_t i = 0; i < m->service_count; i++)
+			depgraph_select(&m->graph, i);
+	}
+
+	for (int i = 0; i < ntargets; i++)
+	{
+		ssize_t node = depgraph_find(&m->graph, targets[i]);
+
+		if (node < 0)
+			errx(1, "%s: no such service", targets[i]);
+
+		depgraph_select(&m->graph, node);
+	}
+}
+
+
+static void
+manager_graph_failed(struct depgraph *g, size_t node, const char *reason, void *opaque)
+{
+	struct manager *m = opaque;
+
+	syslog(LOG_ERR, "%s: not started: %s", g->nodes[node].name, reason);
+	m->failed++;
+}
+
+
+/*
+ * Log how long starts were held back by the spawn limit, for each priority which had to wait.
+ */
+static void
+manager_log_spawn_limit(struct manager *m)
+{
+	struct timespec now;
+	struct spawnlimit_stats stats;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!spawnlimit_stats(&m->spawn_limit, now.tv_sec * 1000000000ULL + now.tv_nsec, &stats))
+		return;
+
+	for (int i = 0; i < SPAWNLIMIT_CLASS_COUNT; i++)
+	{
+		const struct spawnlimit_metrics *c = &stats.classes[i].metrics;
+
+		if (c->waited == 0)
+			continue;
+
+		syslog(LOG_INFO, "boot: %llu of %llu %s priority starts waited for the spawn limit, %.3f s on average, %.3f s at most",
+			(unsigned long long) c->waited, (unsigned long long) c->granted, spawnlimit_class_name(i),
+			c->wait_ns_total / 1e9 / c->waited, c->wait_ns_max / 1e9);
+	}
+}
+
+
+/*
+ * Spawn an svc-supervise for the service, and subscribe to its state changes.
+ */
+static bool
+manager_spawn(struct manager *m, struct manager_service *ms)
+{
+	nvlist_t *obj;
+	int sv[2];
+	bool ok;
+
+	if (ms->proc_argv[0] == NULL)
+	{
+		size_t n = 3;
+
+		ms->proc_argv[0] = (char *) m->supervise_path;
+		ms->proc_argv[1] = "--manager-fd=3";
+
+		if ((ms->proc_argv[2] = malloc(strlen(ms->svc.path) + sizeof "--service=")) == NULL)
+			return false;
+
+		sprintf(ms->proc_argv[2], "--service=%s", ms->svc.path);
+
+		if (m->spawn_limit_arg != NULL)
+			ms->proc_argv[n++] = m->spawn_limit_arg;
+
+		if (m->cgroup_arg != NULL)
+			ms->proc_argv[n++] = m->cgroup_arg;
+
+		if (m->metrics_dir != NULL)
+		{
+			if ((ms->proc_argv[n] = malloc(strlen(m->metrics_dir) + strlen(ms->svc.name) +
+				sizeof "--metrics-listen=unix:/.metrics")) == NULL)
+				return false;
+
+			sprintf(ms->proc_argv[n++], "--metrics-listen=unix:%s/%s.metrics", m->metrics_dir, ms->svc.name);
+		}
+
+		ms->proc_argv[n] = NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	{
+		syslog(LOG_ERR, "%s: socketpair: %s", ms->svc.name, strerror(errno));
+		return false;
+	}
+
+	ms->proc.prog_name = (char *) m->supervise_path;
+	ms->proc.prog_argv = ms->proc_argv;
+	ms->proc.pass_fds[0] = sv[1];
+	ms->proc.pass_fd_count = 1;
+
+	ok = childproc_start(&ms->proc);
+	close(sv[1]);
+
+	if (!ok)
+	{
+		close(sv[0]);
+		return false;
+	}
+
+	ms->ipc_fd = sv[0];
+
+	/* the reply carries the current state, so no transition can be missed */
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "subscribe", 1, false);
+	nvlist_send(ms->ipc_fd, obj);
+	nvlist_destroy(obj);
+
+	ms->starting = true;
+	clock_gettime(CLOCK_MONOTONIC, &ms->start_time);
+
+	return true;
+}
+
+
+/*
+ * Start every service the graph allows to start now.
+ */
+static void
+manager_schedule(struct manager *m)
+{
+	ssize_t node;
+
+	if (m->exiting)
+		return;
+
+	while ((node = depgraph_next(&m->graph)) >= 0)
+	{
+		if (manager_spawn(m, &m->services[node]))
+			continue;
+
+		syslog(LOG_ERR, "%s: could not start svc-supervise", m->services[node].svc.name);
+		m->failed++;
+		depgraph_done(&m->graph, node, false);
+	}
+
+	if (!m->boot_done && depgraph_finished(&m->graph))
+	{
+		m->boot_done = true;
+		syslog(LOG_INFO, "boot: %zu services started, %zu failed, in %llu ms", m->started, m->failed,
+			(unsigned long long) manager_elapsed_ms(&m->boot_start));
+
+		manager_log_spawn_limit(m);
+	}
+}
+
+
+/*
+ * The service came up, or will not: let the services waiting for it go ahead.
+ */
+static void
+manager_started(struct manager *m, struct manager_service *ms, bool ok, const char *why)
+{
+	ms->starting = false;
+
+	if (ok)
+	{
+		syslog(LOG_INFO, "%s: started in %llu ms", ms->svc.name, (unsigned long long) manager_elapsed_ms(&ms->start_time));
+		m->started++;
+	}
+	else
+	{
+		syslog(LOG_ERR, "%s: failed to start: %s", ms->svc.name, why);
+		m->failed++;
+	}
+
+	depgraph_done(&m->graph, ms - m->services, ok);
+	manager_schedule(m);
+}
+
+
+/*
+ * Handle a message from a supervisor: the reply to subscribe, or a state change.
+ */
+static void
+manager_ipc(struct manager *m, struct manager_service *ms)
+{
+	nvlist_t *nvl;
+	int64_t state = -1;
+
+	nvl = nvlist_recv(ms->ipc_fd, 0);
+	if (nvl == NULL)
+	{
+		close(ms->ipc_fd);
+		ms->ipc_fd = -1;
+
+		if (ms->starting)
+			manager_started(m, ms, false, "supervisor closed its IPC socket");
+
+		return;
+	}
+
+	if (nvlist_exists_nvlist(nvl, "services"))
+	{
+		const nvlist_t *services = nvlist_get_nvlist(nvl, "services");
+
+		if (nvlist_exists_number(services, ms->svc.name))
+			state = nvlist_get_number(services, ms->svc.name);
+	}
+	else if (nvlist_exists_number(nvl, "state"))
+		state = nvlist_get_number(nvl, "state");
+
+	nvlist_destroy(nvl);
+
+	if (!ms->starting || state < 0)
+		return;
+
+	/* an on-demand service is available as soon as its supervisor holds its sockets */
+	if (ms->svc.on_demand && state != CHILDPROC_CRASHED)
+		manager_started(m, ms, true, NULL);
+	/* a service which can say when it is ready is waited for until it does */
+	else if (state == CHILDPROC_READY || (state == CHILDPROC_UP && ms->svc.ready.type == NOTIFY_NONE))
+		manager_started(m, ms, true, NULL);
+	else if (state == CHILDPROC_CRASHED)
+		manager_started(m, ms, false, "service exited before it was up");
+	else if (state == CHILDPROC_DOWN)
+		manager_started(m, ms, false, "service went down");
+}
+
+
+/*
+ * Handle a supervisor which has exited.
+ */
+static void
+manager_supervisor_exited(struct manager *m, struct manager_service *ms, int status)
+{
+	if (WIFSIGNALED(status))
+		syslog(LOG_INFO, "%s: supervisor killed by signal %d", ms->svc.name, WTERMSIG(status));
+	else
+		syslog(LOG_INFO, "%s: supervisor exited with status %d", ms->svc.name, WEXITSTATUS(status));
+
+	if (ms->ipc_fd >= 0)
+	{
+		close(ms->ipc_fd);
+		ms->ipc_fd = -1;
+	}
+
+	if (ms->starting)
+		manager_started(m, ms, false, "supervisor exited");
+}
+
+
+static void
+manager_collect_service(struct manager *m, struct manager_service *ms)
+{
+	int status;
+
+	if (childproc_collect(&ms->proc, &status))
+		manager_supervisor_exited(m, ms, status);
+}
+
+
+static void
+manager_collect(struct manager *m)
+{
+	for (size_t i = 0; i < m->service_count; i++)
+		manager_collect_service(m, &m->services[i]);
+}
+
+
+/*
+ * Fail the starts that have taken too long, and return the poll timeout until the
+ * next one would, or -1.
+ */
+static int
+manager_check_timeouts(struct manager *m)
+{
+	uint64_t limit = m->start_timeout * 1000ULL;
+	int timeout = -1;
+
+	if (m->start_timeout <= 0)
+		return -1;
+
+	for (size_t i = 0; i < m->service_count; i++)
+	{
+		struct manager_service *ms = &m->services[i];
+		uint64_t elapsed;
+
+		if (!ms->starting)
+			continue;
+
+		elapsed = manager_elapsed_ms(&ms->start_time);
+		if (elapsed >= limit)
+		{
+			manager_started(m, ms, false, "timed out");
+			continue;
+		}
+
+		if (timeout < 0 || limit - elapsed < (uint64_t) timeout)
+			timeout = limit - elapsed;
+	}
+
+	return timeout;
+}
+
+
+static size_t
+manager_running(const struct manager *m)
+{
+	size_t running = 0;
+
+	for (size_t i = 0; i < m->service_count; i++)
+		running += m->services[i].proc.child_pid != 0;
+
+	return running;
+}
+
+
+/*
+ * Stop every supervisor, each of which stops its service before exiting.
+ */
+static void
+manager_stop(struct manager *m)
+{
+	m->exiting = true;
+
+	for (size_t i = 0; i < m->service_count; i++)
+	{
+		m->services[i].starting = false;
+
+		if (m->services[i].proc.child_pid != 0)
+			childproc_signal(&m->services[i].proc, SIGTERM);
+	}
+}
+
+
+static void
+manager_signal(struct manager *m)
+{
+	struct signalfd_siginfo si;
+
+	if (read(m->signal_fd, &si, sizeof si) != sizeof si)
+		return;
+
+	if (si.ssi_signo == SIGCHLD)
+		manager_collect(m);
+	else
+		manager_stop(m);
+}
+
+
+static void
+manager_prepare(struct manager *m)
+{
+	sigset_t sigs;
+
+	signal_block();
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+
+	/* signal_block() leaves out SIGINT and SIGQUIT, which would otherwise kill us before they are read */
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	m->signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	if (m->signal_fd < 0)
+		err(1, "signalfd");
+
+	m->pfds = calloc(MANAGER_SLOT(m->service_count, 0), sizeof(struct pollfd));
+	if (m->pfds == NULL)
+		err(1, "allocating poll set");
+
+	if (!depgraph_prepare(&m->graph))
+		err(1, "preparing dependency graph");
+}
+
+
+static void
+manager_run(struct manager *m)
+{
+	clock_gettime(CLOCK_MONOTONIC, &m->boot_start);
+	manager_schedule(m);
+
+	while (!m->exiting || manager_running(m) > 0)
+	{
+		int timeout = manager_check_timeouts(m);
+
+		m->pfds[0] = (struct pollfd) {.fd = m->signal_fd, .events = POLLIN};
+
+		for (size_t i = 0; i < m->service_count; i++)
+		{
+			m->pfds[MANAGER_SLOT(i, 0)] = (struct pollfd) {.fd = m->services[i].ipc_fd, .events = POLLIN};
+			m->pfds[MANAGER_SLOT(i, 1)] = (struct pollfd) {.fd = m->services[i].proc.pidfd, .events = POLLIN};
+		}
+
+		if (poll(m->pfds, MANAGER_SLOT(m->service_count, 0), timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			err(1, "poll");
+		}
+
+		if (m->pfds[0].revents & POLLIN)
+			manager_signal(m);
+
+		for (size_t i = 0; i < m->service_count; i++)
+			if (m->pfds[MANAGER_SLOT(i, 0)].revents && m->services[i].ipc_fd >= 0)
+				manager_ipc(m, &m->services[i]);
+
+		/* only supervisors whose pidfd is readable have exited; SIGCHLD covers the rest */
+		for (size_t i = 0; i < m->service_count; i++)
+			if ((m->pfds[MANAGER_SLOT(i, 1)].revents & POLLIN) && m->services[i].proc.pidfd >= 0)
+				manager_collect_service(m, &m->services[i]);
+	}
+}
+
+
+static void
+usage(void)
+{
+	printf("usage: svc-manager [options] --service-dir=DIR [SERVICE...]\n\nOptions:\n\n");
+
+	printf("    --help                        this message\n");
+	printf("    --service-dir=DIR             load the services declared in DIR/*.ini, may\n");
+	printf("                                  be given multiple times\n");
+	printf("    --jobs=NUMBER                 start at most NUMBER services at once\n");
+	printf("                                  (default 0, no limit)\n");
+	printf("    --start-timeout=SECONDS       give up on a service which is not up after\n");
+	printf("                                  SECONDS (default 90, 0 to wait forever)\n");
+	printf("    --supervise=PATH              run PATH as svc-supervise\n");
+	printf("    --spawn-limit=PATH            limit the rate services are started at,\n");
+	printf("                                  host-wide, through a page at PATH\n");
+	printf("    --spawn-rate=NUMBER           start at most NUMBER services per second\n");
+	printf("                                  (default 20)\n");
+	printf("    --spawn-burst=NUMBER          let NUMBER starts through at once (default 8)\n");
+	printf("    --cgroup=DIR                  run each service in its own cgroup under\n");
+	printf("                                  DIR, a cgroup v2 directory\n");
+	printf("    --metrics-dir=DIR             have each supervisor serve OpenMetrics over\n");
+	printf("                                  HTTP on DIR/NAME.metrics\n");
+	printf("    --verbose                     log to stderr as well\n");
+	printf("\nWith SERVICE names, only those and what they need or want are started.\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+
+const char *shortopts = "R:j:t:x:vh";
+const struct option longopts[] = {
+	{"service-dir",		1, NULL, 'R'},
+	{"jobs",		1, NULL, 'j'},
+	{"start-timeout",	1, NULL, 't'},
+	{"supervise",		1, NULL, 'x'},
+	{"spawn-limit",		1, NULL, 128},
+	{"spawn-rate",		1, NULL, 129},
+	{"spawn-burst",		1, NULL, 130},
+	{"cgroup",		1, NULL, 131},
+	{"metrics-dir",		1, NULL, 132},
+	{"verbose",		0, NULL, 'v'},
+	{"help",		0, NULL, 'h'},
+	{NULL,			0, NULL, 0  },
+};
+
+
+/*
+ * Parse the value of an integer option, which must lie within min and max.
+ */
+static bool
+manager_option_int(const char *text, int min, int max, int *value)
+{
+	char *end;
+	long l;
+
+	errno = 0;
+	l = strtol(text, &end, 10);
+
+	if (end == text || *end || errno != 0 || l < min || l > max)
+		return false;
+
+	*value = (int) l;
+	return true;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct manager m = {
+		.supervise_path = "svc-supervise",
+		.start_timeout = 90,
+		.signal_fd = -1,
+	};
+	argv_t service_dirs = {};
+	int jobs = 0, logopt = LOG_PID;
+	const char *spawn_limit_path = NULL;
+	const char *cgroup_path = NULL;
+	int spawn_rate = 0, spawn_burst = 0;
+	char errbuf[256];
+	int ret;
+
+	while ((ret = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+	{
+		switch (ret)
+		{
+			case 'R':
+				argv_append(&service_dirs, optarg);
+				break;
+
+			case 'j':
+				if (!manager_option_int(optarg, 0, MANAGER_JOBS_MAX, &jobs))
+					errx(1, "invalid number of jobs: %s", optarg);
+
+				break;
+
+			case 't':
+				if (!manager_option_int(optarg, 0, 86400, &m.start_timeout))
+					errx(1, "invalid start timeout: %s", optarg);
+
+				break;
+
+			case 'x':
+				m.supervise_path = optarg;
+				break;
+
+			case 'v':
+				logopt |= LOG_PERROR;
+				break;
+
+			case 128:
+				spawn_limit_path = optarg;
+				break;
+
+			case 129:
+				if (!manager_option_int(optarg, 0, SPAWNLIMIT_RATE_MAX, &spawn_rate))
+					errx(1, "invalid spawn rate: %s", optarg);
+
+				break;
+
+			case 130:
+				if (!manager_option_int(optarg, 0, SPAWNLIMIT_RATE_MAX, &spawn_burst))
+					errx(1, "invalid spawn burst: %s", optarg);
+
+				break;
+
+			case 131:
+				cgroup_path = optarg;
+				break;
+
+			case 132:
+				m.metrics_dir = optarg;
+				break;
+
+			case 'h':
+			default:
+				usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argv_count(&service_dirs) == 0)
+		usage();
+
+	openlog("svc-manager", logopt, LOG_DAEMON);
+
+	/* the manager sets the limit; its supervisors only take tokens */
+	if (spawn_limit_path != NULL)
+	{
+		if (!spawnlimit_open(&m.spawn_limit, spawn_limit_path, spawn_rate, spawn_burst))
+			err(1, "opening spawn limit %s", spawn_limit_path);
+
+		if ((m.spawn_limit_arg = malloc(strlen(spawn_limit_path) + sizeof "--spawn-limit=")) == NULL)
+			err(1, "allocating spawn limit argument");
+
+		sprintf(m.spawn_limit_arg, "--spawn-limit=%s", spawn_limit_path);
+	}
+
+	if (cgroup_path != NULL)
+	{
+		if ((m.cgroup_arg = malloc(strlen(cgroup_path) + sizeof "--cgroup=")) == NULL)
+			err(1, "allocating cgroup argument");
+
+		sprintf(m.cgroup_arg, "--cgroup=%s", cgroup_path);
+	}
+
+	for (int i = 0; i < argv_count(&service_dirs); i++)
+		if (!svcdir_load(service_dirs.argv[i], 0, manager_add_dir_entry, &m, errbuf, sizeof errbuf))
+			errx(1, "%s", errbuf);
+
+	argv_free(&service_dirs);
+
+	depgraph_init(&m.graph, jobs > 0 ? jobs : 0, manager_graph_failed, &m);
+	manager_build_graph(&m, argc, argv);
+
+	manager_prepare(&m);
+	manager_run(&m);
+
+	return m.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
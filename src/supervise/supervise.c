@@ -13,10 +13,15 @@
  * from the use of this software.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <syslog.h>
 #include <string.h>
@@ -34,408 +39,2802 @@
 #include <sys/queue.h>
 #include <poll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <assert.h>
 #include <getopt.h>
 #include <err.h>
 
 
+#include "libsvc/accounting.h"
+#include "libsvc/argv.h"
+#include "libsvc/cgroup.h"
+#include "libsvc/inicache.h"
 #include "libsvc/ipc.h"
+#include "libsvc/listener.h"
 #include "libsvc/uidgid.h"
 #include "libsvc/childproc.h"
+#include "libsvc/histogram.h"
+#include "libsvc/logcapture.h"
+#include "libsvc/metrics.h"
+#include "libsvc/notify.h"
+#include "libsvc/respawn.h"
+#include "libsvc/ringbuf.h"
+#include "libsvc/service.h"
 #include "libsvc/signal.h"
+#include "libsvc/spawnlimit.h"
+#include "libsvc/statuspage.h"
+#include "libsvc/svcdir.h"
 
 
-struct supervisor {
-	struct childproc proc;
+/* ipc:ids of requests whose replies are owed once a stop completes */
+struct supervisor_pending {
+	uint64_t *ids;
+	size_t count;
+	size_t size;
+};
 
-	bool exiting;
 
-	int manager_fd;
-	int signal_fd;
-	int watch_fds;
+/* the phases of a run whose latency is kept, each from the end of the one before */
+enum supervisor_latency {
+	SUPERVISOR_LATENCY_SPAWN,	/* start requested to fork, including any wait for the spawn limit */
+	SUPERVISOR_LATENCY_EXEC,	/* fork to exec */
+	SUPERVISOR_LATENCY_READY,	/* exec to ready */
+	SUPERVISOR_LATENCY_STOP,	/* stop requested to the last process gone */
+	SUPERVISOR_LATENCY_COUNT
+};
 
-	mode_t umask;
+static const char *supervisor_latency_names[SUPERVISOR_LATENCY_COUNT] = {
+	[SUPERVISOR_LATENCY_SPAWN] = "spawn",
+	[SUPERVISOR_LATENCY_EXEC] = "exec",
+	[SUPERVISOR_LATENCY_READY] = "ready",
+	[SUPERVISOR_LATENCY_STOP] = "stop",
 };
 
 
-/*
- * Process a supervisor IPC kill command.
- */
-static void
-supervisor_ipc_kill(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
-{
-	nvlist_t *obj;
+struct supervisor_service {
+	struct service svc;
 
-	(void) nvl;
+	/* replies owed to the manager once the stop in progress completes */
+	struct supervisor_pending kill_requests;
+	struct supervisor_pending restart_requests;
 
-	obj = nvlist_create(0);
-	ipc_obj_prepare(obj, "kill", 0, true);
+	/* stdout and stderr captures; stderr is unused when both go to the same log */
+	struct logcapture logs[2];
 
-	childproc_kill(&sup->proc, true);
-	childproc_setstate(&sup->proc, CHILDPROC_DOWN);
+	/* on demand: holding the sockets until a client comes, with no child running */
+	bool waiting;
 
-	nvlist_add_bool(obj, "success", true);
+	/* on demand: the last sign of use, and whether the child is being stopped for lack of it */
+	struct timespec last_activity;
+	uint64_t idle_cpu;
+	bool idle_stop;
 
-	nvlist_send(manager_fd, obj);
-	nvlist_destroy(obj);
-}
+	/* the child has exited, but not everything it forked: status is handled once the cgroup is empty */
+	bool tree_exiting;
+	int tree_status;
 
+	/* held back by the host-wide spawn limit, to be retried when spawn_timer_fd fires */
+	struct spawnlimit *spawn_limit;
+	struct spawnlimit_ticket spawn_ticket;
+	bool spawn_queued;
+	int spawn_timer_fd;
 
-/*
- * Process a supervisor IPC restart command.
- */
-static void
-supervisor_ipc_restart(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
-{
-	nvlist_t *obj;
+	/* what the service has cost, sampled every stats_interval while it runs */
+	struct accounting acct;
 
-	(void) nvl;
+	/* how long each phase of its runs took */
+	struct histogram latency[SUPERVISOR_LATENCY_COUNT];
 
-	obj = nvlist_create(0);
-	ipc_obj_prepare(obj, "restart", 0, true);
+	/* restarts after an exit; unlike restart_count, never reset, as the metric is a counter */
+	uint64_t restarts;
 
-	sup->proc.restart_count = 0;
+	/* exits other than on request, by exit code and by signal */
+	uint32_t exit_codes[256];
+	uint32_t exit_signals[NSIG];
 
-	childproc_kill(&sup->proc, true);
-	childproc_start(&sup->proc);
+	/* readiness notifications, and the child's environment entry naming the socket */
+	struct notify notify;
+	char *child_env[2];
 
-	nvlist_add_bool(obj, "success", true);
-	nvlist_add_number(obj, "pid", sup->proc.child_pid);
+	/* recent output, only allocated if log-buffer-size is set */
+	struct ringbuf ring;
+	uint64_t run_log_offset;
 
-	nvlist_send(manager_fd, obj);
-	nvlist_destroy(obj);
-}
+	bool log_follow;
+	uint64_t log_follow_id;
+	uint64_t log_follow_offset;
+};
 
 
-/*
- * Process a supervisor IPC status command.
- */
-static void
-supervisor_ipc_status(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
-{
-	nvlist_t *obj;
+/* largest piece of log output carried by one IPC message */
+#define SUPERVISOR_LOG_CHUNK	(16 * 1024)
 
-	(void) nvl;
+/* most requests handled per wakeup, so a busy manager cannot starve child reaping */
+#define SUPERVISOR_IPC_BATCH	1024
 
-	obj = nvlist_create(0);
-	ipc_obj_prepare(obj, "status", 0, true);
 
-	nvlist_add_string(obj, "prog_name", sup->proc.prog_name);
+/* a metrics client which has not sent its request and read the reply by then is dropped */
+#define SUPERVISOR_METRICS_TIMEOUT_MS	5000
 
-	if (sup->proc.dir_chroot)
-		nvlist_add_string(obj, "dir_chroot", sup->proc.dir_chroot);
+/* room left in front of the metrics text for the HTTP header */
+#define SUPERVISOR_METRICS_HEADER	256
 
-	if (sup->proc.dir_chdir)
-		nvlist_add_string(obj, "dir_chdir", sup->proc.dir_chdir);
 
-	nvlist_add_number(obj, "pid", sup->proc.child_pid);
+/* poll slots for the supervisor itself */
+enum supervisor_global_slot {
+	SUPERVISOR_GLOBAL_SIGNAL,
+	SUPERVISOR_GLOBAL_MANAGER,
+	SUPERVISOR_GLOBAL_METRICS,
+	SUPERVISOR_GLOBAL_METRICS_CLIENT,
+	SUPERVISOR_GLOBAL_COUNT
+};
 
-	nvlist_add_number(obj, "uid", sup->proc.child_uid);
-	nvlist_add_number(obj, "gid", sup->proc.child_gid);
 
-	nvlist_add_number(obj, "restart_count", sup->proc.restart_count);
+/* per-service poll slots, following the global ones */
+enum supervisor_slot {
+	SUPERVISOR_SLOT_PIDFD,
+	SUPERVISOR_SLOT_STOP_TIMER,
+	SUPERVISOR_SLOT_RESPAWN,
+	SUPERVISOR_SLOT_SPAWN,
+	SUPERVISOR_SLOT_CGROUP,
+	SUPERVISOR_SLOT_STDOUT,
+	SUPERVISOR_SLOT_STDERR,
+	SUPERVISOR_SLOT_NOTIFY,
+	SUPERVISOR_SLOT_ACTIVATE,
+	SUPERVISOR_SLOT_COUNT
+};
 
-	nvlist_add_number(obj, "respawn_delay", sup->proc.respawn_delay);
-	nvlist_add_number(obj, "respawn_max", sup->proc.respawn_max);
-	nvlist_add_number(obj, "respawn_period", sup->proc.respawn_period);
-	nvlist_add_number(obj, "respawn_last", sup->proc.respawn_last);
+#define SUPERVISOR_SLOT(i, slot)	(SUPERVISOR_GLOBAL_COUNT + (i) * SUPERVISOR_SLOT_COUNT + (slot))
 
-	nvlist_send(manager_fd, obj);
-	nvlist_destroy(obj);
-}
 
+/* requests of one IPC method, and how long handling them took */
+struct supervisor_ipc_counter {
+	uint64_t requests;
+	uint64_t errors;
+	struct histogram latency;
+};
 
-/* table must be alphabetically sorted! */
-static const ipc_hdl_dispatch_t supervisor_dispatch_table[] = {
-	{"kill", (ipc_hdl_dispatch_fn_t) supervisor_ipc_kill},
-	{"restart", (ipc_hdl_dispatch_fn_t) supervisor_ipc_restart},
-	{"status", (ipc_hdl_dispatch_fn_t) supervisor_ipc_status},
+
+/* the one metrics client served at a time, over HTTP */
+struct supervisor_metrics_client {
+	int fd;
+	uint64_t deadline_ns;
+
+	char request[1024];
+	size_t request_len;
+
+	/* the reply, as a span of the http buffer; empty until the request is complete */
+	size_t sent;
+	size_t end;
 };
 
 
-/*
- * Process a supervisor IPC.
- */
-static void
-supervisor_ipc(struct supervisor *sup)
+struct supervisor {
+	struct supervisor_service *services;
+	size_t service_count;
+
+	bool exiting;
+
+	int manager_fd;
+	int signal_fd;
+
+	/* push state changes to the manager, tagged with the id of the subscribe request */
+	bool subscribed;
+	uint64_t subscribe_id;
+
+	/* each service gets a cgroup under this one, if it is given */
+	const char *cgroup_parent;
+
+	/* the spawn limit shared with other supervisors, if a path was given */
+	const char *spawn_limit_path;
+	int spawn_rate;
+	int spawn_burst;
+	struct spawnlimit spawn_limit;
+
+	/* seconds between samples of what running services use, 0 to only sample when asked */
+	int stats_interval;
+	uint64_t stats_due_ns;
+
+	/* where to write timings on SIGUSR1 and at exit, if a path was given */
+	const char *timings_path;
+
+	/* per IPC method, in the order of the dispatch table, then requests for no known method */
+	struct supervisor_ipc_counter *ipc_counters;
+
+	/* OpenMetrics text, for the metrics method and, if an address was given, over HTTP */
+	struct metrics_buf metrics_ipc;
+	struct metrics_buf metrics_http;
+	struct listener_set metrics_listen;
+	struct supervisor_metrics_client metrics_client;
+
+	/* service states mirrored for readers which map the page, if a path was given */
+	const char *status_path;
+	struct statuspage status_page;
+
+	/* SUPERVISOR_GLOBAL_COUNT slots, then SUPERVISOR_SLOT_COUNT slots per service */
+	struct pollfd *pfds;
+
+	mode_t umask;
+};
+
+
+static int
+supervisor_service_cmp(const void *a, const void *b)
 {
-	nvlist_t *nvl;
-	ipc_obj_return_code_t rc;
+	const struct supervisor_service *sa = a, *sb = b;
+	return strcmp(sa->svc.name, sb->svc.name);
+}
+
+
+static int
+supervisor_service_name_cmp(const char *key, const void *tentry)
+{
+	const struct supervisor_service *ss = tentry;
+	return strcmp(key, ss->svc.name);
+}
 
-	nvl = nvlist_recv(sup->manager_fd, 0);
-	if (nvl == NULL)
-	{
-		/* XXX: IPC failure occured, maybe handle more gracefully */
-		sup->watch_fds--;
-		return;
-	}
 
-	rc = ipc_obj_dispatch(sup->manager_fd, nvl, supervisor_dispatch_table, ARRAY_SIZE(supervisor_dispatch_table), sup);
-	if (rc != IPC_OBJ_OK)
-		ipc_obj_error(sup->manager_fd, nvl, rc);
+/*
+ * Find the service an IPC request is addressed to.  Requests without a service
+ * name are routed to the only service when exactly one is supervised.
+ */
+static struct supervisor_service *
+supervisor_lookup(struct supervisor *sup, const nvlist_t *nvl)
+{
+	if (!nvlist_exists_string(nvl, "service"))
+		return sup->service_count == 1 ? &sup->services[0] : NULL;
 
-	nvlist_destroy(nvl);
+	return bsearch(nvlist_get_string(nvl, "service"), sup->services, sup->service_count,
+		sizeof(struct supervisor_service), (void *) supervisor_service_name_cmp);
 }
 
 
 /*
- * Prepare to run the supervisor.
+ * Set up what the child is handed besides its command line: the listening sockets,
+ * which stay open from one run to the next, and the readiness channel.
  */
-static void
-supervisor_prepare(struct supervisor *sup)
+static bool
+supervisor_service_prepare(struct supervisor_service *ss)
 {
-	sigset_t sigs;
+	struct childproc *proc = &ss->svc.proc;
+	struct listener_set *listen = &ss->svc.listen;
+	char errbuf[256];
 
-	assert(sup != NULL);
+	if (!listener_open_all(listen, errbuf, sizeof errbuf))
+	{
+		syslog(LOG_ERR, "%s: could not open socket %s", ss->svc.name, errbuf);
+		return false;
+	}
 
-	signal_block();
+	for (size_t i = 0; i < listen->count; i++)
+		proc->pass_fds[i] = listen->items[i].fd;
 
-	sigemptyset(&sigs);
-	sigaddset(&sigs, SIGCHLD);
-	sigaddset(&sigs, SIGTERM);
-	sigaddset(&sigs, SIGQUIT);
+	proc->pass_fd_count = listen->count;
+	proc->listen_fds = listen->count > 0;
 
-	sup->signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+	/* without its channel the service still runs, it just never counts as ready */
+	if (!notify_prepare(&ss->notify))
+		syslog(LOG_ERR, "%s: could not set up readiness notification: %s", ss->svc.name, strerror(errno));
 
-	umask(sup->umask);
-}
+	proc->notify_fd = ss->notify.wr;
+	proc->notify_fd_to = ss->notify.config.fd;
 
+	ss->child_env[0] = ss->notify.env[0] ? ss->notify.env : NULL;
+	proc->child_env = ss->child_env;
 
-#define SVC_SIGMAX (8 * sizeof(sigset_t) + 1)
-typedef bool (*sighdl_fn_t)(struct supervisor *sup);
+	return true;
+}
 
 
+/*
+ * Take a token from the host-wide spawn limit.  Without one the start is queued, and
+ * retried when spawn_timer_fd fires.
+ */
 static bool
-sighdl_chld(struct supervisor *sup)
+supervisor_service_admit(struct supervisor_service *ss)
 {
-	bool should_restart = childproc_monitor(&sup->proc);
+	uint64_t now_ns = respawn_now();
+	uint64_t wait_ns, due_ns;
+	struct itimerspec its = {};
 
-	if (!should_restart)
-	{
-		childproc_setstate(&sup->proc, CHILDPROC_STOPPING);
-		childproc_monitor(&sup->proc);
+	if (ss->spawn_limit == NULL)
+		return true;
 
-		sup->exiting = true;
+	wait_ns = spawnlimit_acquire(ss->spawn_limit, &ss->spawn_ticket, ss->svc.spawn_priority, now_ns);
+	if (wait_ns == 0)
+	{
+		ss->spawn_queued = false;
 		return true;
 	}
 
-	if (sup->proc.respawn_delay)
+	if (ss->spawn_timer_fd < 0)
+		ss->spawn_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	due_ns = now_ns + wait_ns;
+	its.it_value.tv_sec = due_ns / 1000000000ULL;
+	its.it_value.tv_nsec = due_ns % 1000000000ULL;
+
+	/* better a start over the limit than one which never comes */
+	if (ss->spawn_timer_fd < 0 || timerfd_settime(ss->spawn_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	{
+		syslog(LOG_ERR, "%s: could not queue for the spawn limit: %s", ss->svc.name, strerror(errno));
+		spawnlimit_cancel(ss->spawn_limit, &ss->spawn_ticket);
+		ss->spawn_queued = false;
 		return true;
+	}
 
-	childproc_start(&sup->proc);
+	ss->spawn_queued = true;
 	return false;
 }
 
 
-static bool
-sighdl_term(struct supervisor *sup)
+/*
+ * Leave the spawn limit queue, if the service is in it.
+ */
+static void
+supervisor_service_unqueue(struct supervisor_service *ss)
 {
-	sup->exiting = true;
-	childproc_setstate(&sup->proc, CHILDPROC_DOWN);
-	childproc_kill(&sup->proc, true);
-	return true;
-}
+	struct itimerspec its = {};
 
+	if (!ss->spawn_queued)
+		return;
 
-static const sighdl_fn_t sighdl_fns[SVC_SIGMAX] = {
-	[SIGCHLD] = sighdl_chld,
-	[SIGTERM] = sighdl_term,
-	[SIGQUIT] = sighdl_term
-};
+	spawnlimit_cancel(ss->spawn_limit, &ss->spawn_ticket);
+	timerfd_settime(ss->spawn_timer_fd, 0, &its, NULL);
+	ss->spawn_queued = false;
+}
 
 
-/*
- * Main supervision loop.
- */
 static void
-supervisor_run(struct supervisor *sup)
+supervisor_service_start(struct supervisor_service *ss)
 {
-	bool pending_restart = false;
+	struct childproc *proc = &ss->svc.proc;
 
-	assert(sup != NULL);
+	respawn_cancel(&proc->respawn);
+	ss->waiting = false;
+	ss->idle_stop = false;
+
+	/* a start retried for the spawn limit was requested when it was first queued */
+	if (!ss->spawn_queued)
+		proc->times.requested_ns = respawn_now();
 
-	childproc_start(&sup->proc);
+	if (!supervisor_service_admit(ss))
+		return;
+	ss->run_log_offset = ss->ring.end;
 
-	while (!sup->exiting)
+	if (supervisor_service_prepare(ss))
 	{
-		struct pollfd pfds[2] = {
-			[0] = {.fd = sup->signal_fd, .events = POLLIN},
-			[1] = {.fd = sup->manager_fd, .events = POLLIN}
-		};
+		bool started = childproc_start(proc);
 
-		if (sup->proc.state != CHILDPROC_UP || sup->proc.state != CHILDPROC_READY)
-			childproc_setstate(&sup->proc, CHILDPROC_UP);
+		notify_started(&ss->notify);
 
-		if (poll(pfds, sup->watch_fds, !pending_restart ? -1 : (sup->proc.respawn_delay * 1000)) < 0)
-			abort();
+		if (proc->times.fork_ns != 0)
+			histogram_record(&ss->latency[SUPERVISOR_LATENCY_SPAWN], proc->times.fork_ns - proc->times.requested_ns);
 
-		if (pfds[1].revents & POLLIN)
-			supervisor_ipc(sup);
+		if (proc->times.exec_ns != 0)
+			histogram_record(&ss->latency[SUPERVISOR_LATENCY_EXEC], proc->times.exec_ns - proc->times.fork_ns);
 
-		if (pfds[0].revents & POLLIN)
+		/* up means running; ready is only reached when the service says so */
+		if (started)
 		{
-			struct signalfd_siginfo si;
-
-			if (read(sup->signal_fd, &si, sizeof si) < (ssize_t) sizeof(si))
-				abort();
+			clock_gettime(CLOCK_MONOTONIC, &ss->last_activity);
+			ss->idle_cpu = 0;
 
-			if (si.ssi_signo != SIGCHLD)
-				continue;
+			accounting_started(&ss->acct, &proc->cgroup);
 
-			if (sighdl_fns[si.ssi_signo] != NULL)
-			{
-				pending_restart = sighdl_fns[si.ssi_signo](sup);
-				if (pending_restart)
-					continue;
-			}
+			childproc_setstate(proc, CHILDPROC_UP);
+			return;
 		}
 
-		/* if a restart was enqueued, handle it now */
-		if (pending_restart)
-		{
-			childproc_start(&sup->proc);
-			pending_restart = false;
-		}
+		/* a child which failed before exec is reaped through its pidfd like any crash */
+		if (proc->child_pid != 0)
+			return;
 	}
-}
 
+	/* no child could be created at all: back off as from a crash, but never spin */
+	proc->restart_count++;
+	childproc_setstate(proc, CHILDPROC_CRASHED);
 
-static void
-usage(void)
-{
-	printf("usage: svc-supervise [options] -- [program] [arguments]\n\nOptions:\n\n");
+	if (!respawn_crashed(&proc->respawn, respawn_now(), 0))
+	{
+		syslog(LOG_INFO, "%s: could not be started %d times, giving up", ss->svc.name, proc->respawn.policy.max + 1);
+		childproc_setstate(proc, CHILDPROC_DOWN);
+		return;
+	}
 
-	printf("    --help                        this message\n");
-	printf("    --stdout=PATH                 redirect program stdout to PATH\n");
-	printf("    --stderr=PATH                 redirect program stderr to PATH\n");
-	printf("    --chdir=PATH                  change directory to PATH\n");
-	printf("    --chroot=PATH                 change root directory to PATH\n");
-	printf("    --respawn-delay=SECONDS       wait SECONDS before respawning\n");
-	printf("    --respawn-max=NUMBER          give up respawning after NUMBER times\n");
-	printf("    --manager-fd=NUMBER           perform manager-supervisor IPC on the given\n");
-	printf("                                  descriptor number\n");
-	printf("    --umask=UMASK                 set supervisor umask\n");
+	if (proc->respawn.delay_ms < 1000)
+		proc->respawn.delay_ms = 1000;
 
-	exit(EXIT_SUCCESS);
+	if (!respawn_arm(&proc->respawn, respawn_now()))
+	{
+		syslog(LOG_ERR, "%s: could not schedule a restart: %s", ss->svc.name, strerror(errno));
+		childproc_setstate(proc, CHILDPROC_DOWN);
+	}
 }
 
 
-const char *shortopts = "D:m:d:r:e:1:2:u:g:h";
-const struct option longopts[] = {
-	{"respawn-delay",	1, NULL, 'D'},
-	{"respawn-max",		1, NULL, 'm'},
-	{"chdir",		1, NULL, 'd'},
-	{"chroot",		1, NULL, 'r'},
-#ifdef NOTYET
-	{"env",			1, NULL, 'e'},
-#endif
-	{"stdout",		1, NULL, '1'},
-	{"stderr",		1, NULL, '2'},
-	{"uid",			1, NULL, 'u'},
-	{"gid",			1, NULL, 'g'},
-	{"umask",		1, NULL, 'k'},
-	{"help",		0, NULL, 'h'},
-	{"manager-fd",		1, NULL, 128},
-	{NULL,			0, NULL, 0  },
-};
-
-
+/*
+ * Hold the sockets of an on-demand service without running it, until a client connects
+ * or sends.  Without its sockets the service is started as usual, and retried from there.
+ */
 static void
-redirect_descriptor(int *des, const char *path)
+supervisor_service_wait(struct supervisor_service *ss)
 {
-	int fileno;
+	char errbuf[256];
 
-	assert(des != NULL);
-	assert(path != NULL);
+	if (!listener_open_all(&ss->svc.listen, errbuf, sizeof errbuf) || !listener_watch(&ss->svc.listen))
+	{
+		supervisor_service_start(ss);
+		return;
+	}
 
-	fileno = open(path, O_CREAT | O_APPEND | O_RDWR);
-	if (fileno < 0)
-		err(1, "redirection of %s", path);
+	/* a client which came while the last run was stopping was seen by nobody */
+	listener_drain(&ss->svc.listen);
+	if (listener_pending(&ss->svc.listen))
+	{
+		supervisor_service_start(ss);
+		return;
+	}
 
-	*des = fileno;
+	respawn_cancel(&ss->svc.proc.respawn);
+	ss->idle_stop = false;
+	ss->waiting = true;
 }
 
 
 /*
- * Set up the supervisor object and begin supervision.
+ * Schedule a restart of a crashed service once the delay chosen by its respawn policy
+ * has elapsed.
  */
-int
-main(int argc, char *argv[])
+static void
+supervisor_service_schedule(struct supervisor_service *ss)
 {
-	int ret;
-	struct supervisor sup = {};
-
-	sup.exiting = false;
-	sup.manager_fd = -1;
-	sup.watch_fds = 1;
-	sup.umask = 022;
+	struct respawn *r = &ss->svc.proc.respawn;
 
-	sup.proc.child_uid = -1;
-	sup.proc.child_gid = -1;
+	ss->restarts++;
 
-	if (argc < 2)
-		usage();
-
-	/* set up the supervisor object */
-	while ((ret = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+	if (r->delay_ms == 0)
 	{
-		switch (ret)
-		{
-			case 'h':
-				usage();
-				break;
+		supervisor_service_start(ss);
+		return;
+	}
 
-			case '1':
-				redirect_descriptor(&sup.proc.stdout_fd, optarg);
-				break;
+	syslog(LOG_INFO, "%s: restarting in %.3f s", ss->svc.name, r->delay_ms / 1e3);
 
-			case '2':
-				redirect_descriptor(&sup.proc.stderr_fd, optarg);
-				break;
+	if (!respawn_arm(r, respawn_now()))
+	{
+		syslog(LOG_ERR, "%s: could not arm respawn timer: %s", ss->svc.name, strerror(errno));
+		supervisor_service_start(ss);
+	}
+}
 
-			case 'd':
-				sup.proc.dir_chdir = optarg;
-				break;
 
-			case 'r':
-				sup.proc.dir_chroot = optarg;
-				break;
+static nvlist_t *
+supervisor_reply(const char *method, const struct supervisor_service *ss, uint64_t id)
+{
+	nvlist_t *obj = nvlist_create(0);
 
-			case 'D':
-				sup.proc.respawn_delay = atoi(optarg);
-				break;
+	ipc_obj_prepare(obj, method, id, true);
+	nvlist_add_string(obj, "service", ss->svc.name);
 
-			case 'm':
-				sup.proc.respawn_max = atoi(optarg);
-				break;
+	return obj;
+}
 
-			case 'u':
-				sup.proc.child_uid = uid_resolve(optarg);
-				if (sup.proc.child_uid == -1)
-				{
-					fprintf(stderr, "%s: could not resolve user: %s, aborting\n", argv[0], optarg);
-					return EXIT_FAILURE;
-				}
 
-				break;
+static void
+supervisor_pending_push(struct supervisor_pending *pending, uint64_t id)
+{
+	if (pending->count == pending->size)
+	{
+		pending->size = pending->size ? pending->size * 2 : 4;
+		pending->ids = realloc(pending->ids, pending->size * sizeof(uint64_t));
+		if (pending->ids == NULL)
+			abort();
+	}
 
-			case 'g':
-				sup.proc.child_gid = gid_resolve(optarg);
-				if (sup.proc.child_gid == -1)
-				{
-					fprintf(stderr, "%s: could not resolve group: %s, aborting\n", argv[0], optarg);
-					return EXIT_FAILURE;
-				}
+	pending->ids[pending->count++] = id;
+}
 
-				break;
 
-			case 'k':
-				parse_mode(&sup.umask, optarg);
+/*
+ * Send the replies owed for kill requests once the service is down, in the order
+ * the requests arrived.
+ */
+static void
+supervisor_reply_kill(struct supervisor *sup, struct supervisor_service *ss)
+{
+	nvlist_t *obj;
+
+	for (size_t i = 0; i < ss->kill_requests.count; i++)
+	{
+		obj = supervisor_reply("kill", ss, ss->kill_requests.ids[i]);
+
+		nvlist_add_bool(obj, "success", ss->svc.proc.state == CHILDPROC_DOWN);
+		nvlist_add_number(obj, "stop_duration_ns", ss->svc.proc.stop_duration_ns);
+
+		if (sup->manager_fd >= 0)
+			nvlist_send(sup->manager_fd, obj);
+
+		nvlist_destroy(obj);
+	}
+
+	ss->kill_requests.count = 0;
+}
+
+
+/*
+ * Send the replies owed for restart requests once the new child has been started.
+ */
+static void
+supervisor_reply_restart(struct supervisor *sup, struct supervisor_service *ss)
+{
+	nvlist_t *obj;
+
+	for (size_t i = 0; i < ss->restart_requests.count; i++)
+	{
+		obj = supervisor_reply("restart", ss, ss->restart_requests.ids[i]);
+
+		nvlist_add_bool(obj, "success", ss->svc.proc.child_pid != 0);
+		nvlist_add_number(obj, "pid", ss->svc.proc.child_pid);
+
+		if (sup->manager_fd >= 0)
+			nvlist_send(sup->manager_fd, obj);
+
+		nvlist_destroy(obj);
+	}
+
+	ss->restart_requests.count = 0;
+}
+
+
+/*
+ * Begin stopping a service.  Returns false if it is already down.
+ */
+static bool
+supervisor_service_stop(struct supervisor_service *ss)
+{
+	/* the child is gone and the rest already killed: the stop completes once they are */
+	if (ss->tree_exiting)
+	{
+		childproc_setstate(&ss->svc.proc, CHILDPROC_STOPPING);
+		return true;
+	}
+
+	return childproc_stop_begin(&ss->svc.proc);
+}
+
+
+/*
+ * A stop requested over IPC has completed.  A restart is only honoured if no kill
+ * was requested in the meantime.
+ */
+static void
+supervisor_service_stopped(struct supervisor *sup, struct supervisor_service *ss)
+{
+	if (ss->restart_requests.count > 0 && ss->kill_requests.count == 0 && !sup->exiting)
+		supervisor_service_start(ss);
+
+	supervisor_reply_kill(sup, ss);
+
+	/* a start held back by the spawn limit is answered once it happens */
+	if (!ss->spawn_queued)
+		supervisor_reply_restart(sup, ss);
+}
+
+
+/*
+ * Process a supervisor IPC kill command.  The reply is sent once the child is gone.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_kill(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+
+	(void) manager_fd;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	respawn_cancel(&ss->svc.proc.respawn);
+	supervisor_service_unqueue(ss);
+	ss->waiting = false;
+	supervisor_pending_push(&ss->kill_requests, ipc_obj_id(nvl));
+
+	if (!supervisor_service_stop(ss))
+		supervisor_service_stopped(sup, ss);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Process a supervisor IPC list command.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_list(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	nvlist_t *obj, *services;
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "list", ipc_obj_id(nvl), true);
+
+	services = nvlist_create(0);
+	for (size_t i = 0; i < sup->service_count; i++)
+		nvlist_add_number(services, sup->services[i].svc.name, sup->services[i].svc.proc.state);
+
+	nvlist_move_nvlist(obj, "services", services);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Process a supervisor IPC restart command.  The reply is sent once the new child is started.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_restart(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+
+	(void) manager_fd;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	ss->svc.proc.restart_count = 0;
+	respawn_reset(&ss->svc.proc.respawn);
+	supervisor_pending_push(&ss->restart_requests, ipc_obj_id(nvl));
+
+	if (!supervisor_service_stop(ss))
+		supervisor_service_stopped(sup, ss);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Push a state change to a subscribed manager.  Events are kept small, since a
+ * manager watching many services receives one for every transition.
+ */
+static void
+supervisor_state_changed(struct childproc *proc, childproc_state_t old_state, void *opaque)
+{
+	struct supervisor *sup = opaque;
+	struct supervisor_service *ss = CONTAINER_OF(proc, struct supervisor_service, svc.proc);
+	nvlist_t *obj;
+
+	statuspage_publish(&sup->status_page, ss - sup->services, ss->svc.name, proc);
+
+	if (!sup->subscribed || sup->manager_fd < 0)
+		return;
+
+	obj = supervisor_reply("subscribe", ss, sup->subscribe_id);
+
+	nvlist_add_number(obj, "state", proc->state);
+	nvlist_add_number(obj, "old_state", old_state);
+	nvlist_add_number(obj, "timestamp_ns", proc->state_changed.tv_sec * 1000000000ULL + proc->state_changed.tv_nsec);
+
+	if (proc->state == CHILDPROC_CRASHED || proc->state == CHILDPROC_DOWN)
+	{
+		nvlist_add_number(obj, "pid", proc->exit_pid);
+		nvlist_add_number(obj, "exit_status", proc->exit_status);
+	}
+	else
+		nvlist_add_number(obj, "pid", proc->child_pid);
+
+	if (nvlist_send(sup->manager_fd, obj) < 0)
+		sup->subscribed = false;
+
+	nvlist_destroy(obj);
+}
+
+
+/*
+ * Process a supervisor IPC subscribe command.  The reply carries the current state of
+ * every service, so that no change can be missed between it and the first event.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_subscribe(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	nvlist_t *obj, *services;
+
+	sup->subscribed = true;
+	sup->subscribe_id = ipc_obj_id(nvl);
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "subscribe", sup->subscribe_id, true);
+
+	services = nvlist_create(0);
+	for (size_t i = 0; i < sup->service_count; i++)
+		nvlist_add_number(services, sup->services[i].svc.name, sup->services[i].svc.proc.state);
+
+	nvlist_move_nvlist(obj, "services", services);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Process a supervisor IPC unsubscribe command.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_unsubscribe(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	nvlist_t *obj;
+
+	sup->subscribed = false;
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "unsubscribe", ipc_obj_id(nvl), true);
+	nvlist_add_bool(obj, "success", true);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Process a supervisor IPC spawn-limit command: the host-wide limit, and for each
+ * priority the starts queued now and the starts granted and waited for so far.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_spawn_limit(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct spawnlimit_stats stats;
+	nvlist_t *obj, *classes;
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "spawn-limit", ipc_obj_id(nvl), true);
+
+	if (!spawnlimit_stats(&sup->spawn_limit, respawn_now(), &stats))
+	{
+		nvlist_add_bool(obj, "success", false);
+		nvlist_send(manager_fd, obj);
+		nvlist_destroy(obj);
+
+		return IPC_OBJ_OK;
+	}
+
+	nvlist_add_bool(obj, "success", true);
+	nvlist_add_number(obj, "rate", stats.rate);
+	nvlist_add_number(obj, "burst", stats.burst);
+	nvlist_add_number(obj, "tokens", stats.tokens);
+
+	classes = nvlist_create(0);
+	for (int i = 0; i < SPAWNLIMIT_CLASS_COUNT; i++)
+	{
+		const struct spawnlimit_class_stats *c = &stats.classes[i];
+		nvlist_t *class = nvlist_create(0);
+
+		nvlist_add_number(class, "queued", c->queued);
+		nvlist_add_number(class, "granted", c->metrics.granted);
+		nvlist_add_number(class, "waited", c->metrics.waited);
+		nvlist_add_number(class, "wait_ns_total", c->metrics.wait_ns_total);
+		nvlist_add_number(class, "wait_ns_max", c->metrics.wait_ns_max);
+
+		nvlist_move_nvlist(classes, spawnlimit_class_name(i), class);
+	}
+
+	nvlist_move_nvlist(obj, "classes", classes);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Process a supervisor IPC status command.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_status(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+	struct childproc *proc;
+	nvlist_t *obj;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	proc = &ss->svc.proc;
+	obj = supervisor_reply("status", ss, ipc_obj_id(nvl));
+
+	nvlist_add_string(obj, "prog_name", proc->prog_name);
+
+	if (proc->dir_chroot)
+		nvlist_add_string(obj, "dir_chroot", proc->dir_chroot);
+
+	if (proc->dir_chdir)
+		nvlist_add_string(obj, "dir_chdir", proc->dir_chdir);
+
+	nvlist_add_number(obj, "state", proc->state);
+	nvlist_add_number(obj, "pid", proc->child_pid);
+
+	nvlist_add_number(obj, "uid", proc->child_uid);
+	nvlist_add_number(obj, "gid", proc->child_gid);
+
+	nvlist_add_number(obj, "restart_count", proc->restart_count);
+
+	nvlist_add_number(obj, "respawn_delay", proc->respawn.policy.delay);
+	nvlist_add_number(obj, "respawn_delay_max", proc->respawn.policy.delay_max);
+	nvlist_add_number(obj, "respawn_jitter", proc->respawn.policy.jitter);
+	nvlist_add_number(obj, "respawn_max", proc->respawn.policy.max);
+	nvlist_add_number(obj, "respawn_period", proc->respawn.policy.period);
+	nvlist_add_number(obj, "respawn_healthy", proc->respawn.policy.healthy);
+	nvlist_add_number(obj, "respawn_last", proc->respawn_last);
+
+	/* where the policy stands: the backoff step, the crashes in the window, and any restart due */
+	nvlist_add_number(obj, "respawn_attempt", proc->respawn.attempt);
+	nvlist_add_number(obj, "respawn_delay_ms", proc->respawn.delay_ms);
+	nvlist_add_number(obj, "respawn_crashes", respawn_window(&proc->respawn, respawn_now()));
+	nvlist_add_bool(obj, "respawn_gave_up", proc->respawn.gave_up);
+
+	if (proc->respawn.pending)
+		nvlist_add_number(obj, "respawn_due_ns", proc->respawn.due_ns);
+
+	nvlist_add_number(obj, "kill_delay", proc->kill_delay);
+	nvlist_add_number(obj, "stop_duration_ns", proc->stop_duration_ns);
+
+	if (proc->state == CHILDPROC_READY)
+		nvlist_add_number(obj, "ready_ns", proc->ready.tv_sec * 1000000000ULL + proc->ready.tv_nsec);
+
+	if (ss->notify.main_pid > 0)
+		nvlist_add_number(obj, "main_pid", ss->notify.main_pid);
+
+	if (ss->notify.status[0])
+		nvlist_add_string(obj, "status_text", ss->notify.status);
+
+	nvlist_add_string(obj, "spawn_priority", spawnlimit_class_name(ss->svc.spawn_priority));
+
+	if (ss->spawn_queued)
+		nvlist_add_number(obj, "spawn_queued_ns", ss->spawn_ticket.since_ns);
+
+	if (proc->cgroup.path != NULL)
+	{
+		nvlist_add_string(obj, "cgroup", proc->cgroup.path);
+		nvlist_add_bool(obj, "cgroup_populated", cgroup_update(&proc->cgroup));
+	}
+
+	if (ss->svc.on_demand)
+	{
+		nvlist_add_bool(obj, "waiting", ss->waiting);
+		nvlist_add_number(obj, "idle_timeout", ss->svc.idle_timeout);
+	}
+
+	if (ss->ring.data != NULL)
+	{
+		nvlist_add_number(obj, "log_buffer_size", ss->ring.size);
+		nvlist_add_number(obj, "log_start_offset", ringbuf_start(&ss->ring));
+		nvlist_add_number(obj, "log_end_offset", ss->ring.end);
+		nvlist_add_number(obj, "run_log_offset", ss->run_log_offset);
+	}
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+static void
+supervisor_add_usage(nvlist_t *obj, const struct accounting_usage *u)
+{
+	nvlist_add_number(obj, "cpu_user_us", u->cpu_user_us);
+	nvlist_add_number(obj, "cpu_system_us", u->cpu_system_us);
+	nvlist_add_number(obj, "ctxsw_voluntary", u->ctxsw_voluntary);
+	nvlist_add_number(obj, "ctxsw_involuntary", u->ctxsw_involuntary);
+	nvlist_add_number(obj, "io_read_bytes", u->io_read_bytes);
+	nvlist_add_number(obj, "io_write_bytes", u->io_write_bytes);
+}
+
+
+/*
+ * Process a supervisor IPC stats command: what the run in progress uses, as last sampled,
+ * and the totals over every run.  Without periodic sampling the run is sampled now.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_stats(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+	struct childproc *proc;
+	struct accounting_usage total;
+	nvlist_t *obj, *run, *usage;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	proc = &ss->svc.proc;
+
+	if (proc->child_pid != 0 && (sup->stats_interval <= 0 || ss->acct.live.sampled_ns == 0))
+		accounting_sample(&ss->acct, proc->child_pid, &proc->cgroup, respawn_now());
+
+	obj = supervisor_reply("stats", ss, ipc_obj_id(nvl));
+
+	if (proc->child_pid != 0 && ss->acct.live.sampled_ns != 0)
+	{
+		const struct accounting_sample *live = &ss->acct.live;
+
+		run = nvlist_create(0);
+		nvlist_add_number(run, "sampled_ns", live->sampled_ns);
+		supervisor_add_usage(run, &live->usage);
+		nvlist_add_number(run, "rss_bytes", live->rss_bytes);
+		nvlist_add_number(run, "pss_bytes", live->pss_bytes);
+
+		if (proc->cgroup.path != NULL)
+			nvlist_add_number(run, "memory_bytes", live->memory_bytes);
+
+		nvlist_add_number(run, "fd_count", live->fd_count);
+		nvlist_add_number(run, "threads", live->threads);
+
+		nvlist_move_nvlist(obj, "run", run);
+	}
+
+	accounting_cumulative(&ss->acct, &total);
+
+	usage = nvlist_create(0);
+	supervisor_add_usage(usage, &total);
+	nvlist_add_number(usage, "maxrss_bytes", ss->acct.maxrss_bytes);
+	nvlist_add_number(usage, "runs", ss->acct.runs);
+	nvlist_move_nvlist(obj, "total", usage);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+static void
+supervisor_add_histogram(nvlist_t *obj, const char *name, const struct histogram *h)
+{
+	nvlist_t *hist = nvlist_create(0), *buckets;
+	char upper[24];
+
+	nvlist_add_number(hist, "count", h->count);
+	nvlist_add_number(hist, "sum_ns", h->sum_ns);
+	nvlist_add_number(hist, "min_ns", h->min_ns);
+	nvlist_add_number(hist, "max_ns", h->max_ns);
+	nvlist_add_number(hist, "p50_ns", histogram_percentile(h, 50));
+	nvlist_add_number(hist, "p90_ns", histogram_percentile(h, 90));
+	nvlist_add_number(hist, "p99_ns", histogram_percentile(h, 99));
+
+	/* only the buckets holding anything, named by the bound their values are below */
+	buckets = nvlist_create(0);
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (h->buckets[i] == 0)
+			continue;
+
+		if (i == HISTOGRAM_BUCKETS - 1)
+			snprintf(upper, sizeof upper, "inf");
+		else
+			snprintf(upper, sizeof upper, "%" PRIu64, histogram_bucket_upper(i));
+
+		nvlist_add_number(buckets, upper, h->buckets[i]);
+	}
+
+	nvlist_move_nvlist(hist, "buckets", buckets);
+	nvlist_move_nvlist(obj, name, hist);
+}
+
+
+/*
+ * Process a supervisor IPC timings command: when the last run passed each point of its
+ * life, and how long each phase has taken over every run.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_timings(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+	const struct childproc_times *t;
+	nvlist_t *obj, *times, *latency;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	t = &ss->svc.proc.times;
+	obj = supervisor_reply("timings", ss, ipc_obj_id(nvl));
+
+	times = nvlist_create(0);
+	nvlist_add_number(times, "requested_ns", t->requested_ns);
+	nvlist_add_number(times, "fork_ns", t->fork_ns);
+	nvlist_add_number(times, "exec_ns", t->exec_ns);
+	nvlist_add_number(times, "ready_ns", t->ready_ns);
+	nvlist_add_number(times, "stop_ns", t->stop_ns);
+	nvlist_add_number(times, "reap_ns", t->reap_ns);
+	nvlist_move_nvlist(obj, "times", times);
+
+	latency = nvlist_create(0);
+	for (int i = 0; i < SUPERVISOR_LATENCY_COUNT; i++)
+		supervisor_add_histogram(latency, supervisor_latency_names[i], &ss->latency[i]);
+
+	nvlist_move_nvlist(obj, "latency", latency);
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Send the ring contents from *offset onwards, split into chunks.  Returns false if the
+ * manager connection failed.
+ */
+static bool
+supervisor_send_log(struct supervisor *sup, struct supervisor_service *ss, uint64_t id, uint64_t *offset, bool follow)
+{
+	char buf[SUPERVISOR_LOG_CHUNK];
+	uint64_t requested = *offset;
+	size_t n;
+
+	do
+	{
+		nvlist_t *obj = supervisor_reply("log", ss, id);
+		uint64_t chunk_offset;
+
+		n = ringbuf_read(&ss->ring, offset, buf, sizeof buf);
+		chunk_offset = *offset - n;
+
+		nvlist_add_bool(obj, "success", true);
+		nvlist_add_bool(obj, "follow", follow);
+		nvlist_add_number(obj, "offset", chunk_offset);
+		nvlist_add_number(obj, "next_offset", *offset);
+		nvlist_add_bool(obj, "truncated", chunk_offset > requested);
+		nvlist_add_bool(obj, "more", *offset < ss->ring.end);
+		nvlist_add_binary(obj, "data", buf, n);
+
+		requested = *offset;
+
+		if (nvlist_send(sup->manager_fd, obj) < 0)
+		{
+			nvlist_destroy(obj);
+			return false;
+		}
+
+		nvlist_destroy(obj);
+	} while (*offset < ss->ring.end);
+
+	return true;
+}
+
+
+/*
+ * Process a supervisor IPC log command.
+ *
+ * mode "tail" (the default) returns the last "bytes" bytes of output, "since-offset" returns
+ * everything from "offset" onwards, and "follow" does the same and then keeps streaming new
+ * output as it arrives until "unfollow" is requested.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_log(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+	const char *mode = "tail";
+	uint64_t offset;
+
+	if ((ss = supervisor_lookup(sup, nvl)) == NULL)
+		return IPC_OBJ_SERVICE_NOT_FOUND;
+
+	if (nvlist_exists_string(nvl, "mode"))
+		mode = nvlist_get_string(nvl, "mode");
+
+	if (ss->ring.data == NULL || !strcmp(mode, "unfollow"))
+	{
+		nvlist_t *obj = supervisor_reply("log", ss, ipc_obj_id(nvl));
+
+		ss->log_follow = false;
+
+		nvlist_add_bool(obj, "success", ss->ring.data != NULL);
+		if (ss->ring.data == NULL)
+			nvlist_add_string(obj, "error", "log buffer disabled");
+
+		nvlist_send(manager_fd, obj);
+		nvlist_destroy(obj);
+
+		return IPC_OBJ_OK;
+	}
+
+	if (!strcmp(mode, "tail"))
+	{
+		uint64_t bytes = nvlist_exists_number(nvl, "bytes") ? nvlist_get_number(nvl, "bytes") : ss->ring.size;
+
+		offset = bytes < ss->ring.end ? ss->ring.end - bytes : 0;
+		if (offset < ringbuf_start(&ss->ring))
+			offset = ringbuf_start(&ss->ring);
+	}
+	else if (!strcmp(mode, "since-offset") || !strcmp(mode, "follow"))
+		offset = nvlist_exists_number(nvl, "offset") ? nvlist_get_number(nvl, "offset") : 0;
+	else
+		return IPC_OBJ_INVALID;
+
+	if (!supervisor_send_log(sup, ss, ipc_obj_id(nvl), &offset, false))
+		return IPC_OBJ_OK;
+
+	/* streamed output carries the id of the request which started following */
+	if (!strcmp(mode, "follow"))
+	{
+		ss->log_follow = true;
+		ss->log_follow_id = ipc_obj_id(nvl);
+		ss->log_follow_offset = offset;
+	}
+
+	return IPC_OBJ_OK;
+}
+
+
+/*
+ * Capture output from a service and push it to a following manager.
+ */
+static void
+supervisor_service_pump(struct supervisor *sup, struct supervisor_service *ss, struct logcapture *lc)
+{
+	if (logcapture_pump(lc) <= 0 || !ss->log_follow)
+		return;
+
+	if (sup->manager_fd < 0 || !supervisor_send_log(sup, ss, ss->log_follow_id, &ss->log_follow_offset, true))
+		ss->log_follow = false;
+}
+
+
+static const char *supervisor_state_names[] = {
+	[CHILDPROC_INITIAL] = "initial",
+	[CHILDPROC_STARTING] = "starting",
+	[CHILDPROC_UP] = "up",
+	[CHILDPROC_READY] = "ready",
+	[CHILDPROC_CRASHED] = "crashed",
+	[CHILDPROC_STOPPING] = "stopping",
+	[CHILDPROC_DOWN] = "down",
+};
+
+
+static void supervisor_render_ipc(struct supervisor *sup, struct metrics_buf *mb);
+
+
+/*
+ * Render the metrics of every service, family by family as OpenMetrics wants them grouped.
+ */
+static void
+supervisor_render(struct supervisor *sup, struct metrics_buf *mb)
+{
+	char service[METRICS_LABEL_MAX], labels[METRICS_LABEL_MAX + 64];
+	uint64_t now_ns = respawn_now();
+
+	metrics_family(mb, "svc_service_state", "stateset", "State of the service.");
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		metrics_escape(service, sizeof service, sup->services[i].svc.name);
+
+		for (size_t j = 0; j < ARRAY_SIZE(supervisor_state_names); j++)
+			metrics_printf(mb, "svc_service_state{service=\"%s\",svc_service_state=\"%s\"} %d\n", service,
+				supervisor_state_names[j], sup->services[i].svc.proc.state == j);
+	}
+
+	metrics_family(mb, "svc_service_restarts", "counter", "Times the service was restarted after exiting.");
+	for (size_t i = 0; i < sup->service_count; i++)
+		metrics_printf(mb, "svc_service_restarts_total{service=\"%s\"} %" PRIu64 "\n",
+			metrics_escape(service, sizeof service, sup->services[i].svc.name), sup->services[i].restarts);
+
+	metrics_family(mb, "svc_service_exits", "counter", "Exits not requested, by exit code or signal.");
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		const struct supervisor_service *ss = &sup->services[i];
+
+		metrics_escape(service, sizeof service, ss->svc.name);
+
+		for (size_t j = 0; j < ARRAY_SIZE(ss->exit_codes); j++)
+			if (ss->exit_codes[j] > 0)
+				metrics_printf(mb, "svc_service_exits_total{service=\"%s\",cause=\"exit\",code=\"%zu\"} %" PRIu32 "\n",
+					service, j, ss->exit_codes[j]);
+
+		for (size_t j = 0; j < ARRAY_SIZE(ss->exit_signals); j++)
+			if (ss->exit_signals[j] > 0)
+				metrics_printf(mb, "svc_service_exits_total{service=\"%s\",cause=\"signal\",code=\"%zu\"} %" PRIu32 "\n",
+					service, j, ss->exit_signals[j]);
+	}
+
+	metrics_family(mb, "svc_service_uptime_seconds", "gauge", "How long the current run has lasted.");
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		const struct childproc *proc = &sup->services[i].svc.proc;
+		uint64_t started_ns = proc->started.tv_sec * 1000000000ULL + proc->started.tv_nsec;
+		uint64_t uptime_ns = proc->child_pid != 0 && now_ns > started_ns ? now_ns - started_ns : 0;
+
+		metrics_printf(mb, "svc_service_uptime_seconds{service=\"%s\"} %" PRIu64 ".%09" PRIu64 "\n",
+			metrics_escape(service, sizeof service, sup->services[i].svc.name),
+			uptime_ns / 1000000000, uptime_ns % 1000000000);
+	}
+
+	metrics_family(mb, "svc_service_cpu_seconds", "counter", "CPU time used over every run, as last sampled.");
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		struct accounting_usage u;
+
+		accounting_cumulative(&sup->services[i].acct, &u);
+		metrics_escape(service, sizeof service, sup->services[i].svc.name);
+
+		metrics_printf(mb, "svc_service_cpu_seconds_total{service=\"%s\",mode=\"user\"} %" PRIu64 ".%06" PRIu64 "\n",
+			service, u.cpu_user_us / 1000000, u.cpu_user_us % 1000000);
+		metrics_printf(mb, "svc_service_cpu_seconds_total{service=\"%s\",mode=\"system\"} %" PRIu64 ".%06" PRIu64 "\n",
+			service, u.cpu_system_us / 1000000, u.cpu_system_us % 1000000);
+	}
+
+	metrics_family(mb, "svc_service_latency_seconds", "histogram", "Duration of each phase of a run.");
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		metrics_escape(service, sizeof service, sup->services[i].svc.name);
+
+		for (int j = 0; j < SUPERVISOR_LATENCY_COUNT; j++)
+		{
+			snprintf(labels, sizeof labels, "service=\"%s\",phase=\"%s\"", service, supervisor_latency_names[j]);
+			metrics_histogram(mb, "svc_service_latency_seconds", labels, &sup->services[i].latency[j]);
+		}
+	}
+
+	supervisor_render_ipc(sup, mb);
+	metrics_eof(mb);
+}
+
+
+/*
+ * Render into mb, growing it until everything fits.  Returns false if it could not grow.
+ */
+static bool
+supervisor_render_metrics(struct supervisor *sup, struct metrics_buf *mb)
+{
+	for (;;)
+	{
+		metrics_buf_reset(mb);
+		supervisor_render(sup, mb);
+
+		if (!mb->overflow)
+			return true;
+
+		if (!metrics_buf_grow(mb))
+			return false;
+	}
+}
+
+
+/*
+ * Process a supervisor IPC metrics command: everything the supervisor counts, as
+ * OpenMetrics text.
+ */
+static ipc_obj_return_code_t
+supervisor_ipc_metrics(int manager_fd, const nvlist_t *nvl, struct supervisor *sup)
+{
+	nvlist_t *obj;
+	bool ok;
+
+	ok = supervisor_render_metrics(sup, &sup->metrics_ipc);
+
+	obj = nvlist_create(0);
+	ipc_obj_prepare(obj, "metrics", ipc_obj_id(nvl), true);
+	nvlist_add_bool(obj, "success", ok);
+
+	if (ok)
+		nvlist_add_string(obj, "text", metrics_text(&sup->metrics_ipc));
+
+	nvlist_send(manager_fd, obj);
+	nvlist_destroy(obj);
+
+	return IPC_OBJ_OK;
+}
+
+
+static const ipc_hdl_dispatch_t supervisor_dispatch_table[] = {
+	{"kill", (ipc_hdl_dispatch_fn_t) supervisor_ipc_kill},
+	{"list", (ipc_hdl_dispatch_fn_t) supervisor_ipc_list},
+	{"log", (ipc_hdl_dispatch_fn_t) supervisor_ipc_log},
+	{"metrics", (ipc_hdl_dispatch_fn_t) supervisor_ipc_metrics},
+	{"restart", (ipc_hdl_dispatch_fn_t) supervisor_ipc_restart},
+	{"spawn-limit", (ipc_hdl_dispatch_fn_t) supervisor_ipc_spawn_limit},
+	{"stats", (ipc_hdl_dispatch_fn_t) supervisor_ipc_stats},
+	{"status", (ipc_hdl_dispatch_fn_t) supervisor_ipc_status},
+	{"subscribe", (ipc_hdl_dispatch_fn_t) supervisor_ipc_subscribe},
+	{"timings", (ipc_hdl_dispatch_fn_t) supervisor_ipc_timings},
+	{"unsubscribe", (ipc_hdl_dispatch_fn_t) supervisor_ipc_unsubscribe},
+};
+
+static ipc_hdl_index_t supervisor_dispatch_index;
+
+
+static void
+supervisor_render_ipc(struct supervisor *sup, struct metrics_buf *mb)
+{
+	char labels[64];
+
+	metrics_family(mb, "svc_ipc_requests", "counter", "IPC requests handled, by method.");
+	for (size_t i = 0; i <= ARRAY_SIZE(supervisor_dispatch_table); i++)
+		metrics_printf(mb, "svc_ipc_requests_total{method=\"%s\"} %" PRIu64 "\n",
+			i < ARRAY_SIZE(supervisor_dispatch_table) ? supervisor_dispatch_table[i].method : "unknown",
+			sup->ipc_counters[i].requests);
+
+	metrics_family(mb, "svc_ipc_errors", "counter", "IPC requests answered with an error, by method.");
+	for (size_t i = 0; i <= ARRAY_SIZE(supervisor_dispatch_table); i++)
+		metrics_printf(mb, "svc_ipc_errors_total{method=\"%s\"} %" PRIu64 "\n",
+			i < ARRAY_SIZE(supervisor_dispatch_table) ? supervisor_dispatch_table[i].method : "unknown",
+			sup->ipc_counters[i].errors);
+
+	metrics_family(mb, "svc_ipc_request_seconds", "histogram", "Time taken to handle an IPC request, by method.");
+	for (size_t i = 0; i < ARRAY_SIZE(supervisor_dispatch_table); i++)
+	{
+		snprintf(labels, sizeof labels, "method=\"%s\"", supervisor_dispatch_table[i].method);
+		metrics_histogram(mb, "svc_ipc_request_seconds", labels, &sup->ipc_counters[i].latency);
+	}
+}
+
+
+/*
+ * Check whether another request is already queued on the manager socket.
+ */
+static bool
+supervisor_ipc_queued(const struct supervisor *sup)
+{
+	struct pollfd pfd = {.fd = sup->manager_fd, .events = POLLIN};
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+
+/*
+ * Process supervisor IPC.  Every request already queued is handled in one go; none
+ * of the handlers wait for a child, so replies to slow requests such as kill are sent
+ * later and may overtake each other, to be matched up by their ipc:id.
+ */
+static void
+supervisor_ipc(struct supervisor *sup)
+{
+	struct supervisor_ipc_counter *counter;
+	nvlist_t *nvl;
+	ipc_obj_return_code_t rc;
+	uint64_t started_ns;
+	ssize_t method;
+	int handled = 0;
+
+	do
+	{
+		nvl = nvlist_recv(sup->manager_fd, 0);
+		if (nvl == NULL)
+		{
+			/* XXX: IPC failure occured, maybe handle more gracefully */
+			close(sup->manager_fd);
+			sup->manager_fd = -1;
+			return;
+		}
+
+		started_ns = respawn_now();
+
+		/* the entry which handled it is the one to count it against */
+		rc = ipc_obj_dispatch_entry(sup->manager_fd, nvl, &supervisor_dispatch_index, sup, &method);
+		if (rc != IPC_OBJ_OK)
+			ipc_obj_error(sup->manager_fd, nvl, rc);
+
+		counter = &sup->ipc_counters[method >= 0 ? (size_t) method : ARRAY_SIZE(supervisor_dispatch_table)];
+
+		counter->requests++;
+		if (rc != IPC_OBJ_OK)
+			counter->errors++;
+
+		histogram_record(&counter->latency, respawn_now() - started_ns);
+
+		nvlist_destroy(nvl);
+	} while (sup->manager_fd >= 0 && ++handled < SUPERVISOR_IPC_BATCH && supervisor_ipc_queued(sup));
+}
+
+
+/*
+ * Give the service its own cgroup, emptied of anything an earlier supervisor left there,
+ * and set its limits on it.
+ */
+static void
+supervisor_service_cgroup(struct supervisor *sup, struct supervisor_service *ss)
+{
+	struct cgroup *cg = &ss->svc.proc.cgroup;
+	char errbuf[256];
+
+	if (!cgroup_create(cg, sup->cgroup_parent, ss->svc.name))
+		err(1, "creating cgroup for %s in %s", ss->svc.name, sup->cgroup_parent);
+
+	if (cg->populated)
+	{
+		syslog(LOG_WARNING, "%s: killing processes left in %s", ss->svc.name, cg->path);
+		cgroup_kill(cg);
+	}
+
+	if (!cgroup_apply(cg, &ss->svc.limits, errbuf, sizeof errbuf))
+		syslog(LOG_ERR, "%s: %s", ss->svc.name, errbuf);
+}
+
+
+/*
+ * Point the captures of a service at its log buffer.  The captures keep a pointer to the
+ * ring, so this waits until the service table has stopped moving.
+ */
+static void
+supervisor_service_attach_rings(struct supervisor_service *ss)
+{
+	if (ss->ring.data == NULL)
+		return;
+
+	for (size_t i = 0; i < ARRAY_SIZE(ss->logs); i++)
+	{
+		if (ss->logs[i].pipe_rd >= 0 && !logcapture_attach_ring(&ss->logs[i], &ss->ring))
+			err(1, "buffering the output of %s", ss->svc.name);
+	}
+}
+
+
+/*
+ * Prepare to run the supervisor.
+ */
+static void
+supervisor_prepare(struct supervisor *sup)
+{
+	sigset_t sigs;
+	char errbuf[128];
+
+	assert(sup != NULL);
+
+	if (!ipc_hdl_index_init(&supervisor_dispatch_index, supervisor_dispatch_table, ARRAY_SIZE(supervisor_dispatch_table), errbuf, sizeof errbuf))
+		errx(1, "IPC dispatch table: %s", errbuf);
+
+	signal_block();
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGQUIT);
+
+	/* SIGUSR1 dumps the timings; without a file to dump them to it keeps its default action */
+	if (sup->timings_path != NULL)
+		sigaddset(&sigs, SIGUSR1);
+
+	/* signal_block() leaves out the rest, which would otherwise act before they are read */
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	sup->signal_fd = signalfd(-1, &sigs, SFD_CLOEXEC);
+
+	umask(sup->umask);
+
+	/* sorted by name, so that IPC requests can be routed with bsearch() */
+	qsort(sup->services, sup->service_count, sizeof(struct supervisor_service), supervisor_service_cmp);
+
+	sup->pfds = calloc(SUPERVISOR_SLOT(sup->service_count, 0), sizeof(struct pollfd));
+	if (sup->pfds == NULL)
+		abort();
+
+	sup->ipc_counters = calloc(ARRAY_SIZE(supervisor_dispatch_table) + 1, sizeof(struct supervisor_ipc_counter));
+	if (sup->ipc_counters == NULL)
+		abort();
+
+	/* sized for what a scrape usually takes, so that one seldom has to grow it */
+	if (!metrics_buf_init(&sup->metrics_ipc, 32768 + sup->service_count * 8192, 0))
+		abort();
+
+	if (sup->metrics_listen.count > 0)
+	{
+		if (!metrics_buf_init(&sup->metrics_http, 32768 + sup->service_count * 8192, SUPERVISOR_METRICS_HEADER))
+			abort();
+
+		if (!listener_open_all(&sup->metrics_listen, errbuf, sizeof errbuf))
+			errx(1, "metrics: could not open %s", errbuf);
+	}
+
+	if (sup->status_path != NULL && !statuspage_create(&sup->status_page, sup->status_path, sup->service_count))
+		err(1, "creating status page %s", sup->status_path);
+
+	if (sup->cgroup_parent != NULL)
+	{
+		for (size_t i = 0; i < sup->service_count; i++)
+			supervisor_service_cgroup(sup, &sup->services[i]);
+	}
+
+	if (sup->spawn_limit_path != NULL && !spawnlimit_open(&sup->spawn_limit, sup->spawn_limit_path, sup->spawn_rate, sup->spawn_burst))
+		err(1, "opening spawn limit %s", sup->spawn_limit_path);
+
+	/* the service table does not move from here on */
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		sup->services[i].svc.proc.state_fn = supervisor_state_changed;
+		sup->services[i].svc.proc.state_opaque = sup;
+
+		if (sup->spawn_limit.page != NULL)
+			sup->services[i].spawn_limit = &sup->spawn_limit;
+
+		supervisor_service_attach_rings(&sup->services[i]);
+
+		statuspage_publish(&sup->status_page, i, sup->services[i].svc.name, &sup->services[i].svc.proc);
+	}
+}
+
+
+#define SVC_SIGMAX (8 * sizeof(sigset_t) + 1)
+typedef void (*sighdl_fn_t)(struct supervisor *sup);
+
+
+/*
+ * Handle a child which has exited.
+ */
+static void
+supervisor_service_exited(struct supervisor *sup, struct supervisor_service *ss, int status)
+{
+	bool stopping = ss->svc.proc.state == CHILDPROC_STOPPING && ss->svc.proc.times.stop_ns != 0;
+
+	notify_reset(&ss->notify);
+	accounting_ended(&ss->acct, &ss->svc.proc.exit_rusage, &ss->svc.proc.cgroup);
+
+	if (!stopping && WIFEXITED(status))
+		ss->exit_codes[WEXITSTATUS(status)]++;
+	else if (!stopping && WIFSIGNALED(status) && WTERMSIG(status) < NSIG)
+		ss->exit_signals[WTERMSIG(status)]++;
+
+	if (childproc_reaped(&ss->svc.proc, status) && !sup->exiting)
+		supervisor_service_schedule(ss);
+	else
+	{
+		childproc_setstate(&ss->svc.proc, CHILDPROC_DOWN);
+		supervisor_service_stopped(sup, ss);
+
+		if (stopping)
+			histogram_record(&ss->latency[SUPERVISOR_LATENCY_STOP], ss->svc.proc.stop_duration_ns);
+
+		/* stopped for being idle, rather than by request: wait for the next client */
+		if (ss->idle_stop && ss->svc.proc.child_pid == 0 && !sup->exiting)
+			supervisor_service_wait(ss);
+	}
+}
+
+
+/*
+ * The next token of the spawn limit is due: try the held back start again.
+ */
+static void
+supervisor_service_spawn_due(struct supervisor *sup, struct supervisor_service *ss)
+{
+	uint64_t expirations;
+
+	if (read(ss->spawn_timer_fd, &expirations, sizeof expirations) < 0 || !ss->spawn_queued)
+		return;
+
+	supervisor_service_start(ss);
+
+	if (!ss->spawn_queued)
+		supervisor_reply_restart(sup, ss);
+}
+
+
+/*
+ * The child has been reaped.  In a cgroup, whatever it left running is killed, and the
+ * exit is only handled once the cgroup is empty: neither a stop nor a restart completes
+ * while any process of the last run remains.
+ */
+static void
+supervisor_service_reaped(struct supervisor *sup, struct supervisor_service *ss, int status)
+{
+	struct cgroup *cg = &ss->svc.proc.cgroup;
+
+	if (!cgroup_update(cg))
+	{
+		supervisor_service_exited(sup, ss, status);
+		return;
+	}
+
+	syslog(LOG_INFO, "%s: killing what pid %d left running", ss->svc.name, ss->svc.proc.exit_pid);
+
+	ss->tree_exiting = true;
+	ss->tree_status = status;
+
+	if (!cgroup_kill(cg))
+		syslog(LOG_ERR, "%s: could not kill cgroup %s: %s", ss->svc.name, cg->path, strerror(errno));
+}
+
+
+/*
+ * cgroup.events changed while waiting for the last processes of a run to go.
+ */
+static void
+supervisor_service_emptied(struct supervisor *sup, struct supervisor_service *ss)
+{
+	if (!ss->tree_exiting || cgroup_update(&ss->svc.proc.cgroup))
+		return;
+
+	ss->tree_exiting = false;
+	supervisor_service_exited(sup, ss, ss->tree_status);
+}
+
+
+/*
+ * A new client came to an on-demand service: start it if it is waiting for one, or
+ * note that it is in use.
+ */
+static void
+supervisor_service_activated(struct supervisor_service *ss)
+{
+	if (!listener_drain(&ss->svc.listen))
+		return;
+
+	if (ss->waiting)
+	{
+		syslog(LOG_INFO, "%s: starting on demand", ss->svc.name);
+		supervisor_service_start(ss);
+	}
+	else
+		clock_gettime(CLOCK_MONOTONIC, &ss->last_activity);
+}
+
+
+/*
+ * CPU time used so far by a process, in clock ticks, or 0 if it cannot be read.
+ */
+static uint64_t
+supervisor_cpu_ticks(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime, stime;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof buf - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+
+	buf[len] = 0;
+
+	/* the command name may hold spaces and parentheses; the fields after it do not */
+	if ((p = strrchr(buf, ')')) == NULL ||
+		sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+		return 0;
+
+	return utime + stime;
+}
+
+
+/*
+ * Stop the on-demand services which have gone idle_timeout seconds without a new client
+ * or any CPU time used, which catches clients still connected.  Returns the poll timeout
+ * until the next check is due, or -1.
+ */
+static int
+supervisor_run_idle(struct supervisor *sup)
+{
+	struct timespec now;
+	int timeout = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		struct supervisor_service *ss = &sup->services[i];
+		struct childproc *proc = &ss->svc.proc;
+		int64_t remaining;
+		uint64_t cpu;
+
+		if (!ss->svc.on_demand || ss->svc.idle_timeout <= 0 || ss->idle_stop ||
+			(proc->state != CHILDPROC_UP && proc->state != CHILDPROC_READY))
+			continue;
+
+		remaining = (ss->last_activity.tv_sec + ss->svc.idle_timeout - now.tv_sec) * 1000 +
+			(ss->last_activity.tv_nsec - now.tv_nsec) / 1000000;
+
+		if (remaining <= 0)
+		{
+			cpu = supervisor_cpu_ticks(proc->child_pid);
+
+			if (cpu != ss->idle_cpu)
+			{
+				ss->idle_cpu = cpu;
+				ss->last_activity = now;
+				remaining = ss->svc.idle_timeout * 1000;
+			}
+			else
+			{
+				syslog(LOG_INFO, "%s: idle for %d s, stopping", ss->svc.name, ss->svc.idle_timeout);
+
+				ss->idle_stop = true;
+				childproc_stop_begin(proc);
+				continue;
+			}
+		}
+
+		if (timeout < 0 || remaining < timeout)
+			timeout = remaining;
+	}
+
+	return timeout;
+}
+
+
+/*
+ * Sample what every running service uses, if the next round is due.  Returns the poll
+ * timeout until it is, or -1 without periodic sampling.
+ */
+static int
+supervisor_run_stats(struct supervisor *sup)
+{
+	uint64_t now_ns;
+
+	if (sup->stats_interval <= 0)
+		return -1;
+
+	now_ns = respawn_now();
+
+	if (now_ns >= sup->stats_due_ns)
+	{
+		for (size_t i = 0; i < sup->service_count; i++)
+		{
+			struct childproc *proc = &sup->services[i].svc.proc;
+
+			if (proc->child_pid != 0)
+				accounting_sample(&sup->services[i].acct, proc->child_pid, &proc->cgroup, now_ns);
+		}
+
+		sup->stats_due_ns = now_ns + sup->stats_interval * 1000000000ULL;
+	}
+
+	/* rounded up, so that the next round is not a millisecond early and skipped */
+	return (sup->stats_due_ns - now_ns + 999999) / 1000000;
+}
+
+
+/*
+ * Handle what a service sent over its readiness channel.
+ */
+static void
+supervisor_service_notified(struct supervisor_service *ss)
+{
+	struct childproc *proc = &ss->svc.proc;
+	int events = notify_read(&ss->notify, proc->child_pid);
+
+	if (events & NOTIFY_EVENT_MAINPID)
+		syslog(LOG_INFO, "%s: main pid is now %d", ss->svc.name, ss->notify.main_pid);
+
+	if (events & NOTIFY_EVENT_READY && proc->state == CHILDPROC_UP)
+	{
+		childproc_setstate(proc, CHILDPROC_READY);
+		histogram_record(&ss->latency[SUPERVISOR_LATENCY_READY], proc->times.ready_ns - proc->times.exec_ns);
+
+		syslog(LOG_INFO, "%s: ready in %.3f s", ss->svc.name,
+			(proc->ready.tv_sec - proc->started.tv_sec) + (proc->ready.tv_nsec - proc->started.tv_nsec) / 1e9);
+	}
+}
+
+
+/*
+ * Write the timings of every service to timings_path, one record per line as
+ * space-separated key=value pairs: one "times" record per service, then one
+ * "latency" record per phase, whose buckets are listed as UPPER:COUNT where UPPER is the
+ * bound in nanoseconds the values are below.  The file is replaced at once, so readers
+ * never see half of it.
+ */
+static void
+supervisor_write_timings(struct supervisor *sup)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	if (sup->timings_path == NULL)
+		return;
+
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", sup->timings_path) >= (int) sizeof tmp ||
+		(fd = mkstemp(tmp)) < 0)
+	{
+		syslog(LOG_ERR, "could not write timings to %s: %s", sup->timings_path, strerror(errno));
+		return;
+	}
+
+	/* mkstemp() leaves it readable by us alone */
+	fchmod(fd, 0644);
+
+	if ((f = fdopen(fd, "w")) == NULL)
+	{
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		const struct supervisor_service *ss = &sup->services[i];
+		const struct childproc_times *t = &ss->svc.proc.times;
+
+		fprintf(f, "service=%s record=times requested_ns=%" PRIu64 " fork_ns=%" PRIu64 " exec_ns=%" PRIu64
+			" ready_ns=%" PRIu64 " stop_ns=%" PRIu64 " reap_ns=%" PRIu64 "\n", ss->svc.name,
+			t->requested_ns, t->fork_ns, t->exec_ns, t->ready_ns, t->stop_ns, t->reap_ns);
+
+		for (int j = 0; j < SUPERVISOR_LATENCY_COUNT; j++)
+		{
+			const struct histogram *h = &ss->latency[j];
+			const char *sep = "";
+
+			fprintf(f, "service=%s record=latency phase=%s count=%" PRIu64 " sum_ns=%" PRIu64 " min_ns=%" PRIu64
+				" max_ns=%" PRIu64 " p50_ns=%" PRIu64 " p90_ns=%" PRIu64 " p99_ns=%" PRIu64 " buckets=",
+				ss->svc.name, supervisor_latency_names[j], h->count, h->sum_ns, h->min_ns, h->max_ns,
+				histogram_percentile(h, 50), histogram_percentile(h, 90), histogram_percentile(h, 99));
+
+			for (size_t k = 0; k < HISTOGRAM_BUCKETS; k++)
+			{
+				if (h->buckets[k] == 0)
+					continue;
+
+				if (k == HISTOGRAM_BUCKETS - 1)
+					fprintf(f, "%sinf:%" PRIu32, sep, h->buckets[k]);
+				else
+					fprintf(f, "%s%" PRIu64 ":%" PRIu32, sep, histogram_bucket_upper(k), h->buckets[k]);
+
+				sep = ",";
+			}
+
+			fputc('\n', f);
+		}
+	}
+
+	if (fclose(f) != 0 || rename(tmp, sup->timings_path) < 0)
+	{
+		syslog(LOG_ERR, "could not write timings to %s: %s", sup->timings_path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+
+static void
+sighdl_usr1(struct supervisor *sup)
+{
+	supervisor_write_timings(sup);
+}
+
+
+static void
+supervisor_metrics_close(struct supervisor *sup)
+{
+	struct supervisor_metrics_client *c = &sup->metrics_client;
+
+	if (c->fd >= 0)
+		close(c->fd);
+
+	memset(c, 0, sizeof *c);
+	c->fd = -1;
+}
+
+
+/*
+ * Take the next metrics client, unless one is being served: the others wait in the
+ * listen backlog.
+ */
+static void
+supervisor_metrics_accept(struct supervisor *sup)
+{
+	struct supervisor_metrics_client *c = &sup->metrics_client;
+	int fd;
+
+	if (c->fd >= 0 ||
+		(fd = accept4(sup->metrics_listen.items[0].fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+
+	c->fd = fd;
+	c->deadline_ns = respawn_now() + SUPERVISOR_METRICS_TIMEOUT_MS * 1000000ULL;
+}
+
+
+/*
+ * Put the reply together once the request is complete: for a GET of any path the metrics,
+ * with the header written into the room left in front of them.
+ */
+static bool
+supervisor_metrics_reply(struct supervisor *sup)
+{
+	struct supervisor_metrics_client *c = &sup->metrics_client;
+	struct metrics_buf *mb = &sup->metrics_http;
+	char header[SUPERVISOR_METRICS_HEADER];
+	int len;
+
+	if (strncmp(c->request, "GET ", 4))
+	{
+		metrics_buf_reset(mb);
+		len = snprintf(header, sizeof header,
+			"HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	}
+	else if (!supervisor_render_metrics(sup, mb))
+	{
+		metrics_buf_reset(mb);
+		len = snprintf(header, sizeof header,
+			"HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	}
+	else
+		len = snprintf(header, sizeof header,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n", mb->len - mb->reserve);
+
+	if (len < 0 || (size_t) len > mb->reserve)
+		return false;
+
+	memcpy(mb->data + mb->reserve - len, header, len);
+	c->sent = mb->reserve - len;
+	c->end = mb->len;
+
+	return true;
+}
+
+
+/*
+ * The metrics client is readable or writable: read the request until its blank line, then
+ * send the reply as fast as the client takes it, and hang up.
+ */
+static void
+supervisor_metrics_serve(struct supervisor *sup)
+{
+	struct supervisor_metrics_client *c = &sup->metrics_client;
+	ssize_t n;
+
+	if (c->end == 0)
+	{
+		n = read(c->fd, c->request + c->request_len, sizeof c->request - 1 - c->request_len);
+
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (n <= 0)
+		{
+			supervisor_metrics_close(sup);
+			return;
+		}
+
+		c->request_len += n;
+		c->request[c->request_len] = 0;
+
+		/* a request which fills the buffer is answered as far as it got */
+		if (strstr(c->request, "\r\n\r\n") == NULL && c->request_len < sizeof c->request - 1)
+			return;
+
+		if (!supervisor_metrics_reply(sup))
+		{
+			supervisor_metrics_close(sup);
+			return;
+		}
+	}
+
+	while (c->sent < c->end)
+	{
+		n = send(c->fd, sup->metrics_http.data + c->sent, c->end - c->sent, MSG_NOSIGNAL);
+
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		if (n < 0)
+			break;
+
+		c->sent += n;
+	}
+
+	supervisor_metrics_close(sup);
+}
+
+
+/*
+ * Drop a metrics client which is too slow.  Returns the poll timeout until it would be,
+ * or -1 if none is being served.
+ */
+static int
+supervisor_run_metrics(struct supervisor *sup)
+{
+	uint64_t now_ns;
+
+	if (sup->metrics_client.fd < 0)
+		return -1;
+
+	now_ns = respawn_now();
+
+	if (now_ns >= sup->metrics_client.deadline_ns)
+	{
+		supervisor_metrics_close(sup);
+		return -1;
+	}
+
+	return (sup->metrics_client.deadline_ns - now_ns + 999999) / 1000000;
+}
+
+
+/*
+ * Children are normally tracked through their pidfds.  SIGCHLD is only used to reap
+ * children we could not open a pidfd for, e.g. on kernels older than 5.3.
+ */
+static void
+sighdl_chld(struct supervisor *sup)
+{
+	int status;
+
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		struct supervisor_service *ss = &sup->services[i];
+
+		if (ss->svc.proc.pidfd < 0 && childproc_collect(&ss->svc.proc, &status))
+			supervisor_service_reaped(sup, ss, status);
+	}
+}
+
+
+/*
+ * Stop every service at once; the supervisor exits when the last one is down, so a
+ * shutdown takes as long as the slowest service rather than the sum of all of them.
+ */
+static void
+sighdl_term(struct supervisor *sup)
+{
+	sup->exiting = true;
+
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		respawn_cancel(&sup->services[i].svc.proc.respawn);
+		supervisor_service_unqueue(&sup->services[i]);
+		sup->services[i].waiting = false;
+		supervisor_service_stop(&sup->services[i]);
+	}
+}
+
+
+static const sighdl_fn_t sighdl_fns[SVC_SIGMAX] = {
+	[SIGCHLD] = sighdl_chld,
+	[SIGTERM] = sighdl_term,
+	[SIGQUIT] = sighdl_term,
+	[SIGUSR1] = sighdl_usr1,
+};
+
+
+/*
+ * The supervisor is done once every service is down and either it is exiting or no
+ * manager remains to restart them.
+ */
+static bool
+supervisor_idle(const struct supervisor *sup)
+{
+	if (sup->manager_fd >= 0 && !sup->exiting)
+		return false;
+
+	for (size_t i = 0; i < sup->service_count; i++)
+		if (sup->services[i].svc.proc.state != CHILDPROC_DOWN || sup->services[i].waiting || sup->services[i].spawn_queued)
+			return false;
+
+	return true;
+}
+
+
+/*
+ * Main supervision loop.
+ */
+static void
+supervisor_run(struct supervisor *sup)
+{
+	assert(sup != NULL);
+
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		if (sup->services[i].svc.on_demand)
+			supervisor_service_wait(&sup->services[i]);
+		else
+			supervisor_service_start(&sup->services[i]);
+	}
+
+	while (!supervisor_idle(sup))
+	{
+		struct pollfd *pfds = sup->pfds;
+		int timeout, stats_timeout, metrics_timeout;
+
+		pfds[SUPERVISOR_GLOBAL_SIGNAL] = (struct pollfd) {.fd = sup->signal_fd, .events = POLLIN};
+		pfds[SUPERVISOR_GLOBAL_MANAGER] = (struct pollfd) {.fd = sup->manager_fd, .events = POLLIN};
+
+		/* one metrics client at a time: while it is served, the others wait to be accepted */
+		pfds[SUPERVISOR_GLOBAL_METRICS] = (struct pollfd) {
+			.fd = sup->metrics_listen.count > 0 && sup->metrics_client.fd < 0 ? sup->metrics_listen.items[0].fd : -1,
+			.events = POLLIN,
+		};
+		pfds[SUPERVISOR_GLOBAL_METRICS_CLIENT] = (struct pollfd) {
+			.fd = sup->metrics_client.fd,
+			.events = sup->metrics_client.end == 0 ? POLLIN : POLLOUT,
+		};
+
+		/* negative descriptors are ignored by poll(), so every service keeps fixed slots */
+		for (size_t i = 0; i < sup->service_count; i++)
+		{
+			struct childproc *proc = &sup->services[i].svc.proc;
+
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_PIDFD)] = (struct pollfd) {.fd = proc->pidfd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STOP_TIMER)] = (struct pollfd) {.fd = proc->stop_timer_fd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_RESPAWN)] = (struct pollfd) {.fd = proc->respawn.timer_fd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_SPAWN)] = (struct pollfd) {.fd = sup->services[i].spawn_timer_fd, .events = POLLIN};
+
+			/* cgroup.events is always readable; a change shows as POLLPRI */
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_CGROUP)] = (struct pollfd) {
+				.fd = sup->services[i].tree_exiting ? proc->cgroup.events_fd : -1,
+				.events = POLLPRI,
+			};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STDOUT)] = (struct pollfd) {.fd = sup->services[i].logs[0].pipe_rd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STDERR)] = (struct pollfd) {.fd = sup->services[i].logs[1].pipe_rd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_NOTIFY)] = (struct pollfd) {.fd = sup->services[i].notify.rd, .events = POLLIN};
+			pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_ACTIVATE)] = (struct pollfd) {.fd = sup->services[i].svc.listen.watch_fd, .events = POLLIN};
+		}
+
+		timeout = supervisor_run_idle(sup);
+		stats_timeout = supervisor_run_stats(sup);
+
+		if (timeout < 0 || (stats_timeout >= 0 && stats_timeout < timeout))
+			timeout = stats_timeout;
+
+		metrics_timeout = supervisor_run_metrics(sup);
+
+		if (timeout < 0 || (metrics_timeout >= 0 && metrics_timeout < timeout))
+			timeout = metrics_timeout;
+
+		if (poll(pfds, SUPERVISOR_SLOT(sup->service_count, 0), timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			abort();
+		}
+
+		for (size_t i = 0; i < sup->service_count; i++)
+		{
+			struct supervisor_service *ss = &sup->services[i];
+			int status;
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_PIDFD)].revents & POLLIN && childproc_collect(&ss->svc.proc, &status))
+				supervisor_service_reaped(sup, ss, status);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_CGROUP)].revents & POLLPRI)
+				supervisor_service_emptied(sup, ss);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STOP_TIMER)].revents & POLLIN)
+				childproc_stop_advance(&ss->svc.proc);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_RESPAWN)].revents & POLLIN && respawn_expired(&ss->svc.proc.respawn))
+				supervisor_service_start(ss);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_SPAWN)].revents & POLLIN)
+				supervisor_service_spawn_due(sup, ss);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STDOUT)].revents & POLLIN)
+				supervisor_service_pump(sup, ss, &ss->logs[0]);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_STDERR)].revents & POLLIN)
+				supervisor_service_pump(sup, ss, &ss->logs[1]);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_NOTIFY)].revents & (POLLIN | POLLHUP))
+				supervisor_service_notified(ss);
+
+			if (pfds[SUPERVISOR_SLOT(i, SUPERVISOR_SLOT_ACTIVATE)].revents & POLLIN)
+				supervisor_service_activated(ss);
+		}
+
+		if (pfds[SUPERVISOR_GLOBAL_MANAGER].revents & (POLLIN | POLLHUP))
+			supervisor_ipc(sup);
+
+		if (pfds[SUPERVISOR_GLOBAL_METRICS_CLIENT].revents)
+			supervisor_metrics_serve(sup);
+
+		if (pfds[SUPERVISOR_GLOBAL_METRICS].revents & POLLIN)
+			supervisor_metrics_accept(sup);
+
+		if (pfds[SUPERVISOR_GLOBAL_SIGNAL].revents & POLLIN)
+		{
+			struct signalfd_siginfo si;
+
+			if (read(sup->signal_fd, &si, sizeof si) < (ssize_t) sizeof(si))
+				abort();
+
+			if (si.ssi_signo < SVC_SIGMAX && sighdl_fns[si.ssi_signo] != NULL)
+				sighdl_fns[si.ssi_signo](sup);
+		}
+	}
+
+	/* whatever the children wrote last is still queued in the capture pipes */
+	for (size_t i = 0; i < sup->service_count; i++)
+	{
+		logcapture_pump(&sup->services[i].logs[0]);
+		logcapture_pump(&sup->services[i].logs[1]);
+
+		listener_close_all(&sup->services[i].svc.listen);
+		cgroup_destroy(&sup->services[i].svc.proc.cgroup);
+	}
+
+	supervisor_metrics_close(sup);
+	listener_close_all(&sup->metrics_listen);
+
+	supervisor_write_timings(sup);
+}
+
+
+static void
+usage(void)
+{
+	printf("usage: svc-supervise [options] -- [program] [arguments]\n");
+	printf("       svc-supervise [options] --service=FILE [--service=FILE...]\n");
+	printf("       svc-supervise [options] --service-dir=DIR [--service-dir=DIR...]\n\nOptions:\n\n");
+
+	printf("    --help                        this message\n");
+	printf("    --stdout=PATH                 redirect program stdout to PATH\n");
+	printf("    --stderr=PATH                 redirect program stderr to PATH\n");
+	printf("    --log-max-size=SIZE           start a new log segment every SIZE bytes\n");
+	printf("    --log-keep=NUMBER             keep NUMBER old log segments (default 5)\n");
+	printf("    --log-buffer-size=SIZE        keep the last SIZE bytes of output in memory\n");
+	printf("    --chdir=PATH                  change directory to PATH\n");
+	printf("    --chroot=PATH                 change root directory to PATH\n");
+	printf("    --respawn-delay=SECONDS       wait SECONDS before respawning\n");
+	printf("    --respawn-delay-max=SECONDS   double the delay after each crash, up to\n");
+	printf("                                  SECONDS (default 60)\n");
+	printf("    --respawn-jitter=PERCENT      shorten each delay by up to PERCENT at\n");
+	printf("                                  random (default 25)\n");
+	printf("    --respawn-healthy=SECONDS     reset the delay after running SECONDS\n");
+	printf("                                  (default 10)\n");
+	printf("    --respawn-max=NUMBER          give up after more than NUMBER crashes\n");
+	printf("    --respawn-period=SECONDS      only count crashes in the last SECONDS\n");
+	printf("    --manager-fd=NUMBER           perform manager-supervisor IPC on the given\n");
+	printf("                                  descriptor number\n");
+	printf("    --umask=UMASK                 set supervisor umask\n");
+	printf("    --stop-sequence=SEQUENCE      signals to stop the program with and seconds\n");
+	printf("                                  to wait after each, e.g. TERM:3,INT:2,KILL\n");
+	printf("    --service=FILE                supervise the service declared in FILE, may\n");
+	printf("                                  be given multiple times\n");
+	printf("    --service-cache=PATH          keep parsed service files in a cache at PATH\n");
+	printf("    --service-dir=DIR             supervise the services declared in DIR/*.ini,\n");
+	printf("                                  may be given multiple times\n");
+	printf("    --status-file=PATH            publish service states in a shared memory\n");
+	printf("                                  page at PATH\n");
+	printf("    --listen=ADDRESS              pass the program a socket listening on\n");
+	printf("                                  ADDRESS, e.g. tcp:127.0.0.1:80 or unix:PATH\n");
+	printf("    --on-demand                   start the program when the first client\n");
+	printf("                                  connects to a --listen socket\n");
+	printf("    --idle-timeout=SECONDS        stop an on-demand program after SECONDS\n");
+	printf("                                  without new clients or CPU use\n");
+	printf("    --ready=fd:NUMBER             the program writes a newline to descriptor\n");
+	printf("                                  NUMBER once it is ready\n");
+	printf("    --ready=notify                the program sends READY=1 to $NOTIFY_SOCKET\n");
+	printf("                                  once it is ready, as sd_notify(3)\n");
+	printf("    --cgroup=DIR                  run each service in its own cgroup under\n");
+	printf("                                  DIR, a cgroup v2 directory\n");
+	printf("    --cpu-max=LIMIT               limit the program to e.g. 50%% of one CPU\n");
+	printf("    --memory-max=SIZE             limit the program's memory to SIZE\n");
+	printf("    --memory-high=SIZE            throttle the program above SIZE of memory\n");
+	printf("    --io-max=LIMIT                limit the program's I/O, e.g.\n");
+	printf("                                  /dev/sda wbps=10M riops=1000\n");
+	printf("    --spawn-limit=PATH            take a token from the spawn limit shared\n");
+	printf("                                  through PATH before each start\n");
+	printf("    --spawn-rate=NUMBER           set the shared limit to NUMBER starts per\n");
+	printf("                                  second (default 20)\n");
+	printf("    --spawn-burst=NUMBER          let NUMBER starts through at once (default 8)\n");
+	printf("    --spawn-priority=CLASS        queue for the spawn limit as critical, high,\n");
+	printf("                                  normal or low\n");
+	printf("    --stats-interval=SECONDS      sample what services use every SECONDS\n");
+	printf("                                  (default 10, 0 to sample only when asked)\n");
+	printf("    --timings-file=PATH           write start and stop timings to PATH on\n");
+	printf("                                  SIGUSR1 and at exit\n");
+	printf("    --metrics-listen=ADDRESS      serve OpenMetrics over HTTP on ADDRESS, e.g.\n");
+	printf("                                  unix:/run/svc/NAME.metrics\n");
+
+	exit(EXIT_SUCCESS);
+}
+
+
+const char *shortopts = "D:m:d:r:e:1:2:u:g:s:S:L:K:B:P:C:R:n:l:oI:h";
+const struct option longopts[] = {
+	{"respawn-delay",	1, NULL, 'D'},
+	{"respawn-max",		1, NULL, 'm'},
+	{"chdir",		1, NULL, 'd'},
+	{"chroot",		1, NULL, 'r'},
+#ifdef NOTYET
+	{"env",			1, NULL, 'e'},
+#endif
+	{"stdout",		1, NULL, '1'},
+	{"stderr",		1, NULL, '2'},
+	{"uid",			1, NULL, 'u'},
+	{"gid",			1, NULL, 'g'},
+	{"umask",		1, NULL, 'k'},
+	{"service",		1, NULL, 's'},
+	{"service-cache",	1, NULL, 'C'},
+	{"service-dir",		1, NULL, 'R'},
+	{"stop-sequence",	1, NULL, 'S'},
+	{"log-max-size",	1, NULL, 'L'},
+	{"log-keep",		1, NULL, 'K'},
+	{"log-buffer-size",	1, NULL, 'B'},
+	{"status-file",		1, NULL, 'P'},
+	{"ready",		1, NULL, 'n'},
+	{"listen",		1, NULL, 'l'},
+	{"on-demand",		0, NULL, 'o'},
+	{"idle-timeout",	1, NULL, 'I'},
+	{"help",		0, NULL, 'h'},
+	{"manager-fd",		1, NULL, 128},
+	{"respawn-period",	1, NULL, 129},
+	{"respawn-delay-max",	1, NULL, 130},
+	{"respawn-jitter",	1, NULL, 131},
+	{"respawn-healthy",	1, NULL, 132},
+	{"spawn-limit",		1, NULL, 133},
+	{"spawn-rate",		1, NULL, 134},
+	{"spawn-burst",		1, NULL, 135},
+	{"spawn-priority",	1, NULL, 136},
+	{"cgroup",		1, NULL, 137},
+	{"cpu-max",		1, NULL, 138},
+	{"memory-max",		1, NULL, 139},
+	{"memory-high",		1, NULL, 140},
+	{"io-max",		1, NULL, 141},
+	{"stats-interval",	1, NULL, 142},
+	{"timings-file",	1, NULL, 143},
+	{"metrics-listen",	1, NULL, 144},
+	{NULL,			0, NULL, 0  },
+};
+
+
+/*
+ * Route the service's stdout and stderr through log captures.  With a log buffer, output
+ * is captured even if it is not written to disk.
+ */
+static void
+supervisor_service_setup_logs(struct supervisor_service *ss)
+{
+	struct service *svc = &ss->svc;
+	bool buffered = svc->log_buffer_size > 0;
+
+	if (buffered && !ringbuf_init(&ss->ring, svc->log_buffer_size))
+		err(1, "allocating log buffer for %s", svc->name);
+
+	if (svc->stdout_path != NULL || buffered)
+	{
+		if (!logcapture_open(&ss->logs[0], svc->stdout_path, svc->log_max_size, svc->log_keep))
+			err(1, "redirection of %s", svc->stdout_path != NULL ? svc->stdout_path : "stdout");
+
+		svc->proc.stdout_fd = ss->logs[0].pipe_wr;
+	}
+
+	/* both streams going to the same place share one capture */
+	if (ss->logs[0].pipe_wr >= 0 && (svc->stderr_path == svc->stdout_path ||
+		(svc->stderr_path != NULL && svc->stdout_path != NULL && !strcmp(svc->stderr_path, svc->stdout_path))))
+		svc->proc.stderr_fd = ss->logs[0].pipe_wr;
+	else if (svc->stderr_path != NULL || buffered)
+	{
+		if (!logcapture_open(&ss->logs[1], svc->stderr_path, svc->log_max_size, svc->log_keep))
+			err(1, "redirection of %s", svc->stderr_path != NULL ? svc->stderr_path : "stderr");
+
+		svc->proc.stderr_fd = ss->logs[1].pipe_wr;
+	}
+}
+
+
+/*
+ * Set up what the supervisor keeps for a service besides its declaration.
+ */
+static void
+supervisor_service_setup(struct supervisor_service *ss)
+{
+	supervisor_service_setup_logs(ss);
+	notify_init(&ss->notify, &ss->svc.ready);
+
+	if (ss->svc.listen.count > 0 && (ss->svc.proc.listen_fdnames = listener_names(&ss->svc.listen)) == NULL)
+		err(1, "naming the sockets of %s", ss->svc.name);
+}
+
+
+/*
+ * Add a service to the supervisor's service table.
+ */
+static struct supervisor_service *
+supervisor_add(struct supervisor *sup)
+{
+	struct supervisor_service *ss;
+
+	sup->services = realloc(sup->services, sizeof(struct supervisor_service) * (sup->service_count + 1));
+	if (sup->services == NULL)
+		err(1, "allocating service table");
+
+	ss = &sup->services[sup->service_count++];
+	memset(ss, 0, sizeof *ss);
+
+	logcapture_init(&ss->logs[0]);
+	logcapture_init(&ss->logs[1]);
+	notify_init(&ss->notify, NULL);
+	accounting_init(&ss->acct);
+
+	for (int i = 0; i < SUPERVISOR_LATENCY_COUNT; i++)
+		histogram_init(&ss->latency[i]);
+	spawnlimit_ticket_init(&ss->spawn_ticket);
+	ss->spawn_timer_fd = -1;
+
+	return ss;
+}
+
+
+/*
+ * Finish setting up a service just loaded from path.
+ */
+static void
+supervisor_add_loaded(struct supervisor *sup, struct supervisor_service *ss, const char *path)
+{
+	for (size_t i = 0; i + 1 < sup->service_count; i++)
+		if (!strcmp(sup->services[i].svc.name, ss->svc.name))
+			errx(1, "%s: duplicate service name '%s'", path, ss->svc.name);
+
+	supervisor_service_setup(ss);
+}
+
+
+/*
+ * Load a service declaration given with --service.
+ */
+static void
+supervisor_add_file(struct supervisor *sup, const char *path, const struct service_loader *loader)
+{
+	struct supervisor_service *ss = supervisor_add(sup);
+	char errbuf[256];
+
+	if (!service_load(&ss->svc, path, loader, errbuf, sizeof errbuf))
+		errx(1, "%s: %s", path, errbuf);
+
+	supervisor_add_loaded(sup, ss, path);
+}
+
+
+/*
+ * Take over a service loaded from a directory given with --service-dir.
+ */
+static void
+supervisor_add_dir_entry(struct svcdir_entry *entry, void *opaque)
+{
+	struct supervisor *sup = opaque;
+	struct supervisor_service *ss;
+
+	if (!entry->loaded)
+		errx(1, "%s: %s", entry->path, entry->error);
+
+	ss = supervisor_add(sup);
+	ss->svc = entry->svc;
+
+	supervisor_add_loaded(sup, ss, entry->path);
+}
+
+
+/*
+ * Parse the value of an integer option, within the bounds a service file has for the same key.
+ */
+static bool
+supervisor_option_int(const char *text, int min, int max, int *value)
+{
+	char *end;
+	long l;
+
+	errno = 0;
+	l = strtol(text, &end, 10);
+
+	if (end == text || *end || errno != 0 || l < min || l > max)
+		return false;
+
+	*value = (int) l;
+	return true;
+}
+
+
+/*
+ * Set up the supervisor object and begin supervision.
+ */
+int
+main(int argc, char *argv[])
+{
+	int ret;
+	struct supervisor sup = {};
+	struct service cmdline;
+	argv_t service_files = {};
+	argv_t service_dirs = {};
+	const char *cache_path = NULL;
+	const char *progname = argv[0];
+	char errbuf[256];
+
+	sup.exiting = false;
+	sup.manager_fd = -1;
+	sup.umask = 022;
+	sup.stats_interval = 10;
+	sup.metrics_listen.watch_fd = -1;
+	sup.metrics_client.fd = -1;
+
+	/* options other than --service describe the service given on the command line */
+	service_init(&cmdline, NULL);
+
+	if (argc < 2)
+		usage();
+
+	/* set up the supervisor object */
+	while ((ret = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+	{
+		switch (ret)
+		{
+			case 'h':
+				usage();
+				break;
+
+			case '1':
+				free(cmdline.stdout_path);
+				cmdline.stdout_path = strdup(optarg);
+				break;
+
+			case '2':
+				free(cmdline.stderr_path);
+				cmdline.stderr_path = strdup(optarg);
+				break;
+
+			case 'L':
+				if (!logcapture_parse_size(&cmdline.log_max_size, optarg))
+				{
+					fprintf(stderr, "%s: invalid log size: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'K':
+				if (!supervisor_option_int(optarg, 0, 1000, &cmdline.log_keep))
+				{
+					fprintf(stderr, "%s: invalid number of log segments to keep: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'B':
+				if (!logcapture_parse_size(&cmdline.log_buffer_size, optarg))
+				{
+					fprintf(stderr, "%s: invalid log buffer size: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'd':
+				cmdline.proc.dir_chdir = strdup(optarg);
+				break;
+
+			case 'r':
+				cmdline.proc.dir_chroot = strdup(optarg);
+				break;
+
+			case 'D':
+				if (!supervisor_option_int(optarg, 0, 86400, &cmdline.proc.respawn.policy.delay))
+				{
+					fprintf(stderr, "%s: invalid respawn delay: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'm':
+				if (!supervisor_option_int(optarg, 0, RESPAWN_MAX_LIMIT, &cmdline.proc.respawn.policy.max))
+				{
+					fprintf(stderr, "%s: invalid respawn limit: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 129:
+				if (!supervisor_option_int(optarg, 0, INT_MAX, &cmdline.proc.respawn.policy.period))
+				{
+					fprintf(stderr, "%s: invalid respawn period: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 130:
+				if (!supervisor_option_int(optarg, 0, 86400, &cmdline.proc.respawn.policy.delay_max))
+				{
+					fprintf(stderr, "%s: invalid maximum respawn delay: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 131:
+				if (!supervisor_option_int(optarg, 0, 100, &cmdline.proc.respawn.policy.jitter))
+				{
+					fprintf(stderr, "%s: invalid respawn jitter: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 132:
+				if (!supervisor_option_int(optarg, 0, 86400, &cmdline.proc.respawn.policy.healthy))
+				{
+					fprintf(stderr, "%s: invalid respawn healthy time: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'u':
+				cmdline.proc.child_uid = uid_resolve(optarg);
+				if (cmdline.proc.child_uid == -1)
+				{
+					fprintf(stderr, "%s: could not resolve user: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'g':
+				cmdline.proc.child_gid = gid_resolve(optarg);
+				if (cmdline.proc.child_gid == -1)
+				{
+					fprintf(stderr, "%s: could not resolve group: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'k':
+				if (parse_mode(&sup.umask, optarg) < 0)
+				{
+					fprintf(stderr, "%s: invalid umask: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 's':
+				argv_append(&service_files, optarg);
+				break;
+
+			case 'C':
+				cache_path = optarg;
+				break;
+
+			case 'R':
+				argv_append(&service_dirs, optarg);
+				break;
+
+			case 'S':
+				if (!childproc_stop_parse(&cmdline.proc, optarg))
+				{
+					fprintf(stderr, "%s: invalid stop sequence: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'P':
+				sup.status_path = optarg;
+				break;
+
+			case 'o':
+				cmdline.on_demand = true;
+				break;
+
+			case 'I':
+				if (!supervisor_option_int(optarg, 0, 86400, &cmdline.idle_timeout))
+				{
+					fprintf(stderr, "%s: invalid idle timeout: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'l':
+				if (!listener_parse(&cmdline.listen, optarg, errbuf, sizeof errbuf))
+				{
+					fprintf(stderr, "%s: invalid socket: %s, aborting\n", argv[0], errbuf);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 'n':
+				if (!notify_parse(&cmdline.ready, optarg))
+				{
+					fprintf(stderr, "%s: invalid readiness notification: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
 				break;
 
 			case 128:
 				sup.manager_fd = atoi(optarg);
-				sup.watch_fds++;
+				break;
+
+			case 133:
+				sup.spawn_limit_path = optarg;
+				break;
+
+			case 134:
+				if (!supervisor_option_int(optarg, 0, SPAWNLIMIT_RATE_MAX, &sup.spawn_rate))
+				{
+					fprintf(stderr, "%s: invalid spawn rate: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 135:
+				if (!supervisor_option_int(optarg, 0, SPAWNLIMIT_RATE_MAX, &sup.spawn_burst))
+				{
+					fprintf(stderr, "%s: invalid spawn burst: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 136:
+				if (!spawnlimit_class_parse(&cmdline.spawn_priority, optarg))
+				{
+					fprintf(stderr, "%s: invalid spawn priority: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 137:
+				sup.cgroup_parent = optarg;
+				break;
+
+			case 138:
+				if (!cgroup_parse_cpu(&cmdline.limits, optarg))
+				{
+					fprintf(stderr, "%s: invalid CPU limit: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 139:
+			case 140:
+				if (!cgroup_parse_memory(ret == 139 ? &cmdline.limits.memory_max : &cmdline.limits.memory_high, optarg))
+				{
+					fprintf(stderr, "%s: invalid memory limit: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 141:
+				if (!cgroup_parse_io(&cmdline.limits, optarg, errbuf, sizeof errbuf))
+				{
+					fprintf(stderr, "%s: invalid I/O limit: %s: %s, aborting\n", argv[0], optarg, errbuf);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 142:
+				if (!supervisor_option_int(optarg, 0, 86400, &sup.stats_interval))
+				{
+					fprintf(stderr, "%s: invalid stats interval: %s, aborting\n", progname, optarg);
+					return EXIT_FAILURE;
+				}
+
+				break;
+
+			case 143:
+				sup.timings_path = optarg;
+				break;
+
+			case 144:
+				if (sup.metrics_listen.count > 0 || !listener_parse(&sup.metrics_listen, optarg, errbuf, sizeof errbuf) ||
+					sup.metrics_listen.items[0].type != SOCK_STREAM)
+				{
+					fprintf(stderr, "%s: invalid metrics address: %s, aborting\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+
 				break;
 
 			default:
@@ -447,12 +2846,67 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc == 0)
+	if (argc == 0 && argv_count(&service_files) == 0 && argv_count(&service_dirs) == 0)
 		usage();
 
-	sup.proc.prog_name = argv[0];
-	sup.proc.prog_argv = argv;
-	sup.proc.kill_delay = 3;
+	if (argv_count(&service_files) > 0)
+	{
+		struct inicache cache;
+		struct service_loader loader = {};
+
+		if (cache_path != NULL)
+		{
+			inicache_open(&cache, cache_path);
+			loader.cache = &cache;
+		}
+
+		for (int i = 0; i < argv_count(&service_files); i++)
+			supervisor_add_file(&sup, service_files.argv[i], &loader);
+
+		if (cache_path != NULL)
+		{
+			if (!inicache_save(&cache, cache_path))
+				warn("writing service cache %s", cache_path);
+
+			inicache_close(&cache);
+		}
+
+		argv_free(&service_files);
+	}
+
+	for (int i = 0; i < argv_count(&service_dirs); i++)
+		if (!svcdir_load(service_dirs.argv[i], 0, supervisor_add_dir_entry, &sup, errbuf, sizeof errbuf))
+			errx(1, "%s", errbuf);
+
+	argv_free(&service_dirs);
+
+	if (argc > 0)
+	{
+		struct supervisor_service *ss = supervisor_add(&sup);
+		const char *base = strrchr(argv[0], '/');
+
+		for (int i = 0; i < argc; i++)
+			argv_append(&cmdline.argv, argv[i]);
+
+		cmdline.name = strdup(base != NULL ? base + 1 : argv[0]);
+		cmdline.proc.prog_name = cmdline.argv.argv[0];
+		cmdline.proc.prog_argv = cmdline.argv.argv;
+
+		if (cmdline.ready.type == NOTIFY_FD && cmdline.ready.fd < 3 + (int) cmdline.listen.count)
+		{
+			fprintf(stderr, "%s: readiness descriptor %d is taken by a listen socket, aborting\n", progname, cmdline.ready.fd);
+			return EXIT_FAILURE;
+		}
+
+		if (cmdline.on_demand && cmdline.listen.count == 0)
+		{
+			fprintf(stderr, "%s: --on-demand needs a --listen socket, aborting\n", progname);
+			return EXIT_FAILURE;
+		}
+
+		ss->svc = cmdline;
+		supervisor_service_setup(ss);
+	}
 
 	/* TODO: add optional detach */
 	supervisor_prepare(&sup);